@@ -22,7 +22,9 @@ int main(int argc, char* argv[])
         //std::cout << "query\n";
         //::Sleep(3000);
 
-        ft::query(tran, "xiaomi", "ts", "20200606", "930", "1530");
+        ft::TransferResult result = ft::wait(ft::query(tran, "xiaomi", "ts", "20200606", "930", "1530"));
+        std::cout << result.key << ": status " << result.status << ", " << result.bytes << " bytes in "
+            << result.duration.total_milliseconds() << "ms, crc32 " << std::hex << result.checksum << std::dec << "\n";
     }
     catch (const std::exception& e)
     {
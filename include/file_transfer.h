@@ -2,18 +2,374 @@
 #define _FILE_TRANSFR_LIB_H_
 
 #include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/asio/io_service.hpp>
 
 namespace ft {
 
     class Transfer;
     typedef boost::shared_ptr<Transfer> TransferPtr;
+
+    class Engine;
+    typedef boost::shared_ptr<Engine> EnginePtr;
+
+    class Source;
+    typedef boost::shared_ptr<Source> SourcePtr;
+
+    // Pulls the next piece of a stream into buf and returns its length, 0 at the end.
+    typedef boost::function<size_t (char* buf, size_t size)> Generator;
+
+    class Sink;
+    typedef boost::shared_ptr<Sink> SinkPtr;
+
+    // Gets a download chunk by chunk as it arrives, then (NULL, 0) once it is complete. Returning
+    // false pauses the download until resume is called, from any thread.
+    typedef boost::function<bool (const char* data, size_t size, const boost::function<void ()>& resume)> ChunkHandler;
+
+    // Socket options for the connections of a transfer. Buffer sizes of 0 leave the kernel's
+    // autotuning alone and an empty congestion keeps the system default.
+    struct SocketTuning
+    {
+        enum Profile
+        {
+            DEFAULT,     // touch nothing
+            LAN,         // low latency: no Nagle, corked header and data, autotuned buffers
+            WAN,         // bulk over long fat links: large fixed buffers, bbr
+            LOOPBACK,    // same host: buffers of a few loopback segments
+            AUTO,        // LAN, then buffers sized to the measured bandwidth-delay product
+        };
+
+        Profile profile;
+        bool nodelay;              // TCP_NODELAY, the command frames go out at once
+        bool cork;                 // TCP_CORK around the SEND header and the first file data
+        int send_buffer;           // SO_SNDBUF bytes
+        int recv_buffer;           // SO_RCVBUF bytes
+        std::string congestion;    // TCP_CONGESTION, e.g. "cubic" or "bbr"
+        // read back from the socket, only in TransferResult
+        boost::uint32_t rtt_us;
+        boost::uint64_t rate;      // bytes per second AUTO measured, 0 if it did not get to
+
+        SocketTuning() : profile(DEFAULT),
+            nodelay(false),
+            cork(false),
+            send_buffer(0),
+            recv_buffer(0),
+            congestion(),
+            rtt_us(0),
+            rate(0)
+        {}
+
+        static SocketTuning make(Profile profile)
+        {
+            SocketTuning tuning;
+            tuning.profile = profile;
+            if (profile == DEFAULT)
+                return tuning;
+
+            tuning.nodelay = true;
+            tuning.cork = true;
+
+            if (profile == WAN)
+            {
+                tuning.send_buffer = 16 * 1024 * 1024;
+                tuning.recv_buffer = 16 * 1024 * 1024;
+                tuning.congestion = "bbr";
+            }
+            else if (profile == LOOPBACK)
+            {
+                tuning.send_buffer = 4 * 1024 * 1024;
+                tuning.recv_buffer = 4 * 1024 * 1024;
+            }
+
+            return tuning;
+        }
+    };
+
+    struct TransferResult
+    {
+        enum Status
+        {
+            OK,
+            NOT_FOUND,   // the server has no such file (yet)
+            BUSY,        // turned down by admission control, see retry_after_ms
+            FAILED,
+            REJECTED,    // not started: a transfer of the same file is pending, or no source
+        };
+
+        Status status;
+        std::string key;
+        boost::int64_t bytes;
+        boost::posix_time::time_duration duration;
+        // CRC-32 of the bytes received; 0 for sends, whose data never passes through user space
+        boost::uint32_t checksum;
+        int retry_after_ms;
+        // what the socket ended up with, as the kernel reports it
+        SocketTuning tuning;
+        // a send the server had the content of already, under this key now without any data sent
+        bool deduplicated;
+        // bytes of the content the receiver had already and were not sent; the dedup ratio is
+        // dedup_bytes / (dedup_bytes + bytes)
+        boost::int64_t dedup_bytes;
+
+        TransferResult() : status(FAILED),
+            key(),
+            bytes(0),
+            duration(),
+            checksum(0),
+            retry_after_ms(0),
+            tuning(),
+            deduplicated(false),
+            dedup_bytes(0)
+        {}
+    };
+
+    // Called on the transfer thread, so it must not wait() for another transfer.
+    typedef boost::function<void (const TransferResult& result)> CompletionHandler;
+
+    class Completion;
+    typedef boost::shared_ptr<Completion> CompletionPtr;
+
+    // Server side overload protection. Work over a limit is answered with BUSY and a retry hint
+    // instead of being queued. 0 means unlimited.
+    struct AdmissionLimits
+    {
+        size_t max_connections;
+        size_t max_receives;
+        size_t max_bytes_in_flight;  // SIZE of all receives in progress, received bytes for streams;
+                                     // a larger receive is taken when it is the only one
+        int retry_after_ms;
+        size_t accept_batch;         // connections taken off the listen backlog per wakeup
+
+        AdmissionLimits() : max_connections(0),
+            max_receives(0),
+            max_bytes_in_flight(0),
+            retry_after_ms(1000),
+            accept_batch(16)
+        {}
+    };
+    
+    struct ServerOptions
+    {
+        size_t shards;              // io threads, each pinned to a core with its own listener; 0 for one per core
+        bool reuse_port;            // SO_REUSEPORT, so that several server processes can share the port
+        // Unix socket path. A new server takes over the listeners of the one offering them here
+        // and offers its own in turn; the old one then drains. Linux only.
+        std::string handover_path;
+        // The server listens, or takes the listeners over, only once start() is called, so that
+        // the storage settings to be made before the first receive are in place.
+        bool deferred_start;
+
+        ServerOptions() : shards(1),
+            reuse_port(false),
+            deferred_start(false)
+        {}
+    };
     
+    // Server side storage tiers, once there is a cold root. 0 turns a trigger off.
+    struct TierPolicy
+    {
+        int demote_after_s;           // files neither written nor queried for this long go cold
+        boost::uint64_t hot_budget;   // bytes on the hot roots beyond which the least recently used go
+        size_t move_rate;             // bytes per second of the background copies, 0 unpaced
+        int promote_hits;             // queries of a cold file within promote_window_s that bring it back
+        int promote_window_s;
+        int scan_interval_s;          // between two looks for files to demote
+
+        TierPolicy() : demote_after_s(24 * 3600),
+            hot_budget(0),
+            move_rate(32 * 1024 * 1024),
+            promote_hits(3),
+            promote_window_s(3600),
+            scan_interval_s(60)
+        {}
+    };
+
+    // Server only: how new files are spread over the storage roots.
+    struct StoragePlacement
+    {
+        enum Mode
+        {
+            BY_HASH,         // of the key, the default
+            BY_FREE_SPACE,   // in proportion to the free space of each root
+        };
+    };
+
+    // Server only: when an upload asking for DONE hears that the file is stored.
+    struct DurabilityMode
+    {
+        enum Mode
+        {
+            NONE,        // once written, up to the kernel to get to the disk
+            PER_FILE,    // every file and its directory entry synced on its own
+            GROUP,       // the files received within an interval synced together, one syncfs per disk
+        };
+    };
+
+    // Bandwidth class of a file type, realtime first.
+    struct TransferPriority
+    {
+        enum Class
+        {
+            REALTIME,    // default for "ts"
+            NORMAL,
+            BULK,
+        };
+    };
+
+    // Page cache handling of a file type.
+    struct CachePolicy
+    {
+        enum Mode
+        {
+            HOT,         // default for "ts", read in whole when a reply is queued
+            NORMAL,      // read ahead in windows
+            ARCHIVE,     // written once and rarely read: written back and dropped behind receives and replies
+        };
+    };
+
     TransferPtr make_transfer_client(const std::string& host, const std::string& port, const std::string& recv_path ="./files/", const std::string& log_path = "./logs/");
-    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path = "./files/", const std::string& log_path = "./logs/");
+    // shards: io threads, each pinned to a core with its own listener on port; 0 for one per core.
+    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path = "./files/", const std::string& log_path = "./logs/", size_t shards = 1);
+    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path, const std::string& log_path, const ServerOptions& options);
+    // Server only, with ServerOptions::deferred_start: listens and serves from now on.
+    void start(TransferPtr& tran);
     void stop(TransferPtr& tran);
-    void send(TransferPtr& tran, const std::string& file, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end);
-    void query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end);
+    // Server only: stop accepting and let the connections already accepted run to the end.
+    void drain(TransferPtr& tran);
+    // Blocks until the server drains, by drain() or because a successor took over its listeners,
+    // its listeners are closed and its last connection is done. false after timeout_ms, a negative timeout waits forever.
+    bool wait_drained(TransferPtr& tran, int timeout_ms = -1);
+
+    // io threads, connection pools and receive buffers for any number of clients and servers, so
+    // the thread count stays fixed however many peers there are. threads 0 is one per core.
+    EnginePtr make_engine(size_t threads = 1);
+    // Runs everything on ios, which the application keeps running; the engine has no threads.
+    EnginePtr make_engine(boost::asio::io_service& ios);
+    // Transfers on a shared engine. stop() on them waits for their own connections to finish and
+    // leaves the engine running; it must not be called from a thread that runs the engine.
+    // ServerOptions::shards is ignored, the server listens on every shard of the engine.
+    TransferPtr make_transfer_client(const EnginePtr& engine, const std::string& host, const std::string& port, const std::string& recv_path = "./files/", const std::string& log_path = "./logs/");
+    TransferPtr make_transfer_server(const EnginePtr& engine, const std::string& addr, const std::string& port, const std::string& recv_path = "./files/", const std::string& log_path = "./logs/",
+        const ServerOptions& options = ServerOptions());
+    // After every transfer on it is stopped.
+    void stop(EnginePtr& engine);
+    // Memory for receive buffers of everything on the engine.
+    void set_buffer_budget(EnginePtr& engine, size_t bytes);
+    void set_admission_limits(TransferPtr& tran, const AdmissionLimits& limits);
+    // Memory for receive buffers, 64MB by default. Receives beyond it wait for a buffer and leave
+    // their data in the socket, so the senders slow down instead of the process growing.
+    void set_buffer_budget(TransferPtr& tran, size_t bytes);
+    // For connections made from now on. Linux only, elsewhere the sockets keep their defaults.
+    void set_socket_tuning(TransferPtr& tran, const SocketTuning& tuning);
+    void set_socket_profile(TransferPtr& tran, SocketTuning::Profile profile);
+    SocketTuning get_socket_tuning(TransferPtr& tran);
+    // Memory sources of at least bytes are sent with MSG_ZEROCOPY (Linux 4.14+), 64KB by default and
+    // 0 to always copy. Their send completes once the kernel is done with the memory.
+    void set_zerocopy_threshold(TransferPtr& tran, size_t bytes);
+    // Uploads of files and memory of at least bytes send a SHA-256 of the content first, 0
+    // (default) never; about 1MB is where the data costs what the round trip does. A server with
+    // that content stored answers HAVE and links the key to it, so the upload is done after one
+    // round trip. One that does not answer within a few seconds, older than dedup, gets the data.
+    void set_dedup_threshold(TransferPtr& tran, size_t bytes);
+    // Off by default. Uploads over the dedup threshold are also cut into content-defined chunks
+    // of about 64KB, and only the chunks the server does not have yet are sent; the server puts
+    // the file together from its chunk store.
+    void set_chunked_dedup(TransferPtr& tran, bool on);
+    // Client only: uploads ask the server to answer DONE once it stored the file, see
+    // set_durability(), and fail if the connection closes without it. Off by default, an upload
+    // is over once sent, as servers without DONE expect.
+    void set_upload_ack(TransferPtr& tran, bool on);
+    // Server only: the directories files are stored in under recv_path, of {type}, {date}, {id}
+    // and {hash}, two hex digits of the id. "{type}/" by default; "{type}/{date}/{hash}/" keeps
+    // directories small with millions of files. Set it before the first receive, stored files
+    // are not moved. False for an invalid pattern.
+    bool set_storage_layout(TransferPtr& tran, const std::string& pattern);
+    // Server only: one more directory, typically on another disk, to store received files under
+    // with the same layout, before the first receive. Files are spread over recv_path and the
+    // added roots, each device written by a queue of its own so a slow disk only holds the
+    // receives placed on it; queries find a file on whichever root holds it. Files shared with
+    // the dedup store stay under recv_path. False if path is no directory.
+    bool add_storage_root(TransferPtr& tran, const std::string& path);
+    // Server only: how new files are spread over the storage roots, BY_HASH by default.
+    void set_storage_placement(TransferPtr& tran, StoragePlacement::Mode placement);
+    // Server only: a cold storage root, typically on large slow disks. Receives keep landing on
+    // recv_path and the other storage roots, the hot tier, and a background job moves files to
+    // the cold roots and back as the tier policy says. Queries find a file on either tier. Linux
+    // only. False if path is no directory.
+    bool add_cold_root(TransferPtr& tran, const std::string& path);
+    void set_tier_policy(TransferPtr& tran, const TierPolicy& policy);
+    // Server only: received files of up to bytes (at most 16MB) are appended to large segment
+    // files under recv_path/.segments/ instead of getting a file each, 0 (default) never.
+    // Queries find them either way; overwritten ones are compacted away in the background.
+    void set_packed_storage(TransferPtr& tran, size_t bytes);
+    // Server only: when an upload asking for DONE, see set_upload_ack(), hears that the file is
+    // stored. With NONE (default) that is once it is written, up to the kernel to get to the disk.
+    // PER_FILE syncs every file and its directory entry on its own before answering. GROUP makes
+    // the files received within group_interval_ms durable together, one syncfs per disk, so
+    // concurrent uploads share a flush. Linux only.
+    void set_durability(TransferPtr& tran, DurabilityMode::Mode mode, int group_interval_ms = 5);
+    // Server only: memory for hot stored files, 64MB by default and 0 none. Files up to 1/64 of
+    // it are kept when asked for often enough and replied without touching the disk; a file
+    // received again replaces its cached copy.
+    void set_cache_budget(TransferPtr& tran, size_t bytes);
+    // Server only: preloads the stored files of type whose key contains match, e.g. today's
+    // date for the ts files before the open. Returns how many.
+    size_t warm_cache(TransferPtr& tran, const std::string& type, const std::string& match);
+    // Server only: forward every incoming file to another server while it is being received.
+    void add_replica(TransferPtr& tran, const std::string& host, const std::string& port);
+
+    // Outgoing bandwidth limits in bytes per second, 0 is unlimited. They can be changed at any time
+    // and apply to transfers already running. An empty host sets the limit for every other host.
+    void set_global_rate(TransferPtr& tran, size_t bytes_per_sec);
+    void set_host_rate(TransferPtr& tran, const std::string& host, size_t bytes_per_sec);
+    void set_connection_rate(TransferPtr& tran, size_t bytes_per_sec);
+    // Priority class of a file type, NORMAL by default.
+    void set_type_priority(TransferPtr& tran, const std::string& type, TransferPriority::Class priority);
+    // Page cache policy of a file type, NORMAL by default.
+    void set_type_cache_policy(TransferPtr& tran, const std::string& type, CachePolicy::Mode policy);
+    CompletionPtr send(TransferPtr& tran, const std::string& file, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end);
+    CompletionPtr send(TransferPtr& tran, const SourcePtr& source, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end);
+
+    // Sources for send() other than a path. They return an empty pointer on error and are Linux only.
+    SourcePtr make_file_source(const std::string& path);
+    // the whole file behind fd, read with pread semantics; closed when the transfer ends if owns_fd.
+    // A pipe is streamed as make_pipe_source() does, other fds that are not regular files are refused.
+    SourcePtr make_fd_source(int fd, bool owns_fd = false);
+    // the caller keeps data alive until the transfer has completed
+    SourcePtr make_memory_source(const void* data, size_t size);
+    SourcePtr make_memory_source(const boost::shared_ptr<const std::vector<char> >& buffer);
+    // streams until the write end is closed
+    SourcePtr make_pipe_source(int fd, bool owns_fd = true);
+    SourcePtr make_generator_source(const Generator& generator);
+    // wait_until is a UTC deadline; while the file is missing or still being received the server holds
+    // the query open and replies as soon as the file is committed, for a minute at most. Leave it unset to get
+    // an immediate answer.
+    CompletionPtr query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end,
+        const boost::posix_time::ptime& wait_until = boost::posix_time::ptime());
+    // Downloads into sink instead of recv_path/type/key.
+    CompletionPtr query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end,
+        const SinkPtr& sink, const boost::posix_time::ptime& wait_until = boost::posix_time::ptime());
+
+    SinkPtr make_file_sink(const std::string& path);
+    // fails the download if it is larger than capacity
+    SinkPtr make_memory_sink(void* data, size_t capacity);
+    // resized to the received length
+    SinkPtr make_memory_sink(const boost::shared_ptr<std::vector<char> >& buffer);
+    SinkPtr make_callback_sink(const ChunkHandler& handler);
+
+    // send() and query() return once the transfer is started; these follow it to the end.
+    bool is_complete(const CompletionPtr& completion);
+    TransferResult wait(const CompletionPtr& completion);
+    // false if the transfer is still running after timeout
+    bool wait(const CompletionPtr& completion, const boost::posix_time::time_duration& timeout, TransferResult& result);
+    // runs handler right away if the transfer has already completed
+    void on_complete(const CompletionPtr& completion, const CompletionHandler& handler);
+    boost::shared_future<TransferResult> get_future(const CompletionPtr& completion);
 
 }
 
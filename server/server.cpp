@@ -1,26 +1,127 @@
 #include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
 #include <file_transfer.h>
 
 int main(int argc, char* argv[])
 {
     ft::TransferPtr tran;
+    ft::ServerOptions options;
+    std::vector<std::string> args;
+    std::vector<std::string> warm;
+    std::vector<std::string> roots;
+    std::vector<std::string> cold;
+    ft::TierPolicy tiers;
+    ft::StoragePlacement::Mode placement = ft::StoragePlacement::BY_HASH;
+    std::string layout;
+    size_t pack = 0;
+    ft::DurabilityMode::Mode durability = ft::DurabilityMode::NONE;
+    int group_ms = 5;
+
+    // server [--shards=N] [--reuse-port] [--handover=PATH] [--layout=PATTERN] [--root=PATH ...] [--by-free-space] [--cold=PATH ...] [--demote-after=SECONDS] [--hot-budget=BYTES] [--pack=BYTES] [--durability=none|file|group] [--group-ms=MS] [--warm=TYPE[:MATCH] ...] addr port [replica_host:replica_port ...]
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+        if (arg.compare(0, 9, "--shards=") == 0)
+            options.shards = std::atoi(arg.c_str() + 9);
+        else if (arg == "--reuse-port")
+            options.reuse_port = true;
+        else if (arg.compare(0, 11, "--handover=") == 0)
+            options.handover_path = arg.substr(11);
+        else if (arg.compare(0, 9, "--layout=") == 0)
+            layout = arg.substr(9);
+        else if (arg.compare(0, 7, "--root=") == 0)
+            roots.push_back(arg.substr(7));
+        else if (arg == "--by-free-space")
+            placement = ft::StoragePlacement::BY_FREE_SPACE;
+        else if (arg.compare(0, 7, "--cold=") == 0)
+            cold.push_back(arg.substr(7));
+        else if (arg.compare(0, 15, "--demote-after=") == 0)
+            tiers.demote_after_s = std::atoi(arg.c_str() + 15);
+        else if (arg.compare(0, 13, "--hot-budget=") == 0)
+            tiers.hot_budget = std::strtoull(arg.c_str() + 13, NULL, 10);
+        else if (arg.compare(0, 7, "--pack=") == 0)
+            pack = std::strtoul(arg.c_str() + 7, NULL, 10);
+        else if (arg == "--durability=none")
+            durability = ft::DurabilityMode::NONE;
+        else if (arg == "--durability=file")
+            durability = ft::DurabilityMode::PER_FILE;
+        else if (arg == "--durability=group")
+            durability = ft::DurabilityMode::GROUP;
+        else if (arg.compare(0, 11, "--group-ms=") == 0)
+            group_ms = std::atoi(arg.c_str() + 11);
+        else if (arg.compare(0, 7, "--warm=") == 0)
+            warm.push_back(arg.substr(7));
+        else
+            args.push_back(arg);
+    }
+
+    // the storage settings below must be in place before the first receive
+    options.deferred_start = true;
+
     try {
 
-        if (argc >= 3)
+        if (args.size() >= 2)
         {
-            tran = ft::make_transfer_server(argv[1], argv[2]);
+            tran = ft::make_transfer_server(args[0], args[1], "./files/", "./logs/", options);
         }
         else
         {
-            tran = ft::make_transfer_server("0.0.0.0", "6666");
+            tran = ft::make_transfer_server("0.0.0.0", "6666", "./files/", "./logs/", options);
         }
+
+        if (!layout.empty())
+            ft::set_storage_layout(tran, layout);
+        for (size_t i = 0; i < roots.size(); ++i)
+            ft::add_storage_root(tran, roots[i]);
+        if (placement != ft::StoragePlacement::BY_HASH)
+            ft::set_storage_placement(tran, placement);
+        for (size_t i = 0; i < cold.size(); ++i)
+            ft::add_cold_root(tran, cold[i]);
+        if (!cold.empty())
+            ft::set_tier_policy(tran, tiers);
+        if (pack > 0)
+            ft::set_packed_storage(tran, pack);
+        if (durability != ft::DurabilityMode::NONE)
+            ft::set_durability(tran, durability, group_ms);
+
+        for (size_t i = 2; i < args.size(); ++i)
+        {
+            std::string peer(args[i]);
+            std::string::size_type pos = peer.rfind(':');
+            if (pos == std::string::npos)
+            {
+                std::cout << "invalid replica " << peer << "\n";
+                continue;
+            }
+
+            ft::add_replica(tran, peer.substr(0, pos), peer.substr(pos + 1));
+        }
+
+        for (size_t i = 0; i < warm.size(); ++i)
+        {
+            std::string::size_type pos = warm[i].find(':');
+            ft::warm_cache(tran, warm[i].substr(0, pos), pos == std::string::npos ? "" : warm[i].substr(pos + 1));
+        }
+
+        ft::start(tran);
     }
     catch (const std::exception& e)
     {
         std::cout << e.what();
     }
 
-    std::cin.ignore();
+    if (!options.handover_path.empty())
+    {
+        // runs until the next server takes over and the last transfer is done
+        ft::wait_drained(tran);
+        ft::stop(tran);
+    }
+    else
+    {
+        std::cin.ignore();
+    }
 
     return 0;
 }
\ No newline at end of file
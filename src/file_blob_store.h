@@ -0,0 +1,150 @@
+#ifndef _FILE_TRANSFER_BLOB_STORE_H_
+#define _FILE_TRANSFER_BLOB_STORE_H_
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "easylogging++.h"
+#include "file_sha256.h"
+#include "file_storage_layout.h"
+
+namespace ft {
+
+    // Content-addressed storage under recv_path/.blobs/: one blob per SHA-256, and every key with
+    // that content is a hard link to it. The link count is the reference count, a blob left with
+    // just its own link is no longer mapped to any key.
+    class Blob_store
+    {
+    public:
+        explicit Blob_store(const std::string& recv_path) : root_(recv_path + ".blobs/")
+        {}
+
+        // Maps file to the blob of hash. False if there is no such blob.
+        bool link(const std::string& hash, const std::string& file) const
+        {
+            if (!Sha256::is_hex(hash))
+                return false;
+
+            boost::system::error_code ec;
+            boost::filesystem::path blob = blob_path(hash);
+            if (!boost::filesystem::exists(blob, ec))
+                return false;
+
+            // readers of the old file keep it, new ones see the blob
+            std::string temp = file + ".link";
+            boost::filesystem::remove(temp, ec);
+            boost::filesystem::create_hard_link(blob, temp, ec);
+            if (!ec)
+                boost::filesystem::rename(temp, file, ec);
+
+            if (ec)
+            {
+                LERROR << "link " << file << " to blob " << hash << ": " << ec.message();
+                boost::filesystem::remove(temp, ec);
+                return false;
+            }
+
+            return true;
+        }
+
+        // Makes the received file the blob of hash, unless it has one already.
+        void add(const std::string& hash, const std::string& file) const
+        {
+            if (!Sha256::is_hex(hash))
+                return;
+
+            boost::system::error_code ec;
+            boost::filesystem::path blob = blob_path(hash);
+            boost::filesystem::create_directories(blob.parent_path(), ec);
+            if (!ec)
+                boost::filesystem::create_hard_link(file, blob, ec);
+
+            // a concurrent upload of the same content got there first, this copy stays its own
+            if (ec && ec != boost::system::errc::file_exists)
+            {
+                LWARNING << "add blob " << hash << ": " << ec.message();
+            }
+        }
+
+        // keys mapped to the blob of hash
+        boost::uintmax_t refs(const std::string& hash) const
+        {
+            boost::system::error_code ec;
+            boost::uintmax_t links = boost::filesystem::hard_link_count(blob_path(hash), ec);
+
+            return ec ? 0 : links - 1;
+        }
+
+        // A file shared with a blob must not be written in place. Removes it if it is, so the
+        // receive starts a new one; returns whether it did.
+        static bool unshare(const std::string& file)
+        {
+            boost::system::error_code ec;
+            boost::uintmax_t links = boost::filesystem::hard_link_count(file, ec);
+            if (ec || links <= 1)
+                return false;
+
+            boost::filesystem::remove(file, ec);
+            return !ec;
+        }
+
+        // the same for file in dir, without walking its path
+        static bool unshare(const Storage_layout::Directory& dir, const std::string& file)
+        {
+#ifdef __linux__
+            if (dir.fd != -1)
+            {
+                std::string name = boost::filesystem::path(file).filename().string();
+
+                struct stat statbuf;
+                if (::fstatat(dir.fd, name.c_str(), &statbuf, AT_SYMLINK_NOFOLLOW) == -1 || statbuf.st_nlink <= 1)
+                    return false;
+
+                return ::unlinkat(dir.fd, name.c_str(), 0) == 0;
+            }
+#endif
+            return unshare(file);
+        }
+
+        // Removes the blobs no key refers to any more. Returns how many.
+        size_t collect() const
+        {
+            size_t removed = 0;
+
+            boost::system::error_code ec;
+            boost::filesystem::recursive_directory_iterator it(root_, ec), end;
+            for (; !ec && it != end; it.increment(ec))
+            {
+                if (!boost::filesystem::is_regular_file(it->status()))
+                    continue;
+
+                boost::system::error_code ignore;
+                if (boost::filesystem::hard_link_count(it->path(), ignore) == 1
+                    && boost::filesystem::remove(it->path(), ignore))
+                {
+                    ++removed;
+                }
+            }
+
+            if (removed > 0)
+            {
+                LINFO << "removed " << removed << " unreferenced blobs from " << root_;
+            }
+
+            return removed;
+        }
+
+    private:
+        // fanned out by the first byte, like git objects
+        boost::filesystem::path blob_path(const std::string& hash) const
+        {
+            return boost::filesystem::path(root_) / hash.substr(0, 2) / hash;
+        }
+
+    private:
+        const std::string root_;
+    };
+}
+
+#endif
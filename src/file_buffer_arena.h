@@ -0,0 +1,260 @@
+#ifndef _FILE_TRANSFER_BUFFER_ARENA_H_
+#define _FILE_TRANSFER_BUFFER_ARENA_H_
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "easylogging++.h"
+
+namespace ft {
+
+    // Receive buffers for every connection of a transfer. Memory is mapped in chunks of one huge
+    // page, bound to the NUMA node of the thread that asks for it, and cut into fixed slabs that
+    // are reused and never unmapped. A receive holds one slab; once the budget is taken the next
+    // receive waits for a slab instead of reading, which leaves the data in the kernel and lets TCP
+    // slow the senders down.
+    class Buffer_arena
+        : private boost::noncopyable
+    {
+    public:
+        struct Slab
+        {
+            char* data;
+            size_t size;
+            int node;
+        };
+
+        enum
+        {
+            slab_size = 256 * 1024,
+            chunk_size = 2 * 1024 * 1024,
+            default_budget = 64 * 1024 * 1024,
+        };
+
+        explicit Buffer_arena(size_t budget = default_budget) : budget_(std::max<size_t>(budget, chunk_size)),
+            mapped_(0),
+            in_use_(0)
+        {}
+
+        ~Buffer_arena()
+        {
+            for (size_t i = 0; i < chunks_.size(); ++i)
+            {
+                unmap(chunks_[i].first, chunk_size);
+                delete[] chunks_[i].second;
+            }
+        }
+
+        // Never unmaps what is already there; a smaller budget takes effect as slabs come back.
+        void set_budget(size_t budget)
+        {
+            LINFO << "receive buffer budget " << budget << " bytes";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            budget_ = std::max<size_t>(budget, chunk_size);
+        }
+
+        // Returns NULL over budget, and retry is called, from whichever thread releases a slab,
+        // once one is free again.
+        Slab* acquire(const boost::function<void ()>& retry)
+        {
+            int node = current_node();
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (in_use_ + slab_size > budget_)
+            {
+                waiters_.push_back(retry);
+                return NULL;
+            }
+
+            Slab* slab = take_free(node);
+            if (!slab && mapped_ + chunk_size <= budget_)
+            {
+                map_chunk(node);
+                slab = take_free(node);
+            }
+
+            if (!slab)
+            {
+                // the budget is mapped on other nodes already, remote memory beats no memory
+                for (size_t i = 0; i < free_.size() && !slab; ++i)
+                    slab = take_free(static_cast<int>(i));
+            }
+
+            if (!slab)
+            {
+                waiters_.push_back(retry);
+                return NULL;
+            }
+
+            in_use_ += slab->size;
+            return slab;
+        }
+
+        void release(Slab* slab)
+        {
+            if (!slab)
+                return;
+
+            boost::function<void ()> retry;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                in_use_ -= slab->size;
+                free_[slab->node].push_back(slab);
+
+                if (!waiters_.empty() && in_use_ + slab_size <= budget_)
+                {
+                    retry.swap(waiters_.front());
+                    waiters_.pop_front();
+                }
+            }
+
+            if (retry)
+                retry();
+        }
+
+        // Drops the receives still waiting, on teardown.
+        void clear_waiters()
+        {
+            std::deque<boost::function<void ()> > waiters;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                waiters.swap(waiters_);
+            }
+        }
+
+    private:
+        Slab* take_free(int node)
+        {
+            if (node < 0 || static_cast<size_t>(node) >= free_.size() || free_[node].empty())
+                return NULL;
+
+            Slab* slab = free_[node].back();
+            free_[node].pop_back();
+
+            return slab;
+        }
+
+        void map_chunk(int node)
+        {
+            bool huge = false;
+            char* memory = map(node, huge);
+            if (!memory)
+                return;
+
+            Slab* slabs = new Slab[chunk_size / slab_size];
+            chunks_.push_back(std::make_pair(memory, slabs));
+            mapped_ += chunk_size;
+
+            if (static_cast<size_t>(node) >= free_.size())
+                free_.resize(node + 1);
+
+            for (size_t i = 0; i < chunk_size / slab_size; ++i)
+            {
+                slabs[i].data = memory + i * slab_size;
+                slabs[i].size = slab_size;
+                slabs[i].node = node;
+
+                free_[node].push_back(&slabs[i]);
+            }
+
+            LINFO << "receive buffers: " << mapped_ / (1024 * 1024) << "MB mapped on node " << node
+                << (huge ? ", huge pages" : "") << ", budget " << budget_ / (1024 * 1024) << "MB";
+        }
+
+#ifdef __linux__
+        static int current_node()
+        {
+#ifdef SYS_getcpu
+            unsigned cpu = 0;
+            unsigned node = 0;
+            if (::syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+                return static_cast<int>(node);
+#endif
+            return 0;
+        }
+
+        static char* map(int node, bool& huge)
+        {
+            void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+            // only works with pages reserved in vm.nr_hugepages
+            memory = ::mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            huge = memory != MAP_FAILED;
+#endif
+            if (memory == MAP_FAILED)
+            {
+                memory = ::mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (memory == MAP_FAILED)
+                {
+                    LERROR << "map receive buffers error(" << errno << ")";
+                    return NULL;
+                }
+#ifdef MADV_HUGEPAGE
+                // transparent huge pages, if the kernel has them
+                ::madvise(memory, chunk_size, MADV_HUGEPAGE);
+#endif
+            }
+
+#ifdef SYS_mbind
+            // MPOL_PREFERRED: the node of the io thread, falling back to others when it is full
+            const int mpol_preferred = 1;
+            if (node < static_cast<int>(sizeof(unsigned long) * 8))
+            {
+                unsigned long mask = 1UL << node;
+                ::syscall(SYS_mbind, memory, static_cast<unsigned long>(chunk_size), mpol_preferred, &mask, sizeof(mask) * 8, 0);
+            }
+#endif
+            return static_cast<char*>(memory);
+        }
+
+        static void unmap(char* memory, size_t size)
+        {
+            ::munmap(memory, size);
+        }
+#else
+        static int current_node()
+        {
+            return 0;
+        }
+
+        static char* map(int, bool& huge)
+        {
+            huge = false;
+            return new char[chunk_size];
+        }
+
+        static void unmap(char* memory, size_t)
+        {
+            delete[] memory;
+        }
+#endif
+
+    private:
+        boost::mutex mutex_;
+
+        size_t budget_;
+        size_t mapped_;
+        size_t in_use_;
+
+        std::vector<std::pair<char*, Slab*> > chunks_;
+        std::vector<std::vector<Slab*> > free_;  // by NUMA node
+        std::deque<boost::function<void ()> > waiters_;
+    };
+}
+
+#endif
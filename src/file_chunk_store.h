@@ -0,0 +1,280 @@
+#ifndef _FILE_TRANSFER_CHUNK_STORE_H_
+#define _FILE_TRANSFER_CHUNK_STORE_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <ctime>
+
+#include <boost/filesystem.hpp>
+
+#include "easylogging++.h"
+#include "file_chunker.h"
+#include "file_sink.h"
+#include "file_durability.h"
+
+namespace ft {
+
+    // Chunks of chunked uploads under recv_path/.chunks/, one file per SHA-256. Files are
+    // assembled from them into the usual place, where queries serve them with sendfile. A file
+    // does not refer to its chunks once assembled, they only spare later uploads sending them
+    // again, so collect() drops the ones no upload looked up for a while.
+    class Chunk_store
+    {
+    public:
+        enum { default_max_age_hours = 7 * 24 };
+
+        explicit Chunk_store(const std::string& recv_path) : root_(recv_path + ".chunks/")
+        {}
+
+        // and keeps it from collect() for another max age
+        bool use(const std::string& hash) const
+        {
+            boost::system::error_code ec;
+            boost::filesystem::last_write_time(path(hash), std::time(NULL), ec);
+            return !ec;
+        }
+
+        // The chunks missing from the store, and their bytes. A stat per chunk, not for an io thread.
+        boost::int64_t missing(const std::vector<Chunk>& chunks, std::vector<bool>& missing) const
+        {
+            boost::int64_t bytes = 0;
+
+            missing.assign(chunks.size(), false);
+            for (size_t i = 0; i < chunks.size(); ++i)
+            {
+                if (!use(chunks[i].hash))
+                {
+                    missing[i] = true;
+                    bytes += chunks[i].length;
+                }
+            }
+
+            return bytes;
+        }
+
+        // Checked against its hash and written aside under a name of its own before it is
+        // renamed, so a chunk is either whole or not there, also while several uploads store it.
+        bool put(const std::string& hash, const char* data, size_t size) const
+        {
+            Sha256 sha;
+            sha.update(data, size);
+            if (sha.hex() != hash)
+            {
+                LERROR << "chunk does not match its hash " << hash;
+                return false;
+            }
+
+            boost::filesystem::path file = path(hash);
+
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(file.parent_path(), ec);
+
+            std::string temp = file.string() + "." + boost::filesystem::unique_path().string() + ".part";
+            {
+                std::ofstream out(temp.c_str(), std::ios::binary | std::ios::trunc);
+                out.write(data, size);
+                out.close();
+                if (out.fail())
+                {
+                    LERROR << "write chunk " << hash << " fail";
+                    boost::filesystem::remove(temp, ec);
+                    return false;
+                }
+            }
+
+            boost::filesystem::rename(temp, file, ec);
+            if (ec)
+            {
+                LERROR << "store chunk " << hash << ": " << ec.message();
+                boost::filesystem::remove(temp, ec);
+                return false;
+            }
+
+            return true;
+        }
+
+        // Removes the chunks not used for max_age_hours and what interrupted puts left behind,
+        // before any upload runs. Returns how many.
+        size_t collect(int max_age_hours = default_max_age_hours) const
+        {
+            const std::time_t oldest = std::time(NULL) - static_cast<std::time_t>(max_age_hours) * 3600;
+
+            // listed first, the iterator stops at an entry removed under it
+            std::vector<boost::filesystem::path> unused;
+
+            boost::system::error_code ec;
+            boost::filesystem::recursive_directory_iterator it(root_, ec), end;
+            for (; !ec && it != end; it.increment(ec))
+            {
+                if (!boost::filesystem::is_regular_file(it->status()))
+                    continue;
+
+                boost::system::error_code ignore;
+                std::time_t written = boost::filesystem::last_write_time(it->path(), ignore);
+                if (it->path().extension() == ".part" || (!ignore && written < oldest))
+                    unused.push_back(it->path());
+            }
+
+            size_t removed = 0;
+            for (size_t i = 0; i < unused.size(); ++i)
+            {
+                boost::system::error_code ignore;
+                if (boost::filesystem::remove(unused[i], ignore))
+                    ++removed;
+            }
+
+            if (removed > 0)
+            {
+                LINFO << "removed " << removed << " unused chunks from " << root_;
+            }
+
+            return removed;
+        }
+
+        boost::filesystem::path path(const std::string& hash) const
+        {
+            return boost::filesystem::path(root_) / hash.substr(0, 2) / hash;
+        }
+
+    private:
+        const std::string root_;
+    };
+
+    // Receives the chunks the server lacked, back to back, into the store and assembles the file
+    // at path from all its chunks once the transfer is complete, on queue since that reads and
+    // writes the whole file. content sees the assembled bytes.
+    class Chunk_sink : public Sink
+    {
+    public:
+        Chunk_sink(const std::string& path, const std::vector<Chunk>& chunks, const std::vector<bool>& missing,
+            const Chunk_store& store, Sha256& content, const Io_queuePtr& queue) : path_(path),
+            chunks_(chunks),
+            missing_(missing),
+            store_(store),
+            content_(content),
+            queue_(queue),
+            next_(0),
+            buffer_()
+        {}
+
+        std::string name() const
+        {
+            return path_;
+        }
+
+        bool open(boost::int64_t)
+        {
+            next_ = next_missing(0);
+            buffer_.reserve(Chunker::max_size);
+            return true;
+        }
+
+        bool write(const char* data, size_t size)
+        {
+            while (size > 0)
+            {
+                if (next_ >= chunks_.size())
+                {
+                    LERROR << path_ << " more data than chunks";
+                    return false;
+                }
+
+                const Chunk& chunk = chunks_[next_];
+                size_t take = std::min(size, chunk.length - buffer_.size());
+                buffer_.insert(buffer_.end(), data, data + take);
+                data += take;
+                size -= take;
+
+                if (buffer_.size() < chunk.length)
+                    break;
+
+                if (!store_.put(chunk.hash, &buffer_[0], buffer_.size()))
+                {
+                    LERROR << path_ << " chunk " << next_ << " not stored";
+                    return false;
+                }
+
+                buffer_.clear();
+                next_ = next_missing(next_ + 1);
+            }
+
+            return true;
+        }
+
+        // a file that could not be assembled is not left behind half written
+        bool close(bool complete)
+        {
+            buffer_.clear();
+
+            if (!complete || assemble())
+                return true;
+
+            boost::system::error_code ec;
+            boost::filesystem::remove(path_, ec);
+            return false;
+        }
+
+        Io_queuePtr close_queue() const
+        {
+            return queue_;
+        }
+
+#ifdef __linux__
+        bool sync()
+        {
+            return sync_file(path_);
+        }
+#endif
+
+    private:
+        size_t next_missing(size_t from) const
+        {
+            while (from < missing_.size() && !missing_[from])
+                ++from;
+
+            return from;
+        }
+
+        bool assemble()
+        {
+            std::ofstream out(path_.c_str(), std::ios::binary | std::ios::trunc);
+
+            std::vector<char> data(Chunker::max_size);
+            for (size_t i = 0; i < chunks_.size(); ++i)
+            {
+                std::ifstream in(store_.path(chunks_[i].hash).string().c_str(), std::ios::binary);
+                in.read(&data[0], chunks_[i].length);
+                if (static_cast<size_t>(in.gcount()) != chunks_[i].length)
+                {
+                    LERROR << "assemble " << path_ << ": chunk " << chunks_[i].hash << " is gone";
+                    return false;
+                }
+
+                out.write(&data[0], chunks_[i].length);
+                content_.update(&data[0], chunks_[i].length);
+            }
+
+            out.close();
+            if (out.fail())
+            {
+                LERROR << "assemble " << path_ << " fail";
+                return false;
+            }
+
+            return true;
+        }
+
+    private:
+        std::string path_;
+        std::vector<Chunk> chunks_;
+        std::vector<bool> missing_;
+        const Chunk_store& store_;
+        Sha256& content_;
+        Io_queuePtr queue_;
+        size_t next_;
+        std::vector<char> buffer_;
+    };
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef _FILE_TRANSFER_CHUNKER_H_
+#define _FILE_TRANSFER_CHUNKER_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include "file_sha256.h"
+
+namespace ft {
+
+    struct Chunk
+    {
+        std::string hash;
+        boost::int64_t offset;
+        size_t length;
+
+        Chunk() : hash(),
+            offset(0),
+            length(0)
+        {}
+    };
+
+    // Content-defined chunking after FastCDC: a cut where the gear hash of the last 64 bytes
+    // matches a mask, so an insertion moves the cuts around it and leaves the others in place.
+    // Sizes are normalized around avg_size by a stricter mask before it and a looser one after.
+    // Bytes are fed in any pieces; the chunks come out with their SHA-256.
+    class Chunker
+    {
+    public:
+        enum
+        {
+            min_size = 16 * 1024,
+            avg_size = 64 * 1024,
+            max_size = 256 * 1024,
+        };
+
+        Chunker() : hash_(0),
+            offset_(0),
+            length_(0)
+        {
+            // the same table everywhere, or two senders would cut the same data differently
+            boost::uint64_t seed = 0x6672616e73666572ULL;
+            for (int i = 0; i < 256; ++i)
+            {
+                // splitmix64
+                boost::uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                gear_[i] = z ^ (z >> 31);
+            }
+        }
+
+        void update(const char* data, size_t size)
+        {
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+            while (size > 0)
+            {
+                // cut-point skipping: no cut can fall below min_size, so those bytes are not hashed
+                if (length_ < min_size)
+                {
+                    size_t skip = std::min<size_t>(size, min_size - length_);
+                    consume(bytes, skip);
+                    bytes += skip;
+                    size -= skip;
+                    continue;
+                }
+
+                size_t end = std::min<size_t>(size, max_size - length_);
+                size_t normal = length_ < avg_size ? avg_size - length_ : 0;
+
+                // only the high bits depend on the whole 64 byte window
+                boost::uint64_t h = hash_;
+                size_t i = 0;
+                for (; i < std::min(normal, end); ++i)
+                {
+                    h = (h << 1) + gear_[bytes[i]];
+                    if (!(h & mask_small))
+                        break;
+                }
+                if (i == std::min(normal, end))
+                {
+                    for (; i < end; ++i)
+                    {
+                        h = (h << 1) + gear_[bytes[i]];
+                        if (!(h & mask_large))
+                            break;
+                    }
+                }
+
+                hash_ = h;
+
+                if (i < end)
+                {
+                    consume(bytes, i + 1);
+                    cut();
+                    bytes += i + 1;
+                    size -= i + 1;
+                }
+                else {
+                    consume(bytes, end);
+                    bytes += end;
+                    size -= end;
+
+                    if (length_ >= max_size)
+                        cut();
+                }
+            }
+        }
+
+        // Ends the last chunk. Returns every chunk of the data.
+        const std::vector<Chunk>& finish()
+        {
+            if (length_ > 0)
+                cut();
+
+            return chunks_;
+        }
+
+        // HASH.LENGTH:HASH.LENGTH:... as the CHUNKS option of a SEND
+        static std::string format(const std::vector<Chunk>& chunks)
+        {
+            std::ostringstream os;
+            for (size_t i = 0; i < chunks.size(); ++i)
+            {
+                if (i > 0)
+                    os << ":";
+                os << chunks[i].hash << "." << chunks[i].length;
+            }
+
+            return os.str();
+        }
+
+        // False unless every chunk is well formed and they add up to size.
+        static bool parse(const std::string& str, boost::int64_t size, std::vector<Chunk>& chunks)
+        {
+            chunks.clear();
+
+            std::vector<std::string> items;
+            boost::split(items, str, boost::is_any_of(":"));
+
+            boost::int64_t offset = 0;
+            for (size_t i = 0; i < items.size(); ++i)
+            {
+                std::string::size_type dot = items[i].find('.');
+                if (dot == std::string::npos)
+                    return false;
+
+                Chunk chunk;
+                chunk.hash = items[i].substr(0, dot);
+                chunk.offset = offset;
+                chunk.length = std::strtoul(items[i].c_str() + dot + 1, NULL, 10);
+                if (!Sha256::is_hex(chunk.hash) || chunk.length == 0 || chunk.length > max_size)
+                    return false;
+
+                offset += chunk.length;
+                chunks.push_back(chunk);
+            }
+
+            return offset == size;
+        }
+
+        // one bit per chunk, in hex digits of four
+        static std::string to_bitmap(const std::vector<bool>& bits)
+        {
+            static const char digits[] = "0123456789abcdef";
+
+            std::string hex((bits.size() + 3) / 4, '0');
+            for (size_t i = 0; i < bits.size(); ++i)
+            {
+                if (bits[i])
+                    hex[i / 4] = digits[(hex[i / 4] <= '9' ? hex[i / 4] - '0' : hex[i / 4] - 'a' + 10) | (1 << (i % 4))];
+            }
+
+            return hex;
+        }
+
+        static bool from_bitmap(const std::string& hex, size_t count, std::vector<bool>& bits)
+        {
+            if (hex.size() != (count + 3) / 4 || hex.find_first_not_of("0123456789abcdef") != std::string::npos)
+                return false;
+
+            bits.assign(count, false);
+            for (size_t i = 0; i < count; ++i)
+            {
+                int digit = hex[i / 4] <= '9' ? hex[i / 4] - '0' : hex[i / 4] - 'a' + 10;
+                bits[i] = (digit & (1 << (i % 4))) != 0;
+            }
+
+            return true;
+        }
+
+    private:
+        // 18 and 14 of the top bits, for an average near avg_size
+        static const boost::uint64_t mask_small = 0xffffc00000000000ULL;
+        static const boost::uint64_t mask_large = 0xfffc000000000000ULL;
+
+        void consume(const unsigned char* bytes, size_t size)
+        {
+            sha_.update(bytes, size);
+            length_ += size;
+        }
+
+        void cut()
+        {
+            Chunk chunk;
+            chunk.hash = sha_.hex();
+            chunk.offset = offset_;
+            chunk.length = length_;
+            chunks_.push_back(chunk);
+
+            sha_.reset();
+            hash_ = 0;
+            offset_ += length_;
+            length_ = 0;
+        }
+
+    private:
+        boost::uint64_t gear_[256];
+        boost::uint64_t hash_;
+        Sha256 sha_;
+        boost::int64_t offset_;
+        size_t length_;
+        std::vector<Chunk> chunks_;
+    };
+}
+
+#endif
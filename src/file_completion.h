@@ -0,0 +1,108 @@
+#ifndef _FILE_TRANSFER_COMPLETION_H_
+#define _FILE_TRANSFER_COMPLETION_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "file_transfer.h"
+
+namespace ft {
+
+    // The outcome of one send or query, completed exactly once by the connection that runs it.
+    class Completion
+    {
+    public:
+        explicit Completion(const std::string& key) : key_(key),
+            start_(boost::posix_time::microsec_clock::universal_time()),
+            done_(false),
+            promise_(),
+            future_(promise_.get_future())
+        {}
+
+        // for calls that are turned down before a connection exists
+        static CompletionPtr completed(const std::string& key, TransferResult::Status status)
+        {
+            CompletionPtr completion(new Completion(key));
+
+            TransferResult result;
+            result.status = status;
+            completion->complete(result);
+
+            return completion;
+        }
+
+        const std::string& key() const
+        {
+            return key_;
+        }
+
+        // Fills in key and duration; later calls are ignored.
+        void complete(TransferResult result)
+        {
+            std::vector<CompletionHandler> handlers;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (done_)
+                    return;
+
+                result.key = key_;
+                result.duration = boost::posix_time::microsec_clock::universal_time() - start_;
+
+                done_ = true;
+                result_ = result;
+                handlers.swap(handlers_);
+            }
+
+            promise_.set_value(result);
+
+            for (size_t i = 0; i < handlers.size(); ++i)
+                handlers[i](result);
+        }
+
+        bool ready() const
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return done_;
+        }
+
+        void on_complete(const CompletionHandler& handler)
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (!done_)
+                {
+                    handlers_.push_back(handler);
+                    return;
+                }
+            }
+
+            handler(result_);
+        }
+
+        const boost::shared_future<TransferResult>& future() const
+        {
+            return future_;
+        }
+
+    private:
+        const std::string key_;
+        const boost::posix_time::ptime start_;
+
+        mutable boost::mutex mutex_;
+        bool done_;
+        TransferResult result_;
+        std::vector<CompletionHandler> handlers_;
+
+        boost::promise<TransferResult> promise_;
+        boost::shared_future<TransferResult> future_;
+    };
+}
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef _FILE_TRANSFER_CONNECTION_POOL_H_
+#define _FILE_TRANSFER_CONNECTION_POOL_H_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+
+#include "file_transfer_connection.h"
+
+namespace ft {
+
+    // Connections built up front and taken back when their last reference goes away, so a burst
+    // of small transfers reuses the sockets, timers, strings and buffers of earlier ones. A pool
+    // serves every transfer on its shard; a connection belongs to one only while it is out.
+    class Connection_pool
+        : public boost::enable_shared_from_this<Connection_pool>,
+        private boost::noncopyable
+    {
+    public:
+        enum { default_capacity = 1024 };
+
+        explicit Connection_pool(Transfer_shard* shard, size_t capacity = default_capacity)
+            : shard_(shard),
+            capacity_(capacity),
+            closed_(false)
+        {}
+
+        ~Connection_pool()
+        {
+            close();
+        }
+
+        void reserve(size_t count)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            while (free_.size() < std::min(count, capacity_))
+                free_.push_back(new Transfer_connection(NULL, shard_, ""));
+        }
+
+        Transfer_connection::pointer acquire(Transfer* transfer, const std::string& recv_path)
+        {
+            Transfer_connection* connection = NULL;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (!free_.empty())
+                {
+                    connection = free_.back();
+                    free_.pop_back();
+                }
+            }
+
+            if (!connection)
+                connection = new Transfer_connection(transfer, shard_, recv_path);
+            else
+                connection->attach(transfer, recv_path);
+
+            connection_opened(transfer);
+
+            return Transfer_connection::pointer(connection, Recycler(shared_from_this()));
+        }
+
+        // Frees the idle connections and stops taking any back. Must run while the io_service of
+        // the shard still exists.
+        void close()
+        {
+            std::vector<Transfer_connection*> idle;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                closed_ = true;
+                idle.swap(free_);
+            }
+
+            for (size_t i = 0; i < idle.size(); ++i)
+                delete idle[i];
+        }
+
+    private:
+        struct Recycler
+        {
+            explicit Recycler(const boost::shared_ptr<Connection_pool>& pool) : pool(pool)
+            {}
+
+            void operator()(Transfer_connection* connection) const
+            {
+                pool->release(connection);
+            }
+
+            boost::shared_ptr<Connection_pool> pool;
+        };
+
+        void release(Transfer_connection* connection)
+        {
+            Transfer* transfer = connection->transfer_;
+
+            if (accepts())
+            {
+                // outside the lock: completing its handle may start the next transfer
+                connection->recycle();
+
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (!closed_ && free_.size() < capacity_)
+                {
+                    free_.push_back(connection);
+                    connection = NULL;
+                }
+            }
+
+            delete connection;
+
+            // last, the transfer may be gone as soon as it has seen its last connection back
+            connection_closed(transfer);
+        }
+
+        // defined with Transfer
+        static void connection_opened(Transfer* transfer);
+        static void connection_closed(Transfer* transfer);
+
+        bool accepts()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return !closed_ && free_.size() < capacity_;
+        }
+
+    private:
+        Transfer_shard* shard_;
+        const size_t capacity_;
+
+        boost::mutex mutex_;
+        std::vector<Transfer_connection*> free_;
+        bool closed_;
+    };
+}
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef _FILE_TRANSFER_DURABILITY_H_
+#define _FILE_TRANSFER_DURABILITY_H_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_storage_layout.h"
+
+namespace ft {
+
+#ifdef __linux__
+    inline bool sync_directory(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+
+        bool synced = ::fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+
+    // The data of a stored file and its name, the entry in the directory holding it.
+    inline bool sync_file(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return false;
+
+        bool synced = ::fdatasync(fd) == 0;
+        ::close(fd);
+        if (!synced)
+            return false;
+
+        std::string dir = boost::filesystem::path(path).parent_path().string();
+        return sync_directory(dir.empty() ? "." : dir);
+    }
+
+    // When a received file counts as stored, and its sender is told so. NONE leaves it to the
+    // kernel's writeback. PER_FILE flushes every file and its directory entry on its own, one
+    // device flush per file. GROUP collects the files completed within a few milliseconds and
+    // makes them durable together with one syncfs per device of the hot roots, which writes back
+    // the directories too, so concurrent receives share a flush instead of queueing for one each.
+    class Durability
+    {
+    public:
+        enum Mode
+        {
+            NONE,
+            PER_FILE,
+            GROUP,
+        };
+
+        enum
+        {
+            default_interval_ms = 5,
+            max_interval_ms = 1000,
+        };
+
+        // makes one stored file durable, for PER_FILE
+        typedef boost::function<bool ()> Sync;
+        typedef boost::function<void (bool durable)> Done;
+
+        explicit Durability(Storage_layout& layout) : layout_(layout),
+            mode_(NONE),
+            interval_ms_(default_interval_ms),
+            started_(false),
+            stopping_(false)
+        {}
+
+        ~Durability()
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                stopping_ = true;
+            }
+            ready_.notify_all();
+
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+        void set_mode(int mode, int interval_ms)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            mode_ = std::max(0, std::min<int>(mode, GROUP));
+            interval_ms_ = std::max(0, std::min<int>(interval_ms, max_interval_ms));
+
+            static const char* names[] = { "none", "per file", "group commit" };
+            LINFO << "durability " << names[mode_] << ", group interval " << interval_ms_ << "ms";
+
+            if (mode_ != NONE && !started_)
+            {
+                started_ = true;
+                thread_ = boost::thread(boost::bind(&Durability::run, this));
+            }
+        }
+
+        int mode()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return mode_;
+        }
+
+        // Calls done once the file sync stores is durable, on the durability thread, or right
+        // away with NONE.
+        void commit(const Sync& sync, const Done& done)
+        {
+            bool durable = false;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                if (mode_ != NONE && !stopping_)
+                {
+                    pending_.push_back(Commit(sync, done));
+                    ready_.notify_all();
+                    return;
+                }
+
+                durable = mode_ == NONE;
+            }
+
+            done(durable);
+        }
+
+    private:
+        typedef std::pair<Sync, Done> Commit;
+
+        // finishes the commits queued before stopping
+        void run()
+        {
+            for (;;)
+            {
+                std::vector<Commit> batch;
+                int mode = NONE;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex_);
+                    while (pending_.empty() && !stopping_)
+                        ready_.wait(lock);
+
+                    if (pending_.empty())
+                        return;
+
+                    // the receives completing right after the first one join its group
+                    if (mode_ == GROUP && interval_ms_ > 0)
+                    {
+                        boost::posix_time::ptime due = boost::posix_time::microsec_clock::universal_time()
+                            + boost::posix_time::milliseconds(interval_ms_);
+
+                        while (!stopping_ && boost::posix_time::microsec_clock::universal_time() < due)
+                            ready_.timed_wait(lock, due);
+                    }
+
+                    mode = mode_;
+                    batch.swap(pending_);
+                }
+
+                if (mode == GROUP)
+                {
+                    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+                    bool durable = sync_devices();
+
+                    LINFO << "group commit " << batch.size() << " files in "
+                        << (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() << "us";
+
+                    for (size_t i = 0; i < batch.size(); ++i)
+                        batch[i].second(durable);
+
+                    continue;
+                }
+
+                // or NONE, set since they were queued
+                for (size_t i = 0; i < batch.size(); ++i)
+                    batch[i].second(mode == NONE || !batch[i].first || batch[i].first());
+            }
+        }
+
+        // One syncfs for every device of the hot roots; the cold ones only receive copies the
+        // tiers flush themselves.
+        bool sync_devices()
+        {
+            std::vector<std::string> roots = layout_.roots();
+            std::set<dev_t> devices;
+            bool durable = true;
+
+            for (size_t i = 0; i < roots.size(); ++i)
+            {
+                if (layout_.cold(i))
+                    continue;
+
+                int fd = ::open(roots[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd == -1)
+                {
+                    LERROR << "open " << roots[i] << " error(" << errno << ")";
+                    durable = false;
+                    continue;
+                }
+
+                struct stat statbuf;
+                if (::fstat(fd, &statbuf) == 0 && devices.insert(statbuf.st_dev).second && ::syncfs(fd) == -1)
+                {
+                    LERROR << "syncfs " << roots[i] << " error(" << errno << ")";
+                    durable = false;
+                }
+
+                ::close(fd);
+            }
+
+            return durable;
+        }
+
+    private:
+        Storage_layout& layout_;
+
+        boost::mutex mutex_;
+        boost::condition_variable ready_;
+        int mode_;
+        int interval_ms_;
+        std::vector<Commit> pending_;
+        bool started_;
+        bool stopping_;
+        boost::thread thread_;
+    };
+#endif
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef _FILE_TRANSFER_HANDLER_ALLOC_H_
+#define _FILE_TRANSFER_HANDLER_ALLOC_H_
+
+#include <cstddef>
+#include <new>
+
+#include <boost/noncopyable.hpp>
+#include <boost/aligned_storage.hpp>
+
+namespace ft {
+
+    // Storage for one in-flight handler. A connection keeps one per direction, so the handlers of
+    // its reads and writes reuse the same memory instead of going through the heap every time.
+    // Anything larger, or a second handler while the slot is taken, falls back to operator new.
+    class Handler_allocator
+        : private boost::noncopyable
+    {
+    public:
+        Handler_allocator() : in_use_(false)
+        {}
+
+        void* allocate(std::size_t size)
+        {
+            if (!in_use_ && size <= storage_.size)
+            {
+                in_use_ = true;
+                return storage_.address();
+            }
+
+            return ::operator new(size);
+        }
+
+        void deallocate(void* pointer)
+        {
+            if (pointer == storage_.address())
+            {
+                in_use_ = false;
+                return;
+            }
+
+            ::operator delete(pointer);
+        }
+
+    private:
+        // the bound member function, the connection pointer and asio's own wrapping
+        boost::aligned_storage<512> storage_;
+        bool in_use_;
+    };
+
+    // Wraps a handler so that asio allocates everything belonging to the operation from allocator.
+    template <typename Handler>
+    class Alloc_handler
+    {
+    public:
+        Alloc_handler(Handler_allocator& allocator, Handler handler) : allocator_(allocator),
+            handler_(handler)
+        {}
+
+        template <typename Arg1>
+        void operator()(Arg1 arg1)
+        {
+            handler_(arg1);
+        }
+
+        template <typename Arg1, typename Arg2>
+        void operator()(Arg1 arg1, Arg2 arg2)
+        {
+            handler_(arg1, arg2);
+        }
+
+        friend void* asio_handler_allocate(std::size_t size, Alloc_handler<Handler>* this_handler)
+        {
+            return this_handler->allocator_.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void* pointer, std::size_t, Alloc_handler<Handler>* this_handler)
+        {
+            this_handler->allocator_.deallocate(pointer);
+        }
+
+    private:
+        Handler_allocator& allocator_;
+        Handler handler_;
+    };
+
+    template <typename Handler>
+    inline Alloc_handler<Handler> make_alloc_handler(Handler_allocator& allocator, Handler handler)
+    {
+        return Alloc_handler<Handler>(allocator, handler);
+    }
+}
+
+#endif
@@ -33,6 +33,20 @@ namespace ft {
             return key;
         }
 
+        // Every field is part of a path on the server: none may be empty or leave its directory.
+        bool valid() const
+        {
+            const std::string* fields[] = { &id, &type, &date, &tm_begin, &tm_end };
+            for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+            {
+                const std::string& field = *fields[i];
+                if (field.empty() || field.find_first_of("/\\") != std::string::npos || field.find("..") != std::string::npos)
+                    return false;
+            }
+
+            return true;
+        }
+
         std::string to_string() const
         {
             std::string str;
@@ -0,0 +1,87 @@
+#ifndef _FILE_TRANSFER_IO_QUEUE_H_
+#define _FILE_TRANSFER_IO_QUEUE_H_
+
+#include <string>
+#include <deque>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include "easylogging++.h"
+
+namespace ft {
+
+    // A writer thread of its own for one storage device, so that receives to a slow disk queue
+    // up there instead of holding the io threads every other receive needs. Jobs run in order.
+    class Io_queue
+    {
+    public:
+        typedef boost::function<void ()> Job;
+
+        explicit Io_queue(const std::string& name) : name_(name),
+            stopping_(false)
+        {
+            thread_ = boost::thread(boost::bind(&Io_queue::run, this));
+        }
+
+        ~Io_queue()
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                stopping_ = true;
+            }
+            ready_.notify_one();
+            thread_.join();
+        }
+
+        const std::string& name() const
+        {
+            return name_;
+        }
+
+        void post(const Job& job)
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                jobs_.push_back(job);
+            }
+            ready_.notify_one();
+        }
+
+    private:
+        // finishes the jobs queued before stopping
+        void run()
+        {
+            for (;;)
+            {
+                Job job;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex_);
+                    while (jobs_.empty() && !stopping_)
+                        ready_.wait(lock);
+
+                    if (jobs_.empty())
+                        return;
+
+                    job = jobs_.front();
+                    jobs_.pop_front();
+                }
+
+                job();
+            }
+        }
+
+    private:
+        const std::string name_;
+        boost::mutex mutex_;
+        boost::condition_variable ready_;
+        std::deque<Job> jobs_;
+        bool stopping_;
+        boost::thread thread_;
+    };
+
+    typedef boost::shared_ptr<Io_queue> Io_queuePtr;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef _FILE_TRANSFER_LISTENER_HANDOVER_H_
+#define _FILE_TRANSFER_LISTENER_HANDOVER_H_
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#endif
+
+#include "easylogging++.h"
+
+namespace ft {
+
+    // Passes the listening sockets of a running server to its successor over a unix socket, so a
+    // new build takes over the port without ever closing it: connections that arrive meanwhile
+    // wait in the backlog and are accepted by the new process.
+    class Listener_handover
+        : public boost::enable_shared_from_this<Listener_handover>,
+        private boost::noncopyable
+    {
+    public:
+        typedef boost::function<std::vector<int> ()> Listeners;
+        typedef boost::function<void ()> Handed_over;
+
+        enum
+        {
+            max_listeners = 64,
+            timeout_ms = 5000,
+        };
+
+        Listener_handover(boost::asio::io_service& ios, const std::string& path, const Listeners& listeners, const Handed_over& handed_over)
+            : ios_(ios),
+            path_(path),
+            listeners_(listeners),
+            handed_over_(handed_over)
+#ifdef __linux__
+            , acceptor_(ios)
+#endif
+        {}
+
+        // Successor side: the listeners of the server offering them at path, none if nobody does.
+        // The caller owns the descriptors.
+        static std::vector<int> take(const std::string& path)
+        {
+            std::vector<int> fds;
+#ifdef __linux__
+            int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (sock < 0)
+                return fds;
+
+            timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+            ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            sockaddr_un addr;
+            if (!make_address(path, addr) || ::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+            {
+                // no server running, start from scratch
+                ::close(sock);
+                return fds;
+            }
+
+            char tag = 0;
+            iovec iov = { &tag, 1 };
+            char control[CMSG_SPACE(sizeof(int) * max_listeners)];
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (::recvmsg(sock, &msg, 0) <= 0)
+            {
+                LERROR << "take over listeners from " << path << " error(" << errno << ")";
+            }
+            else {
+                for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                {
+                    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                        continue;
+
+                    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    const int* data = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+                    fds.insert(fds.end(), data, data + count);
+                }
+
+                LINFO << "took over " << fds.size() << " listeners from " << path;
+            }
+
+            ::close(sock);
+#else
+            LWARNING << "listener handover is not supported on this platform";
+#endif
+            return fds;
+        }
+
+        // Running side: waits at path for the next process and hands the listeners to it. Any
+        // earlier server at path must have been taken over already.
+        void offer()
+        {
+#ifdef __linux__
+            ::unlink(path_.c_str());
+
+            boost::system::error_code ec;
+            acceptor_.open(boost::asio::local::stream_protocol(), ec);
+            if (!ec)
+                acceptor_.bind(boost::asio::local::stream_protocol::endpoint(path_), ec);
+            if (!ec)
+                acceptor_.listen(1, ec);
+
+            if (ec)
+            {
+                LERROR << "offer listeners at " << path_ << ": " << ec.message();
+                return;
+            }
+
+            LINFO << "offer listeners at " << path_;
+
+            start_accept();
+#else
+            LWARNING << "listener handover is not supported on this platform";
+#endif
+        }
+
+        void close()
+        {
+#ifdef __linux__
+            boost::system::error_code ignore;
+            acceptor_.close(ignore);
+#endif
+        }
+
+    private:
+#ifdef __linux__
+        typedef boost::shared_ptr<boost::asio::local::stream_protocol::socket> socket_ptr;
+
+        void start_accept()
+        {
+            socket_ptr successor(new boost::asio::local::stream_protocol::socket(ios_));
+
+            acceptor_.async_accept(*successor, boost::bind(&Listener_handover::handle_accept,
+                shared_from_this(),
+                successor,
+                boost::asio::placeholders::error));
+        }
+
+        void handle_accept(socket_ptr successor, const boost::system::error_code& error)
+        {
+            if (error)
+            {
+                if (error != boost::asio::error::operation_aborted)
+                    start_accept();
+                return;
+            }
+
+            std::vector<int> fds = listeners_();
+            if (fds.size() > max_listeners)
+                fds.resize(max_listeners);
+
+            if (!send_fds(successor->native_handle(), fds))
+            {
+                LERROR << "hand over listeners error(" << errno << ")";
+                start_accept();
+                return;
+            }
+
+            LINFO << "handed " << fds.size() << " listeners over to the next process";
+
+            // the path belongs to the successor now, leave it in place
+            close();
+            handed_over_();
+        }
+
+        static bool send_fds(int sock, const std::vector<int>& fds)
+        {
+            char tag = 'L';
+            iovec iov = { &tag, 1 };
+            char control[CMSG_SPACE(sizeof(int) * max_listeners)];
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+
+            if (!fds.empty())
+            {
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                std::memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+            }
+
+            return ::sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+        }
+
+        static bool make_address(const std::string& path, sockaddr_un& addr)
+        {
+            std::memset(&addr, 0, sizeof(addr));
+            if (path.size() >= sizeof(addr.sun_path))
+                return false;
+
+            addr.sun_family = AF_UNIX;
+            std::memcpy(addr.sun_path, path.c_str(), path.size());
+            return true;
+        }
+#endif
+
+    private:
+        boost::asio::io_service& ios_;
+        const std::string path_;
+        Listeners listeners_;
+        Handed_over handed_over_;
+
+#ifdef __linux__
+        boost::asio::local::stream_protocol::acceptor acceptor_;
+#endif
+    };
+}
+
+#endif
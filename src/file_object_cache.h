@@ -0,0 +1,324 @@
+#ifndef _FILE_TRANSFER_OBJECT_CACHE_H_
+#define _FILE_TRANSFER_OBJECT_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+
+#include "easylogging++.h"
+
+namespace ft {
+
+    // Approximate access counts for admission, a count-min sketch of 4 bit counters that are
+    // halved every so often, so what was popular yesterday fades.
+    class Frequency_sketch
+    {
+    public:
+        enum
+        {
+            width = 8192,
+            depth = 4,
+            max_count = 15,
+            // accesses between two halvings
+            sample_size = 10 * width,
+        };
+
+        Frequency_sketch() : counters_(width * depth, 0),
+            samples_(0)
+        {}
+
+        void increment(const std::string& key)
+        {
+            bool added = false;
+            for (int row = 0; row < depth; ++row)
+            {
+                boost::uint8_t& counter = counters_[row * width + index(key, row)];
+                if (counter < max_count)
+                {
+                    ++counter;
+                    added = true;
+                }
+            }
+
+            if (added && ++samples_ >= sample_size)
+                age();
+        }
+
+        int frequency(const std::string& key) const
+        {
+            int count = max_count;
+            for (int row = 0; row < depth; ++row)
+                count = std::min<int>(count, counters_[row * width + index(key, row)]);
+
+            return count;
+        }
+
+    private:
+        static size_t index(const std::string& key, int row)
+        {
+            size_t hash = boost::hash<std::string>()(key);
+            size_t mixed = (hash ^ (hash >> 17)) * 0x9e3779b1U;
+
+            return (hash + row * (mixed | 1)) & (width - 1);
+        }
+
+        void age()
+        {
+            for (size_t i = 0; i < counters_.size(); ++i)
+                counters_[i] >>= 1;
+
+            samples_ /= 2;
+        }
+
+    private:
+        std::vector<boost::uint8_t> counters_;
+        size_t samples_;
+    };
+
+    // Stored files small and popular enough to be served from memory, within a byte budget.
+    // Admission is W-TinyLFU: new files enter a small LRU window, and leaving it they only get
+    // into the main segmented LRU by being asked for more often than what they would evict.
+    // Entries in the main part move from probation to protected on their second hit.
+    class Object_cache
+    {
+    public:
+        typedef boost::shared_ptr<const std::vector<char> > Buffer;
+
+        enum { default_budget = 64 * 1024 * 1024 };
+
+        explicit Object_cache(size_t budget = default_budget) : budget_(budget),
+            epoch_(0)
+        {
+            std::fill(bytes_, bytes_ + segments, 0);
+        }
+
+        void set_budget(size_t bytes)
+        {
+            LINFO << "object cache budget " << bytes << " bytes";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            budget_ = bytes;
+
+            while (bytes_[WINDOW] > window_budget())
+                evict(WINDOW);
+            while (bytes_[PROBATION] + bytes_[PROTECTED] > budget_ - window_budget())
+                evict(lru_[PROBATION].empty() ? PROTECTED : PROBATION);
+        }
+
+        // largest file taken in
+        size_t max_object() const
+        {
+            return budget_ / 64;
+        }
+
+        // The cached file, empty on a miss. Either way counts as an access to key.
+        Buffer get(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            sketch_.increment(key);
+
+            Index::iterator it = index_.find(key);
+            if (it == index_.end())
+                return Buffer();
+
+            Slot& slot = it->second;
+            Buffer data = slot.entry->data;
+
+            if (slot.segment == PROBATION)
+            {
+                // a second hit, protect it
+                move(slot, PROTECTED);
+                while (bytes_[PROTECTED] > protected_budget())
+                    move(index_[lru_[PROTECTED].back().key], PROBATION);
+            }
+            else {
+                lru_[slot.segment].splice(lru_[slot.segment].begin(), lru_[slot.segment], slot.entry);
+            }
+
+            return data;
+        }
+
+        // Whether a file just asked for is worth reading into memory to offer it: asked for before
+        // and not cached yet.
+        bool wants(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return budget_ > 0 && !index_.count(key) && sketch_.frequency(key) > 1;
+        }
+
+        // Offers a file just read from disk, unless a file was erased since epoch() was taken
+        // before the read: it might be the one that was read.
+        void put(const std::string& key, const Buffer& data, size_t epoch)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (!data || budget_ == 0 || data->size() > max_object() || index_.count(key) || epoch != epoch_)
+                return;
+
+            insert(key, data, WINDOW);
+
+            while (bytes_[WINDOW] > window_budget())
+            {
+                Entry candidate = lru_[WINDOW].back();
+                remove(candidate.key);
+                admit(candidate);
+            }
+        }
+
+        // Preloads a file at startup, into the main part while it has room. False once it is full.
+        bool warm(const std::string& key, const Buffer& data)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (!data || budget_ == 0 || data->size() > max_object())
+                return true;
+
+            if (bytes_[PROBATION] + bytes_[PROTECTED] + data->size() > budget_ - window_budget())
+                return false;
+
+            if (!index_.count(key))
+            {
+                sketch_.increment(key);
+                insert(key, data, PROBATION);
+            }
+
+            return true;
+        }
+
+        // The file was committed again.
+        void erase(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            remove(key);
+            ++epoch_;
+        }
+
+        size_t epoch()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return epoch_;
+        }
+
+        size_t bytes()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return bytes_[WINDOW] + bytes_[PROBATION] + bytes_[PROTECTED];
+        }
+
+    private:
+        enum Segment
+        {
+            WINDOW,
+            PROBATION,
+            PROTECTED,
+            segments,
+        };
+
+        struct Entry
+        {
+            std::string key;
+            Buffer data;
+        };
+
+        typedef std::list<Entry> Lru;
+
+        struct Slot
+        {
+            Segment segment;
+            Lru::iterator entry;
+        };
+
+        typedef boost::unordered_map<std::string, Slot> Index;
+
+        // 1% of the budget, enough for the largest object
+        size_t window_budget() const
+        {
+            return std::min(budget_, std::max(budget_ / 100, max_object()));
+        }
+
+        size_t protected_budget() const
+        {
+            return (budget_ - window_budget()) / 5 * 4;
+        }
+
+        // A file leaving the window gets into the main part if it is asked for more often than
+        // the ones it would push out.
+        void admit(const Entry& candidate)
+        {
+            size_t main_budget = budget_ - window_budget();
+            size_t size = candidate.data->size();
+
+            while (bytes_[PROBATION] + bytes_[PROTECTED] + size > main_budget)
+            {
+                Segment from = lru_[PROBATION].empty() ? PROTECTED : PROBATION;
+                if (lru_[from].empty())
+                    return;
+
+                if (sketch_.frequency(candidate.key) <= sketch_.frequency(lru_[from].back().key))
+                    return;
+
+                evict(from);
+            }
+
+            insert(candidate.key, candidate.data, PROBATION);
+        }
+
+        void insert(const std::string& key, const Buffer& data, Segment segment)
+        {
+            lru_[segment].push_front(Entry());
+            lru_[segment].front().key = key;
+            lru_[segment].front().data = data;
+            bytes_[segment] += data->size();
+
+            Slot slot;
+            slot.segment = segment;
+            slot.entry = lru_[segment].begin();
+            index_[key] = slot;
+        }
+
+        void move(Slot& slot, Segment to)
+        {
+            size_t size = slot.entry->data->size();
+            bytes_[slot.segment] -= size;
+            bytes_[to] += size;
+
+            lru_[to].splice(lru_[to].begin(), lru_[slot.segment], slot.entry);
+            slot.segment = to;
+        }
+
+        void evict(Segment segment)
+        {
+            remove(lru_[segment].back().key);
+        }
+
+        void remove(const std::string& key)
+        {
+            Index::iterator it = index_.find(key);
+            if (it == index_.end())
+                return;
+
+            bytes_[it->second.segment] -= it->second.entry->data->size();
+            lru_[it->second.segment].erase(it->second.entry);
+            index_.erase(it);
+        }
+
+    private:
+        boost::mutex mutex_;
+        size_t budget_;
+        size_t epoch_;
+        Lru lru_[segments];
+        size_t bytes_[segments];
+        Index index_;
+        Frequency_sketch sketch_;
+    };
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef _FILE_TRANSFER_PAGE_CACHE_H_
+#define _FILE_TRANSFER_PAGE_CACHE_H_
+
+#include <string>
+#include <map>
+#include <algorithm>
+
+#include <boost/thread.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+
+#include "easylogging++.h"
+
+namespace ft {
+
+    // What a file type does to the page cache. Hot files are read ahead whole when a reply is
+    // queued; normal ones sequentially, a window ahead of the send. Archive files are written once
+    // and rarely read, so receives write them back and drop them as they go and replies drop what
+    // they have sent, leaving the hot working set resident while bulk traffic flows.
+    class Page_cache_policy
+    {
+    public:
+        enum Policy
+        {
+            HOT,
+            NORMAL,
+            ARCHIVE,
+            POLICY_COUNT,
+        };
+
+        enum
+        {
+            // read ahead of a reply, and dropped behind an archive reply, in steps of this
+            readahead_window = 4 * 1024 * 1024,
+        };
+
+        Page_cache_policy()
+        {
+            type_policy_["ts"] = HOT;
+        }
+
+        void set_type_policy(const std::string& type, int policy)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            type_policy_[type] = std::max(0, std::min<int>(policy, ARCHIVE));
+        }
+
+        int policy(const std::string& type)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            std::map<std::string, int>::const_iterator it = type_policy_.find(type);
+            return it != type_policy_.end() ? it->second : NORMAL;
+        }
+
+    private:
+        boost::mutex mutex_;
+        std::map<std::string, int> type_policy_;
+    };
+
+#ifdef __linux__
+    // Write-behind for a file written once: every window the new bytes are queued for writeback
+    // and the window before, written back by then, leaves the page cache. Without it a large
+    // upload fills the cache with dirty pages nobody reads.
+    class Drop_behind
+    {
+    public:
+        enum { window = 8 * 1024 * 1024 };
+
+        Drop_behind() : fd_(-1),
+            written_(0),
+            queued_(0),
+            dropped_(0)
+        {}
+
+        // the writer's descriptor, from offset on
+        void attach(int fd, off_t offset)
+        {
+            fd_ = fd;
+            written_ = queued_ = dropped_ = offset;
+        }
+
+        // True when the writer should flush and call advance(): a window is complete.
+        bool wrote(size_t size)
+        {
+            written_ += size;
+            return fd_ != -1 && written_ - queued_ >= window;
+        }
+
+        void advance()
+        {
+            if (fd_ == -1)
+                return;
+
+            ::sync_file_range(fd_, queued_, written_ - queued_, SYNC_FILE_RANGE_WRITE);
+
+            if (queued_ > dropped_)
+            {
+                // written back while the window after it came in, so this rarely waits
+                ::sync_file_range(fd_, dropped_, queued_ - dropped_,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                ::posix_fadvise(fd_, dropped_, queued_ - dropped_, POSIX_FADV_DONTNEED);
+                dropped_ = queued_;
+            }
+
+            queued_ = written_;
+        }
+
+        // Queues the tail and drops whatever of the file is clean already, before the writer
+        // closes the descriptor.
+        void finish()
+        {
+            if (fd_ == -1)
+                return;
+
+            ::sync_file_range(fd_, queued_, 0, SYNC_FILE_RANGE_WRITE);
+            ::posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+            fd_ = -1;
+        }
+
+    private:
+        int fd_;
+        off_t written_;
+        off_t queued_;     // writeback started up to here
+        off_t dropped_;    // and gone from the page cache up to here
+    };
+#endif
+}
+
+#endif
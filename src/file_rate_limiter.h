@@ -0,0 +1,294 @@
+#ifndef _FILE_TRANSFER_RATE_LIMITER_H_
+#define _FILE_TRANSFER_RATE_LIMITER_H_
+
+#include <map>
+#include <string>
+#include <algorithm>
+
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+namespace ft {
+
+    // Bytes per second with a burst of a tenth of a second. A rate of 0 means unlimited.
+    class Token_bucket
+    {
+    public:
+        Token_bucket() : rate_(0),
+            burst_(0),
+            tokens_(0),
+            last_()
+        {}
+
+        void set_rate(size_t rate)
+        {
+            if (rate == rate_)
+                return;
+
+            rate_ = rate;
+            burst_ = std::max(rate / 10.0, double(min_grant));
+            tokens_ = std::min(tokens_, burst_);
+        }
+
+        bool unlimited() const
+        {
+            return rate_ == 0;
+        }
+
+        void refill(const boost::posix_time::ptime& now)
+        {
+            if (!last_.is_not_a_date_time() && !unlimited())
+            {
+                double elapsed = (now - last_).total_microseconds() / 1e6;
+                tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+            }
+
+            last_ = now;
+        }
+
+        void fill()
+        {
+            tokens_ = burst_;
+        }
+
+        // whether refill(now) would leave it with the whole burst, like a new one after fill()
+        bool full(const boost::posix_time::ptime& now) const
+        {
+            if (unlimited() || last_.is_not_a_date_time())
+                return true;
+
+            double elapsed = (now - last_).total_microseconds() / 1e6;
+            return tokens_ + elapsed * rate_ >= burst_;
+        }
+
+        size_t available() const
+        {
+            if (unlimited())
+                return size_t(-1);
+
+            return tokens_ > 0 ? static_cast<size_t>(tokens_) : 0;
+        }
+
+        void consume(size_t bytes)
+        {
+            if (!unlimited())
+                tokens_ -= bytes;
+        }
+
+        // time until `bytes` tokens are there
+        boost::posix_time::time_duration wait_for(size_t bytes) const
+        {
+            if (unlimited() || tokens_ >= bytes)
+                return boost::posix_time::time_duration();
+
+            return boost::posix_time::microseconds(static_cast<long>((bytes - tokens_) * 1e6 / rate_) + 1);
+        }
+
+        // sends are never granted less than this unless the caller wants less
+        enum { min_grant = 16 * 1024 };
+
+    private:
+        size_t rate_;
+        double burst_;
+        double tokens_;
+        boost::posix_time::ptime last_;
+    };
+
+    // Hierarchical shaping of outgoing file data: every send must fit into its connection bucket,
+    // the bucket of the remote host and the global bucket. Priority classes are strict: while a
+    // connection of a higher class waits for global tokens, lower classes get none.
+    class Rate_limiter
+    {
+    public:
+        enum Priority
+        {
+            REALTIME,
+            NORMAL,
+            BULK,
+            PRIORITY_COUNT,
+        };
+
+        enum { sweep_interval_s = 10 };
+
+        Rate_limiter() : connection_rate_(0),
+            default_host_rate_(0),
+            last_sweep_()
+        {
+            std::fill(waiting_, waiting_ + PRIORITY_COUNT, 0);
+
+            type_priority_["ts"] = REALTIME;
+        }
+
+        void set_global_rate(size_t rate)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            global_.set_rate(rate);
+        }
+
+        // an empty host sets the default for hosts without their own limit
+        void set_host_rate(const std::string& host, size_t rate)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (host.empty())
+            {
+                default_host_rate_ = rate;
+            }
+            else {
+                host_rate_[host] = rate;
+            }
+        }
+
+        void set_connection_rate(size_t rate)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            connection_rate_ = rate;
+        }
+
+        void set_type_priority(const std::string& type, int priority)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            type_priority_[type] = std::max(0, std::min<int>(priority, BULK));
+        }
+
+        int priority(const std::string& type)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            std::map<std::string, int>::const_iterator it = type_priority_.find(type);
+            return it != type_priority_.end() ? it->second : NORMAL;
+        }
+
+        // How many of `want` bytes a connection may send now. Returns 0 and sets delay when it has to
+        // wait; `waiting` tracks whether the connection is queued for global tokens and must be passed
+        // back unchanged on the next call.
+        size_t allowance(Token_bucket& conn, const std::string& host, int priority, size_t want,
+            bool& waiting, boost::posix_time::time_duration& delay)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (waiting)
+            {
+                --waiting_[priority];
+                waiting = false;
+            }
+
+            boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+            sweep_hosts(now);
+            Token_bucket& host_bucket = host_bucket_for(host);
+            conn.set_rate(connection_rate_);
+
+            conn.refill(now);
+            host_bucket.refill(now);
+            global_.refill(now);
+
+            size_t need = std::min(want, size_t(Token_bucket::min_grant));
+
+            for (int p = 0; p < priority; ++p)
+            {
+                if (waiting_[p] > 0)
+                {
+                    // leave the refill to the higher class
+                    delay = std::max(global_.wait_for(need), boost::posix_time::time_duration(boost::posix_time::milliseconds(1)));
+                    return 0;
+                }
+            }
+
+            size_t grant = std::min(want, std::min(conn.available(), host_bucket.available()));
+            if (grant < need)
+            {
+                delay = std::max(conn.wait_for(need), host_bucket.wait_for(need));
+                return 0;
+            }
+
+            grant = std::min(grant, global_.available());
+            if (grant < need)
+            {
+                waiting = true;
+                ++waiting_[priority];
+
+                delay = global_.wait_for(need);
+                return 0;
+            }
+
+            return grant;
+        }
+
+        void charge(Token_bucket& conn, const std::string& host, size_t bytes)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            conn.consume(bytes);
+            host_bucket_for(host).consume(bytes);
+            global_.consume(bytes);
+        }
+
+        // a connection that stops sending while queued for global tokens
+        void cancel(int priority, bool& waiting)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (waiting)
+            {
+                --waiting_[priority];
+                waiting = false;
+            }
+        }
+
+    private:
+        // A host starts with its whole burst, so the bucket of one that sent nothing for a while
+        // is dropped without any difference to its next send.
+        Token_bucket& host_bucket_for(const std::string& host)
+        {
+            std::map<std::string, size_t>::const_iterator it = host_rate_.find(host);
+            size_t rate = it != host_rate_.end() ? it->second : default_host_rate_;
+
+            std::map<std::string, Token_bucket>::iterator bucket = host_bucket_.find(host);
+            if (bucket == host_bucket_.end())
+            {
+                bucket = host_bucket_.insert(std::make_pair(host, Token_bucket())).first;
+                bucket->second.set_rate(rate);
+                bucket->second.fill();
+            }
+            else {
+                bucket->second.set_rate(rate);
+            }
+
+            return bucket->second;
+        }
+
+        // every host ever served would stay otherwise
+        void sweep_hosts(const boost::posix_time::ptime& now)
+        {
+            if (!last_sweep_.is_not_a_date_time() && now - last_sweep_ < boost::posix_time::seconds(static_cast<long>(sweep_interval_s)))
+                return;
+
+            last_sweep_ = now;
+
+            std::map<std::string, Token_bucket>::iterator it = host_bucket_.begin();
+            while (it != host_bucket_.end())
+            {
+                if (it->second.full(now))
+                    host_bucket_.erase(it++);
+                else
+                    ++it;
+            }
+        }
+
+    private:
+        boost::mutex mutex_;
+
+        Token_bucket global_;
+        std::map<std::string, Token_bucket> host_bucket_;
+        std::map<std::string, size_t> host_rate_;
+        size_t connection_rate_;
+        size_t default_host_rate_;
+        boost::posix_time::ptime last_sweep_;
+
+        std::map<std::string, int> type_priority_;
+        int waiting_[PRIORITY_COUNT];
+    };
+}
+
+#endif
@@ -0,0 +1,815 @@
+#ifndef _FILE_TRANSFER_SEGMENT_STORE_H_
+#define _FILE_TRANSFER_SEGMENT_STORE_H_
+
+#ifdef __linux__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "easylogging++.h"
+#include "file_source.h"
+#include "file_sink.h"
+#include "file_durability.h"
+
+namespace ft {
+
+    // Small files packed into large append-only segment files under recv_path/.segments/, one
+    // record per stored file: a header, the key and the data. The index of key to segment and
+    // offset lives in memory and is rebuilt by reading the segments at startup, the last record
+    // of a key wins. A key stored again leaves its old record dead; segments at least half dead
+    // are compacted in the background into the one being appended to. One process at a time
+    // appends, the one holding the flock on the directory; a server taking over the listeners of
+    // another only reads the segments until the old one has exited, then loads them again.
+    class Segment_store
+    {
+    public:
+        enum
+        {
+            segment_size = 256 * 1024 * 1024,
+            // larger files are never packed, whatever the threshold
+            max_file_size = 16 * 1024 * 1024,
+        };
+
+        explicit Segment_store(const std::string& recv_path) : root_(recv_path + ".segments/"),
+            lock_fd_(-1),
+            locked_(false),
+            threshold_(0),
+            active_(0),
+            stopping_(false)
+        {}
+
+        ~Segment_store()
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                stopping_ = true;
+            }
+            compact_.notify_all();
+
+            if (compactor_)
+                compactor_->join();
+
+            if (lock_fd_ != -1)
+                ::close(lock_fd_);
+        }
+
+        // Reads the segments of the last run into the index and starts compaction. Server only.
+        void recover()
+        {
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(root_, ec);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            std::string lock_path = root_ + "lock";
+            lock_fd_ = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (lock_fd_ == -1)
+            {
+                LERROR << "open " << lock_path << " error(" << errno << "), files are not packed";
+            }
+
+            locked_ = lock_fd_ != -1 && ::flock(lock_fd_, LOCK_EX | LOCK_NB) == 0;
+            if (lock_fd_ != -1 && !locked_)
+            {
+                LWARNING << "segment store " << root_ << " is in use by another process, files are packed once it exits";
+            }
+
+            load();
+
+            compactor_.reset(new boost::thread(boost::bind(&Segment_store::compact_loop, this)));
+        }
+
+        // Received files of up to bytes are packed, 0 never.
+        void set_threshold(size_t bytes)
+        {
+            LINFO << "pack files of up to " << bytes << " bytes into segments";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            threshold_ = std::min<size_t>(bytes, max_file_size);
+        }
+
+        bool packs(boost::int64_t size)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return locked_ && size >= 0 && static_cast<boost::uint64_t>(size) <= threshold_;
+        }
+
+        // Appends the file in one write. False if it could not be stored.
+        bool put(const std::string& key, const char* data, size_t size)
+        {
+            boost::lock_guard<boost::mutex> append_guard(append_mutex_);
+
+            if (!append(key, data, size))
+                return false;
+
+            // stored again after it was erased, the tombstone would hide the new record
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            tombstones_.erase(std::remove(tombstones_.begin(), tombstones_.end(), key), tombstones_.end());
+            return true;
+        }
+
+        // The key is stored elsewhere from now on. Its tombstone is appended in the background,
+        // so that the io thread calling this does not wait for a large append in progress.
+        void erase(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (forget(key))
+            {
+                tombstones_.push_back(key);
+                compact_.notify_all();
+            }
+        }
+
+        // Makes the stored file of key durable, and the name of the segment holding it. False if
+        // the key is not packed.
+        bool sync(const std::string& key)
+        {
+            SegmentPtr segment;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                Index::const_iterator it = index_.find(key);
+                if (it != index_.end())
+                    segment = find_segment(it->second.segment);
+            }
+
+            return segment && ::fdatasync(segment->fd) == 0 && sync_directory(root_);
+        }
+
+        // The stored file as a slice of its segment, empty if the key is not packed.
+        SourcePtr open(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            Index::const_iterator it = index_.find(key);
+            if (it == index_.end())
+                return SourcePtr();
+
+            const Location& location = it->second;
+            SegmentPtr segment = find_segment(location.segment);
+            if (!segment)
+            {
+                LERROR << key << " is in segment " << location.segment << ", which is gone";
+                return SourcePtr();
+            }
+
+            return SourcePtr(new Slice_source(segment, location.offset, location.length, key));
+        }
+
+        // a copy of the stored file, for the object cache
+        bool read(const std::string& key, std::vector<char>& data)
+        {
+            SourcePtr source = open(key);
+            if (!source)
+                return false;
+
+            data.clear();
+            data.reserve(source->size());
+            return source->scan(boost::bind(&append_to, &data, _1, _2));
+        }
+
+        std::vector<std::string> keys()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            std::vector<std::string> keys;
+            keys.reserve(index_.size());
+            for (Index::const_iterator it = index_.begin(); it != index_.end(); ++it)
+                keys.push_back(it->first);
+
+            return keys;
+        }
+
+    private:
+        static const boost::uint64_t tombstone = ~0ULL;
+        static const boost::uint32_t magic = 0x47535446;    // "FTSG"
+
+        struct Header
+        {
+            boost::uint32_t magic;
+            boost::uint32_t key_size;
+            boost::uint64_t data_size;    // tombstone for a key stored elsewhere since
+        };
+
+        // A segment file, kept open while replies read from it even after compaction removed it.
+        struct Segment
+        {
+            Segment(boost::uint32_t id, int fd, const std::string& path) : id(id),
+                fd(fd),
+                path(path),
+                size(0),
+                dead(0),
+                kept(false)
+            {}
+
+            ~Segment()
+            {
+                ::close(fd);
+            }
+
+            boost::uint32_t id;
+            int fd;
+            std::string path;
+            off_t size;
+            off_t dead;    // bytes of records no key points to
+            bool kept;     // compaction failed, left alone until the next start
+        };
+
+        typedef boost::shared_ptr<Segment> SegmentPtr;
+
+        struct Location
+        {
+            boost::uint32_t segment;
+            off_t offset;    // of the data
+            size_t length;
+        };
+
+        typedef boost::unordered_map<std::string, Location> Index;
+
+        class Slice_source : public Source
+        {
+        public:
+            Slice_source(const SegmentPtr& segment, off_t offset, size_t length, const std::string& key) : segment_(segment),
+                offset_(offset),
+                length_(length),
+                name_(segment->path + ":" + key)
+            {}
+
+            boost::int64_t size() const
+            {
+                return length_;
+            }
+
+            std::string name() const
+            {
+                return name_;
+            }
+
+            ssize_t send_to(int sock, off_t offset, size_t count)
+            {
+                if (offset >= static_cast<off_t>(length_))
+                    return 0;
+
+                off_t from = offset_ + offset;
+                return ::sendfile(sock, segment_->fd, &from, std::min<size_t>(count, length_ - offset));
+            }
+
+            bool scan(const Scanner& scanner) const
+            {
+                std::vector<char> buffer(std::min<size_t>(length_, 256 * 1024));
+                for (size_t done = 0; done < length_; )
+                {
+                    ssize_t result = ::pread(segment_->fd, &buffer[0], std::min(buffer.size(), length_ - done), offset_ + done);
+                    if (result <= 0)
+                        return false;
+
+                    scanner(&buffer[0], result);
+                    done += result;
+                }
+
+                return true;
+            }
+
+            void prefetch(off_t offset, size_t count)
+            {
+                if (offset < static_cast<off_t>(length_))
+                    ::posix_fadvise(segment_->fd, offset_ + offset, std::min<size_t>(count, length_ - offset), POSIX_FADV_WILLNEED);
+            }
+
+        private:
+            SegmentPtr segment_;
+            off_t offset_;
+            size_t length_;
+            std::string name_;
+        };
+
+        static void append_to(std::vector<char>* data, const char* bytes, size_t size)
+        {
+            data->insert(data->end(), bytes, bytes + size);
+        }
+
+        static size_t record_size(const std::string& key, boost::uint64_t data_size)
+        {
+            return sizeof(Header) + key.size() + (data_size == tombstone ? 0 : data_size);
+        }
+
+        std::string segment_path(boost::uint32_t id) const
+        {
+            char name[32];
+            std::sprintf(name, "seg-%06u.dat", id);
+            return root_ + name;
+        }
+
+        // under mutex_
+        SegmentPtr find_segment(boost::uint32_t id) const
+        {
+            std::map<boost::uint32_t, SegmentPtr>::const_iterator it = segments_.find(id);
+            return it != segments_.end() ? it->second : SegmentPtr();
+        }
+
+        // under mutex_
+        SegmentPtr open_segment(boost::uint32_t id)
+        {
+            std::string path = segment_path(id);
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+            if (fd == -1)
+            {
+                LERROR << "open segment " << path << " error(" << errno << ")";
+                return SegmentPtr();
+            }
+
+            SegmentPtr segment(new Segment(id, fd, path));
+            segments_[id] = segment;
+            active_ = std::max(active_, id);
+            return segment;
+        }
+
+        // under mutex_: opens the segments in the directory and indexes their records
+        void load()
+        {
+            std::vector<boost::uint32_t> ids;
+            boost::system::error_code ec;
+            boost::filesystem::directory_iterator it(root_, ec), end;
+            for (; !ec && it != end; it.increment(ec))
+            {
+                unsigned id = 0;
+                if (std::sscanf(it->path().filename().string().c_str(), "seg-%u.dat", &id) == 1)
+                    ids.push_back(id);
+            }
+            std::sort(ids.begin(), ids.end());
+
+            for (size_t i = 0; i < ids.size(); ++i)
+            {
+                SegmentPtr segment = open_segment(ids[i]);
+                if (segment)
+                    scan(segment, locked_ && i + 1 == ids.size());
+            }
+
+            if (!index_.empty())
+            {
+                LINFO << "segment store " << root_ << ": " << index_.size() << " files in " << segments_.size() << " segments";
+            }
+        }
+
+        // under mutex_: once the process that had the directory is gone, appends from here on, to
+        // segments read again with what it appended since
+        void take_over()
+        {
+            if (lock_fd_ == -1 || ::flock(lock_fd_, LOCK_EX | LOCK_NB) == -1)
+                return;
+
+            LINFO << "segment store " << root_ << " taken over, load it again";
+
+            locked_ = true;
+            segments_.clear();
+            index_.clear();
+            active_ = 0;
+            load();
+
+            // erased while the other process had the directory
+            for (size_t i = 0; i < tombstones_.size(); ++i)
+                forget(tombstones_[i]);
+        }
+
+        // under mutex_: drops key from the index, its record is dead. False if it is not packed.
+        bool forget(const std::string& key)
+        {
+            Index::iterator it = index_.find(key);
+            if (it == index_.end())
+                return false;
+
+            SegmentPtr segment = find_segment(it->second.segment);
+            if (segment)
+                segment->dead += record_size(key, it->second.length);
+
+            index_.erase(it);
+            return true;
+        }
+
+        // under mutex_: indexes the records of a segment. A torn last record of the active one,
+        // being appended when the process stopped, is cut off; a sealed segment with an
+        // unreadable record is kept as it is, with the records after it lost to the index.
+        void scan(const SegmentPtr& segment, bool active)
+        {
+            struct stat statbuf;
+            if (::fstat(segment->fd, &statbuf) == -1)
+                return;
+
+            off_t offset = 0;
+            while (offset + static_cast<off_t>(sizeof(Header)) <= statbuf.st_size)
+            {
+                Header header;
+                std::vector<char> key;
+                if (!read_record(segment->fd, offset, statbuf.st_size, header, key))
+                    break;
+
+                std::string name(key.begin(), key.end());
+                off_t size = record_size(name, header.data_size);
+                index(name, header.data_size, segment, offset, size);
+                if (header.data_size == tombstone)
+                    segment->dead += size;
+
+                offset += size;
+            }
+
+            if (offset < statbuf.st_size && active)
+            {
+                LWARNING << segment->path << ": torn record at " << offset << ", " << statbuf.st_size - offset << " bytes dropped";
+                if (::ftruncate(segment->fd, offset) == -1)
+                {
+                    LERROR << "truncate " << segment->path << " error(" << errno << ")";
+                }
+            }
+            else if (offset < statbuf.st_size)
+            {
+                LERROR << segment->path << ": unreadable record at " << offset << ", " << statbuf.st_size - offset << " bytes not indexed, kept";
+                segment->kept = true;
+            }
+
+            segment->size = offset;
+        }
+
+        static bool read_record(int fd, off_t offset, off_t end, Header& header, std::vector<char>& key)
+        {
+            if (::pread(fd, &header, sizeof(header), offset) != sizeof(header) || header.magic != magic
+                || header.key_size == 0 || header.key_size > 4096)
+                return false;
+
+            off_t data_size = header.data_size == tombstone ? 0 : static_cast<off_t>(header.data_size);
+            if (header.data_size != tombstone && (header.data_size > max_file_size
+                || offset + static_cast<off_t>(sizeof(header) + header.key_size) + data_size > end))
+                return false;
+
+            key.resize(header.key_size);
+            return ::pread(fd, &key[0], key.size(), offset + sizeof(header)) == static_cast<ssize_t>(key.size());
+        }
+
+        // under mutex_: points key at the record, the one it pointed to before is dead now
+        void index(const std::string& key, boost::uint64_t data_size, const SegmentPtr& segment, off_t offset, off_t /*size*/)
+        {
+            Index::iterator it = index_.find(key);
+            if (it != index_.end())
+            {
+                std::map<boost::uint32_t, SegmentPtr>::iterator old = segments_.find(it->second.segment);
+                if (old != segments_.end())
+                    old->second->dead += record_size(key, it->second.length);
+            }
+
+            if (data_size == tombstone)
+            {
+                if (it != index_.end())
+                    index_.erase(it);
+                return;
+            }
+
+            Location location;
+            location.segment = segment->id;
+            location.offset = offset + sizeof(Header) + key.size();
+            location.length = data_size;
+            index_[key] = location;
+        }
+
+        // under append_mutex_: writes one record at the end of the active segment and points the
+        // index at it. The write itself runs without mutex_, so lookups go on meanwhile; appends
+        // stay one at a time, a failed one leaves no hole before the next. Returns its size, 0 on
+        // failure.
+        size_t append(const std::string& key, const char* data, boost::uint64_t data_size)
+        {
+            size_t size = record_size(key, data_size);
+
+            SegmentPtr segment;
+            off_t offset = 0;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                if (!locked_)
+                    return 0;
+
+                segment = find_segment(active_);
+                if (!segment || (segment->size > 0 && segment->size + static_cast<off_t>(size) > segment_size))
+                {
+                    // sealed, a candidate for compaction from now on
+                    segment = open_segment(segment ? active_ + 1 : std::max<boost::uint32_t>(active_, 1));
+                    if (!segment)
+                        return 0;
+
+                    compact_.notify_all();
+                }
+
+                offset = segment->size;
+            }
+
+            Header header;
+            header.magic = magic;
+            header.key_size = static_cast<boost::uint32_t>(key.size());
+            header.data_size = data_size;
+
+            struct iovec iov[3];
+            iov[0].iov_base = &header;
+            iov[0].iov_len = sizeof(header);
+            iov[1].iov_base = const_cast<char*>(key.data());
+            iov[1].iov_len = key.size();
+            iov[2].iov_base = const_cast<char*>(data);
+            iov[2].iov_len = data_size == tombstone ? 0 : data_size;
+
+            ssize_t result = ::pwritev(segment->fd, iov, data_size == tombstone || data_size == 0 ? 2 : 3, offset);
+            if (result != static_cast<ssize_t>(size))
+            {
+                LERROR << "append " << key << " to " << segment->path << " error(" << errno << ")";
+                return 0;
+            }
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            index(key, data_size, segment, offset, size);
+            if (data_size == tombstone)
+                segment->dead += size;
+
+            segment->size = offset + size;
+            return size;
+        }
+
+        // under append_mutex_: appends the tombstones of the keys erased since the last time.
+        // False if one could not be written, it is tried again later.
+        bool write_tombstones()
+        {
+            std::vector<std::string> keys;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                keys.swap(tombstones_);
+            }
+
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                if (!append(keys[i], NULL, tombstone))
+                {
+                    boost::lock_guard<boost::mutex> guard(mutex_);
+                    tombstones_.insert(tombstones_.begin(), keys.begin() + i, keys.end());
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // under mutex_: a sealed segment mostly dead
+        SegmentPtr victim() const
+        {
+            for (std::map<boost::uint32_t, SegmentPtr>::const_iterator it = segments_.begin(); it != segments_.end(); ++it)
+            {
+                const Segment& segment = *it->second;
+                if (locked_ && segment.id != active_ && !segment.kept && segment.size > 0 && segment.dead * 2 >= segment.size)
+                    return it->second;
+            }
+
+            return SegmentPtr();
+        }
+
+        // Also writes the tombstones, and takes the directory over from another process.
+        void compact_loop()
+        {
+            bool backoff = false;
+            for (;;)
+            {
+                SegmentPtr segment;
+                bool tombstones = false;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex_);
+                    for (;;)
+                    {
+                        if (stopping_)
+                            return;
+
+                        if (!locked_)
+                            take_over();
+
+                        tombstones = locked_ && !backoff && !tombstones_.empty();
+                        segment = victim();
+                        if (tombstones || segment)
+                            break;
+
+                        compact_.timed_wait(lock, boost::posix_time::seconds(locked_ ? 10 : 1));
+                        backoff = false;
+                    }
+                }
+
+                if (tombstones)
+                {
+                    boost::lock_guard<boost::mutex> append_guard(append_mutex_);
+                    backoff = !write_tombstones();
+                }
+
+                if (segment && !compact(segment))
+                {
+                    boost::lock_guard<boost::mutex> guard(mutex_);
+                    segment->kept = true;
+                }
+            }
+        }
+
+        // Copies the live records of segment to the active one and removes it. Replies still
+        // reading it keep it open. A segment not read to its end is kept, the keys in the rest of
+        // it are still only there.
+        bool compact(const SegmentPtr& segment)
+        {
+            LINFO << "compact " << segment->path << ", " << segment->dead << " of " << segment->size << " bytes dead";
+
+            boost::uint32_t first = 0;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                first = active_;
+            }
+
+            size_t moved = 0;
+            std::vector<char> data;
+            for (off_t offset = 0; offset < segment->size; )
+            {
+                Header header;
+                std::vector<char> key;
+                if (!read_record(segment->fd, offset, segment->size, header, key))
+                {
+                    LERROR << "compact " << segment->path << ": unreadable record at " << offset << ", kept";
+                    return false;
+                }
+
+                std::string name(key.begin(), key.end());
+                off_t size = record_size(name, header.data_size);
+
+                if (header.data_size != tombstone)
+                {
+                    data.resize(header.data_size);
+                    off_t at = offset + sizeof(header) + key.size();
+                    if (!data.empty() && ::pread(segment->fd, &data[0], data.size(), at) != static_cast<ssize_t>(data.size()))
+                    {
+                        LERROR << "compact " << segment->path << ": read error(" << errno << "), kept";
+                        return false;
+                    }
+
+                    // no other append between the look at the index and this one
+                    boost::lock_guard<boost::mutex> append_guard(append_mutex_);
+                    bool live = false;
+                    {
+                        boost::lock_guard<boost::mutex> guard(mutex_);
+                        Index::const_iterator it = index_.find(name);
+                        live = it != index_.end() && it->second.segment == segment->id && it->second.offset == at;
+                    }
+
+                    if (live)
+                    {
+                        if (!append(name, data.empty() ? NULL : &data[0], data.size()))
+                            return false;
+                        ++moved;
+                    }
+                }
+                else {
+                    // still needed while an older segment may hold the key
+                    boost::lock_guard<boost::mutex> append_guard(append_mutex_);
+                    bool needed = false;
+                    {
+                        boost::lock_guard<boost::mutex> guard(mutex_);
+                        needed = !index_.count(name) && segments_.begin()->first < segment->id;
+                    }
+
+                    if (needed && !append(name, NULL, tombstone))
+                        return false;
+                }
+
+                offset += size;
+            }
+
+            // the moved records durable before their only other copy goes, files acknowledged as
+            // durable must stay so
+            std::vector<SegmentPtr> written;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                for (boost::uint32_t id = first; id <= active_; ++id)
+                {
+                    SegmentPtr target = find_segment(id);
+                    if (target)
+                        written.push_back(target);
+                }
+            }
+
+            for (size_t i = 0; i < written.size(); ++i)
+            {
+                if (::fdatasync(written[i]->fd) == -1)
+                {
+                    LERROR << "compact " << segment->path << ": sync " << written[i]->path << " error(" << errno << "), kept";
+                    return false;
+                }
+            }
+
+            if (!sync_directory(root_))
+            {
+                LERROR << "compact " << segment->path << ": sync " << root_ << " error(" << errno << "), kept";
+                return false;
+            }
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            segments_.erase(segment->id);
+            ::unlink(segment->path.c_str());
+
+            LINFO << "compacted " << segment->path << ", " << moved << " files moved";
+            return true;
+        }
+
+    private:
+        const std::string root_;
+        int lock_fd_;
+        bool locked_;    // this process appends, it holds the flock on root_
+
+        // taken before mutex_, one append at a time
+        boost::mutex append_mutex_;
+        boost::mutex mutex_;
+        size_t threshold_;
+        std::map<boost::uint32_t, SegmentPtr> segments_;
+        boost::uint32_t active_;
+        Index index_;
+        std::vector<std::string> tombstones_;    // erased keys, their tombstones to be appended
+
+        bool stopping_;
+        boost::condition_variable compact_;
+        boost::shared_ptr<boost::thread> compactor_;
+    };
+
+    // Collects a small received file and packs it into the segment store once it is complete.
+    class Segment_sink : public Sink
+    {
+    public:
+        // queue: where close() appends the file to its segment
+        Segment_sink(Segment_store& store, const std::string& key, const Io_queuePtr& queue) : store_(store),
+            key_(key),
+            queue_(queue),
+            data_()
+        {}
+
+        std::string name() const
+        {
+            return "segment:" + key_;
+        }
+
+        bool open(boost::int64_t size)
+        {
+            data_.reserve(static_cast<size_t>(std::max<boost::int64_t>(size, 0)));
+            return true;
+        }
+
+        bool write(const char* data, size_t size)
+        {
+            if (data_.size() + size > Segment_store::max_file_size)
+                return false;
+
+            data_.insert(data_.end(), data, data + size);
+            return true;
+        }
+
+        bool close(bool complete)
+        {
+            bool stored = !complete || store_.put(key_, data_.empty() ? NULL : &data_[0], data_.size());
+            if (!stored)
+            {
+                LERROR << "store " << key_ << " in a segment fail";
+            }
+
+            std::vector<char>().swap(data_);
+            return stored;
+        }
+
+        Io_queuePtr close_queue() const
+        {
+            return queue_;
+        }
+
+        bool sync()
+        {
+            return store_.sync(key_);
+        }
+
+    private:
+        Segment_store& store_;
+        std::string key_;
+        Io_queuePtr queue_;
+        std::vector<char> data_;
+    };
+}
+
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef _FILE_TRANSFER_SHA256_H_
+#define _FILE_TRANSFER_SHA256_H_
+
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/cstdint.hpp>
+
+namespace ft {
+
+    // SHA-256 (FIPS 180-4), the content address of deduplicated files.
+    class Sha256
+    {
+    public:
+        enum { digest_size = 32 };
+
+        Sha256()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            static const boost::uint32_t init[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+            };
+
+            std::memcpy(state_, init, sizeof(state_));
+            length_ = 0;
+            used_ = 0;
+        }
+
+        void update(const void* data, size_t size)
+        {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            length_ += size;
+
+            if (used_ > 0)
+            {
+                size_t take = std::min<size_t>(size, sizeof(block_) - used_);
+                std::memcpy(block_ + used_, bytes, take);
+                used_ += take;
+                bytes += take;
+                size -= take;
+
+                if (used_ < sizeof(block_))
+                    return;
+
+                transform(block_);
+                used_ = 0;
+            }
+
+            for (; size >= sizeof(block_); bytes += sizeof(block_), size -= sizeof(block_))
+                transform(bytes);
+
+            std::memcpy(block_, bytes, size);
+            used_ = size;
+        }
+
+        // Lowercase hex of the digest. Finishes the hash, reset() before using it again.
+        std::string hex()
+        {
+            unsigned char digest[digest_size];
+            finish(digest);
+
+            static const char digits[] = "0123456789abcdef";
+            std::string hex;
+            hex.reserve(digest_size * 2);
+            for (size_t i = 0; i < digest_size; ++i)
+            {
+                hex += digits[digest[i] >> 4];
+                hex += digits[digest[i] & 0x0f];
+            }
+
+            return hex;
+        }
+
+        static bool is_hex(const std::string& hex)
+        {
+            if (hex.size() != digest_size * 2)
+                return false;
+
+            return hex.find_first_not_of("0123456789abcdef") == std::string::npos;
+        }
+
+    private:
+        void finish(unsigned char* digest)
+        {
+            boost::uint64_t bits = length_ * 8;
+
+            unsigned char pad[sizeof(block_) + 8] = { 0x80 };
+            size_t pad_size = (used_ < 56 ? 56 : 120) - used_;
+            update(pad, pad_size);
+
+            unsigned char size[8];
+            for (int i = 0; i < 8; ++i)
+                size[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+            update(size, sizeof(size));
+
+            for (int i = 0; i < 8; ++i)
+            {
+                digest[4 * i] = static_cast<unsigned char>(state_[i] >> 24);
+                digest[4 * i + 1] = static_cast<unsigned char>(state_[i] >> 16);
+                digest[4 * i + 2] = static_cast<unsigned char>(state_[i] >> 8);
+                digest[4 * i + 3] = static_cast<unsigned char>(state_[i]);
+            }
+        }
+
+        static boost::uint32_t rotr(boost::uint32_t x, int n)
+        {
+            return (x >> n) | (x << (32 - n));
+        }
+
+        void transform(const unsigned char* block)
+        {
+            static const boost::uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+            };
+
+            boost::uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+            {
+                w[i] = (boost::uint32_t(block[4 * i]) << 24) | (boost::uint32_t(block[4 * i + 1]) << 16)
+                    | (boost::uint32_t(block[4 * i + 2]) << 8) | boost::uint32_t(block[4 * i + 3]);
+            }
+            for (int i = 16; i < 64; ++i)
+            {
+                boost::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                boost::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            boost::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+            boost::uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+
+            for (int i = 0; i < 64; ++i)
+            {
+                boost::uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+                boost::uint32_t ch = (e & f) ^ (~e & g);
+                boost::uint32_t t1 = h + s1 + ch + k[i] + w[i];
+                boost::uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+                boost::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                boost::uint32_t t2 = s0 + maj;
+
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state_[0] += a;
+            state_[1] += b;
+            state_[2] += c;
+            state_[3] += d;
+            state_[4] += e;
+            state_[5] += f;
+            state_[6] += g;
+            state_[7] += h;
+        }
+
+    private:
+        boost::uint32_t state_[8];
+        boost::uint64_t length_;
+        unsigned char block_[64];
+        size_t used_;
+    };
+}
+
+#endif
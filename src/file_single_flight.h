@@ -0,0 +1,192 @@
+#ifndef _FILE_TRANSFER_SINGLE_FLIGHT_H_
+#define _FILE_TRANSFER_SINGLE_FLIGHT_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_source.h"
+#include "file_io_queue.h"
+
+namespace ft {
+
+    // Coalesces concurrent replies for one stored file while it is read into memory. A file the
+    // object cache wants is read once, on a thread of its own rather than an io thread, and every
+    // query for the key until the read is done waits for that copy instead of reading again.
+    // Without a read in progress replies go out with sendfile. The reads in progress reserve
+    // max_bytes at most.
+    class Single_flight
+    {
+    public:
+        typedef boost::shared_ptr<const std::vector<char> > Buffer;
+        // the copy, empty if it could not be read; called on the reading thread
+        typedef boost::function<void (const Buffer& data)> Waiter;
+
+        enum
+        {
+            default_max_bytes = 64 * 1024 * 1024,
+        };
+
+        Single_flight() : max_bytes_(default_max_bytes),
+            bytes_(0)
+        {}
+
+#ifdef __linux__
+        // Waits for the copy a read in progress makes. False if there is none.
+        bool join(const std::string& key, const Waiter& waiter)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            Flight_map::iterator it = flights_.find(key);
+            if (it == flights_.end())
+                return false;
+
+            it->second->waiters.push_back(waiter);
+
+            LINFO << "query " << key << " joins the read in flight";
+            return true;
+        }
+
+        // Reads path, if it has up to limit bytes, for waiter and the queries joining meanwhile.
+        // False if a read of key is in progress already or the reads would reserve more than
+        // max_bytes.
+        bool load(const std::string& key, const std::string& path, size_t limit, const Waiter& waiter)
+        {
+            boost::shared_ptr<Flight> flight(new Flight(limit));
+            flight->waiters.push_back(waiter);
+
+            Io_queuePtr reader;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (flights_.count(key) || bytes_ + limit > max_bytes_)
+                    return false;
+
+                flights_[key] = flight;
+                bytes_ += limit;
+
+                if (!reader_)
+                    reader_.reset(new Io_queue("flights"));
+                reader = reader_;
+            }
+
+            reader->post(boost::bind(&Single_flight::run, this, key, path, flight));
+            return true;
+        }
+#endif
+
+        // The file was committed again, queries from now on read the new one.
+        void forget(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            flights_.erase(key);
+        }
+
+#ifdef __linux__
+        // Reads path whole, unless it is larger than limit.
+        static bool read(const std::string& path, size_t limit, std::vector<char>& data)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                return false;
+
+            struct stat statbuf;
+            if (::fstat(fd, &statbuf) == -1 || static_cast<boost::uint64_t>(statbuf.st_size) > limit)
+            {
+                ::close(fd);
+                return false;
+            }
+
+            data.resize(statbuf.st_size);
+            size_t offset = 0;
+            while (offset < data.size())
+            {
+                ssize_t result = ::pread(fd, &data[offset], data.size() - offset, offset);
+                if (result <= 0)
+                {
+                    if (result == -1)
+                    {
+                        LERROR << "read " << path << " error(" << errno << ")";
+                    }
+                    ::close(fd);
+                    return false;
+                }
+
+                offset += result;
+            }
+
+            ::close(fd);
+            return true;
+        }
+#endif
+
+    private:
+        struct Flight
+        {
+            explicit Flight(size_t reserved) : reserved(reserved)
+            {}
+
+            size_t reserved;
+            std::vector<Waiter> waiters;
+        };
+
+#ifdef __linux__
+        // on the reading thread
+        void run(const std::string& key, const std::string& path, const boost::shared_ptr<Flight>& flight)
+        {
+            boost::shared_ptr<std::vector<char> > data(new std::vector<char>());
+            Buffer copy;
+            if (read(path, flight->reserved, *data))
+                copy = data;
+
+            std::vector<Waiter> waiters;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                // unless forget() let a newer read take the key
+                Flight_map::iterator it = flights_.find(key);
+                if (it != flights_.end() && it->second == flight)
+                    flights_.erase(it);
+
+                bytes_ -= flight->reserved;
+                waiters.swap(flight->waiters);
+            }
+
+            if (copy)
+            {
+                LINFO << "read " << key << " once for " << waiters.size() << " queries, " << copy->size() << " bytes";
+            }
+
+            for (size_t i = 0; i < waiters.size(); ++i)
+                waiters[i](copy);
+        }
+#endif
+
+    private:
+        typedef boost::unordered_map<std::string, boost::shared_ptr<Flight> > Flight_map;
+
+        boost::mutex mutex_;
+        Flight_map flights_;
+        size_t max_bytes_;
+        size_t bytes_;     // reserved by the reads in progress
+
+        // last, so that it finishes its reads first
+        Io_queuePtr reader_;
+    };
+}
+
+#endif
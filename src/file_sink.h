@@ -0,0 +1,494 @@
+#ifndef _FILE_TRANSFER_SINK_H_
+#define _FILE_TRANSFER_SINK_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+
+#include "file_transfer.h"
+#include "file_page_cache.h"
+#include "file_storage_layout.h"
+#include "file_durability.h"
+
+namespace ft {
+
+    // Where the bytes of an incoming transfer go, for server receives as well as query downloads.
+    class Sink
+    {
+    public:
+        enum { unknown_size = -1 };
+
+        typedef boost::function<void (boost::int64_t committed)> Committed;
+
+        virtual ~Sink() {}
+
+        virtual std::string name() const = 0;
+
+        // called when the SEND action arrives with the announced SIZE, unknown_size for streams
+        virtual bool open(boost::int64_t size) = 0;
+
+        virtual bool write(const char* data, size_t size) = 0;
+
+        // Back-pressure: false if the consumer wants no more data for now. It then calls resume,
+        // from any thread, once it does.
+        virtual bool ready(const boost::function<void ()>& /*resume*/)
+        {
+            return true;
+        }
+
+        // The bytes of path() readers can read by now. committed is called with the new count,
+        // from any thread, whenever writes reach the file from then on. -1 if readers cannot
+        // follow the sink.
+        virtual boost::int64_t watch(const Committed& /*committed*/)
+        {
+            return -1;
+        }
+
+        // Ends the transfer, complete if all of it arrived. False if a complete one could not be
+        // stored; the receive then fails.
+        virtual bool close(bool complete) = 0;
+
+        // The I/O queue close() has to run on when it does more than let go of the sink, such as
+        // assembling a file; none if it is quick enough for an io thread.
+        virtual Io_queuePtr close_queue() const
+        {
+            return Io_queuePtr();
+        }
+
+        // Makes what a complete close() stored durable, its data and its name. False if it failed.
+        virtual bool sync()
+        {
+            return true;
+        }
+
+        // file that cut-through readers and replicas can read while receiving, empty if none
+        virtual std::string path() const
+        {
+            return std::string();
+        }
+    };
+
+    class File_sink : public Sink
+    {
+    public:
+        // written but still queued for the device at most, before the receive pauses
+        enum { max_pending = 4 * 1024 * 1024 };
+
+        // append continues a partial file, for resumed replica uploads; drop_behind keeps a file
+        // written once out of the page cache. With dir the file is opened relative to it, and
+        // written and closed on the I/O queue of its device if it has one.
+        File_sink(const std::string& path, bool append, bool drop_behind = false,
+            const Storage_layout::DirectoryPtr& dir = Storage_layout::DirectoryPtr()) : path_(path),
+            append_(append),
+            drop_behind_(drop_behind),
+            dir_(dir),
+#ifdef __linux__
+            fd_(-1),
+            queue_(dir ? dir->queue : Io_queuePtr()),
+            committed_(0),
+            pending_(0),
+            failed_(false)
+#else
+            file_()
+#endif
+        {}
+
+        ~File_sink()
+        {
+            close(false);
+        }
+
+        std::string name() const
+        {
+            return path_;
+        }
+
+#ifdef __linux__
+        bool open(boost::int64_t)
+        {
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append_ ? O_APPEND : O_TRUNC);
+            if (dir_ && dir_->fd != -1)
+                fd_ = ::openat(dir_->fd, boost::filesystem::path(path_).filename().c_str(), flags, 0666);
+            else
+                fd_ = ::open(path_.c_str(), flags, 0666);
+
+            dir_.reset();
+            if (fd_ == -1)
+                return false;
+
+            off_t offset = append_ ? ::lseek(fd_, 0, SEEK_END) : 0;
+            if (drop_behind_)
+                writeback_.attach(fd_, offset);
+
+            committed_ = offset;
+            return true;
+        }
+
+        // With a queue the bytes are copied to it and a failure shows in a later write, or in
+        // close(), which the queue runs after them all.
+        bool write(const char* data, size_t size)
+        {
+            if (!queue_)
+            {
+                if (!write_through(data, size))
+                    return false;
+
+                commit(size);
+                return true;
+            }
+
+            boost::shared_ptr<std::vector<char> > copy(new std::vector<char>(data, data + size));
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                if (failed_)
+                    return false;
+
+                pending_ += size;
+            }
+            queue_->post(boost::bind(&File_sink::write_queued, this, copy));
+
+            return true;
+        }
+
+        bool ready(const boost::function<void ()>& resume)
+        {
+            if (!queue_)
+                return true;
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            if (pending_ < max_pending || failed_)
+                return true;
+
+            resume_ = resume;
+            return false;
+        }
+
+        boost::int64_t watch(const Committed& committed)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            committed_handler_ = committed;
+            return committed_;
+        }
+
+        // nothing left to wait for when it runs on the queue
+        bool close(bool)
+        {
+            if (fd_ == -1)
+                return true;
+
+            bool written = true;
+            if (queue_)
+                written = drain();
+
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                resume_.clear();
+                committed_handler_.clear();
+            }
+
+            writeback_.finish();
+            if (::close(fd_) == -1)
+                written = false;
+
+            fd_ = -1;
+            return written;
+        }
+
+        Io_queuePtr close_queue() const
+        {
+            return queue_;
+        }
+
+        bool sync()
+        {
+            return sync_file(path_);
+        }
+#else
+        bool open(boost::int64_t)
+        {
+            std::ios::openmode mode = std::ios::binary;
+            if (append_)
+                mode |= std::ios::app;
+
+            file_.open(path_.c_str(), mode);
+            return file_.is_open();
+        }
+
+        bool write(const char* data, size_t size)
+        {
+            file_.write(data, size);
+            return !file_.fail();
+        }
+
+        bool close(bool)
+        {
+            file_.close();
+            return !file_.fail();
+        }
+#endif
+
+        std::string path() const
+        {
+            return path_;
+        }
+
+    private:
+#ifdef __linux__
+        bool write_through(const char* data, size_t size)
+        {
+            while (size > 0)
+            {
+                ssize_t result = ::write(fd_, data, size);
+                if (result == -1)
+                {
+                    if (errno == EINTR)
+                        continue;
+
+                    return false;
+                }
+
+                data += result;
+                size -= result;
+
+                if (drop_behind_ && writeback_.wrote(result))
+                    writeback_.advance();
+            }
+
+            return true;
+        }
+
+        // on the queue's thread; the receive continues once half the limit is written
+        void write_queued(const boost::shared_ptr<std::vector<char> >& data)
+        {
+            bool written = write_through(data->empty() ? NULL : &(*data)[0], data->size());
+            int error = written ? 0 : errno;
+
+            boost::function<void ()> resume;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                pending_ -= data->size();
+                if (!written)
+                {
+                    LERROR << "write " << path_ << " error(" << error << ")";
+                    failed_ = true;
+                }
+
+                if (resume_ && (pending_ <= max_pending / 2 || failed_))
+                    resume.swap(resume_);
+            }
+            drained_.notify_all();
+
+            if (written)
+                commit(data->size());
+
+            if (resume)
+                resume();
+        }
+
+        // size more bytes are in the file, for the readers following it
+        void commit(size_t size)
+        {
+            Committed committed;
+            boost::int64_t bytes = 0;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                committed_ += size;
+                committed = committed_handler_;
+                bytes = committed_;
+            }
+
+            if (committed)
+                committed(bytes);
+        }
+
+        // false if a queued write failed
+        bool drain()
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (pending_ > 0)
+                drained_.wait(lock);
+
+            return !failed_;
+        }
+#endif
+
+    private:
+        std::string path_;
+        bool append_;
+        bool drop_behind_;
+        Storage_layout::DirectoryPtr dir_;
+#ifdef __linux__
+        int fd_;
+        Drop_behind writeback_;
+
+        Io_queuePtr queue_;
+        boost::mutex mutex_;
+        boost::condition_variable drained_;
+        boost::int64_t committed_;    // with the offset append continued at
+        size_t pending_;
+        bool failed_;
+        boost::function<void ()> resume_;
+        Committed committed_handler_;
+#else
+        std::ofstream file_;
+#endif
+    };
+
+    // A caller supplied buffer of fixed capacity, or a vector sized to the announced SIZE and cut
+    // to the received length when the transfer ends.
+    class Memory_sink : public Sink
+    {
+    public:
+        Memory_sink(char* data, size_t capacity) : data_(data),
+            capacity_(capacity),
+            buffer_(),
+            length_(0)
+        {}
+
+        explicit Memory_sink(const boost::shared_ptr<std::vector<char> >& buffer) : data_(NULL),
+            capacity_(0),
+            buffer_(buffer),
+            length_(0)
+        {}
+
+        std::string name() const
+        {
+            return "memory";
+        }
+
+        bool open(boost::int64_t size)
+        {
+            if (buffer_)
+            {
+                if (size > 0)
+                    buffer_->resize(static_cast<size_t>(size));
+
+                return true;
+            }
+
+            return size <= static_cast<boost::int64_t>(capacity_);
+        }
+
+        bool write(const char* data, size_t size)
+        {
+            if (buffer_)
+            {
+                if (buffer_->size() < length_ + size)
+                    buffer_->resize(length_ + size);
+
+                std::memcpy(&(*buffer_)[length_], data, size);
+            }
+            else {
+                if (capacity_ - length_ < size)
+                    return false;
+
+                std::memcpy(data_ + length_, data, size);
+            }
+
+            length_ += size;
+            return true;
+        }
+
+        bool close(bool)
+        {
+            if (buffer_)
+                buffer_->resize(length_);
+
+            return true;
+        }
+
+    private:
+        char* data_;
+        size_t capacity_;
+        boost::shared_ptr<std::vector<char> > buffer_;
+        size_t length_;
+    };
+
+    // Hands every chunk to the caller as it arrives and (NULL, 0) once the transfer is complete.
+    class Callback_sink
+        : public Sink,
+        public boost::enable_shared_from_this<Callback_sink>
+    {
+    public:
+        explicit Callback_sink(const ChunkHandler& handler) : handler_(handler),
+            paused_(false),
+            continuation_()
+        {}
+
+        std::string name() const
+        {
+            return "callback";
+        }
+
+        bool open(boost::int64_t)
+        {
+            return true;
+        }
+
+        bool write(const char* data, size_t size)
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                paused_ = true;
+            }
+
+            if (handler_(data, size, boost::bind(&Callback_sink::resume, shared_from_this())))
+                resume();
+
+            return true;
+        }
+
+        bool ready(const boost::function<void ()>& resume)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (!paused_)
+                return true;
+
+            continuation_ = resume;
+            return false;
+        }
+
+        bool close(bool complete)
+        {
+            if (complete)
+                handler_(NULL, 0, boost::function<void ()>());
+
+            return true;
+        }
+
+    private:
+        void resume()
+        {
+            boost::function<void ()> continuation;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                paused_ = false;
+                continuation.swap(continuation_);
+            }
+
+            if (continuation)
+                continuation();
+        }
+
+    private:
+        ChunkHandler handler_;
+
+        boost::mutex mutex_;
+        bool paused_;
+        boost::function<void ()> continuation_;
+    };
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _FILE_TRANSFER_SOCKET_TUNING_H_
+#define _FILE_TRANSFER_SOCKET_TUNING_H_
+
+#include <string>
+#include <algorithm>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_transfer.h"
+
+namespace ft {
+
+    // Applies a SocketTuning to a connected socket and reads back what the kernel made of it.
+    class Socket_tuner
+    {
+    public:
+        enum
+        {
+            // AUTO measures over this much data before it sizes the buffers
+            auto_sample_bytes = 4 * 1024 * 1024,
+            min_buffer = 64 * 1024,
+            max_buffer = 64 * 1024 * 1024,
+        };
+
+        // Returns the settings in effect, whatever the kernel refused or clamped.
+        static SocketTuning apply(int sock, const SocketTuning& tuning)
+        {
+#ifdef __linux__
+            if (tuning.nodelay)
+                set(sock, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+            if (tuning.send_buffer > 0)
+                set(sock, SOL_SOCKET, SO_SNDBUF, tuning.send_buffer, "SO_SNDBUF");
+            if (tuning.recv_buffer > 0)
+                set(sock, SOL_SOCKET, SO_RCVBUF, tuning.recv_buffer, "SO_RCVBUF");
+#ifdef TCP_CONGESTION
+            if (!tuning.congestion.empty()
+                && ::setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, tuning.congestion.c_str(), tuning.congestion.size()) != 0)
+            {
+                // not loaded, or not in net.ipv4.tcp_allowed_congestion_control
+                LWARNING << "congestion control " << tuning.congestion << " error(" << errno << ")";
+            }
+#endif
+#endif
+            return read(sock, tuning);
+        }
+
+        static SocketTuning read(int sock, const SocketTuning& tuning)
+        {
+            SocketTuning applied = tuning;
+#ifdef __linux__
+            applied.nodelay = get(sock, IPPROTO_TCP, TCP_NODELAY) != 0;
+            applied.send_buffer = get(sock, SOL_SOCKET, SO_SNDBUF);
+            applied.recv_buffer = get(sock, SOL_SOCKET, SO_RCVBUF);
+#ifdef TCP_CONGESTION
+            char name[16] = { 0 };
+            socklen_t len = sizeof(name) - 1;
+            if (::getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, name, &len) == 0)
+                applied.congestion = name;
+#endif
+            applied.rtt_us = rtt_us(sock);
+#endif
+            return applied;
+        }
+
+        // Header and data leave in full segments while corked; uncorking flushes the rest.
+        static void cork(int sock, bool on)
+        {
+#if defined(__linux__) && defined(TCP_CORK)
+            set(sock, IPPROTO_TCP, TCP_CORK, on ? 1 : 0, "TCP_CORK");
+#endif
+        }
+
+        // Smoothed RTT, or the receiver's estimate where only data comes in.
+        static boost::uint32_t rtt_us(int sock)
+        {
+#ifdef __linux__
+            tcp_info info;
+            socklen_t len = sizeof(info);
+            if (::getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+                return std::max(info.tcpi_rtt, info.tcpi_rcv_rtt);
+#endif
+            return 0;
+        }
+
+        // AUTO: grows the buffer of the busy direction to a few times the bandwidth-delay
+        // product. Never shrinks, the rate measured is capped by the buffer it had.
+        static void size_for_bdp(int sock, bool sending, boost::uint64_t rate, SocketTuning& applied)
+        {
+            applied.rtt_us = rtt_us(sock);
+            applied.rate = rate;
+
+            boost::uint64_t bdp = rate * applied.rtt_us / 1000000;
+            int size = static_cast<int>(std::min<boost::uint64_t>(std::max<boost::uint64_t>(bdp * 4, min_buffer), max_buffer));
+
+            int& current = sending ? applied.send_buffer : applied.recv_buffer;
+#ifdef __linux__
+            // getsockopt reports twice what was set, the kernel's bookkeeping overhead
+            if (size > current / 2)
+                set(sock, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF, size, sending ? "SO_SNDBUF" : "SO_RCVBUF");
+
+            current = get(sock, SOL_SOCKET, sending ? SO_SNDBUF : SO_RCVBUF);
+#endif
+        }
+
+    private:
+#ifdef __linux__
+        static void set(int sock, int level, int name, int value, const char* what)
+        {
+            if (::setsockopt(sock, level, name, &value, sizeof(value)) != 0)
+            {
+                LWARNING << "set " << what << " " << value << " error(" << errno << ")";
+            }
+        }
+
+        static int get(int sock, int level, int name)
+        {
+            int value = 0;
+            socklen_t len = sizeof(value);
+            ::getsockopt(sock, level, name, &value, &len);
+            return value;
+        }
+#endif
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, const SocketTuning& tuning)
+    {
+        static const char* profiles[] = { "default", "lan", "wan", "loopback", "auto" };
+
+        os << profiles[tuning.profile]
+            << " nodelay " << tuning.nodelay
+            << " sndbuf " << tuning.send_buffer
+            << " rcvbuf " << tuning.recv_buffer
+            << " cc " << (tuning.congestion.empty() ? "-" : tuning.congestion)
+            << " rtt " << tuning.rtt_us << "us";
+        if (tuning.rate > 0)
+            os << " rate " << tuning.rate << "B/s";
+
+        return os;
+    }
+}
+
+#endif
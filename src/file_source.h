@@ -0,0 +1,376 @@
+#ifndef _FILE_TRANSFER_SOURCE_H_
+#define _FILE_TRANSFER_SOURCE_H_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "file_transfer.h"
+#include "file_zerocopy.h"
+
+namespace ft {
+
+    // Where the bytes of an outgoing transfer come from. Every source writes straight to the
+    // non-blocking socket with the cheapest primitive it has: sendfile for files and fds, send
+    // from the caller's memory, splice for pipes.
+    class Source
+    {
+    public:
+        typedef boost::function<void (const char* data, size_t size)> Scanner;
+
+        enum
+        {
+            unknown_size = -1,
+            pending = -2,    // a stream has no data right now, wait for wait_fd()
+        };
+
+        virtual ~Source() {}
+
+        // total length, unknown_size for streams that end when they run dry
+        virtual boost::int64_t size() const = 0;
+
+        virtual std::string name() const = 0;
+
+#ifdef __linux__
+        // Writes up to count bytes from offset to sock. Returns the bytes written, 0 at the end of
+        // the data, pending, or -1 with errno set (EAGAIN when the socket is full, EPIPE when the
+        // peer is gone). Streams ignore offset and continue where they stopped.
+        virtual ssize_t send_to(int sock, off_t offset, size_t count) = 0;
+
+        // readable when a pending stream has data again, -1 for sources that are never pending
+        virtual int wait_fd() const
+        {
+            return -1;
+        }
+
+        // Sends with MSG_ZEROCOPY from now on, if the source can. The caller then holds on to the
+        // source until the kernel has reported every send done.
+        virtual bool set_zerocopy(bool)
+        {
+            return false;
+        }
+
+        // Hands the whole content to scanner in order without consuming it, for hashing and
+        // chunking ahead of the send. False for sources that can be read only once.
+        virtual bool scan(const Scanner& /*scanner*/) const
+        {
+            return false;
+        }
+
+        // Page cache hints for sources backed by a file: bytes to be sent soon, bytes not needed
+        // again.
+        virtual void prefetch(off_t /*offset*/, size_t /*count*/) {}
+        virtual void release(off_t /*offset*/, size_t /*count*/) {}
+#endif
+    };
+
+#ifdef __linux__
+    class Fd_source : public Source
+    {
+    public:
+        Fd_source(int fd, bool owns_fd, const std::string& name) : fd_(fd),
+            owns_fd_(owns_fd),
+            size_(0),
+            regular_(false),
+            name_(name)
+        {
+            struct stat statbuf;
+            if (::fstat(fd_, &statbuf) != -1)
+            {
+                size_ = statbuf.st_size;
+                regular_ = S_ISREG(statbuf.st_mode);
+            }
+        }
+
+        ~Fd_source()
+        {
+            if (owns_fd_)
+                ::close(fd_);
+        }
+
+        static SourcePtr open(const std::string& path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (-1 == fd)
+                return SourcePtr();
+
+            return SourcePtr(new Fd_source(fd, true, path));
+        }
+
+        boost::int64_t size() const
+        {
+            return size_;
+        }
+
+        std::string name() const
+        {
+            return name_;
+        }
+
+        ssize_t send_to(int sock, off_t offset, size_t count)
+        {
+            return ::sendfile(sock, fd_, &offset, count);
+        }
+
+        void prefetch(off_t offset, size_t count)
+        {
+            if (!regular_ || offset >= size_)
+                return;
+
+            // a larger read-ahead window for the rest, and the next part read in the background;
+            // readahead() would wait for the reads to be issued
+            if (offset == 0)
+                ::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+            ::posix_fadvise(fd_, offset, count, POSIX_FADV_WILLNEED);
+        }
+
+        void release(off_t offset, size_t count)
+        {
+            if (regular_)
+                ::posix_fadvise(fd_, offset, count, POSIX_FADV_DONTNEED);
+        }
+
+        bool scan(const Scanner& scanner) const
+        {
+            if (!regular_)
+                return false;
+
+            std::vector<char> buffer(256 * 1024);
+            for (off_t offset = 0; offset < size_; )
+            {
+                ssize_t result = ::pread(fd_, &buffer[0], buffer.size(), offset);
+                if (result <= 0)
+                    return false;
+
+                scanner(&buffer[0], result);
+                offset += result;
+            }
+
+            return true;
+        }
+
+    private:
+        int fd_;
+        bool owns_fd_;
+        boost::int64_t size_;
+        bool regular_;
+        std::string name_;
+    };
+
+    // The bytes stay where the caller has them. owner keeps them alive for shared buffers and is
+    // empty when the caller guarantees the lifetime until the transfer completes.
+    class Memory_source : public Source
+    {
+    public:
+        Memory_source(const char* data, size_t size, const boost::shared_ptr<const void>& owner) : data_(data),
+            size_(size),
+            owner_(owner),
+            zerocopy_(false)
+        {}
+
+        boost::int64_t size() const
+        {
+            return size_;
+        }
+
+        std::string name() const
+        {
+            return "memory";
+        }
+
+        ssize_t send_to(int sock, off_t offset, size_t count)
+        {
+            if (offset >= static_cast<off_t>(size_))
+                return 0;
+
+            count = std::min<size_t>(count, size_ - offset);
+            return ::send(sock, data_ + offset, count, MSG_NOSIGNAL | (zerocopy_ ? MSG_ZEROCOPY : 0));
+        }
+
+        bool set_zerocopy(bool on)
+        {
+            zerocopy_ = on;
+            return true;
+        }
+
+        bool scan(const Scanner& scanner) const
+        {
+            scanner(data_, size_);
+            return true;
+        }
+
+    private:
+        const char* data_;
+        size_t size_;
+        boost::shared_ptr<const void> owner_;
+        bool zerocopy_;
+    };
+
+    // Ranges of another source back to back, the parts of a chunked upload the receiver lacks.
+    class Range_source : public Source
+    {
+    public:
+        typedef std::pair<off_t, size_t> Range;
+
+        Range_source(const SourcePtr& source, const std::vector<Range>& ranges) : source_(source),
+            ranges_(ranges),
+            starts_(),
+            size_(0)
+        {
+            for (size_t i = 0; i < ranges_.size(); ++i)
+            {
+                starts_.push_back(size_);
+                size_ += ranges_[i].second;
+            }
+        }
+
+        boost::int64_t size() const
+        {
+            return size_;
+        }
+
+        std::string name() const
+        {
+            return source_->name();
+        }
+
+        ssize_t send_to(int sock, off_t offset, size_t count)
+        {
+            if (offset >= size_)
+                return 0;
+
+            // the range holding offset, and no further than its end
+            size_t i = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+            off_t within = offset - starts_[i];
+            count = std::min<size_t>(count, ranges_[i].second - within);
+
+            return source_->send_to(sock, ranges_[i].first + within, count);
+        }
+
+        bool set_zerocopy(bool on)
+        {
+            return source_->set_zerocopy(on);
+        }
+
+    private:
+        SourcePtr source_;
+        std::vector<Range> ranges_;
+        std::vector<off_t> starts_;
+        boost::int64_t size_;
+    };
+
+    class Pipe_source : public Source
+    {
+    public:
+        Pipe_source(int fd, bool owns_fd) : fd_(fd),
+            owns_fd_(owns_fd)
+        {
+            ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) | O_NONBLOCK);
+        }
+
+        ~Pipe_source()
+        {
+            if (owns_fd_)
+                ::close(fd_);
+        }
+
+        boost::int64_t size() const
+        {
+            return unknown_size;
+        }
+
+        std::string name() const
+        {
+            return "pipe";
+        }
+
+        ssize_t send_to(int sock, off_t, size_t count)
+        {
+            // splice reports EAGAIN for an empty pipe and a full socket alike, so look first
+            struct pollfd pfd = { fd_, POLLIN, 0 };
+            if (::poll(&pfd, 1, 0) == 0)
+                return pending;
+
+            return ::splice(fd_, NULL, sock, NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        }
+
+        int wait_fd() const
+        {
+            return fd_;
+        }
+
+    private:
+        int fd_;
+        bool owns_fd_;
+    };
+
+    class Generator_source : public Source
+    {
+    public:
+        explicit Generator_source(const Generator& generator) : generator_(generator),
+            buffer_(64 * 1024),
+            begin_(0),
+            end_(0),
+            done_(false)
+        {}
+
+        boost::int64_t size() const
+        {
+            return unknown_size;
+        }
+
+        std::string name() const
+        {
+            return "generator";
+        }
+
+        ssize_t send_to(int sock, off_t, size_t count)
+        {
+            if (begin_ == end_)
+            {
+                if (done_)
+                    return 0;
+
+                begin_ = 0;
+                end_ = generator_(&buffer_[0], buffer_.size());
+                if (end_ == 0)
+                {
+                    done_ = true;
+                    return 0;
+                }
+            }
+
+            count = std::min(count, end_ - begin_);
+            ssize_t result = ::send(sock, &buffer_[begin_], count, MSG_NOSIGNAL);
+            if (result > 0)
+                begin_ += result;
+
+            return result;
+        }
+
+    private:
+        Generator generator_;
+        std::vector<char> buffer_;
+        size_t begin_;
+        size_t end_;
+        bool done_;
+    };
+#endif
+}
+
+#endif
@@ -0,0 +1,611 @@
+#ifndef _FILE_TRANSFER_STORAGE_LAYOUT_H_
+#define _FILE_TRANSFER_STORAGE_LAYOUT_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_info.h"
+#include "file_io_queue.h"
+
+namespace ft {
+
+    // Where under recv_path a file is stored: a directory pattern of {type}, {date}, {id} and
+    // {hash}, two hex digits of the id that spread a type over 256 directories, then the key.
+    // "{type}/" is the flat layout of old. Directories are created once and kept open, files
+    // are opened relative to them, so storing one walks no path.
+    // Further roots, on other disks, stripe the files over all of them by a hash of the key or by
+    // free space. Each device gets an I/O queue of its own, and the root of every key stored or
+    // looked up is remembered, so a query probes the roots at most once per key. Cold roots take
+    // no receives, files get there and back by relocate().
+    class Storage_layout
+    {
+    public:
+        enum Placement
+        {
+            BY_HASH,
+            BY_FREE_SPACE,
+        };
+
+        struct Directory
+        {
+            Directory(int fd, const Io_queuePtr& queue) : fd(fd),
+                queue(queue)
+            {}
+
+            ~Directory()
+            {
+#ifdef __linux__
+                if (fd != -1)
+                    ::close(fd);
+#endif
+            }
+
+            int fd;    // -1 where there are no directory descriptors
+            Io_queuePtr queue;    // writes to files in it, none with a single root
+        };
+
+        typedef boost::shared_ptr<const Directory> DirectoryPtr;
+
+        // open directories kept at most, the ones in use stay open beyond
+        enum { max_directories = 4096 };
+
+        // keys whose root is remembered at most, forgotten all at once beyond
+        enum { max_locations = 4 * 1024 * 1024 };
+
+        explicit Storage_layout(const std::string& root) : pattern_("{type}/"),
+            placement_(BY_HASH)
+        {
+            roots_.push_back(Root());
+            roots_.back().path = root;
+        }
+
+        static const size_t npos = static_cast<size_t>(-1);
+
+        // Another root to store files under, before the first receive, or with cold to move them
+        // to later. Roots on one device share its queue. False if path cannot be made a directory.
+        bool add_root(std::string path, bool cold = false)
+        {
+            if (path.empty())
+                return false;
+            if (path[path.size() - 1] != '/')
+                path += "/";
+
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(path, ec);
+            if (!boost::filesystem::is_directory(path, ec))
+            {
+                LERROR << "invalid storage root " << path;
+                return false;
+            }
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            for (size_t i = 0; i < roots_.size(); ++i)
+            {
+                if (roots_[i].path == path)
+                    return true;
+            }
+
+            roots_.push_back(Root());
+            roots_.back().path = path;
+            roots_.back().cold = cold;
+
+            // the first root writes inline while it is the only one
+            boost::filesystem::create_directories(roots_[0].path, ec);
+            for (size_t i = 0; i < roots_.size(); ++i)
+            {
+                Root& root = roots_[i];
+                root.device = device(root.path);
+                root.directories.clear();
+
+                for (size_t j = 0; j < i && !root.queue; ++j)
+                {
+                    if (roots_[j].device == root.device)
+                        root.queue = roots_[j].queue;
+                }
+
+                if (!root.queue)
+                    root.queue.reset(new Io_queue(root.path));
+            }
+
+            LINFO << (cold ? "cold storage root " : "storage root ") << path << ", " << roots_.size() << " roots";
+            return true;
+        }
+
+        void set_placement(int placement)
+        {
+            LINFO << "storage placement " << (placement == BY_FREE_SPACE ? "by free space" : "by hash");
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            placement_ = placement == BY_FREE_SPACE ? BY_FREE_SPACE : BY_HASH;
+        }
+
+        std::vector<std::string> roots()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            std::vector<std::string> paths;
+            for (size_t i = 0; i < roots_.size(); ++i)
+                paths.push_back(roots_[i].path);
+
+            return paths;
+        }
+
+        bool cold(size_t root)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return root < roots_.size() && roots_[root].cold;
+        }
+
+        // the root holding the file of info, npos if none does
+        size_t root(const FileInfo& info)
+        {
+            std::string dir = directory(info);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return find(info.key(), dir);
+        }
+
+        // the root placement picks for key among the hot or the cold ones, npos if there is none
+        size_t target(const std::string& key, bool cold)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return place(key, cold);
+        }
+
+        // dir of a root, as directory() gives it
+        DirectoryPtr open_directory(size_t root, const std::string& dir, bool create)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return root < roots_.size() ? lookup(roots_[root], dir, create) : DirectoryPtr();
+        }
+
+#ifdef __linux__
+        // Moves key in dir from one root to another: temp, a complete and synced copy in the
+        // directory on the other root, takes the place of the key there and the file on the
+        // first root goes. Nothing happens, false, if the key moved, was written since it was
+        // copied, as fstat gave source, or busy says a transfer of it is running.
+        bool relocate(const std::string& key, const std::string& dir, size_t from, size_t to,
+            const std::string& temp, const struct stat& source, const boost::function<bool (const std::string&)>& busy)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            DirectoryPtr origin = lookup(roots_[from], dir, false);
+            DirectoryPtr destination = lookup(roots_[to], dir, false);
+
+            struct stat statbuf;
+            if (!origin || !destination || locate(key, dir) != from || (busy && busy(key))
+                || ::fstatat(origin->fd, key.c_str(), &statbuf, 0) == -1
+                || statbuf.st_ino != source.st_ino || statbuf.st_size != source.st_size
+                || statbuf.st_mtime != source.st_mtime)
+            {
+                if (destination)
+                    ::unlinkat(destination->fd, temp.c_str(), 0);
+                return false;
+            }
+
+            if (::renameat(destination->fd, temp.c_str(), destination->fd, key.c_str()) == -1)
+            {
+                LERROR << "rename " << roots_[to].path << dir << temp << " error(" << errno << ")";
+                ::unlinkat(destination->fd, temp.c_str(), 0);
+                return false;
+            }
+
+            // the new name is durable before the old one goes
+            ::fsync(destination->fd);
+            remember(key, to);
+            ::unlinkat(origin->fd, key.c_str(), 0);
+            return true;
+        }
+#endif
+
+        // False, keeping the layout, for a pattern with an unknown field or leaving recv_path.
+        // Files already stored are not moved.
+        bool set_pattern(std::string pattern)
+        {
+            if (!pattern.empty() && pattern[pattern.size() - 1] != '/')
+                pattern += "/";
+
+            FileInfo probe;
+            std::string dir;
+            if (!expand(pattern, probe, dir) || pattern[0] == '/' || pattern.find("..") != std::string::npos)
+            {
+                LERROR << "invalid storage layout " << pattern;
+                return false;
+            }
+
+            LINFO << "storage layout " << roots_[0].path << pattern << "<key>";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            pattern_ = pattern;
+            return true;
+        }
+
+        // directory of info relative to recv_path, ending in '/' unless empty
+        std::string directory(const FileInfo& info)
+        {
+            std::string pattern;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                pattern = pattern_;
+            }
+
+            std::string dir;
+            expand(pattern, info, dir);
+            return dir;
+        }
+
+        // the file of info on the root holding it, or on the first one if none does
+        std::string path(const FileInfo& info)
+        {
+            std::string dir = directory(info);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            size_t root = locate(info.key(), dir);
+            return roots_[root == npos ? 0 : root].path + dir + info.key();
+        }
+
+        // The directory of info: with create the one to store it in, on the root already holding
+        // the key or else the one placement picks, created with its parents the first time; the
+        // first root if primary, for files hard linked to the blob store there. Without create
+        // the one holding the key. Empty if it does not exist or cannot be made.
+        DirectoryPtr open_directory(const FileInfo& info, bool create, bool primary = false)
+        {
+            std::string dir = directory(info);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            size_t root = locate(info.key(), dir);
+            if (create)
+            {
+                if (root != npos && ((primary && root != 0) || roots_[root].cold))
+                {
+                    // moves to the first root, or back to the hot ones
+                    unlink(root, dir, info.key());
+                    root = npos;
+                }
+
+                if (root == npos)
+                {
+                    root = primary ? 0 : place(info.key(), false);
+                    remember(info.key(), root);
+                }
+            }
+
+            if (root == npos)
+                return DirectoryPtr();
+
+            return lookup(roots_[root], dir, create);
+        }
+
+        bool exists(const FileInfo& info)
+        {
+            std::string dir = directory(info);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return find(info.key(), dir) != npos;
+        }
+
+        // Removes the stored file of info, if there is one.
+        void remove(const FileInfo& info)
+        {
+            std::string dir = directory(info);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            size_t root = locate(info.key(), dir);
+            if (root != npos)
+                unlink(root, dir, info.key());
+        }
+
+    private:
+        typedef boost::unordered_map<std::string, DirectoryPtr> Directory_map;
+
+        struct Root
+        {
+            Root() : cold(false),
+                device(0)
+            {}
+
+            std::string path;
+            bool cold;
+            boost::uint64_t device;
+            Io_queuePtr queue;
+            Directory_map directories;
+        };
+
+        static bool expand(const std::string& pattern, const FileInfo& info, std::string& dir)
+        {
+            dir.clear();
+
+            std::string::size_type pos = 0;
+            while (pos < pattern.size())
+            {
+                std::string::size_type open = pattern.find('{', pos);
+                dir.append(pattern, pos, open == std::string::npos ? std::string::npos : open - pos);
+                if (open == std::string::npos)
+                    break;
+
+                std::string::size_type close = pattern.find('}', open);
+                if (close == std::string::npos)
+                    return false;
+
+                std::string field = pattern.substr(open + 1, close - open - 1);
+                if (field == "type")
+                    dir += info.type;
+                else if (field == "date")
+                    dir += info.date;
+                else if (field == "id")
+                    dir += info.id;
+                else if (field == "hash")
+                    dir += hash_prefix(info.id);
+                else
+                    return false;
+
+                pos = close + 1;
+            }
+
+            return true;
+        }
+
+        // FNV-1a, the same on every build so that files stay where they were put
+        static boost::uint32_t fnv(const std::string& text)
+        {
+            boost::uint32_t hash = 2166136261U;
+            for (size_t i = 0; i < text.size(); ++i)
+            {
+                hash ^= static_cast<unsigned char>(text[i]);
+                hash *= 16777619U;
+            }
+
+            return hash;
+        }
+
+        static std::string hash_prefix(const std::string& id)
+        {
+            char hex[3];
+            std::sprintf(hex, "%02x", static_cast<unsigned>(fnv(id) & 0xff));
+            return hex;
+        }
+
+        static boost::uint64_t device(const std::string& path)
+        {
+#ifdef __linux__
+            struct stat statbuf;
+            if (::stat(path.c_str(), &statbuf) == 0)
+                return statbuf.st_dev;
+#endif
+            return 0;
+        }
+
+        // Free bytes of a root in MB, 0 if unknown.
+        static boost::uint64_t free_space(const std::string& path)
+        {
+#ifdef __linux__
+            struct statvfs stats;
+            if (::statvfs(path.c_str(), &stats) == 0)
+                return static_cast<boost::uint64_t>(stats.f_bavail) * stats.f_frsize / (1024 * 1024);
+#endif
+            return 0;
+        }
+
+        // under mutex_: the root of the tier a new key goes to, with probability of its share of
+        // the free space in that mode, drawn by the key so that a retried receive lands on the
+        // same one
+        size_t place(const std::string& key, bool cold)
+        {
+            if (roots_.size() == 1)
+                return cold ? npos : 0;
+
+            std::vector<size_t> tier;
+            for (size_t i = 0; i < roots_.size(); ++i)
+            {
+                if (roots_[i].cold == cold)
+                    tier.push_back(i);
+            }
+
+            if (tier.empty())
+                return npos;
+
+            boost::uint32_t hash = fnv(key);
+            if (placement_ == BY_FREE_SPACE)
+            {
+                std::vector<boost::uint64_t> space(tier.size());
+                boost::uint64_t total = 0;
+                for (size_t i = 0; i < tier.size(); ++i)
+                    total += space[i] = free_space(roots_[tier[i]].path);
+
+                if (total > 0)
+                {
+                    boost::uint64_t draw = hash % total;
+                    for (size_t i = 0; i < tier.size(); ++i)
+                    {
+                        if (draw < space[i])
+                            return tier[i];
+                        draw -= space[i];
+                    }
+                }
+            }
+
+            return tier[hash % tier.size()];
+        }
+
+        // under mutex_: the root key is stored or being received on, probing every root for a key
+        // not seen before; npos if none has it
+        size_t locate(const std::string& key, const std::string& dir)
+        {
+            if (roots_.size() == 1)
+                return 0;
+
+            Location_map::iterator it = locations_.find(key);
+            if (it != locations_.end())
+                return it->second;
+
+            for (size_t i = 0; i < roots_.size(); ++i)
+            {
+                if (holds(roots_[i], dir, key))
+                {
+                    remember(key, i);
+                    return i;
+                }
+            }
+
+            return npos;
+        }
+
+        // under mutex_: the root key is stored on, looking on the others as well if the one
+        // remembered has no such file, moved by another process sharing the roots; that one
+        // stays remembered otherwise, the key may be about to be received there
+        size_t find(const std::string& key, const std::string& dir)
+        {
+            size_t root = locate(key, dir);
+            if (root == npos || holds(roots_[root], dir, key))
+                return root;
+
+            for (size_t i = 0; i < roots_.size(); ++i)
+            {
+                if (i != root && holds(roots_[i], dir, key))
+                {
+                    remember(key, i);
+                    return i;
+                }
+            }
+
+            return npos;
+        }
+
+        void remember(const std::string& key, size_t root)
+        {
+            if (roots_.size() == 1)
+                return;
+
+            if (locations_.size() >= max_locations)
+                locations_.clear();
+
+            locations_[key] = static_cast<boost::uint8_t>(root);
+        }
+
+        bool holds(Root& root, const std::string& dir, const std::string& key)
+        {
+#ifdef __linux__
+            DirectoryPtr directory = lookup(root, dir, false);
+            struct stat statbuf;
+            return directory && ::fstatat(directory->fd, key.c_str(), &statbuf, 0) == 0;
+#else
+            boost::system::error_code ec;
+            return boost::filesystem::exists(root.path + dir + key, ec);
+#endif
+        }
+
+        void unlink(size_t root, const std::string& dir, const std::string& key)
+        {
+#ifdef __linux__
+            DirectoryPtr directory = lookup(roots_[root], dir, false);
+            if (directory)
+                ::unlinkat(directory->fd, key.c_str(), 0);
+#else
+            boost::system::error_code ec;
+            boost::filesystem::remove(roots_[root].path + dir + key, ec);
+#endif
+            locations_.erase(key);
+        }
+
+        // under mutex_; dir is relative to the root and ends in '/'
+        DirectoryPtr lookup(Root& root, const std::string& dir, bool create)
+        {
+            Directory_map& directories = root.directories;
+
+            Directory_map::iterator it = directories.find(dir);
+            if (it != directories.end())
+                return it->second;
+
+            if (directories.size() >= max_directories)
+                directories.clear();
+
+#ifdef __linux__
+            int fd = -1;
+            if (dir.empty())
+            {
+                if (create && ::mkdir(root.path.c_str(), 0777) == -1 && errno != EEXIST)
+                {
+                    LERROR << "create " << root.path << " error(" << errno << ")";
+                    return DirectoryPtr();
+                }
+
+                fd = ::open(root.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+            else {
+                // the parent first, then this one relative to it; an empty name would walk up forever
+                std::string::size_type slash = dir.size() > 1 ? dir.rfind('/', dir.size() - 2) : std::string::npos;
+                std::string parent = slash == std::string::npos ? std::string() : dir.substr(0, slash + 1);
+                std::string name = dir.substr(parent.size(), dir.size() - parent.size() - 1);
+                if (name.empty() || name == "." || name == ".." || parent == dir)
+                {
+                    LERROR << "invalid directory " << root.path << dir;
+                    return DirectoryPtr();
+                }
+
+                DirectoryPtr up = lookup(root, parent, create);
+                if (!up)
+                    return DirectoryPtr();
+
+                if (create && ::mkdirat(up->fd, name.c_str(), 0777) == -1 && errno != EEXIST)
+                {
+                    LERROR << "create " << root.path << dir << " error(" << errno << ")";
+                    return DirectoryPtr();
+                }
+
+                fd = ::openat(up->fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+
+            if (fd == -1)
+            {
+                if (create)
+                {
+                    LERROR << "open " << root.path << dir << " error(" << errno << ")";
+                }
+                return DirectoryPtr();
+            }
+#else
+            boost::system::error_code ec;
+            if (create)
+                boost::filesystem::create_directories(root.path + dir, ec);
+            if (ec || !boost::filesystem::is_directory(root.path + dir, ec))
+                return DirectoryPtr();
+
+            int fd = -1;
+#endif
+            DirectoryPtr directory(new Directory(fd, root.queue));
+            directories[dir] = directory;
+            return directory;
+        }
+
+    private:
+        typedef boost::unordered_map<std::string, boost::uint8_t> Location_map;
+
+        boost::mutex mutex_;
+        std::vector<Root> roots_;
+        std::string pattern_;
+        Placement placement_;
+        Location_map locations_;    // with more than one root
+    };
+}
+
+#endif
@@ -0,0 +1,455 @@
+#ifndef _FILE_TRANSFER_STORAGE_TIERS_H_
+#define _FILE_TRANSFER_STORAGE_TIERS_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ctime>
+#include <algorithm>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_transfer.h"
+#include "file_info.h"
+#include "file_storage_layout.h"
+
+namespace ft {
+
+#ifdef __linux__
+    // Keeps recent files on the hot storage roots and the rest on the cold ones. A background job
+    // moves a file to the cold tier once nobody wrote or asked for it for a while, and least
+    // recently used first while the hot tier holds more than its budget; a cold file queried
+    // often enough comes back. The copies are paced, so moving files does not take the disks from
+    // receives and queries, and the layout swaps a file between roots only when the copy is
+    // complete, so lookups find it on one tier or the other all along.
+    class Storage_tiers
+    {
+    public:
+        // whether a transfer of the key is running, which leaves it where it is
+        typedef boost::function<bool (const std::string& key)> Busy;
+
+        enum
+        {
+            copy_block = 1024 * 1024,
+            // keys whose last use is remembered at most, forgotten all at once beyond
+            max_tracked = 1024 * 1024,
+            max_promotions = 1024,
+        };
+
+        Storage_tiers(Storage_layout& layout, const Busy& busy) : layout_(layout),
+            busy_(busy),
+            policy_(),
+            started_(false),
+            stopping_(false)
+        {}
+
+        ~Storage_tiers()
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                stopping_ = true;
+            }
+            wake_.notify_all();
+
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+        void set_policy(const TierPolicy& policy)
+        {
+            LINFO << "storage tiers: demote after " << policy.demote_after_s << "s"
+                << ", hot budget " << policy.hot_budget << " bytes"
+                << ", move rate " << policy.move_rate << " bytes/s"
+                << ", promote after " << policy.promote_hits << " queries in " << policy.promote_window_s << "s";
+
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                policy_ = policy;
+            }
+            wake_.notify_all();
+        }
+
+        // once there is a cold root
+        void start()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            if (started_)
+                return;
+
+            started_ = true;
+            thread_ = boost::thread(boost::bind(&Storage_tiers::run, this));
+        }
+
+        // A query is served the stored file of info. A cold one asked for often enough is queued
+        // to come back to the hot tier.
+        void touch(const FileInfo& info)
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                if (!started_)
+                    return;
+            }
+
+            size_t root = layout_.root(info);
+            bool cold = root != Storage_layout::npos && layout_.cold(root);
+            std::string dir = cold ? layout_.directory(info) : std::string();
+            std::time_t now = std::time(NULL);
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if (uses_.size() >= max_tracked)
+                uses_.clear();
+
+            Use& use = uses_[info.key()];
+            use.last = now;
+
+            if (!cold || policy_.promote_hits <= 0 || use.queued)
+                return;
+
+            if (now - use.since > policy_.promote_window_s)
+            {
+                use.since = now;
+                use.hits = 0;
+            }
+
+            if (++use.hits < policy_.promote_hits || promotions_.size() >= max_promotions)
+                return;
+
+            Move move;
+            move.key = info.key();
+            move.dir = dir;
+            move.root = root;
+            promotions_.push_back(move);
+            use.queued = true;
+
+            wake_.notify_all();
+        }
+
+    private:
+        struct Use
+        {
+            Use() : last(0),
+                since(0),
+                hits(0),
+                queued(false)
+            {}
+
+            std::time_t last;     // last query
+            std::time_t since;    // promotion window start
+            int hits;
+            bool queued;
+        };
+
+        struct Move
+        {
+            std::string key;
+            std::string dir;
+            size_t root;
+        };
+
+        struct Candidate
+        {
+            std::string key;
+            std::string dir;
+            size_t root;
+            boost::uint64_t size;
+            std::time_t used;
+
+            bool operator<(const Candidate& other) const
+            {
+                return used < other.used;
+            }
+        };
+
+        void run()
+        {
+            boost::posix_time::ptime next_scan = boost::posix_time::microsec_clock::universal_time();
+
+            for (;;)
+            {
+                std::deque<Move> promotions;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex_);
+                    while (!stopping_ && promotions_.empty()
+                        && boost::posix_time::microsec_clock::universal_time() < next_scan)
+                        wake_.timed_wait(lock, next_scan);
+
+                    if (stopping_)
+                        return;
+
+                    promotions.swap(promotions_);
+                }
+
+                for (size_t i = 0; i < promotions.size() && !stopping(); ++i)
+                {
+                    move(promotions[i].key, promotions[i].dir, promotions[i].root, false);
+
+                    // counts again from zero, on whichever tier it is now
+                    boost::lock_guard<boost::mutex> guard(mutex_);
+                    Use& use = uses_[promotions[i].key];
+                    use = Use();
+                    use.last = std::time(NULL);
+                }
+
+                if (boost::posix_time::microsec_clock::universal_time() >= next_scan)
+                {
+                    demote();
+                    next_scan = boost::posix_time::microsec_clock::universal_time()
+                        + boost::posix_time::seconds(std::max(1, policy().scan_interval_s));
+                }
+            }
+        }
+
+        // Moves the files of the hot tier gone unused too long, then the least recently used
+        // while the tier is over budget.
+        void demote()
+        {
+            TierPolicy policy = this->policy();
+            std::time_t now = std::time(NULL);
+
+            std::vector<Candidate> candidates;
+            boost::uint64_t total = 0;
+
+            std::vector<std::string> roots = layout_.roots();
+            for (size_t root = 0; root < roots.size(); ++root)
+            {
+                if (layout_.cold(root))
+                    continue;
+
+                boost::system::error_code ec;
+                boost::filesystem::recursive_directory_iterator it(roots[root], ec), end;
+                for (; !ec && it != end; it.increment(ec))
+                {
+                    std::string key = it->path().filename().string();
+                    if (boost::filesystem::is_directory(it->status()))
+                    {
+                        // the blob, chunk and segment stores
+                        if (key[0] == '.')
+                            it.no_push();
+                        continue;
+                    }
+
+                    std::string path = it->path().string();
+                    struct stat statbuf;
+                    if (::lstat(path.c_str(), &statbuf) == -1 || !S_ISREG(statbuf.st_mode) || is_temp(key))
+                        continue;
+
+                    total += statbuf.st_size;
+
+                    // shared with the blob store, whose hard links stay on the first root
+                    if (statbuf.st_nlink > 1)
+                        continue;
+
+                    Candidate candidate;
+                    candidate.key = key;
+                    candidate.dir = path.substr(roots[root].size(), path.size() - roots[root].size() - key.size());
+                    candidate.root = root;
+                    candidate.size = statbuf.st_size;
+                    candidate.used = std::max(statbuf.st_mtime, last_use(key));
+                    candidates.push_back(candidate);
+                }
+            }
+
+            std::sort(candidates.begin(), candidates.end());
+
+            size_t moved = 0;
+            for (size_t i = 0; i < candidates.size() && !stopping(); ++i)
+            {
+                const Candidate& candidate = candidates[i];
+
+                bool old = policy.demote_after_s > 0 && now - candidate.used >= policy.demote_after_s;
+                bool over = policy.hot_budget > 0 && total > policy.hot_budget;
+                if (!old && !over)
+                    break;
+
+                if (move(candidate.key, candidate.dir, candidate.root, true))
+                {
+                    total -= candidate.size;
+                    ++moved;
+                }
+            }
+
+            if (moved > 0)
+            {
+                LINFO << "demoted " << moved << " files, " << total << " bytes left on the hot tier";
+            }
+        }
+
+        // Copies key from root to the tier, at the policy's rate, and has the layout swap it in.
+        bool move(const std::string& key, const std::string& dir, size_t root, bool cold)
+        {
+            size_t to = layout_.target(key, cold);
+            if (to == Storage_layout::npos || (busy_ && busy_(key)))
+                return false;
+
+            Storage_layout::DirectoryPtr origin = layout_.open_directory(root, dir, false);
+            Storage_layout::DirectoryPtr destination = layout_.open_directory(to, dir, true);
+            if (!origin || !destination)
+                return false;
+
+            int in = ::openat(origin->fd, key.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in == -1)
+                return false;
+
+            struct stat source;
+            if (::fstat(in, &source) == -1)
+            {
+                ::close(in);
+                return false;
+            }
+
+            const std::string temp = key + temp_suffix();
+            int out = ::openat(destination->fd, temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, source.st_mode & 0777);
+            if (out == -1)
+            {
+                LERROR << "create " << temp << " error(" << errno << ")";
+                ::close(in);
+                return false;
+            }
+
+            bool copied = copy(in, out, source.st_size) && ::fdatasync(out) == 0;
+
+            if (cold)
+            {
+                // neither copy is read again soon
+                ::posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+                ::posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+            }
+
+            ::close(in);
+            ::close(out);
+
+            if (!copied)
+            {
+                ::unlinkat(destination->fd, temp.c_str(), 0);
+                return false;
+            }
+
+            if (!layout_.relocate(key, dir, root, to, temp, source, busy_))
+            {
+                LINFO << "leave " << key << " where it is, it changed while being copied";
+                return false;
+            }
+
+            LINFO << (cold ? "demote " : "promote ") << key << " to " << layout_.roots()[to] << ", " << source.st_size << " bytes";
+            return true;
+        }
+
+        // paced to the move rate; false on an error or when stopping
+        bool copy(int in, int out, off_t size)
+        {
+            std::vector<char> block(copy_block);
+            boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+            off_t offset = 0;
+
+            while (offset < size)
+            {
+                ssize_t result = ::pread(in, &block[0], block.size(), offset);
+                if (result <= 0)
+                {
+                    LERROR << "tier copy read error(" << errno << ")";
+                    return false;
+                }
+
+                for (ssize_t written = 0; written < result; )
+                {
+                    ssize_t count = ::write(out, &block[written], result - written);
+                    if (count == -1)
+                    {
+                        if (errno == EINTR)
+                            continue;
+
+                        LERROR << "tier copy write error(" << errno << ")";
+                        return false;
+                    }
+                    written += count;
+                }
+
+                offset += result;
+
+                if (!pace(start, offset))
+                    return false;
+            }
+
+            return true;
+        }
+
+        // Waits until bytes since start are within the rate. False when stopping.
+        bool pace(const boost::posix_time::ptime& start, off_t bytes)
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            if (policy_.move_rate > 0)
+            {
+                boost::posix_time::ptime due = start + boost::posix_time::microseconds(
+                    static_cast<boost::int64_t>(bytes * 1000000.0 / policy_.move_rate));
+
+                while (!stopping_ && boost::posix_time::microsec_clock::universal_time() < due)
+                    wake_.timed_wait(lock, due);
+            }
+
+            return !stopping_;
+        }
+
+        static const char* temp_suffix()
+        {
+            return ".tier";
+        }
+
+        static bool is_temp(const std::string& name)
+        {
+            const std::string suffix = temp_suffix();
+            return name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+
+        std::time_t last_use(const std::string& key)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            Use_map::const_iterator it = uses_.find(key);
+            return it != uses_.end() ? it->second.last : 0;
+        }
+
+        TierPolicy policy()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return policy_;
+        }
+
+        bool stopping()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return stopping_;
+        }
+
+    private:
+        typedef boost::unordered_map<std::string, Use> Use_map;
+
+        Storage_layout& layout_;
+        const Busy busy_;
+
+        boost::mutex mutex_;
+        boost::condition_variable wake_;
+        TierPolicy policy_;
+        Use_map uses_;
+        std::deque<Move> promotions_;
+        bool started_;
+        bool stopping_;
+        boost::thread thread_;
+    };
+#endif
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/static_assert.hpp>
 
 #include <easylogging++.h>
 _INITIALIZE_EASYLOGGINGPP
@@ -15,12 +16,29 @@ _INITIALIZE_EASYLOGGINGPP
 
 namespace ft {
 
+    // Once per process: reconfiguring the loggers while others log through them loses all output
+    // from then on, so the first path wins.
     void initialize_logger(const std::string& path)
     {
+        static boost::mutex mutex;
+        static std::string configured;
+
+        boost::lock_guard<boost::mutex> guard(mutex);
+
+        if (!configured.empty())
+        {
+            if (path != configured)
+            {
+                LWARNING << "logging goes to " << configured << " already, ignore " << path;
+            }
+            return;
+        }
+
         easyloggingpp::Configurations defaultConf;
         defaultConf.setAll(easyloggingpp::ConfigurationType::Filename, path + "file_transfer.log");
 
         easyloggingpp::Loggers::reconfigureAllLoggers(defaultConf);
+        configured = path;
     }
 
     TransferPtr make_transfer_client(const std::string& host, const std::string& port, const std::string& recv_path, const std::string& log_path)
@@ -35,18 +53,92 @@ namespace ft {
         return tran;
     }
 
-    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path, const std::string& log_path)
+    TransferPtr make_transfer_client(const EnginePtr& engine, const std::string& host, const std::string& port, const std::string& recv_path, const std::string& log_path)
+    {
+        initialize_logger(log_path);
+
+        if (!engine)
+            return TransferPtr();
+
+        LINFO << "start file transfer client " << host << ":" << port << " on a shared engine";
+
+        return boost::make_shared<Transfer>(host, port, recv_path, false, ServerOptions(), engine);
+    }
+
+    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path, const std::string& log_path, size_t shards)
+    {
+        ServerOptions options;
+        options.shards = shards;
+
+        return make_transfer_server(addr, port, recv_path, log_path, options);
+    }
+
+    TransferPtr make_transfer_server(const std::string& addr, const std::string& port, const std::string& recv_path, const std::string& log_path, const ServerOptions& options)
     {
         initialize_logger(log_path);
 
         LINFO << "start file transfer server " << addr << ":" << port;
 
-        TransferPtr tran = boost::make_shared<Transfer>(addr, port, recv_path, true);
-        tran->start();
+        TransferPtr tran = boost::make_shared<Transfer>(addr, port, recv_path, true, options);
+        if (!options.deferred_start)
+            tran->start();
 
         return tran;
     }
 
+    TransferPtr make_transfer_server(const EnginePtr& engine, const std::string& addr, const std::string& port, const std::string& recv_path, const std::string& log_path,
+        const ServerOptions& options)
+    {
+        initialize_logger(log_path);
+
+        if (!engine)
+            return TransferPtr();
+
+        LINFO << "start file transfer server " << addr << ":" << port << " on a shared engine";
+
+        TransferPtr tran = boost::make_shared<Transfer>(addr, port, recv_path, true, options, engine);
+        if (!options.deferred_start)
+            tran->start();
+
+        return tran;
+    }
+
+    EnginePtr make_engine(size_t threads)
+    {
+        EnginePtr engine = boost::make_shared<Engine>(threads);
+        engine->start();
+
+        return engine;
+    }
+
+    EnginePtr make_engine(boost::asio::io_service& ios)
+    {
+        return boost::make_shared<Engine>(boost::ref(ios));
+    }
+
+    void stop(EnginePtr& engine)
+    {
+        if (engine)
+        {
+            engine->stop();
+            engine->join();
+        }
+    }
+
+    void set_buffer_budget(EnginePtr& engine, size_t bytes)
+    {
+        if (engine)
+        {
+            engine->set_buffer_budget(bytes);
+        }
+    }
+
+    void start(TransferPtr& tran)
+    {
+        if (tran)
+            tran->start();
+    }
+
     void stop(TransferPtr& tran)
     {
         if (tran)
@@ -57,35 +149,452 @@ namespace ft {
         }
     }
 
-    void send(TransferPtr& tran, const std::string& file, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end)
+    void drain(TransferPtr& tran)
     {
         if (tran)
         {
-            FileInfo info;
-            info.id = id;
-            info.type = type;
-            info.date = date;
-            info.tm_begin = tm_begin;
-            info.tm_end = tm_end;
+            // shared listeners stay open in the other processes, queued connections are ours
+            tran->drain(true);
+        }
+    }
+
+    bool wait_drained(TransferPtr& tran, int timeout_ms)
+    {
+        if (!tran)
+            return true;
 
-            tran->send(file, info);
+        return tran->wait_drained(timeout_ms);
+    }
+
+    void set_admission_limits(TransferPtr& tran, const AdmissionLimits& limits)
+    {
+        if (tran)
+        {
+            tran->set_admission_limits(limits);
         }
+    }
 
+    void set_buffer_budget(TransferPtr& tran, size_t bytes)
+    {
+        if (tran)
+        {
+            tran->set_buffer_budget(bytes);
+        }
     }
 
-    void query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end)
+    void set_socket_tuning(TransferPtr& tran, const SocketTuning& tuning)
     {
         if (tran)
         {
-            FileInfo info;
-            info.id = id;
-            info.type = type;
-            info.date = date;
-            info.tm_begin = tm_begin;
-            info.tm_end = tm_end;
+            tran->set_socket_tuning(tuning);
+        }
+    }
+
+    void set_socket_profile(TransferPtr& tran, SocketTuning::Profile profile)
+    {
+        set_socket_tuning(tran, SocketTuning::make(profile));
+    }
+
+    SocketTuning get_socket_tuning(TransferPtr& tran)
+    {
+        if (!tran)
+            return SocketTuning();
 
-            tran->query(info);
+        return tran->socket_tuning();
+    }
+
+    void set_zerocopy_threshold(TransferPtr& tran, size_t bytes)
+    {
+        if (tran)
+        {
+            tran->set_zerocopy_threshold(bytes);
+        }
+    }
+
+    void set_dedup_threshold(TransferPtr& tran, size_t bytes)
+    {
+        if (tran)
+        {
+            tran->set_dedup_threshold(bytes);
+        }
+    }
+
+    void set_chunked_dedup(TransferPtr& tran, bool on)
+    {
+        if (tran)
+        {
+            tran->set_chunking(on);
         }
     }
 
+    void set_upload_ack(TransferPtr& tran, bool on)
+    {
+        if (tran)
+        {
+            tran->set_upload_ack(on);
+        }
+    }
+
+    bool set_storage_layout(TransferPtr& tran, const std::string& pattern)
+    {
+        if (tran)
+        {
+            return tran->set_storage_layout(pattern);
+        }
+
+        return false;
+    }
+
+    bool add_storage_root(TransferPtr& tran, const std::string& path)
+    {
+        if (tran)
+        {
+            return tran->add_storage_root(path);
+        }
+
+        return false;
+    }
+
+    // the public enums pass through as they are to the classes behind them
+    BOOST_STATIC_ASSERT(static_cast<int>(StoragePlacement::BY_FREE_SPACE) == static_cast<int>(Storage_layout::BY_FREE_SPACE));
+#ifdef __linux__
+    BOOST_STATIC_ASSERT(static_cast<int>(DurabilityMode::GROUP) == static_cast<int>(Durability::GROUP));
+#endif
+    BOOST_STATIC_ASSERT(static_cast<int>(TransferPriority::BULK) == static_cast<int>(Rate_limiter::BULK));
+    BOOST_STATIC_ASSERT(static_cast<int>(CachePolicy::ARCHIVE) == static_cast<int>(Page_cache_policy::ARCHIVE));
+
+    void set_storage_placement(TransferPtr& tran, StoragePlacement::Mode placement)
+    {
+        if (tran)
+        {
+            tran->set_storage_placement(placement);
+        }
+    }
+
+    bool add_cold_root(TransferPtr& tran, const std::string& path)
+    {
+#ifdef __linux__
+        if (tran)
+        {
+            return tran->add_cold_root(path);
+        }
+#endif
+        return false;
+    }
+
+    void set_tier_policy(TransferPtr& tran, const TierPolicy& policy)
+    {
+#ifdef __linux__
+        if (tran)
+        {
+            tran->tiers().set_policy(policy);
+        }
+#endif
+    }
+
+    void set_packed_storage(TransferPtr& tran, size_t bytes)
+    {
+#ifdef __linux__
+        if (tran)
+        {
+            tran->segments().set_threshold(bytes);
+        }
+#endif
+    }
+
+    void set_durability(TransferPtr& tran, DurabilityMode::Mode mode, int group_interval_ms)
+    {
+#ifdef __linux__
+        if (tran)
+        {
+            tran->durability().set_mode(mode, group_interval_ms);
+        }
+#endif
+    }
+
+    void set_cache_budget(TransferPtr& tran, size_t bytes)
+    {
+        if (tran)
+        {
+            tran->set_cache_budget(bytes);
+        }
+    }
+
+    size_t warm_cache(TransferPtr& tran, const std::string& type, const std::string& match)
+    {
+#ifdef __linux__
+        if (tran)
+        {
+            return tran->warm_cache(type, match);
+        }
+#endif
+        return 0;
+    }
+
+    void add_replica(TransferPtr& tran, const std::string& host, const std::string& port)
+    {
+        if (tran)
+        {
+            tran->add_replica(host, port);
+        }
+    }
+
+    void set_global_rate(TransferPtr& tran, size_t bytes_per_sec)
+    {
+        if (tran)
+        {
+            tran->limiter().set_global_rate(bytes_per_sec);
+        }
+    }
+
+    void set_host_rate(TransferPtr& tran, const std::string& host, size_t bytes_per_sec)
+    {
+        if (tran)
+        {
+            tran->limiter().set_host_rate(host, bytes_per_sec);
+        }
+    }
+
+    void set_connection_rate(TransferPtr& tran, size_t bytes_per_sec)
+    {
+        if (tran)
+        {
+            tran->limiter().set_connection_rate(bytes_per_sec);
+        }
+    }
+
+    void set_type_priority(TransferPtr& tran, const std::string& type, TransferPriority::Class priority)
+    {
+        if (tran)
+        {
+            tran->limiter().set_type_priority(type, priority);
+        }
+    }
+
+    void set_type_cache_policy(TransferPtr& tran, const std::string& type, CachePolicy::Mode policy)
+    {
+        if (tran)
+        {
+            tran->page_cache().set_type_policy(type, policy);
+        }
+    }
+
+    CompletionPtr send(TransferPtr& tran, const std::string& file, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end)
+    {
+        FileInfo info;
+        info.id = id;
+        info.type = type;
+        info.date = date;
+        info.tm_begin = tm_begin;
+        info.tm_end = tm_end;
+
+        if (!tran)
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+
+        return tran->send(file, info);
+    }
+
+    CompletionPtr send(TransferPtr& tran, const SourcePtr& source, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end)
+    {
+        FileInfo info;
+        info.id = id;
+        info.type = type;
+        info.date = date;
+        info.tm_begin = tm_begin;
+        info.tm_end = tm_end;
+
+        if (!tran || !source)
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+
+#ifdef __linux__
+        return tran->send(source, info);
+#else
+        LERROR << "send from " << source->name() << " is not supported";
+        return Completion::completed(info.key(), TransferResult::REJECTED);
+#endif
+    }
+
+    SourcePtr make_file_source(const std::string& path)
+    {
+#ifdef __linux__
+        SourcePtr source = Fd_source::open(path);
+        if (!source)
+        {
+            LERROR << "open file " << path << " error(" << errno << ")";
+        }
+
+        return source;
+#else
+        return SourcePtr();
+#endif
+    }
+
+    SourcePtr make_fd_source(int fd, bool owns_fd)
+    {
+#ifdef __linux__
+        struct stat statbuf;
+        if (::fstat(fd, &statbuf) == -1)
+        {
+            LERROR << "fstat fd " << fd << " error(" << errno << ")";
+            return SourcePtr();
+        }
+
+        // a pipe has no size to send up front, it is streamed until closed instead
+        if (S_ISFIFO(statbuf.st_mode))
+            return SourcePtr(new Pipe_source(fd, owns_fd));
+
+        // sockets, terminals and devices stat as empty and cannot be read with pread
+        if (!S_ISREG(statbuf.st_mode))
+        {
+            LERROR << "send from fd " << fd << " is not supported, not a regular file or pipe";
+            if (owns_fd)
+                ::close(fd);
+
+            return SourcePtr();
+        }
+
+        std::stringstream name;
+        name << "fd " << fd;
+
+        return SourcePtr(new Fd_source(fd, owns_fd, name.str()));
+#else
+        return SourcePtr();
+#endif
+    }
+
+    SourcePtr make_memory_source(const void* data, size_t size)
+    {
+#ifdef __linux__
+        return SourcePtr(new Memory_source(static_cast<const char*>(data), size, boost::shared_ptr<const void>()));
+#else
+        return SourcePtr();
+#endif
+    }
+
+    SourcePtr make_memory_source(const boost::shared_ptr<const std::vector<char> >& buffer)
+    {
+#ifdef __linux__
+        if (!buffer)
+            return SourcePtr();
+
+        return SourcePtr(new Memory_source(buffer->empty() ? NULL : &(*buffer)[0], buffer->size(), buffer));
+#else
+        return SourcePtr();
+#endif
+    }
+
+    SourcePtr make_pipe_source(int fd, bool owns_fd)
+    {
+#ifdef __linux__
+        return SourcePtr(new Pipe_source(fd, owns_fd));
+#else
+        return SourcePtr();
+#endif
+    }
+
+    SourcePtr make_generator_source(const Generator& generator)
+    {
+#ifdef __linux__
+        return SourcePtr(new Generator_source(generator));
+#else
+        return SourcePtr();
+#endif
+    }
+
+    CompletionPtr query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end,
+        const boost::posix_time::ptime& wait_until)
+    {
+        FileInfo info;
+        info.id = id;
+        info.type = type;
+        info.date = date;
+        info.tm_begin = tm_begin;
+        info.tm_end = tm_end;
+
+        if (!tran)
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+
+        return tran->query(info, wait_until);
+    }
+
+    CompletionPtr query(TransferPtr& tran, const std::string& id, const std::string& type, const std::string& date, const std::string& tm_begin, const std::string& tm_end,
+        const SinkPtr& sink, const boost::posix_time::ptime& wait_until)
+    {
+        FileInfo info;
+        info.id = id;
+        info.type = type;
+        info.date = date;
+        info.tm_begin = tm_begin;
+        info.tm_end = tm_end;
+
+        if (!tran)
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+
+        return tran->query(info, wait_until, sink);
+    }
+
+    SinkPtr make_file_sink(const std::string& path)
+    {
+        return SinkPtr(new File_sink(path, false));
+    }
+
+    SinkPtr make_memory_sink(void* data, size_t capacity)
+    {
+        return SinkPtr(new Memory_sink(static_cast<char*>(data), capacity));
+    }
+
+    SinkPtr make_memory_sink(const boost::shared_ptr<std::vector<char> >& buffer)
+    {
+        if (!buffer)
+            return SinkPtr();
+
+        return SinkPtr(new Memory_sink(buffer));
+    }
+
+    SinkPtr make_callback_sink(const ChunkHandler& handler)
+    {
+        return SinkPtr(new Callback_sink(handler));
+    }
+
+    bool is_complete(const CompletionPtr& completion)
+    {
+        return completion && completion->ready();
+    }
+
+    TransferResult wait(const CompletionPtr& completion)
+    {
+        if (!completion)
+            return TransferResult();
+
+        return completion->future().get();
+    }
+
+    bool wait(const CompletionPtr& completion, const boost::posix_time::time_duration& timeout, TransferResult& result)
+    {
+        if (!completion)
+            return false;
+
+        if (!completion->future().timed_wait(timeout))
+            return false;
+
+        result = completion->future().get();
+        return true;
+    }
+
+    void on_complete(const CompletionPtr& completion, const CompletionHandler& handler)
+    {
+        if (completion && handler)
+        {
+            completion->on_complete(handler);
+        }
+    }
+
+    boost::shared_future<TransferResult> get_future(const CompletionPtr& completion)
+    {
+        if (!completion)
+            return boost::shared_future<TransferResult>();
+
+        return completion->future();
+    }
+
 }
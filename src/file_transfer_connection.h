@@ -3,6 +3,7 @@
 
 #include <string>
 #include <fstream>
+#include <limits>
 
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
@@ -10,6 +11,8 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/crc.hpp>
 
 #ifdef __linux__
 #include <sys/types.h>
@@ -20,10 +23,22 @@
 
 #include "easylogging++.h"
 #include "file_info.h"
+#include "file_source.h"
+#include "file_sink.h"
+#include "file_completion.h"
+#include "file_handler_alloc.h"
+#include "file_buffer_arena.h"
+#include "file_socket_tuning.h"
+#include "file_rate_limiter.h"
+#include "file_sha256.h"
+#include "file_blob_store.h"
+#include "file_chunk_store.h"
+#include "file_single_flight.h"
 
 namespace ft {
 
     class Transfer;
+    class Transfer_shard;
     using boost::asio::ip::tcp;
 
 #if defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
@@ -37,10 +52,11 @@ namespace ft {
     public:
         typedef boost::shared_ptr<Transfer_connection> pointer;
 
-        static pointer create(Transfer* transfer, boost::asio::io_service& io_service, const std::string& recv_path)
-        {
-            return pointer(new Transfer_connection(transfer, io_service, recv_path));
-        }
+        ~Transfer_connection();
+
+        // Back to the state of a fresh connection; called by Connection_pool once nothing refers to
+        // it any more. Strings and the streambuf keep their capacity.
+        void recycle();
 
         tcp::socket& socket()
         {
@@ -52,42 +68,190 @@ namespace ft {
             return file_info_;
         }
 
+        // Client side: completed with the outcome when the connection shuts down.
+        void set_completion(const CompletionPtr& completion)
+        {
+            completion_ = completion;
+        }
+
         void start_recv();
-        void start_query(const FileInfo& info, const std::string& addr, const std::string& port);
+        void start_query(const FileInfo& info, const std::string& addr, const std::string& port, const boost::posix_time::ptime& wait_until, const SinkPtr& sink);
+#ifdef __linux__
+        void start_send(const SourcePtr& source, const FileInfo& info, const std::string& addr, const std::string& port);
+#else
         void start_send(const std::string& file_path, const FileInfo& info, const std::string& addr, const std::string& port);
+#endif
+
+        // Called by Transfer once the file a parked QUERY waits for has been committed.
+        void wake();
+
+        Transfer_shard* shard() const
+        {
+            return shard_;
+        }
+
+        // Server side: the connection counts against the admission limits until it shuts down.
+        void set_admitted()
+        {
+            admitted_ = true;
+        }
+
+        // Applies the socket tuning of the transfer to a socket just connected or accepted.
+        void tune_socket();
+
+        // Server side: answer BUSY without reading the request and close.
+        void reject_busy(int retry_after_ms);
+        void drain_rejected();
+        void handle_rejected_data(const boost::system::error_code& error);
+        void handle_reject_timeout(const boost::system::error_code& error);
+
+#ifdef __linux__
+        // Cut-through reply: reader streams the file this connection is still receiving.
+        bool add_reader(pointer reader);
+        // add_reader() for a reader on another shard, which starts over if it is too late.
+        void attach_reader(pointer reader);
+#endif
 
     private:
-        Transfer_connection(Transfer* transfer, boost::asio::io_service& io_service, const std::string& recv_path);
+        friend class Connection_pool;
+
+        Transfer_connection(Transfer* transfer, Transfer_shard* shard, const std::string& recv_path);
+
+        // hands a pooled connection to the next transfer
+        void attach(Transfer* transfer, const std::string& recv_path)
+        {
+            transfer_ = transfer;
+            recv_path_ = recv_path;
+        }
+
+        // Runs handler on the shard of conn: right away on this one, as a message to any other.
+        template <typename Handler>
+        void post_to(const pointer& conn, Handler handler);
 
         bool connect(const std::string& addr, const std::string& port);
 
         void send_file(const std::string& file_path);
+#ifdef __linux__
+        void start_follow(const std::string& file_path, boost::int64_t file_size, boost::int64_t committed);
+        void on_data_committed(boost::int64_t committed);
+        void on_source_aborted();
+        void release_readers(bool aborted);
+
+        // readers follow the bytes the sink has in the file, see Sink::watch(); -1 if they cannot
+        boost::int64_t watch_sink();
+        static void handle_committed(const boost::weak_ptr<Transfer_connection>& conn, boost::int64_t committed);
+        void notify_readers(boost::int64_t committed);
+
+        void send_source(const SourcePtr& source);
+        void start_send_data(off_t limit);
+        void handle_offer_reply(const boost::system::error_code& error, size_t bytes_transferred);
+        void handle_offer_timeout(const boost::system::error_code& error);
+        void send_body();
+        void send_file_data();
+        void handle_file_data_sent(const boost::system::error_code& error);
+        void start_shaping();
+        void handle_throttle(const boost::system::error_code& error);
+        void advise_source();
+        void abort_send();
+        void finish_send();
+        void close_send_file();
+
+        // MSG_ZEROCOPY for memory sources from Transfer::zerocopy_threshold() on
+        void start_zerocopy();
+        void stop_zerocopy(const char* why);
+        void wait_zerocopy();
+        void handle_zerocopy(const boost::system::error_code& error);
+
+        // Fan-out: a replica link follows this receive like a reader, but to a downstream server.
+        void replicate_to(const std::string& host, const std::string& port);
+        void start_replicate(const std::string& host, const std::string& port, const std::string& file_path, boost::int64_t file_size, boost::int64_t committed);
+        void connect_replica();
+        // resolver: kept until the lookup is done
+        void handle_replica_resolve(const boost::shared_ptr<tcp::resolver>& resolver, const boost::system::error_code& error,
+            tcp::resolver::iterator iterator);
+        void handle_replica_connect(const boost::system::error_code& error);
+        void handle_replica_resume(const boost::system::error_code& error, size_t bytes_transferred);
+        void retry_replica();
+        void handle_replica_retry(const boost::system::error_code& error);
+#endif
 
         std::string make_query_action() const;
 
         std::string make_reply_action(const std::string& info, int status) const;
 
-        std::string make_send_action(const FileInfo& file_info);
+        std::string make_send_action(const FileInfo& file_info, boost::int64_t size, int resume = -1) const;
+        std::string make_resume_action(boost::int64_t offset) const;
+        std::string make_busy_action(int retry_after_ms) const;
+        std::string make_have_action() const;
+        std::string make_need_action() const;
+        std::string make_done_action() const;
 
         void send_action(const std::string& info, boost::system::error_code& ec);
+        void start_send_reply();
+        void handle_send_reply(const boost::system::error_code& error, size_t bytes_transferred);
         void handle_action(const boost::system::error_code& error, size_t bytes_transferred);
         void handle_file_sent(const boost::system::error_code& error, size_t bytes_transferred);
 
+        bool open_recv_file();
+        // a receive takes a slab once there is data to read, and gives it back once the socket has
+        // no more for now, so an idle sender holds no buffer
         void start_recv_file();
+        void handle_recv_ready(const boost::system::error_code& error);
+        void read_recv_data();
+        void resume_recv();
+        bool write_recv_data(const char* bytes, size_t size);
+        void release_recv_slab();
         void handle_file_data_recv(const boost::system::error_code& error, size_t bytes_transferred);
 
-        void start_reply();
+        // follow false answers a query for a file still being received without streaming it
+        void start_reply(bool follow = true);
+        void handle_wait_timeout(const boost::system::error_code& error);
+        // a parked query whose client hung up
+        void handle_parked_read(const boost::system::error_code& error);
+#ifdef __linux__
+        // a reply sharing the read of a Single_flight
+        void handle_flight(const std::string& file, size_t epoch, bool first, const Single_flight::Buffer& data);
+        void reply_flight(const std::string& file, size_t epoch, bool first, const Single_flight::Buffer& data);
+#endif
 
-        bool make_directory(const std::string type);
+        // a sink with a close_queue() is closed on it, and the receive ends back on the io thread
+        void finish_recv();
+        void close_queued();
+        void handle_closed(bool stored);
+        void abort_recv();
+
+        // Server side: answers the stored file with action once Transfer::durability() has it
+        // durable, and ends the receive.
+        void commit_stored(const std::string& action);
+        void handle_durable(const std::string& action, bool durable);
+        void acknowledge(const std::string& action, bool durable);
+
+        // Server side: content dedup against Transfer::blobs() and Transfer::chunk_store()
+        bool link_offered_content();
+        bool plan_chunks();
+        void find_missing_chunks();
+        void handle_missing_chunks(boost::int64_t needed);
+        void index_content();
+
+        // the data of a SEND, once it is admitted and its chunks are planned
+        void start_recv_data();
+
+        Storage_layout::DirectoryPtr make_directory();
         std::string to_file_path(const FileInfo& info) const;
 
         void shutdown();
+        void complete();
+
+        void uncork();
+        // AUTO: sizes the buffers once enough data has gone through
+        void sample_rate(bool sending, size_t bytes);
 
         void parseOptions(const std::string& str);
         std::string getOption(const std::string& key) const;
 
     private:
         Transfer* transfer_;
+        Transfer_shard* shard_;
         tcp::socket socket_;
         std::string filename_;
 #if defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
@@ -96,12 +260,80 @@ namespace ft {
         std::string action_;
         std::map <std::string, std::string> optios_;
         FileInfo file_info_;
-        int file_size_;
-        int recv_count_;
-        const std::string recv_path_;
+        boost::int64_t file_size_;  // -1 for a stream until it ends
+        boost::int64_t recv_count_;
+#ifdef __linux__
+        SourcePtr source_;
+        boost::asio::posix::stream_descriptor source_wait_;  // a dup of a stream source's wait_fd()
+        Zerocopy zerocopy_;
+        bool zerocopy_on_;
+        boost::asio::posix::stream_descriptor zerocopy_wait_;  // a dup of socket_, woken by the error queue
+        off_t send_offset_;
+        off_t send_limit_;  // bytes that may be sent so far, grows while following a receive
+        bool sending_;
+        std::vector<pointer> readers_;
+
+        static const int max_replica_retries = 8;
+        std::string replica_host_;
+        std::string replica_port_;
+        int replica_retries_;
+        boost::asio::deadline_timer retry_timer_;
+
+        Token_bucket rate_;
+        std::string remote_host_;
+        int priority_;
+        bool throttled_;  // queued for global tokens in the limiter
+        boost::asio::deadline_timer throttle_timer_;
+
+        int cache_policy_;
+        off_t prefetched_;  // read ahead of the send up to here
+        off_t released_;    // and dropped from the page cache behind it
+#endif
+        std::string recv_path_;
+
+        enum { max_wait_ms = 60 * 1000 };  // the longest a server holds a query open
+        boost::posix_time::ptime wait_until_;
+        // the deadline of a parked query, or of the answer to an offered hash
+        boost::asio::deadline_timer wait_timer_;
+
+        bool admitted_;
+        bool receive_admitted_;
+        size_t receive_bytes_;  // counted against max_bytes_in_flight
+
+        bool ack_;           // an upload that is over once the server answers DONE, see commit_stored()
+        bool acked_;
+        bool awaiting_ack_;  // everything sent, only DONE is missing
+        bool reply_closed_;  // the server closed before DONE
 
         boost::asio::streambuf buffer_;
-        std::ofstream  out_file_;
+        SinkPtr sink_;
+
+        CompletionPtr completion_;
+        TransferResult::Status result_;  // reported by complete(), FAILED until a path succeeds
+        int retry_after_ms_;
+        boost::crc_32_type crc_;
+
+        enum { offer_timeout_s = 5 };
+        enum { reject_linger_ms = 1000 };  // for a rejected client to read BUSY and close
+        std::string content_hash_;  // SHA-256 offered with a SEND, checked against the data on receive
+        bool offer_expired_;        // unanswered, the data goes out as to a server without dedup
+        Sha256 content_sha_;
+        bool deduplicated_;
+        std::vector<Chunk> chunks_;  // of a chunked upload, whose missing_ ones are sent
+        std::vector<bool> missing_;
+        boost::int64_t dedup_bytes_;
+
+        SocketTuning tuning_;  // as applied, read back from the socket
+        bool corked_;
+        boost::posix_time::ptime sample_start_;
+        size_t sample_bytes_;
+
+        // one handler in flight per direction, see start_recv() and send_file_data()
+        Handler_allocator recv_alloc_;
+        Handler_allocator send_alloc_;
+
+        // file data is read into a slab of Transfer::arena_, the action into buffer_
+        Buffer_arena::Slab* recv_slab_;
     };
 
 
@@ -0,0 +1,136 @@
+#ifndef _FILE_TRANSFER_ENGINE_H_
+#define _FILE_TRANSFER_ENGINE_H_
+
+#include <vector>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <signal.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_transfer_shard.h"
+
+namespace ft {
+
+    // The io threads, connection pools and receive buffers behind any number of clients and
+    // servers. A transfer made without one gets a private engine; with a shared one the thread
+    // count stays the same however many peers the process talks to.
+    class Engine
+        : private boost::noncopyable
+    {
+    public:
+        // threads is the number of shards, 0 for one per core. More than one pins each to a core.
+        explicit Engine(size_t threads) : external_(false)
+        {
+            size_t cpus = boost::thread::hardware_concurrency();
+            if (threads == 0)
+                threads = std::max<size_t>(cpus, 1);
+#ifndef __linux__
+            // no SO_REUSEPORT to share a port between the shards
+            threads = 1;
+#endif
+
+            for (size_t i = 0; i < threads; ++i)
+            {
+                // a single shard runs unpinned, as it always did
+                int cpu = (threads > 1 && cpus > 0) ? static_cast<int>(i % cpus) : -1;
+
+                shards_.push_back(boost::shared_ptr<Transfer_shard>(new Transfer_shard(i, cpu)));
+            }
+
+            // the default budget is the engine's, not each shard's
+            if (shards_.size() > 1)
+                set_buffer_budget(Buffer_arena::default_budget);
+
+            ignore_sigpipe();
+        }
+
+        // Everything runs on ios, the application keeps it running and the engine has no thread.
+        explicit Engine(boost::asio::io_service& ios) : external_(true)
+        {
+            shards_.push_back(boost::shared_ptr<Transfer_shard>(new Transfer_shard(0, ios)));
+
+            ignore_sigpipe();
+        }
+
+        ~Engine()
+        {
+            join();
+        }
+
+        bool external() const
+        {
+            return external_;
+        }
+
+        size_t size() const
+        {
+            return shards_.size();
+        }
+
+        Transfer_shard& shard(size_t index)
+        {
+            return *shards_[index];
+        }
+
+        // Spreads the budget evenly over the shards.
+        void set_buffer_budget(size_t bytes)
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i]->arena().set_budget(bytes / shards_.size());
+        }
+
+        void reserve(size_t connections)
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i]->pool().reserve(connections);
+        }
+
+        void start()
+        {
+            if (shards_.size() > 1)
+            {
+                LINFO << "engine runs " << shards_.size() << " shards";
+            }
+
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i]->start();
+        }
+
+        // Lets the threads return once they run out of work.
+        void stop()
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i]->stop();
+        }
+
+        void join()
+        {
+            for (size_t i = 0; i < shards_.size(); ++i)
+                shards_[i]->join();
+        }
+
+    private:
+        // sendfile and splice have no MSG_NOSIGNAL, a peer gone away would kill the process
+        // instead of failing the write with EPIPE. A handler the application set stays.
+        static void ignore_sigpipe()
+        {
+#ifdef __linux__
+            struct sigaction action;
+            if (::sigaction(SIGPIPE, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+                ::signal(SIGPIPE, SIG_IGN);
+#endif
+        }
+
+        const bool external_;
+        std::vector<boost::shared_ptr<Transfer_shard> > shards_;
+    };
+}
+
+#endif
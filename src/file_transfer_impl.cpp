@@ -40,7 +40,29 @@ using namespace ft;
     }
 #endif
 
-void Transfer_connection::start_query(const FileInfo& info, const std::string& addr, const std::string& port)
+    // the chunk list of a SEND runs to kilobytes, the log gets its start
+    static std::string loggable(const std::string& action)
+    {
+        static const size_t max_logged = 512;
+        if (action.size() <= max_logged)
+            return action;
+
+        std::ostringstream os;
+        os << action.substr(0, max_logged) << "... (" << action.size() << " bytes)";
+        return os.str();
+    }
+
+#ifdef __linux__
+    // the content of an upload, for its hash and its chunks
+    static void scan_content(Sha256* sha, Chunker* chunker, const char* data, size_t size)
+    {
+        sha->update(data, size);
+        if (chunker)
+            chunker->update(data, size);
+    }
+#endif
+
+void Transfer_connection::start_query(const FileInfo& info, const std::string& addr, const std::string& port, const boost::posix_time::ptime& wait_until, const SinkPtr& sink)
 {
     LINFO << "start query file " << info.key();
 
@@ -48,6 +70,8 @@ void Transfer_connection::start_query(const FileInfo& info, const std::string& a
         return;
 
     file_info_ = info;
+    wait_until_ = wait_until;
+    sink_ = sink;
 
     boost::system::error_code ec;
     std::string query = make_query_action();
@@ -70,10 +94,11 @@ void Transfer_connection::start_recv()
     boost::asio::async_read_until(socket_,
         buffer_,
         ';',
-        boost::bind(&Transfer_connection::handle_action,
-            shared_from_this(),
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::bytes_transferred));
+        make_alloc_handler(recv_alloc_,
+            boost::bind(&Transfer_connection::handle_action,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred)));
 }
 
 bool Transfer_connection::connect(const std::string& addr, const std::string& port)
@@ -100,14 +125,70 @@ bool Transfer_connection::connect(const std::string& addr, const std::string& po
         return false;
     }
 
+    tune_socket();
     return true;
 }
 
+void Transfer_connection::tune_socket()
+{
+    SocketTuning tuning = transfer_->socket_tuning();
+
+    tuning_ = Socket_tuner::apply(socket_.native(), tuning);
+    sample_start_ = boost::posix_time::microsec_clock::universal_time();
+    sample_bytes_ = 0;
+
+    LINFO << "socket " << tuning_;
+}
+
+void Transfer_connection::uncork()
+{
+    if (!corked_)
+        return;
+
+    corked_ = false;
+    Socket_tuner::cork(socket_.native(), false);
+}
+
+void Transfer_connection::sample_rate(bool sending, size_t bytes)
+{
+    if (tuning_.profile != SocketTuning::AUTO || tuning_.rate != 0)
+        return;
+
+    sample_bytes_ += bytes;
+    if (sample_bytes_ < Socket_tuner::auto_sample_bytes)
+        return;
+
+    boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - sample_start_;
+    boost::uint64_t rate = sample_bytes_ * 1000000ULL / std::max<boost::int64_t>(elapsed.total_microseconds(), 1);
+
+    Socket_tuner::size_for_bdp(socket_.native(), sending, rate, tuning_);
+
+    LINFO << "socket sized to the bandwidth-delay product: " << tuning_;
+}
+
+#ifdef __linux__
+void Transfer_connection::start_send(const SourcePtr& source, const FileInfo& info, const std::string& addr, const std::string& port)
+{
+    LINFO << "start send " << source->name() << " to " << addr << ":" << port;
+
+    file_info_ = info;
+    transfer_->add_task(shared_from_this(), Transfer::SEND);
+
+    if (!transfer_->is_server_ && !connect(addr, port))
+    {
+        shutdown();
+        return;
+    }
+
+    send_source(source);
+}
+#else
 void Transfer_connection::start_send(const std::string& file_path, const FileInfo& info, const std::string& addr, const std::string& port)
 {
     LINFO << "start send " << file_path << " to " << addr << ":" << port;
 
     file_info_ = info;
+    transfer_->add_task(shared_from_this(), Transfer::SEND);
 
     if (!transfer_->is_server_ && !connect(addr, port))
     {
@@ -117,6 +198,7 @@ void Transfer_connection::start_send(const std::string& file_path, const FileInf
 
     send_file(file_path);
 }
+#endif
 
 #ifdef WIN32
 void Transfer_connection::send_file(const std::string& file_path)
@@ -130,7 +212,8 @@ void Transfer_connection::send_file(const std::string& file_path)
         OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0), ec);
     if (file_.is_open())
     {
-        std::string action = make_send_action(file_info_);
+        DWORD size = ::GetFileSize(file_.native_handle(), NULL);
+        std::string action = make_send_action(file_info_, size);
         send_action(action, ec);
 
         if (ec)
@@ -164,318 +247,1915 @@ void Transfer_connection::send_file(const std::string& file_path)
 {
     LINFO << "send file " << file_path;
 
-    filename_ = file_path;
-
-    int fd = ::open(filename_.c_str(), O_RDONLY);
-    if (-1 == fd)
+    SourcePtr source = Fd_source::open(file_path);
+    if (!source)
     {
-        LERROR << "open file " << filename_ << " error(" << errno << ")";
+        LERROR << "open file " << file_path << " error(" << errno << ")";
         shutdown();
         return;
     }
 
-    boost::system::error_code ec;
-    std::string action = make_send_action(file_info_);
-    send_action(action, ec);
+    send_source(source);
+}
 
-    if (ec)
+void Transfer_connection::send_source(const SourcePtr& source)
+{
+    source_ = source;
+    filename_ = source_->name();
+    file_size_ = source_->size();
+
+    // an upload that asks for DONE is over once the server has the file stored, not once it is sent
+    ack_ = !transfer_->is_server_ && transfer_->upload_ack();
+
+    // the disk reads start in the background while the send waits for its turn, all of a hot file
+    cache_policy_ = transfer_->page_cache().policy(file_info_.type);
+    prefetched_ = cache_policy_ == Page_cache_policy::HOT ? std::max<off_t>(file_size_, 0) : static_cast<off_t>(Page_cache_policy::readahead_window);
+    released_ = 0;
+    source_->prefetch(0, prefetched_);
+
+    // large uploads offer their hash first, the server may have the content under another key
+    size_t threshold = transfer_->dedup_threshold();
+    if (!transfer_->is_server_ && threshold > 0 && file_size_ >= 0 && static_cast<size_t>(file_size_) >= threshold)
     {
-        LERROR << ec.message();
-        shutdown();
-        ::close(fd);
-        return;
-    }
+        // and with chunking the chunks, of which it may have most
+        Chunker chunker;
+        Chunker* chunking = transfer_->chunking() ? &chunker : NULL;
 
-    //if (socket_.non_blocking())  // asio bug 
-    {
-        socket_.non_blocking(false, ec);
-        if (ec)
+        content_sha_.reset();
+        if (source_->scan(boost::bind(&scan_content, &content_sha_, chunking, _1, _2)))
         {
-            LERROR << "(" << ec.value() << ")" << ec.message();
-            shutdown();
-            return;
+            content_hash_ = content_sha_.hex();
+            if (chunking)
+                chunks_ = chunker.finish();
         }
     }
 
-    int sock = socket_.native();
-    off_t start = 0;
-    while (start < file_size_)
-    {
-        size_t end = start + 1 * 1024 * 1024;
-        if (start > file_size_)
-            end = file_size_;
+    start_send_data(file_size_ >= 0 ? file_size_ : std::numeric_limits<off_t>::max());
+}
 
-        ssize_t result = ::sendfile(sock, fd, &start, end - start );
-        if (result == -1)
-        {
-            ec.assign(errno, boost::system::system_category());
-            LERROR <<"(" << ec.value() << ")" << ec.message();
-            break;
-        }
-        else if (result == 0)
-        {
-            ec.assign(errno, boost::system::system_category());
-            LERROR << ec.message();
-            break;
-        }
-        else {
-            LINFO <<file_info_.key() << " send bytes: " << start << " rest: " << file_size_ - start << " percentage:" << double(start) /file_size_;
-            if (start == file_size_)
-                break;
-        }
+void Transfer_connection::start_follow(const std::string& file_path, boost::int64_t file_size, boost::int64_t committed)
+{
+    LINFO << "follow recv of " << file_info_.key() << ", " << committed << " of " << file_size << " bytes committed";
+
+    filename_ = file_path;
+
+    source_ = Fd_source::open(filename_);
+    if (!source_)
+    {
+        LERROR << "open file " << filename_ << " error(" << errno << ")";
+        shutdown();
+        return;
     }
 
-    ::close(fd);
-    shutdown();
-}
-#endif
+    file_size_ = file_size;
 
-Transfer_connection::Transfer_connection(Transfer* transfer, boost::asio::io_service& io_service, const std::string& recv_path)
-    : transfer_(transfer),
-    socket_(io_service),
-    filename_(),
-#if defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
-    file_(io_service),
-#endif // DEBUG
-    file_size_(0),
-    recv_count_(0),
-    recv_path_(recv_path)
-{
+    start_send_data(committed);
 }
 
-std::string Transfer_connection::make_query_action() const
+void Transfer_connection::on_data_committed(boost::int64_t committed)
 {
-    std::stringstream os;
-    os << "CMD=QUERY,";
-    os << file_info_.to_string();
-    os << ";";
+    if (!source_)
+        return;
 
-    return os.str();
+    send_limit_ = committed;
+
+    if (!sending_)
+        send_file_data();
 }
 
-std::string Transfer_connection::make_reply_action(const std::string& info, int status) const
+void Transfer_connection::on_source_aborted()
 {
-    std::stringstream os;
-    os << "CMD=REPLY,";
-    os << "INFO=" << info <<",";
-    os << "STATUS=" << status << ",";
-    os << ";";
+    if (!source_)
+        return;
 
-    return os.str();
+    LERROR << "recv of " << file_info_.key() << " aborted, stop following";
+
+    close_send_file();
+    shutdown();
 }
 
-std::string Transfer_connection::make_send_action(const FileInfo& file_info)
+void Transfer_connection::start_send_data(off_t limit)
 {
-#ifdef WIN32 
-    DWORD size = ::GetFileSize(file_.native_handle(), NULL);
-#endif
+    send_offset_ = 0;
+    send_limit_ = limit;
 
-#ifdef __linux__
-    struct stat statbuf;
-    int result = stat(filename_.c_str(), &statbuf);
-    assert(result != -1);
-    int size = statbuf.st_size;
-    file_size_ = size;
-#endif
+    // the header goes out in one segment with the first data, unless it waits for an answer
+    if (tuning_.cork && content_hash_.empty())
+    {
+        Socket_tuner::cork(socket_.native(), true);
+        corked_ = true;
+    }
 
-    std::stringstream os;
-    os << "CMD=SEND,";
-    os << file_info.to_string();
-    os << "SIZE=" << size << ",";
-    os << ";";
+    boost::system::error_code ec;
+    std::string action = make_send_action(file_info_, file_size_);
+    send_action(action, ec);
 
-    return os.str();
-}
+    if (ec)
+    {
+        LERROR << ec.message();
+        close_send_file();
+        shutdown();
+        return;
+    }
 
-void Transfer_connection::send_action(const std::string& info, boost::system::error_code& ec)
-{
-    LINFO << "send: " << info;
+    if (!content_hash_.empty())
+    {
+        // a server older than dedup reads the data right after the header and never answers
+        wait_timer_.expires_from_now(boost::posix_time::seconds(static_cast<long>(offer_timeout_s)));
+        wait_timer_.async_wait(boost::bind(&Transfer_connection::handle_offer_timeout,
+            shared_from_this(),
+            boost::asio::placeholders::error));
+
+        // HAVE if the server has the content already, RESUME for the data
+        boost::asio::async_read_until(socket_,
+            buffer_,
+            ';',
+            make_alloc_handler(recv_alloc_,
+                boost::bind(&Transfer_connection::handle_offer_reply,
+                    shared_from_this(),
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred)));
+        return;
+    }
 
-    boost::asio::write(socket_,
-        boost::asio::buffer(info),
-        boost::asio::transfer_exactly(info.size()),
-        ec);
+    send_body();
 }
 
-void Transfer_connection::handle_action(const boost::system::error_code& error,
-    size_t bytes_transferred)
+void Transfer_connection::handle_offer_reply(const boost::system::error_code& error, size_t bytes_transferred)
 {
+    boost::system::error_code ignore;
+    wait_timer_.cancel(ignore);
+
+    if (error == boost::asio::error::operation_aborted && offer_expired_)
+    {
+        LWARNING << "no answer to the hash of " << file_info_.key() << " in " << offer_timeout_s << "s, send it whole";
+
+        chunks_.clear();
+        send_body();
+        return;
+    }
+
     if (error)
     {
-        LERROR << error.message();
+        LERROR << "send " << filename_ << ": " << error.message();
+        close_send_file();
         shutdown();
         return;
     }
 
     boost::asio::streambuf::const_buffers_type data = buffer_.data();
-    action_ = std::string(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
+    std::string reply(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
     buffer_.consume(bytes_transferred);
 
-    LINFO << "handle action: " << action_;
-
-    parseOptions(action_);
+    parseOptions(reply);
 
     const std::string cmd = getOption("CMD");
-
-    if (cmd == "SEND")
-    {
-        transfer_->add_task(shared_from_this(), Transfer::RECV);
-
-        start_recv_file();
-    }
-    else if (cmd == "QUERY")
-    {
-        start_reply();
-    }
-    else if (cmd == "REPLY")
+    if (cmd == "HAVE")
     {
-        std::string result = getOption("RESULT");
+        LINFO << "server has the content of " << file_info_.key() << " already, nothing to send";
 
+        result_ = TransferResult::OK;
+        deduplicated_ = true;
+        dedup_bytes_ = source_->size();
+        close_send_file();
         shutdown();
+        return;
     }
-}
-
-void Transfer_connection::start_recv_file()
-{
-    boost::asio::streambuf::mutable_buffers_type mbuf = buffer_.prepare(4 * 1024);
-    socket_.async_read_some(boost::asio::buffer(mbuf),
-        boost::bind(&Transfer_connection::handle_file_data_recv,
-            shared_from_this(),
-            boost::asio::placeholders::error,
-            boost::asio::placeholders::bytes_transferred)
-    );
-}
 
-void Transfer_connection::handle_file_data_recv(const boost::system::error_code& error,
-    size_t bytes_transferred)
-{
-    if (!error)
+    if (cmd == "NEED" && !chunks_.empty())
     {
-        if (bytes_transferred == 0)
+        if (!Chunker::from_bitmap(getOption("MISSING"), chunks_.size(), missing_))
         {
-            LINFO << "recv completed, " << file_info_.key();
-
+            LERROR << "invalid chunk bitmap for " << file_info_.key() << ": " << reply;
+            close_send_file();
             shutdown();
             return;
         }
 
-        if (!out_file_.is_open())
+        // adjacent missing chunks go out as one range
+        std::vector<Range_source::Range> ranges;
+        size_t count = 0;
+        for (size_t i = 0; i < chunks_.size(); ++i)
         {
-            std::string type = getOption("TYPE");
-
-            if (!make_directory(type))
-                return;
-
-            std::string file = recv_path_ + type + "/" + file_info_.key();
-            out_file_.open(file.c_str(), std::ios::binary);
-            if (!out_file_)
-            {
-                LERROR << "open file fail: " << file;
-                shutdown();
-                return;
-            }
-
-            LINFO << "recv " << file;
+            if (!missing_[i])
+                continue;
+
+            ++count;
+            if (!ranges.empty() && ranges.back().first + static_cast<off_t>(ranges.back().second) == chunks_[i].offset)
+                ranges.back().second += chunks_[i].length;
+            else
+                ranges.push_back(Range_source::Range(chunks_[i].offset, chunks_[i].length));
         }
 
-        boost::asio::streambuf::const_buffers_type data = buffer_.data();
-        out_file_.write(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
-
-        buffer_.consume(bytes_transferred);
+        boost::int64_t total = source_->size();
+        source_.reset(new Range_source(source_, ranges));
+        file_size_ = source_->size();
+        send_limit_ = file_size_;
+        dedup_bytes_ = total - file_size_;
 
-        size_t M = recv_count_ / (1 * 1024 * 1024);
-        recv_count_ += bytes_transferred;
+        LINFO << file_info_.key() << " server lacks " << count << " of " << chunks_.size() << " chunks, send "
+            << file_size_ << " of " << total << " bytes, dedup ratio " << (total > 0 ? double(dedup_bytes_) / total : 0);
 
-        if ((recv_count_ / (1 * 1024 * 1024)) > M)
+        if (file_size_ == 0)
         {
-            LINFO << file_info_.key() << " recieve bytes: " << recv_count_ << " rest: " << file_size_ - recv_count_ << " percentage:" << double(recv_count_) / file_size_;
+            // put together from stored chunks, which the server answers with DONE as well
+            result_ = TransferResult::OK;
+            start_send_reply();
+            finish_send();
+            return;
         }
 
-        start_recv_file();
+        send_body();
+        return;
     }
-    else
+
+    if (cmd == "BUSY")
     {
-        if (recv_count_ == file_size_)
-        {
-            LINFO << "recv completed " << file_info_.key();
-        }
-        else {
-            LERROR << "recv file data: " << error.message();
-        }
+        LWARNING << "server busy, retry " << file_info_.key() << " after " << getOption("RETRY") << "ms";
+
+        result_ = TransferResult::BUSY;
+        retry_after_ms_ = std::atoi(getOption("RETRY").c_str());
+        close_send_file();
         shutdown();
+        return;
     }
-}
 
-bool Transfer_connection::make_directory(const std::string type)
-{
-    boost::filesystem::path path(recv_path_);
-    if (!boost::filesystem::exists(path))
+    if (cmd != "RESUME")
     {
-        boost::system::error_code ec;
-        boost::filesystem::create_directory(path, ec);
-        if (ec)
-        {
-            LERROR << ec.message() << " " << path.generic_string();
-            shutdown();
-            return false;
-        }
+        LERROR << "unexpected reply to " << file_info_.key() << ": " << reply;
+        close_send_file();
+        shutdown();
+        return;
     }
 
-    path /= type;
-    if (!boost::filesystem::exists(path))
-    {
-        boost::system::error_code ec;
-        boost::filesystem::create_directory(path, ec);
-        if (ec)
-        {
-            LERROR << ec.message() << " " << path.generic_string();
-            shutdown();
-            return false;
-        }
-    }
+    send_offset_ = ::strtoll(getOption("OFFSET").c_str(), NULL, 10);
 
-    return true;
+    send_body();
 }
 
-std::string Transfer_connection::to_file_path(const FileInfo& info) const
+void Transfer_connection::handle_offer_timeout(const boost::system::error_code& error)
 {
-    return recv_path_ + info.type + "/" + file_info_.key();
+    if (error)
+        return;
+
+    // ends the read of the answer, which then sends the data
+    offer_expired_ = true;
+    boost::system::error_code ignore;
+    socket_.cancel(ignore);
 }
 
-void Transfer_connection::handle_file_sent(const boost::system::error_code& error,
-    size_t bytes_transferred)
+void Transfer_connection::send_body()
 {
-    if (error)
+    // sendfile is driven by write readiness, so the socket must not block
+    boost::system::error_code ec;
+    socket_.non_blocking(true, ec);
+    if (ec)
     {
-        LERROR << "send " << filename_ << ": " << error.message();
+        LERROR << "(" << ec.value() << ")" << ec.message();
+        close_send_file();
+        shutdown();
+        return;
     }
-    LINFO << filename_ << " send completed";
 
-    shutdown();
+    start_zerocopy();
+
+    // an upload listens for the server turning it down while data is in flight
+    if (!transfer_->is_server_)
+        start_send_reply();
+
+    start_shaping();
+    send_file_data();
 }
 
-void Transfer_connection::shutdown()
+void Transfer_connection::send_file_data()
 {
-    boost::system::error_code ignored_ec;
-    socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
-
-    transfer_->remove_task(shared_from_this());
+    sending_ = true;
 
-    LINFO << "connection shutdown: " << file_info_.key();
+    socket_.async_write_some(boost::asio::null_buffers(),
+        make_alloc_handler(send_alloc_,
+            boost::bind(&Transfer_connection::handle_file_data_sent,
+                shared_from_this(),
+                boost::asio::placeholders::error)));
 }
 
-void Transfer_connection::parseOptions(const std::string& str)
+void Transfer_connection::handle_file_data_sent(const boost::system::error_code& error)
 {
-    optios_.clear();
-
-    std::vector<std::string> option;
-    boost::split(option, str, boost::is_any_of(","));
+    if (!source_)
+        return;
 
-    std::vector<std::string>::const_iterator it = option.begin();
-    while (it != option.end())
+    if (error)
     {
-        std::vector<std::string> kv;
-        boost::split(kv, *it, boost::is_any_of("="));
+        LERROR << "send " << filename_ << ": " << error.message();
+        abort_send();
+        return;
+    }
+
+    int sock = socket_.native();
+    if (!zerocopy_.idle() && !zerocopy_.reap(sock))
+    {
+        LERROR << "send " << filename_ << " error(" << errno << ")";
+        abort_send();
+        return;
+    }
+
+    if (zerocopy_on_ && zerocopy_.copied() > 0)
+        stop_zerocopy("the kernel copies anyway");
+
+    while (send_offset_ < send_limit_)
+    {
+        size_t count = std::min<off_t>(send_limit_ - send_offset_, 1 * 1024 * 1024);
+
+        boost::posix_time::time_duration delay;
+        count = transfer_->limiter_.allowance(rate_, remote_host_, priority_, count, throttled_, delay);
+        if (count == 0)
+        {
+            uncork();
+
+            throttle_timer_.expires_from_now(delay);
+            throttle_timer_.async_wait(boost::bind(&Transfer_connection::handle_throttle,
+                shared_from_this(),
+                boost::asio::placeholders::error));
+            return;
+        }
+
+        ssize_t result = source_->send_to(sock, send_offset_, count);
+        if (result == Source::pending)
+        {
+            uncork();
+
+            // a stream ran dry, wait until it has more
+            boost::system::error_code ec;
+            if (!source_wait_.is_open())
+                source_wait_.assign(::dup(source_->wait_fd()), ec);
+
+            source_wait_.async_read_some(boost::asio::null_buffers(),
+                make_alloc_handler(send_alloc_,
+                    boost::bind(&Transfer_connection::handle_file_data_sent,
+                        shared_from_this(),
+                        boost::asio::placeholders::error)));
+            return;
+        }
+        else if (result == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                send_file_data();
+                return;
+            }
+
+            if (errno == ENOBUFS && zerocopy_on_)
+            {
+                // notifications pile up beyond net.core.optmem_max
+                stop_zerocopy("out of option memory");
+                continue;
+            }
+
+            // EPIPE and ECONNRESET too: the peer is gone, SIGPIPE is ignored by the engine
+            boost::system::error_code ec(errno, boost::system::system_category());
+            LERROR << "(" << ec.value() << ")" << ec.message();
+            abort_send();
+            return;
+        }
+        else if (result == 0)
+        {
+            if (file_size_ < 0)
+            {
+                // end of a stream of unknown length
+                file_size_ = send_offset_;
+                break;
+            }
+
+            LERROR << filename_ << " is shorter than " << send_limit_ << " bytes";
+            close_send_file();
+            shutdown();
+            return;
+        }
+
+        send_offset_ += result;
+        transfer_->limiter_.charge(rate_, remote_host_, result);
+        advise_source();
+
+        if (zerocopy_on_)
+            zerocopy_.sent();
+
+        uncork();
+        sample_rate(true, result);
+
+        if (file_size_ > 0)
+        {
+            LINFO << file_info_.key() << " send bytes: " << send_offset_ << " rest: " << file_size_ - send_offset_ << " percentage:" << double(send_offset_) / file_size_;
+        }
+    }
+
+    sending_ = false;
+    uncork();
+
+    if (file_size_ >= 0 && send_offset_ >= file_size_)
+    {
+        LINFO << filename_ << " send completed";
+
+        result_ = TransferResult::OK;
+
+        // the kernel may still read from the source
+        if (!zerocopy_.idle())
+        {
+            wait_zerocopy();
+            return;
+        }
+
+        finish_send();
+    }
+
+    // otherwise we follow a receive in progress and on_data_committed() resumes
+}
+
+void Transfer_connection::finish_send()
+{
+    if (zerocopy_.count() > 0)
+    {
+        LINFO << file_info_.key() << " zero-copy sends: " << zerocopy_.count() << ", copied by the kernel: " << zerocopy_.copied();
+    }
+
+    close_send_file();
+
+    if (ack_ && !acked_)
+    {
+        if (reply_closed_)
+        {
+            LERROR << "send " << filename_ << ": server closed before storing it";
+            result_ = TransferResult::FAILED;
+            shutdown();
+            return;
+        }
+
+        // the end of the data, which is all a stream of unknown length or an empty file has;
+        // handle_send_reply() shuts down on DONE
+        boost::system::error_code ignore;
+        socket_.shutdown(tcp::socket::shutdown_send, ignore);
+
+        awaiting_ack_ = true;
+        return;
+    }
+
+    shutdown();
+}
+
+void Transfer_connection::start_zerocopy()
+{
+    zerocopy_.reset();
+    zerocopy_on_ = false;
+
+    size_t threshold = transfer_->zerocopy_threshold();
+    if (threshold == 0 || file_size_ < 0 || static_cast<size_t>(file_size_) < threshold)
+        return;
+
+    if (!source_->set_zerocopy(true))
+        return;
+
+    if (!Zerocopy::enable(socket_.native()))
+    {
+        // kernels before 4.14
+        source_->set_zerocopy(false);
+        return;
+    }
+
+    zerocopy_on_ = true;
+}
+
+void Transfer_connection::stop_zerocopy(const char* why)
+{
+    LINFO << file_info_.key() << " stop zero-copy, " << why;
+
+    source_->set_zerocopy(false);
+    zerocopy_on_ = false;
+}
+
+void Transfer_connection::wait_zerocopy()
+{
+    boost::system::error_code ec;
+    if (!zerocopy_wait_.is_open())
+        zerocopy_wait_.assign(::dup(socket_.native()), ec);
+
+    if (ec)
+    {
+        LERROR << "(" << ec.value() << ")" << ec.message();
+        abort_send();
+        return;
+    }
+
+    // the error queue wakes readers of the socket
+    zerocopy_wait_.async_read_some(boost::asio::null_buffers(),
+        make_alloc_handler(send_alloc_,
+            boost::bind(&Transfer_connection::handle_zerocopy,
+                shared_from_this(),
+                boost::asio::placeholders::error)));
+}
+
+void Transfer_connection::handle_zerocopy(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || !source_)
+        return;
+
+    if (error || !zerocopy_.reap(socket_.native()))
+    {
+        LERROR << "send " << filename_ << ": zero-copy completion error(" << errno << ")";
+        abort_send();
+        return;
+    }
+
+    if (!zerocopy_.idle())
+    {
+        wait_zerocopy();
+        return;
+    }
+
+    finish_send();
+}
+
+void Transfer_connection::start_shaping()
+{
+    boost::system::error_code ec;
+    tcp::endpoint remote = socket_.remote_endpoint(ec);
+    remote_host_ = ec ? std::string() : remote.address().to_string();
+
+    priority_ = transfer_->limiter_.priority(file_info_.type);
+}
+
+// Keeps the read-ahead a window in front of the send, and an archive file out of the page
+// cache behind it.
+void Transfer_connection::advise_source()
+{
+    const off_t window = Page_cache_policy::readahead_window;
+
+    if (send_offset_ + window / 2 >= prefetched_ && prefetched_ < send_limit_)
+    {
+        source_->prefetch(prefetched_, window);
+        prefetched_ += window;
+    }
+
+    // pages still queued in the socket cannot be dropped, so this stays two windows behind
+    if (cache_policy_ == Page_cache_policy::ARCHIVE && send_offset_ - released_ >= 3 * window)
+    {
+        source_->release(released_, window);
+        released_ += window;
+    }
+}
+
+void Transfer_connection::handle_throttle(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || !source_)
+        return;
+
+    handle_file_data_sent(boost::system::error_code());
+}
+
+void Transfer_connection::abort_send()
+{
+    if (!replica_host_.empty())
+    {
+        retry_replica();
+        return;
+    }
+
+    close_send_file();
+    shutdown();
+}
+
+void Transfer_connection::close_send_file()
+{
+    transfer_->limiter_.cancel(priority_, throttled_);
+
+    boost::system::error_code ignore;
+    source_wait_.close(ignore);
+    zerocopy_wait_.close(ignore);
+
+    source_.reset();
+}
+
+bool Transfer_connection::add_reader(pointer reader)
+{
+    if (!sink_ || sink_->path().empty() || file_size_ <= 0)
+        return false;
+
+    boost::int64_t committed = watch_sink();
+    if (committed < 0)
+        return false;
+
+    readers_.push_back(reader);
+
+    post_to(reader, boost::bind(&Transfer_connection::start_follow, reader, to_file_path(file_info_), file_size_, committed));
+
+    return true;
+}
+
+void Transfer_connection::attach_reader(pointer reader)
+{
+    // the receive may have ended while the message was on its way
+    if (transfer_->get_task_connection(file_info_) == shared_from_this() && add_reader(reader))
+    {
+        LINFO << "reply file " << file_info_.key() << " while receiving on shard " << shard_->index();
+        return;
+    }
+
+    // without following again, or the two could keep passing the reader back and forth
+    post_to(reader, boost::bind(&Transfer_connection::start_reply, reader, false));
+}
+
+void Transfer_connection::replicate_to(const std::string& host, const std::string& port)
+{
+    if (!sink_ || sink_->path().empty() || file_size_ <= 0)
+        return;
+
+    boost::int64_t committed = watch_sink();
+    if (committed < 0)
+        return;
+
+    pointer link = shard_->make_connection(transfer_, recv_path_);
+    link->file_info_ = file_info_;
+
+    readers_.push_back(link);
+
+    link->start_replicate(host, port, to_file_path(file_info_), file_size_, committed);
+}
+
+void Transfer_connection::start_replicate(const std::string& host, const std::string& port, const std::string& file_path, boost::int64_t file_size, boost::int64_t committed)
+{
+    LINFO << "replicate " << file_info_.key() << " to " << host << ":" << port;
+
+    replica_host_ = host;
+    replica_port_ = port;
+    filename_ = file_path;
+    file_size_ = file_size;
+    send_limit_ = committed;
+
+    source_ = Fd_source::open(filename_);
+    if (!source_)
+    {
+        LERROR << "open file " << filename_ << " error(" << errno << ")";
+        shutdown();
+        return;
+    }
+
+    connect_replica();
+}
+
+void Transfer_connection::connect_replica()
+{
+    // on_data_committed() must not start sendfile before the peer told us where to resume
+    sending_ = true;
+
+    // a name lookup can take seconds, the other connections on this io thread go on meanwhile
+    boost::shared_ptr<tcp::resolver> resolver(new tcp::resolver(socket_.get_io_service()));
+    resolver->async_resolve(tcp::resolver::query(replica_host_, replica_port_),
+        boost::bind(&Transfer_connection::handle_replica_resolve,
+            shared_from_this(),
+            resolver,
+            boost::asio::placeholders::error,
+            boost::asio::placeholders::iterator));
+}
+
+void Transfer_connection::handle_replica_resolve(const boost::shared_ptr<tcp::resolver>&,
+    const boost::system::error_code& error, tcp::resolver::iterator iterator)
+{
+    if (error)
+    {
+        LERROR << "resolve replica " << replica_host_ << ":" << replica_port_ << ": " << error.message();
+        retry_replica();
+        return;
+    }
+
+    boost::asio::async_connect(socket_, iterator,
+        make_alloc_handler(send_alloc_,
+            boost::bind(&Transfer_connection::handle_replica_connect,
+                shared_from_this(),
+                boost::asio::placeholders::error)));
+}
+
+void Transfer_connection::handle_replica_connect(const boost::system::error_code& error)
+{
+    if (error)
+    {
+        LERROR << "connect replica " << replica_host_ << ":" << replica_port_ << ": " << error.message();
+        retry_replica();
+        return;
+    }
+
+    tune_socket();
+
+    boost::system::error_code ec;
+    send_action(make_send_action(file_info_, file_size_, replica_retries_ > 0 ? 1 : 0), ec);
+    if (ec)
+    {
+        LERROR << ec.message();
+        retry_replica();
+        return;
+    }
+
+    boost::asio::async_read_until(socket_,
+        buffer_,
+        ';',
+        make_alloc_handler(recv_alloc_,
+            boost::bind(&Transfer_connection::handle_replica_resume,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred)));
+}
+
+void Transfer_connection::handle_replica_resume(const boost::system::error_code& error, size_t bytes_transferred)
+{
+    if (error)
+    {
+        LERROR << "replica " << replica_host_ << ":" << replica_port_ << ": " << error.message();
+        retry_replica();
+        return;
+    }
+
+    boost::asio::streambuf::const_buffers_type data = buffer_.data();
+    std::string reply(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
+    buffer_.consume(bytes_transferred);
+
+    parseOptions(reply);
+    if (getOption("CMD") != "RESUME")
+    {
+        LERROR << "unexpected reply from replica: " << reply;
+        close_send_file();
+        shutdown();
+        return;
+    }
+
+    send_offset_ = ::strtoll(getOption("OFFSET").c_str(), NULL, 10);
+    LINFO << "replica " << replica_host_ << ":" << replica_port_ << " resume " << file_info_.key() << " at " << send_offset_;
+
+    start_shaping();
+
+    boost::system::error_code ec;
+    socket_.non_blocking(true, ec);
+    if (ec)
+    {
+        LERROR << "(" << ec.value() << ")" << ec.message();
+        retry_replica();
+        return;
+    }
+
+    send_file_data();
+}
+
+void Transfer_connection::retry_replica()
+{
+    if (!source_)
+        return;
+
+    if (++replica_retries_ > max_replica_retries)
+    {
+        LERROR << "give up replicating " << file_info_.key() << " to " << replica_host_ << ":" << replica_port_;
+        close_send_file();
+        shutdown();
+        return;
+    }
+
+    boost::system::error_code ignore;
+    socket_.close(ignore);
+    buffer_.consume(buffer_.size());
+    sending_ = true;
+    transfer_->limiter_.cancel(priority_, throttled_);
+
+    int backoff = std::min(1 << replica_retries_, 30);
+    LWARNING << "retry replica " << replica_host_ << ":" << replica_port_ << " in " << backoff << "s";
+
+    retry_timer_.expires_from_now(boost::posix_time::seconds(backoff));
+    retry_timer_.async_wait(boost::bind(&Transfer_connection::handle_replica_retry,
+        shared_from_this(),
+        boost::asio::placeholders::error));
+}
+
+void Transfer_connection::handle_replica_retry(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || !source_)
+        return;
+
+    connect_replica();
+}
+
+// A complete receive is all in the file, the readers send the rest of it.
+void Transfer_connection::release_readers(bool aborted)
+{
+    std::vector<pointer> readers;
+    readers.swap(readers_);
+
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        if (aborted)
+            post_to(readers[i], boost::bind(&Transfer_connection::on_source_aborted, readers[i]));
+        else
+            post_to(readers[i], boost::bind(&Transfer_connection::on_data_committed, readers[i], recv_count_));
+    }
+}
+
+// the sink holds on to the handler, which must not keep the connection
+boost::int64_t Transfer_connection::watch_sink()
+{
+    boost::weak_ptr<Transfer_connection> conn(shared_from_this());
+    return sink_->watch(boost::bind(&Transfer_connection::handle_committed, conn, _1));
+}
+
+// from the thread the sink wrote on
+void Transfer_connection::handle_committed(const boost::weak_ptr<Transfer_connection>& conn, boost::int64_t committed)
+{
+    pointer self = conn.lock();
+    if (self)
+        self->shard_->io_service().post(boost::bind(&Transfer_connection::notify_readers, self, committed));
+}
+
+void Transfer_connection::notify_readers(boost::int64_t committed)
+{
+    for (size_t i = 0; i < readers_.size(); ++i)
+        post_to(readers_[i], boost::bind(&Transfer_connection::on_data_committed, readers_[i], committed));
+}
+#endif
+
+template <typename Handler>
+void Transfer_connection::post_to(const pointer& conn, Handler handler)
+{
+    if (conn->shard_ == shard_)
+    {
+        handler();
+        return;
+    }
+
+    conn->shard_->io_service().post(handler);
+}
+
+Transfer_connection::Transfer_connection(Transfer* transfer, Transfer_shard* shard, const std::string& recv_path)
+    : transfer_(transfer),
+    shard_(shard),
+    socket_(shard->io_service()),
+    filename_(),
+#if defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
+    file_(shard->io_service()),
+#endif // DEBUG
+    file_size_(0),
+    recv_count_(0),
+#ifdef __linux__
+    source_(),
+    source_wait_(shard->io_service()),
+    zerocopy_(),
+    zerocopy_on_(false),
+    zerocopy_wait_(shard->io_service()),
+    send_offset_(0),
+    send_limit_(0),
+    sending_(false),
+    replica_retries_(0),
+    retry_timer_(shard->io_service()),
+    priority_(Rate_limiter::NORMAL),
+    throttled_(false),
+    throttle_timer_(shard->io_service()),
+    cache_policy_(Page_cache_policy::NORMAL),
+    prefetched_(0),
+    released_(0),
+#endif
+    recv_path_(recv_path),
+    wait_until_(),
+    wait_timer_(shard->io_service()),
+    admitted_(false),
+    receive_admitted_(false),
+    receive_bytes_(0),
+    ack_(false),
+    acked_(false),
+    awaiting_ack_(false),
+    reply_closed_(false),
+    completion_(),
+    result_(TransferResult::FAILED),
+    retry_after_ms_(0),
+    content_hash_(),
+    offer_expired_(false),
+    content_sha_(),
+    deduplicated_(false),
+    chunks_(),
+    missing_(),
+    dedup_bytes_(0),
+    tuning_(),
+    corked_(false),
+    sample_start_(),
+    sample_bytes_(0),
+    recv_slab_(NULL)
+{
+}
+
+Transfer_connection::~Transfer_connection()
+{
+    // a connection dropped on an error path that never reached shutdown()
+    complete();
+    release_recv_slab();
+}
+
+void Transfer_connection::recycle()
+{
+    complete();
+    release_recv_slab();
+
+    boost::system::error_code ignore;
+    socket_.close(ignore);
+
+    filename_.clear();
+#if defined(BOOST_ASIO_HAS_WINDOWS_OVERLAPPED_PTR)
+    file_.close(ignore);
+#endif
+    action_.clear();
+    optios_.clear();
+    file_info_ = FileInfo();
+    file_size_ = 0;
+    recv_count_ = 0;
+#ifdef __linux__
+    source_.reset();
+    source_wait_.close(ignore);
+    zerocopy_.reset();
+    zerocopy_on_ = false;
+    zerocopy_wait_.close(ignore);
+    send_offset_ = 0;
+    send_limit_ = 0;
+    sending_ = false;
+    readers_.clear();
+
+    replica_host_.clear();
+    replica_port_.clear();
+    replica_retries_ = 0;
+    retry_timer_.cancel(ignore);
+
+    rate_ = Token_bucket();
+    remote_host_.clear();
+    priority_ = Rate_limiter::NORMAL;
+    throttled_ = false;
+    throttle_timer_.cancel(ignore);
+
+    cache_policy_ = Page_cache_policy::NORMAL;
+    prefetched_ = 0;
+    released_ = 0;
+#endif
+    wait_until_ = boost::posix_time::ptime();
+    wait_timer_.cancel(ignore);
+
+    admitted_ = false;
+    receive_admitted_ = false;
+    receive_bytes_ = 0;
+
+    ack_ = false;
+    acked_ = false;
+    awaiting_ack_ = false;
+    reply_closed_ = false;
+
+    buffer_.consume(buffer_.size());
+    sink_.reset();
+
+    result_ = TransferResult::FAILED;
+    retry_after_ms_ = 0;
+    crc_.reset();
+
+    content_hash_.clear();
+    offer_expired_ = false;
+    content_sha_.reset();
+    deduplicated_ = false;
+    chunks_.clear();
+    missing_.clear();
+    dedup_bytes_ = 0;
+
+    tuning_ = SocketTuning();
+    corked_ = false;
+    sample_bytes_ = 0;
+
+    transfer_ = NULL;
+}
+
+std::string Transfer_connection::make_query_action() const
+{
+    std::stringstream os;
+    os << "CMD=QUERY,";
+    os << file_info_.to_string();
+    if (!wait_until_.is_not_a_date_time())
+    {
+        boost::posix_time::time_duration left = wait_until_ - boost::posix_time::microsec_clock::universal_time();
+        if (left.total_milliseconds() > 0)
+            os << "WAIT=" << left.total_milliseconds() << ",";
+    }
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_reply_action(const std::string& info, int status) const
+{
+    std::stringstream os;
+    os << "CMD=REPLY,";
+    os << "INFO=" << info <<",";
+    os << "STATUS=" << status << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_resume_action(boost::int64_t offset) const
+{
+    std::stringstream os;
+    os << "CMD=RESUME,";
+    os << file_info_.to_string();
+    os << "SIZE=" << file_size_ << ",";
+    os << "OFFSET=" << offset << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_busy_action(int retry_after_ms) const
+{
+    std::stringstream os;
+    os << "CMD=BUSY,";
+    os << file_info_.to_string();
+    os << "RETRY=" << retry_after_ms << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_have_action() const
+{
+    std::stringstream os;
+    os << "CMD=HAVE,";
+    os << file_info_.to_string();
+    os << "SIZE=" << file_size_ << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_need_action() const
+{
+    std::stringstream os;
+    os << "CMD=NEED,";
+    os << file_info_.to_string();
+    os << "SIZE=" << file_size_ << ",";
+    os << "MISSING=" << Chunker::to_bitmap(missing_) << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_done_action() const
+{
+    std::stringstream os;
+    os << "CMD=DONE,";
+    os << file_info_.to_string();
+    os << "SIZE=" << file_size_ << ",";
+    os << ";";
+
+    return os.str();
+}
+
+std::string Transfer_connection::make_send_action(const FileInfo& file_info, boost::int64_t size, int resume) const
+{
+    std::stringstream os;
+    os << "CMD=SEND,";
+    os << file_info.to_string();
+    os << "SIZE=" << size << ",";
+    if (resume >= 0)
+        os << "RESUME=" << resume << ",";
+    if (ack_)
+        os << "ACK=1,";
+    if (!content_hash_.empty())
+        os << "HASH=" << content_hash_ << ",";
+    if (!chunks_.empty())
+        os << "CHUNKS=" << Chunker::format(chunks_) << ",";
+    os << ";";
+
+    return os.str();
+}
+
+void Transfer_connection::send_action(const std::string& info, boost::system::error_code& ec)
+{
+    LINFO << "send: " << loggable(info);
+
+    boost::asio::write(socket_,
+        boost::asio::buffer(info),
+        boost::asio::transfer_exactly(info.size()),
+        ec);
+}
+
+void Transfer_connection::handle_action(const boost::system::error_code& error,
+    size_t bytes_transferred)
+{
+    if (error)
+    {
+        LERROR << error.message();
+        shutdown();
+        return;
+    }
+
+    boost::asio::streambuf::const_buffers_type data = buffer_.data();
+    action_ = std::string(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
+    buffer_.consume(bytes_transferred);
+
+    LINFO << "handle action: " << loggable(action_);
+
+    parseOptions(action_);
+
+    const std::string cmd = getOption("CMD");
+
+    if (transfer_->is_server_ && (cmd == "SEND" || cmd == "QUERY") && !file_info_.valid())
+    {
+        LWARNING << "invalid file info, reject: " << loggable(action_);
+        shutdown();
+        return;
+    }
+
+    if (cmd == "SEND")
+    {
+        if (transfer_->is_server_)
+        {
+            ack_ = getOption("ACK") == "1";
+
+            // a stream counts what it has received so far, see write_recv_data()
+            receive_bytes_ = static_cast<size_t>(std::max<boost::int64_t>(file_size_, 0));
+            int retry_after = transfer_->admit_receive(receive_bytes_);
+            if (retry_after > 0)
+            {
+                LWARNING << "too many receives, reject " << file_info_.key();
+                reject_busy(retry_after);
+                return;
+            }
+
+            receive_admitted_ = true;
+        }
+
+        transfer_->add_task(shared_from_this(), Transfer::RECV);
+
+        if (link_offered_content())
+            return;
+
+        // the data is received once the chunks the store lacks are known
+        if (plan_chunks())
+            return;
+
+        start_recv_data();
+    }
+    else if (cmd == "QUERY")
+    {
+        std::string wait = getOption("WAIT");
+        if (!wait.empty())
+        {
+            long wait_ms = std::min<long>(std::atol(wait.c_str()), max_wait_ms);
+            wait_until_ = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(wait_ms);
+        }
+
+        start_reply();
+    }
+    else if (cmd == "REPLY")
+    {
+        std::string result = getOption("RESULT");
+
+        result_ = TransferResult::NOT_FOUND;
+        shutdown();
+    }
+    else if (cmd == "BUSY")
+    {
+        LWARNING << "server busy, retry " << file_info_.key() << " after " << getOption("RETRY") << "ms";
+
+        result_ = TransferResult::BUSY;
+        retry_after_ms_ = std::atoi(getOption("RETRY").c_str());
+        shutdown();
+    }
+}
+
+void Transfer_connection::reject_busy(int retry_after_ms)
+{
+    boost::system::error_code ignore;
+    send_action(make_busy_action(retry_after_ms), ignore);
+
+    // Closing with the client's data unread resets the connection, and a client still sending
+    // sees the reset instead of BUSY. Its data is thrown away until it closes after reading BUSY.
+    socket_.shutdown(tcp::socket::shutdown_send, ignore);
+
+    wait_timer_.expires_from_now(boost::posix_time::milliseconds(static_cast<long>(reject_linger_ms)));
+    wait_timer_.async_wait(boost::bind(&Transfer_connection::handle_reject_timeout,
+        shared_from_this(),
+        boost::asio::placeholders::error));
+
+    drain_rejected();
+}
+
+void Transfer_connection::drain_rejected()
+{
+    buffer_.consume(buffer_.size());
+
+    boost::asio::async_read(socket_,
+        buffer_,
+        boost::asio::transfer_at_least(1),
+        boost::bind(&Transfer_connection::handle_rejected_data,
+            shared_from_this(),
+            boost::asio::placeholders::error));
+}
+
+void Transfer_connection::handle_rejected_data(const boost::system::error_code& error)
+{
+    if (!error)
+    {
+        drain_rejected();
+        return;
+    }
+
+    boost::system::error_code ignore;
+    wait_timer_.cancel(ignore);
+
+    shutdown();
+}
+
+void Transfer_connection::handle_reject_timeout(const boost::system::error_code& error)
+{
+    if (error)
+        return;
+
+    // ends the drain, which then closes
+    boost::system::error_code ignore;
+    socket_.cancel(ignore);
+}
+
+void Transfer_connection::start_send_reply()
+{
+    boost::asio::async_read_until(socket_,
+        buffer_,
+        ';',
+        make_alloc_handler(recv_alloc_,
+            boost::bind(&Transfer_connection::handle_send_reply,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred)));
+}
+
+void Transfer_connection::handle_send_reply(const boost::system::error_code& error, size_t bytes_transferred)
+{
+    if (error)
+    {
+        reply_closed_ = true;
+
+        // and without DONE the file may not be stored
+        if (awaiting_ack_)
+        {
+            LERROR << "send " << filename_ << ": server closed before storing it";
+            awaiting_ack_ = false;
+            result_ = TransferResult::FAILED;
+            shutdown();
+        }
+        return;
+    }
+
+    boost::asio::streambuf::const_buffers_type data = buffer_.data();
+    std::string reply(boost::asio::buffer_cast<const char*>(data), bytes_transferred);
+    buffer_.consume(bytes_transferred);
+
+    parseOptions(reply);
+
+    if (getOption("CMD") == "BUSY")
+    {
+        LWARNING << "server busy, retry " << file_info_.key() << " after " << getOption("RETRY") << "ms";
+
+        result_ = TransferResult::BUSY;
+        retry_after_ms_ = std::atoi(getOption("RETRY").c_str());
+#ifdef __linux__
+        close_send_file();
+#endif
+        shutdown();
+        return;
+    }
+
+    if (getOption("CMD") == "DONE")
+    {
+        LINFO << "server stored " << file_info_.key();
+
+        acked_ = true;
+        if (awaiting_ack_)
+        {
+            awaiting_ack_ = false;
+            shutdown();
+        }
+        return;
+    }
+
+    start_send_reply();
+}
+
+bool Transfer_connection::open_recv_file()
+{
+    const std::string resume = getOption("RESUME");
+
+    // a query download may bring its own sink, everything else lands in recv_path_
+    if (!sink_)
+    {
+        std::string type = getOption("TYPE");
+
+        Storage_layout::DirectoryPtr dir = make_directory();
+        if (!dir)
+            return false;
+
+        std::string file = to_file_path(file_info_);
+
+#ifdef __linux__
+        // a small file goes into a segment, unless replicas follow it as it is written
+        if (chunks_.empty() && resume.empty() && getOption("HASH").empty()
+            && transfer_->segments().packs(file_size_) && transfer_->replicas().empty())
+        {
+            // the segment holds the key from now on, not a file stored before
+            transfer_->layout().remove(file_info_);
+            sink_.reset(new Segment_sink(transfer_->segments(), file_info_.key(), transfer_->store_queue()));
+        }
+        else {
+            transfer_->segments().erase(file_info_.key());
+        }
+#endif
+
+        // a key linked to a blob gets a file of its own instead of overwriting the blob
+        if (!sink_ && Blob_store::unshare(*dir, file))
+        {
+            LINFO << file_info_.key() << " no longer shares its content";
+        }
+
+        if (!sink_ && !chunks_.empty())
+        {
+            sink_.reset(new Chunk_sink(file, chunks_, missing_, transfer_->chunk_store(), content_sha_,
+                transfer_->store_queue()));
+        }
+
+        // a replica link that reconnects continues its own partial upload
+        bool append = false;
+        if (!sink_ && resume == "1")
+        {
+            boost::system::error_code ec;
+            boost::uintmax_t size = boost::filesystem::file_size(file, ec);
+            if (!ec && size <= static_cast<boost::uintmax_t>(file_size_))
+            {
+                append = true;
+                recv_count_ = static_cast<boost::int64_t>(size);
+            }
+        }
+
+        if (!sink_)
+            sink_.reset(new File_sink(file, append, transfer_->page_cache().policy(type) == Page_cache_policy::ARCHIVE, dir));
+    }
+
+    if (!sink_->open(file_size_))
+    {
+        LERROR << "open file fail: " << sink_->name();
+        sink_.reset();
+        shutdown();
+        return false;
+    }
+
+    LINFO << "recv " << sink_->name() << " from offset " << recv_count_;
+
+    // an offered hash the server has no blob for is answered the same way, chunks with NEED
+    if (!chunks_.empty())
+    {
+        boost::system::error_code ec;
+        send_action(make_need_action(), ec);
+        if (ec)
+        {
+            LERROR << ec.message();
+            shutdown();
+            return false;
+        }
+    }
+    else if (!resume.empty() || !getOption("HASH").empty())
+    {
+        boost::system::error_code ec;
+        send_action(make_resume_action(recv_count_), ec);
+        if (ec)
+        {
+            LERROR << ec.message();
+            shutdown();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Transfer_connection::start_recv_file()
+{
+    if (recv_slab_)
+    {
+        read_recv_data();
+        return;
+    }
+
+    socket_.async_read_some(boost::asio::null_buffers(),
+        make_alloc_handler(recv_alloc_,
+            boost::bind(&Transfer_connection::handle_recv_ready,
+                shared_from_this(),
+                boost::asio::placeholders::error)));
+}
+
+void Transfer_connection::handle_recv_ready(const boost::system::error_code& error)
+{
+    if (error)
+    {
+        handle_file_data_recv(error, 0);
+        return;
+    }
+
+    // over the memory budget: no read until another receive gives a slab back
+    recv_slab_ = shard_->arena().acquire(boost::bind(&Transfer_connection::resume_recv, shared_from_this()));
+    if (!recv_slab_)
+        return;
+
+    read_recv_data();
+}
+
+void Transfer_connection::read_recv_data()
+{
+    socket_.async_read_some(boost::asio::buffer(recv_slab_->data, recv_slab_->size),
+        make_alloc_handler(recv_alloc_,
+            boost::bind(&Transfer_connection::handle_file_data_recv,
+                shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred)));
+}
+
+void Transfer_connection::handle_file_data_recv(const boost::system::error_code& error,
+    size_t bytes_transferred)
+{
+    if (!error)
+    {
+        if (bytes_transferred == 0)
+        {
+            LINFO << "recv completed, " << file_info_.key();
+
+            finish_recv();
+            return;
+        }
+
+        if (!write_recv_data(recv_slab_->data, bytes_transferred))
+            return;
+
+        sample_rate(false, bytes_transferred);
+
+        if (file_size_ > 0 && recv_count_ >= file_size_)
+        {
+            LINFO << "recv completed " << file_info_.key();
+
+            finish_recv();
+            return;
+        }
+
+        // the consumer of a callback sink may want a break, the slab is of no use meanwhile
+        if (!sink_->ready(boost::bind(&Transfer_connection::resume_recv, shared_from_this())))
+        {
+            release_recv_slab();
+            return;
+        }
+
+        // the sender paused with the socket emptied, the slab is of no use until it goes on
+        boost::system::error_code ec;
+        if (bytes_transferred < recv_slab_->size && socket_.available(ec) == 0)
+            release_recv_slab();
+
+        start_recv_file();
+    }
+    else
+    {
+        // a stream of unknown length ends with the connection
+        if (recv_count_ == file_size_ || (file_size_ < 0 && error == boost::asio::error::eof))
+        {
+            LINFO << "recv completed " << file_info_.key();
+
+            finish_recv();
+            return;
+        }
+
+        LERROR << "recv file data: " << error.message();
+        abort_recv();
+    }
+}
+
+// Hands received bytes to the sink; aborts the receive and returns false on failure.
+bool Transfer_connection::write_recv_data(const char* bytes, size_t size)
+{
+    bool written = sink_->write(bytes, size);
+    if (completion_)
+        crc_.process_bytes(bytes, size);
+    // a chunked receive hashes the file as it assembles it
+    if (!content_hash_.empty() && chunks_.empty())
+        content_sha_.update(bytes, size);
+
+    if (!written)
+    {
+        LERROR << "write " << sink_->name() << " fail, " << file_info_.key();
+        abort_recv();
+        return false;
+    }
+
+    boost::int64_t M = recv_count_ / (1 * 1024 * 1024);
+    recv_count_ += size;
+
+    if ((recv_count_ / (1 * 1024 * 1024)) > M)
+    {
+        LINFO << file_info_.key() << " recieve bytes: " << recv_count_ << " rest: " << file_size_ - recv_count_ << " percentage:" << double(recv_count_) / file_size_;
+
+        // a stream of unknown length is counted in flight as it grows, a megabyte ahead
+        if (receive_admitted_ && recv_count_ > static_cast<boost::int64_t>(receive_bytes_))
+        {
+            size_t grown = static_cast<size_t>((recv_count_ / (1 * 1024 * 1024) + 1) * (1 * 1024 * 1024));
+            transfer_->resize_receive(receive_bytes_, grown);
+            receive_bytes_ = grown;
+        }
+    }
+
+    return true;
+}
+
+void Transfer_connection::abort_recv()
+{
+#ifdef __linux__
+    release_readers(true);
+#endif
+    if (sink_)
+    {
+        // after the writes still queued
+        Io_queuePtr queue = sink_->close_queue();
+        if (queue)
+            queue->post(boost::bind(&Sink::close, sink_, false));
+        else
+            sink_->close(false);
+    }
+
+    release_recv_slab();
+
+    shutdown();
+}
+
+void Transfer_connection::release_recv_slab()
+{
+    Buffer_arena::Slab* slab = recv_slab_;
+    recv_slab_ = NULL;
+
+    shard_->arena().release(slab);
+}
+
+void Transfer_connection::resume_recv()
+{
+    // the consumer may resume from any thread
+    socket_.get_io_service().post(boost::bind(&Transfer_connection::start_recv_file, shared_from_this()));
+}
+
+void Transfer_connection::finish_recv()
+{
+    release_recv_slab();
+
+    Io_queuePtr queue = sink_->close_queue();
+    if (queue)
+    {
+        queue->post(boost::bind(&Transfer_connection::close_queued, shared_from_this()));
+        return;
+    }
+
+    handle_closed(sink_->close(true));
+}
+
+// on the sink's queue, nothing reads from the socket meanwhile
+void Transfer_connection::close_queued()
+{
+    bool stored = sink_->close(true);
+
+    socket_.get_io_service().post(boost::bind(&Transfer_connection::handle_closed, shared_from_this(), stored));
+}
+
+void Transfer_connection::handle_closed(bool stored)
+{
+    if (!stored)
+    {
+        // neither reported OK nor acknowledged, the sender fails
+        LERROR << "store " << sink_->name() << " fail, " << file_info_.key();
+        abort_recv();
+        return;
+    }
+
+    result_ = TransferResult::OK;
+    if (!content_hash_.empty())
+        index_content();
+#ifdef __linux__
+    release_readers(false);
+#endif
+
+    commit_stored(ack_ ? make_done_action() : std::string());
+}
+
+void Transfer_connection::commit_stored(const std::string& action)
+{
+#ifdef __linux__
+    if (transfer_->is_server_ && transfer_->durability().mode() != Durability::NONE)
+    {
+        // a key linked to a blob has no sink
+        Durability::Sync sync;
+        if (sink_)
+            sync = boost::bind(&Sink::sync, sink_);
+        else
+            sync = boost::bind(&sync_file, to_file_path(file_info_));
+
+        transfer_->durability().commit(sync, boost::bind(&Transfer_connection::handle_durable, shared_from_this(), action, _1));
+        return;
+    }
+#endif
+
+    acknowledge(action, true);
+}
+
+void Transfer_connection::handle_durable(const std::string& action, bool durable)
+{
+    // on the durability thread
+    socket_.get_io_service().post(boost::bind(&Transfer_connection::acknowledge, shared_from_this(), action, durable));
+}
+
+void Transfer_connection::acknowledge(const std::string& action, bool durable)
+{
+    if (!durable)
+    {
+        // the sender hears nothing and fails
+        LERROR << "commit " << file_info_.key() << " fail";
+        result_ = TransferResult::FAILED;
+    }
+    else if (!action.empty())
+    {
+        boost::system::error_code ec;
+        send_action(action, ec);
+        if (ec)
+        {
+            LERROR << ec.message();
+        }
+    }
+
+    // the task must be gone before the waiters look it up again
+    shutdown();
+
+    transfer_->notify_waiters(file_info_);
+}
+
+// Answers HAVE to an offered hash the server has a blob for, mapping the key to it without any
+// data. Returns true if the receive is over.
+bool Transfer_connection::link_offered_content()
+{
+    if (!transfer_->is_server_ || sink_)
+        return false;
+
+    const std::string hash = getOption("HASH");
+    if (hash.empty())
+        return false;
+
+    if (!Sha256::is_hex(hash))
+    {
+        LWARNING << "invalid content hash for " << file_info_.key() << ": " << hash;
+        return false;
+    }
+
+    content_hash_ = hash;
+    content_sha_.reset();
+
+    // replicas follow the data of a receive, and a linked file has none for them
+    if (!transfer_->replicas().empty())
+        return false;
+
+    if (!make_directory())
+        return true;
+
+    if (!transfer_->blobs().link(content_hash_, to_file_path(file_info_)))
+        return false;
+
+#ifdef __linux__
+    transfer_->segments().erase(file_info_.key());
+#endif
+
+    LINFO << "have " << file_info_.key() << " as blob " << content_hash_ << ", refs " << transfer_->blobs().refs(content_hash_);
+
+    result_ = TransferResult::OK;
+    commit_stored(make_have_action());
+    return true;
+}
+
+// A chunked upload receives just the chunks not in the store, which open_recv_file() asks for
+// with NEED; file_size_ is their length from here on.
+void Transfer_connection::start_recv_data()
+{
+    // opened up front so a QUERY arriving before the first data can already follow it
+    if (!open_recv_file())
+        return;
+
+    if (!chunks_.empty() && file_size_ == 0)
+    {
+        LINFO << "recv completed " << file_info_.key() << " from stored chunks";
+
+        finish_recv();
+        return;
+    }
+
+    if (file_size_ > 0 && recv_count_ >= file_size_)
+    {
+        LINFO << "recv completed " << file_info_.key();
+
+        finish_recv();
+        return;
+    }
+
+#ifdef __linux__
+    if (transfer_->is_server_)
+    {
+        std::vector<Transfer::Peer> replicas = transfer_->replicas();
+        for (size_t i = 0; i < replicas.size(); ++i)
+            replicate_to(replicas[i].first, replicas[i].second);
+    }
+#endif
+
+    // a short file arrives together with the action, and its sender may be gone before the next read
+    if (buffer_.size() > 0)
+    {
+        boost::asio::streambuf::const_buffers_type data = buffer_.data();
+        size_t size = buffer_.size();
+        bool written = write_recv_data(boost::asio::buffer_cast<const char*>(data), size);
+
+        buffer_.consume(size);
+        if (!written)
+            return;
+
+        if (file_size_ > 0 && recv_count_ >= file_size_)
+        {
+            LINFO << "recv completed " << file_info_.key();
+
+            finish_recv();
+            return;
+        }
+    }
+
+    start_recv_file();
+}
+
+// True if the chunk list is looked up in the store, handle_missing_chunks() continues then.
+bool Transfer_connection::plan_chunks()
+{
+    const std::string list = getOption("CHUNKS");
+    if (!transfer_->is_server_ || sink_ || list.empty() || content_hash_.empty())
+        return false;
+
+    // replicas follow the file as it is written, an assembled one is written all at the end
+    if (!transfer_->replicas().empty())
+        return false;
+
+    if (!Chunker::parse(list, file_size_, chunks_))
+    {
+        LWARNING << "invalid chunk list for " << file_info_.key() << ", receive it whole";
+        chunks_.clear();
+        return false;
+    }
+
+    // a stat per chunk, thousands for a large file
+    transfer_->store_queue()->post(boost::bind(&Transfer_connection::find_missing_chunks, shared_from_this()));
+    return true;
+}
+
+// on the store queue
+void Transfer_connection::find_missing_chunks()
+{
+    boost::int64_t needed = transfer_->chunk_store().missing(chunks_, missing_);
+
+    socket_.get_io_service().post(boost::bind(&Transfer_connection::handle_missing_chunks, shared_from_this(), needed));
+}
+
+void Transfer_connection::handle_missing_chunks(boost::int64_t needed)
+{
+    boost::int64_t total = file_size_;
+
+    // admitted with the whole size
+    if (receive_admitted_)
+    {
+        transfer_->resize_receive(receive_bytes_, static_cast<size_t>(needed));
+        receive_bytes_ = static_cast<size_t>(needed);
+    }
+    file_size_ = needed;
+    dedup_bytes_ = total - needed;
+
+    LINFO << file_info_.key() << " lacks " << needed << " of " << total << " bytes in "
+        << std::count(missing_.begin(), missing_.end(), true) << " of " << chunks_.size() << " chunks, dedup ratio "
+        << (total > 0 ? double(dedup_bytes_) / total : 0);
+
+    start_recv_data();
+}
+
+// A receive that came with a hash becomes the blob of its content, if the data matches it.
+void Transfer_connection::index_content()
+{
+    std::string received = content_sha_.hex();
+    if (received != content_hash_)
+    {
+        LWARNING << file_info_.key() << " does not match its hash " << content_hash_ << ", not deduplicated";
+        return;
+    }
+
+    transfer_->blobs().add(content_hash_, to_file_path(file_info_));
+}
+
+// The directory file_info_ is stored in, created on its first file. Content shared with the
+// blob store stays on the first storage root, hard links do not cross devices.
+Storage_layout::DirectoryPtr Transfer_connection::make_directory()
+{
+    Storage_layout::DirectoryPtr dir = transfer_->layout().open_directory(file_info_, true, !content_hash_.empty());
+    if (!dir)
+    {
+        LERROR << "no directory for " << file_info_.key() << " under " << recv_path_;
+        shutdown();
+    }
+
+    return dir;
+}
+
+std::string Transfer_connection::to_file_path(const FileInfo& info) const
+{
+    return transfer_->layout().path(info);
+}
+
+void Transfer_connection::handle_file_sent(const boost::system::error_code& error,
+    size_t /*bytes_transferred*/)
+{
+    if (error)
+    {
+        LERROR << "send " << filename_ << ": " << error.message();
+    }
+    else {
+        LINFO << filename_ << " send completed";
+
+        result_ = TransferResult::OK;
+    }
+
+    shutdown();
+}
+
+void Transfer_connection::shutdown()
+{
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(tcp::socket::shutdown_both, ignored_ec);
+
+    if (receive_admitted_)
+    {
+        receive_admitted_ = false;
+        transfer_->release_receive(receive_bytes_);
+    }
+
+    if (admitted_)
+    {
+        admitted_ = false;
+        transfer_->release_connection();
+    }
+
+    transfer_->remove_task(shared_from_this());
+
+    LINFO << "connection shutdown: " << file_info_.key();
+
+    complete();
+}
+
+void Transfer_connection::complete()
+{
+    if (!completion_)
+        return;
+
+    TransferResult result;
+    result.status = result_;
+    result.retry_after_ms = retry_after_ms_;
+    result.tuning = tuning_;
+    result.deduplicated = deduplicated_;
+    result.dedup_bytes = dedup_bytes_;
+
+    if (sink_)
+    {
+        result.bytes = recv_count_;
+        result.checksum = crc_.checksum();
+    }
+    else {
+#ifdef __linux__
+        result.bytes = send_offset_;
+#else
+        result.bytes = result_ == TransferResult::OK ? file_size_ : 0;
+#endif
+    }
+
+    CompletionPtr completion;
+    completion.swap(completion_);
+    completion->complete(result);
+}
+
+void Transfer_connection::parseOptions(const std::string& str)
+{
+    optios_.clear();
+
+    std::vector<std::string> option;
+    boost::split(option, str, boost::is_any_of(","));
+
+    std::vector<std::string>::const_iterator it = option.begin();
+    while (it != option.end())
+    {
+        std::vector<std::string> kv;
+        boost::split(kv, *it, boost::is_any_of("="));
 
         if (kv.size() == 2)
         {
@@ -494,16 +2174,20 @@ void Transfer_connection::parseOptions(const std::string& str)
         ++it;
     }
 
-    file_info_.id = getOption("ID");
-    file_info_.type = getOption("TYPE");
-    file_info_.date = getOption("DATE");
-    file_info_.tm_begin = getOption("BEGIN");
-    file_info_.tm_end = getOption("END");
+    // a BUSY sent before the request was read has no file info
+    if (optios_.count("ID"))
+    {
+        file_info_.id = getOption("ID");
+        file_info_.type = getOption("TYPE");
+        file_info_.date = getOption("DATE");
+        file_info_.tm_begin = getOption("BEGIN");
+        file_info_.tm_end = getOption("END");
+    }
 
     std::string size = getOption("SIZE").c_str();
     if (!size.empty())
     {
-        file_size_ = std::atoi(size.c_str());
+        file_size_ = ::strtoll(size.c_str(), NULL, 10);
     }
     else {
         file_size_ = 0;
@@ -521,25 +2205,113 @@ std::string Transfer_connection::getOption(const std::string& key) const
     return "";
 }
 
-void Transfer_connection::start_reply()
+void Transfer_connection::start_reply(bool follow)
 {
-    Transfer::Status status = transfer_->get_task_status(file_info_);
+    size_t generation = 0;
+    Transfer::Status status = transfer_->get_task_status(file_info_, &generation);
     std::string info = "not ready";
     if (status == Transfer::UNKNOWN)
     {
-        std::string file = to_file_path(file_info_);
-        boost::filesystem::path path(file);
-        if (boost::filesystem::exists(path))
+        // a hot file goes out from memory, without touching the file system
+        Object_cache& cache = transfer_->cache();
+        Object_cache::Buffer cached = cache.get(file_info_.key());
+        if (cached)
         {
+            LINFO << "reply file " << file_info_.key() << " from cache";
+            send_source(SourcePtr(new Memory_source(cached->empty() ? NULL : &(*cached)[0], cached->size(), cached)));
+            return;
+        }
+
+#ifdef __linux__
+        // a small file packed into a segment goes out with sendfile from there
+        SourcePtr packed = transfer_->segments().open(file_info_.key());
+        if (packed)
+        {
+            LINFO << "reply file " << file_info_.key() << " from " << packed->name();
+            send_source(packed);
+            return;
+        }
+#endif
+
+        if (transfer_->layout().exists(file_info_))
+        {
+            // on the root it was just found on
+            std::string file = to_file_path(file_info_);
             LINFO << "reply file " << file_info_.key();
 
+#ifdef __linux__
+            transfer_->tiers().touch(file_info_);
+
+            // a file the cache wants is read once, off the io thread, for it and every query
+            // meanwhile; archive files stream from disk and leave the page cache behind them
+            if (transfer_->page_cache().policy(file_info_.type) != Page_cache_policy::ARCHIVE)
+            {
+                Single_flight& flights = transfer_->flights();
+                if (flights.join(file_info_.key(), boost::bind(&Transfer_connection::handle_flight, shared_from_this(), file, 0, false, _1)))
+                    return;
+
+                size_t epoch = cache.epoch();
+                if (cache.wants(file_info_.key()) && flights.load(file_info_.key(), file, cache.max_object(),
+                    boost::bind(&Transfer_connection::handle_flight, shared_from_this(), file, epoch, true, _1)))
+                    return;
+            }
+
+            // moved to the other tier since it was found
+            if (::access(file.c_str(), F_OK) != 0 && transfer_->layout().exists(file_info_))
+                file = to_file_path(file_info_);
+#endif
             send_file(file);
             return;
         }
 
         info = "file not exists";
     }
-        
+#ifdef __linux__
+    else if (status == Transfer::RECV)
+    {
+        // serve what is already written and follow the receive for the rest
+        Connection::pointer source = follow ? transfer_->get_task_connection(file_info_) : Connection::pointer();
+        if (source && source->shard() != shard_)
+        {
+            // its reader list belongs to the other shard, ask there
+            source->shard()->io_service().post(boost::bind(&Transfer_connection::attach_reader, source, shared_from_this()));
+            return;
+        }
+
+        if (source && source->add_reader(shared_from_this()))
+        {
+            LINFO << "reply file " << file_info_.key() << " while receiving";
+            return;
+        }
+    }
+#endif
+
+    if ((status == Transfer::UNKNOWN || status == Transfer::RECV)
+        && !wait_until_.is_not_a_date_time()
+        && boost::posix_time::microsec_clock::universal_time() < wait_until_)
+    {
+        // a receive started or committed since the status was read, look again
+        if (!transfer_->add_waiter(shared_from_this(), generation))
+        {
+            start_reply(follow);
+            return;
+        }
+
+        LINFO << "park query " << file_info_.key() << " until " << boost::posix_time::to_simple_string(wait_until_);
+
+        wait_timer_.expires_at(wait_until_);
+        wait_timer_.async_wait(boost::bind(&Transfer_connection::handle_wait_timeout,
+            shared_from_this(),
+            boost::asio::placeholders::error));
+
+        // the client sends nothing more, the socket turns readable when it hangs up
+        socket_.async_read_some(boost::asio::null_buffers(),
+            boost::bind(&Transfer_connection::handle_parked_read,
+                shared_from_this(),
+                boost::asio::placeholders::error));
+        return;
+    }
+
     std::string action = make_reply_action(info, status);
     boost::system::error_code ignore;
     send_action(action, ignore);
@@ -547,3 +2319,74 @@ void Transfer_connection::start_reply()
     shutdown();
     return;
 }
+
+#ifdef __linux__
+void Transfer_connection::handle_flight(const std::string& file, size_t epoch, bool first, const Single_flight::Buffer& data)
+{
+    // on the reading thread
+    socket_.get_io_service().post(boost::bind(&Transfer_connection::reply_flight, shared_from_this(), file, epoch, first, data));
+}
+
+void Transfer_connection::reply_flight(const std::string& file, size_t epoch, bool first, const Single_flight::Buffer& data)
+{
+    if (!data)
+    {
+        // too large after all, or moved to the other tier meanwhile
+        std::string path = file;
+        if (::access(path.c_str(), F_OK) != 0 && transfer_->layout().exists(file_info_))
+            path = to_file_path(file_info_);
+
+        send_file(path);
+        return;
+    }
+
+    if (first)
+        transfer_->cache().put(file_info_.key(), data, epoch);
+
+    send_source(SourcePtr(new Memory_source(data->empty() ? NULL : &(*data)[0], data->size(), data)));
+}
+#endif
+
+void Transfer_connection::wake()
+{
+    boost::system::error_code ignore;
+    wait_timer_.cancel(ignore);
+    socket_.cancel(ignore);
+
+    start_reply();
+}
+
+void Transfer_connection::handle_wait_timeout(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    // lost the race against notify_waiters(), wake() answers instead
+    if (!transfer_->remove_waiter(shared_from_this()))
+        return;
+
+    LINFO << "query " << file_info_.key() << " wait timeout";
+
+    boost::system::error_code ignore;
+    socket_.cancel(ignore);
+
+    wait_until_ = boost::posix_time::ptime();
+    start_reply();
+}
+
+void Transfer_connection::handle_parked_read(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+
+    // lost the race against notify_waiters(), wake() answers instead
+    if (!transfer_->remove_waiter(shared_from_this()))
+        return;
+
+    LINFO << "query " << file_info_.key() << " client gone while waiting";
+
+    boost::system::error_code ignore;
+    wait_timer_.cancel(ignore);
+
+    shutdown();
+}
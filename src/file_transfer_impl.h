@@ -1,19 +1,31 @@
 #ifndef _FILE_TRANSFER_IMPL_H_
 #define _FILE_TRANSFER_IMPL_H_
 
+#include <algorithm>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/asio.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
 
+#include "file_transfer.h"
 #include "file_transfer_connection.h"
+#include "file_completion.h"
+#include "file_transfer_engine.h"
+#include "file_listener_handover.h"
+#include "file_single_flight.h"
+#include "file_object_cache.h"
+#include "file_segment_store.h"
+#include "file_storage_tiers.h"
+#include "file_durability.h"
 
 namespace ft
 {
     typedef Transfer_connection Connection;
 
     using namespace boost::asio::ip;
-    typedef boost::shared_ptr<tcp::acceptor> acceptor_ptr;
 
     class Transfer
     {
@@ -28,34 +40,100 @@ namespace ft
             ABORT,
             READY,
         };
+        typedef std::pair<std::string, std::string> Peer;
+        typedef boost::shared_ptr<tcp::acceptor> acceptor_ptr;
     public:
-        explicit Transfer(const std::string& host, const std::string& port, const std::string& recv_path, bool is_server) : is_server_(is_server),
-            ios_(),
+        // Without an engine the transfer runs on a private one with options.shards io threads, 0
+        // for one per core. On a server more than one shard gives each its own acceptor on the port.
+        explicit Transfer(const std::string& host, const std::string& port, const std::string& recv_path, bool is_server,
+            const ServerOptions& options = ServerOptions(), const EnginePtr& engine = EnginePtr()) : is_server_(is_server),
             host_(host),
             port_(port),
             recv_path_(recv_path),
-            acceptor_(),
-            work_(new boost::asio::io_service::work(ios_))
+            engine_(engine),
+            owns_engine_(!engine),
+            next_shard_(0),
+            tuning_(),
+            zerocopy_threshold_(Zerocopy::default_threshold),
+            dedup_threshold_(0),
+            chunking_(false),
+            upload_ack_(false),
+            layout_(recv_path),
+            blobs_(recv_path),
+            chunk_store_(recv_path),
+#ifdef __linux__
+            segments_(recv_path),
+            tiers_(layout_, boost::bind(&Transfer::has_task, this, _1)),
+            durability_(layout_),
+#endif
+            flights_(),
+            cache_(),
+            store_queue_(),
+            limits_(),
+            connections_(0),
+            receives_(0),
+            bytes_in_flight_(0),
+            draining_(false),
+            listening_(0),
+            live_connections_(0),
+            options_(options),
+            started_(false)
         {
+            if (owns_engine_)
+                engine_.reset(new Engine(options.shards));
+
+            engine_->reserve(is_server ? server_pool_reserve : client_pool_reserve);
+
+            for (size_t i = 0; i < engine_->size(); ++i)
+                registry_.push_back(boost::shared_ptr<Registry>(new Registry()));
+
             if (is_server)
             {
-                tcp::endpoint endpoint(address::from_string(host_), std::atoi(port.c_str()));
-                acceptor_.reset(new tcp::acceptor(ios_, endpoint));
+                store_queue_.reset(new Io_queue("store"));
 
-                start_accept();
+                // blobs whose keys were all overwritten since the last run
+                blobs_.collect();
+                chunk_store_.collect();
+#ifdef __linux__
+                segments_.recover();
+#endif
             }
         }
 
         ~Transfer()
         {
-            if (thread_.joinable())
-                thread_.join();
+            if (owns_engine_)
+            {
+                engine_->join();
+
+                // what the engine still holds goes back to its pools while this transfer is whole
+                handover_.reset();
+                listeners_.clear();
+                registry_.clear();
+                engine_.reset();
+                return;
+            }
+
+            stop();
+
+            handover_.reset();
+            listeners_.clear();
         }
 
-        void send(const std::string& file_path, const FileInfo& info)
+        CompletionPtr send(const std::string& file_path, const FileInfo& info)
         {
             LINFO << "start send " << file_path;
 
+#ifdef __linux__
+            SourcePtr source = Fd_source::open(file_path);
+            if (!source)
+            {
+                LERROR << "open file " << boost::filesystem::system_complete(file_path).generic_string() << " error(" << errno << ")";
+                return Completion::completed(info.key(), TransferResult::REJECTED);
+            }
+
+            return send(source, info);
+#else
             boost::filesystem::path path(file_path);
 
             if (boost::filesystem::exists(path))
@@ -63,11 +141,14 @@ namespace ft
                 Status status = get_task_status(info);
                 if (status == UNKNOWN)
                 {
-                    Connection::pointer conn = Connection::create(this, ios_, recv_path_);
+                    CompletionPtr completion(new Completion(info.key()));
 
-                    add_task(conn, SEND);
+                    Connection::pointer conn = make_connection();
+                    conn->set_completion(completion);
 
                     conn->start_send(file_path, info, host_, port_);
+
+                    return completion;
                 }
                 else {
                     LWARNING << info.key() << " has pending task, status(" << status << ")";
@@ -76,15 +157,46 @@ namespace ft
             else {
                 LERROR << "file not exists, " << boost::filesystem::system_complete(path).generic_string();
             }
+
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+#endif
         }
 
-        Status query(const FileInfo& info)
+#ifdef __linux__
+        CompletionPtr send(const SourcePtr& source, const FileInfo& info)
+        {
+            LINFO << "start send " << source->name();
+
+            Status status = get_task_status(info);
+            if (status == UNKNOWN)
+            {
+                CompletionPtr completion(new Completion(info.key()));
+
+                Connection::pointer conn = make_connection();
+                conn->set_completion(completion);
+
+                conn->start_send(source, info, host_, port_);
+
+                return completion;
+            }
+            else {
+                LWARNING << info.key() << " has pending task, status(" << status << ")";
+            }
+
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+        }
+#endif
+
+        CompletionPtr query(const FileInfo& info, const boost::posix_time::ptime& wait_until = boost::posix_time::ptime(), const SinkPtr& sink = SinkPtr())
         {
             LINFO << "query " << info.key();
 
             Status status = get_task_status(info);
             if (status != UNKNOWN)
-                return status;
+            {
+                LWARNING << info.key() << " has pending task, status(" << status << ")";
+                return Completion::completed(info.key(), TransferResult::REJECTED);
+            }
 
             /*std::string file = recv_path_ + info.type + "/" + info.key();
             boost::filesystem::path path(file);
@@ -96,66 +208,683 @@ namespace ft
 
             if (!is_server_)
             {
-                Connection::pointer conn = Connection::create(this, ios_, recv_path_);
+                CompletionPtr completion(new Completion(info.key()));
+
+                Connection::pointer conn = make_connection();
+                conn->set_completion(completion);
 
-                conn->start_query(info, host_, port_);
+                conn->start_query(info, host_, port_, wait_until, sink);
 
-                return QUERY;
+                return completion;
             }
 
-            return UNKNOWN;
+            return Completion::completed(info.key(), TransferResult::REJECTED);
+        }
+
+        // Every file received from now on is also forwarded to host:port while it comes in.
+        void add_replica(const std::string& host, const std::string& port)
+        {
+            LINFO << "add replica " << host << ":" << port;
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            replicas_.push_back(Peer(host, port));
+        }
+
+        std::vector<Peer> replicas()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return replicas_;
+        }
+
+        // Outgoing bandwidth shaping, takes effect on connections already sending.
+        Rate_limiter& limiter()
+        {
+            return limiter_;
+        }
+
+        // What receives and replies of each type do to the page cache.
+        Page_cache_policy& page_cache()
+        {
+            return page_cache_;
+        }
+
+        // Upper bound for the memory of all receive buffers of the engine, whoever else uses it.
+        void set_buffer_budget(size_t bytes)
+        {
+            engine_->set_buffer_budget(bytes);
+        }
+
+        void set_socket_tuning(const SocketTuning& tuning)
+        {
+            LINFO << "socket tuning " << tuning;
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            tuning_ = tuning;
+        }
+
+        SocketTuning socket_tuning()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return tuning_;
+        }
+
+        // Memory sources at least this large go out with MSG_ZEROCOPY, 0 never.
+        void set_zerocopy_threshold(size_t bytes)
+        {
+            LINFO << "zero-copy send threshold " << bytes << " bytes";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            zerocopy_threshold_ = bytes;
+        }
+
+        size_t zerocopy_threshold()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return zerocopy_threshold_;
+        }
+
+        // Uploads at least this large offer their content hash first, 0 never.
+        void set_dedup_threshold(size_t bytes)
+        {
+            LINFO << "content dedup threshold " << bytes << " bytes";
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            dedup_threshold_ = bytes;
+        }
+
+        size_t dedup_threshold()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return dedup_threshold_;
+        }
+
+        // Uploads over the dedup threshold also offer their chunks, of which only those the
+        // server lacks are sent.
+        void set_chunking(bool on)
+        {
+            LINFO << "chunked dedup " << (on ? "on" : "off");
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            chunking_ = on;
+        }
+
+        bool chunking()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return chunking_;
+        }
+
+        // Client side: uploads wait for the server's DONE, which older servers never send.
+        void set_upload_ack(bool on)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            upload_ack_ = on;
+        }
+
+        bool upload_ack()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return upload_ack_;
         }
 
+        // Server side: where received files are stored under recv_path.
+        Storage_layout& layout()
+        {
+            return layout_;
+        }
+
+        bool set_storage_layout(const std::string& pattern)
+        {
+            return layout_.set_pattern(pattern);
+        }
+
+        bool add_storage_root(const std::string& path)
+        {
+            return layout_.add_root(path);
+        }
+
+        void set_storage_placement(int placement)
+        {
+            layout_.set_placement(placement);
+        }
+
+#ifdef __linux__
+        bool add_cold_root(const std::string& path)
+        {
+            if (!layout_.add_root(path, true))
+                return false;
+
+            tiers_.start();
+            return true;
+        }
+
+        // Server side: moves stored files between the hot and the cold roots.
+        Storage_tiers& tiers()
+        {
+            return tiers_;
+        }
+
+        // Server side: when a received file counts as stored.
+        Durability& durability()
+        {
+            return durability_;
+        }
+#endif
+
+        // Server side: the content of received files, by hash.
+        const Blob_store& blobs() const
+        {
+            return blobs_;
+        }
+
+        const Chunk_store& chunk_store() const
+        {
+            return chunk_store_;
+        }
+
+        // Server side: storage work too slow for an io thread, in the order it is posted.
+        const Io_queuePtr& store_queue() const
+        {
+            return store_queue_;
+        }
+
+#ifdef __linux__
+        // Server side: small files packed into segment files.
+        Segment_store& segments()
+        {
+            return segments_;
+        }
+#endif
+
+        // Server side: replies in flight, shared by concurrent queries for a key.
+        Single_flight& flights()
+        {
+            return flights_;
+        }
+
+        // Server side: hot stored files kept in memory.
+        Object_cache& cache()
+        {
+            return cache_;
+        }
+
+        void set_cache_budget(size_t bytes)
+        {
+            cache_.set_budget(bytes);
+        }
+
+#ifdef __linux__
+        // Preloads the stored files of type whose key contains match, until the cache is full.
+        size_t warm_cache(const std::string& type, const std::string& match)
+        {
+            size_t count = 0;
+            size_t bytes = 0;
+
+            // keys are id_type_date_begin_end, wherever the layout puts them
+            const std::string infix = "_" + type + "_";
+
+            // every storage root, then the packed files
+            std::vector<std::string> roots = layout_.roots();
+            bool full = false;
+            for (size_t i = 0; i < roots.size() && !full; ++i)
+                full = !warm_directory(roots[i], infix, match, count, bytes);
+
+            std::vector<std::string> keys = segments_.keys();
+            for (size_t i = 0; i < keys.size() && !full; ++i)
+            {
+                if (keys[i].find(infix) == std::string::npos || keys[i].find(match) == std::string::npos)
+                    continue;
+
+                boost::shared_ptr<std::vector<char> > data(new std::vector<char>());
+                if (!segments_.read(keys[i], *data))
+                    continue;
+
+                if (!cache_.warm(keys[i], data))
+                    break;
+
+                ++count;
+                bytes += data->size();
+            }
+
+            LINFO << "warmed the cache with " << count << " " << type << " files, " << bytes << " bytes";
+            return count;
+        }
+#endif
+
+        void set_admission_limits(const AdmissionLimits& limits)
+        {
+            LINFO << "admission limits: connections " << limits.max_connections
+                << ", receives " << limits.max_receives
+                << ", bytes in flight " << limits.max_bytes_in_flight;
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            limits_ = limits;
+        }
+
+        // A server listens from here on, or takes the listeners over from the one offering them,
+        // so the storage settings made before apply to every receive.
         void start()
         {
-            thread_ = boost::thread(boost::bind(&Transfer::run,
-                this
-            ));
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                if (started_)
+                    return;
+
+                started_ = true;
+            }
+
+            if (is_server_)
+            {
+                tcp::endpoint endpoint(address::from_string(host_), std::atoi(port_.c_str()));
+                listen(endpoint, options_);
+
+                {
+                    boost::lock_guard<boost::mutex> guard(mutex_);
+                    listening_ = listeners_.size();
+                }
+
+                for (size_t i = 0; i < listeners_.size(); ++i)
+                {
+                    listener_fds_.push_back(listeners_[i].acceptor->native_handle());
+                    start_accept(listeners_[i].shard, listeners_[i].acceptor.get());
+                }
+
+                if (!options_.handover_path.empty())
+                {
+                    handover_.reset(new Listener_handover(engine_->shard(0).io_service(), options_.handover_path,
+                        boost::bind(&Transfer::listeners_to_hand_over, this),
+                        boost::bind(&Transfer::drain, this, false)));
+                    handover_->offer();
+                }
+            }
+
+            // a shared engine is already running
+            if (owns_engine_)
+                engine_->start();
+        }
+
+        // Stops accepting, connections already accepted run to the end. take_backlog accepts what
+        // is queued on the listeners first; without it the listeners must live on elsewhere.
+        void drain(bool take_backlog)
+        {
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (draining_)
+                    return;
+
+                draining_ = true;
+                listener_fds_.clear();
+                drained_.notify_all();
+            }
+
+            LINFO << "drain, stop accepting";
+
+            for (size_t i = 0; i < engine_->size(); ++i)
+                engine_->shard(i).io_service().post(boost::bind(&Transfer::close_listeners, this, &engine_->shard(i), take_backlog));
+        }
+
+        // Returns false if listeners are still open or connections still running after timeout_ms,
+        // negative waits forever.
+        bool wait_drained(int timeout_ms)
+        {
+            boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time()
+                + boost::posix_time::milliseconds(timeout_ms);
+
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (!draining_ || listening_ > 0 || connections_ > 0)
+            {
+                if (timeout_ms < 0)
+                {
+                    drained_.wait(lock);
+                }
+                else if (!drained_.timed_wait(lock, deadline)) {
+                    return draining_ && listening_ == 0 && connections_ == 0;
+                }
+            }
 
+            return true;
         }
 
+        // A private engine stops with the transfer. On a shared one this stops accepting and
+        // waits for the connections of this transfer to finish, so it must not be called from a
+        // thread the engine runs on.
         void stop()
         {
-            work_.reset();
-            if (thread_.joinable())
-                thread_.join();
+            if (owns_engine_)
+            {
+                engine_->stop();
+                engine_->join();
+                return;
+            }
+
+            drain(false);
+
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (live_connections_ > 0)
+                drained_.wait(lock);
         }
 
     private:
         friend class Transfer_connection;
 
-        void start_accept()
+        // Binds fresh listeners, or takes over those of the server offering them at the handover path.
+        void listen(const tcp::endpoint& endpoint, const ServerOptions& options)
         {
-            Transfer_connection::pointer new_connection =
-                Transfer_connection::create(this, acceptor_->get_io_service(), recv_path_);
+            size_t shards = engine_->size();
+            bool reuse_port = options.reuse_port || shards > 1;
+
+            std::vector<int> fds;
+            if (!options.handover_path.empty())
+                fds = Listener_handover::take(options.handover_path);
 
-            acceptor_->async_accept(new_connection->socket(),
-                boost::bind(&Transfer::handle_accept, this, new_connection,
+#ifdef __linux__
+            for (size_t i = 0; i < fds.size(); ++i)
+                adopt_listener(engine_->shard(i % shards), fds[i]);
+#endif
+
+            for (size_t i = fds.size(); i < shards; ++i)
+            {
+                if (fds.empty())
+                {
+                    bind_listener(engine_->shard(i), endpoint, reuse_port);
+                    continue;
+                }
+
+                // more shards than the old server had, works if it listened with SO_REUSEPORT
+                try
+                {
+                    bind_listener(engine_->shard(i), endpoint, true);
+                }
+                catch (const boost::system::system_error& e)
+                {
+                    LWARNING << "shard " << i << " has no listener of its own: " << e.what();
+                }
+            }
+        }
+
+        // With reuse_port every shard, and any other process doing the same, binds the same port
+        // and the kernel spreads incoming connections over their acceptors.
+        void bind_listener(Transfer_shard& shard, const tcp::endpoint& endpoint, bool reuse_port)
+        {
+            acceptor_ptr acceptor(new tcp::acceptor(shard.io_service()));
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(tcp::acceptor::reuse_address(true));
+#if defined(__linux__) && defined(SO_REUSEPORT)
+            if (reuse_port)
+                acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+            acceptor->bind(endpoint);
+            acceptor->listen();
+
+            add_listener(shard, acceptor);
+        }
+
+#ifdef __linux__
+        // Warms the cache with the matching files under one storage root; false once it is full.
+        bool warm_directory(const std::string& root, const std::string& infix, const std::string& match,
+            size_t& count, size_t& bytes)
+        {
+            boost::system::error_code ec;
+            boost::filesystem::recursive_directory_iterator it(root, ec), end;
+            for (; !ec && it != end; it.increment(ec))
+            {
+                std::string key = it->path().filename().string();
+                if (boost::filesystem::is_directory(it->status()))
+                {
+                    // the blob and chunk stores
+                    if (key[0] == '.')
+                        it.no_push();
+                    continue;
+                }
+
+                if (!boost::filesystem::is_regular_file(it->status())
+                    || key.find(infix) == std::string::npos || key.find(match) == std::string::npos)
+                    continue;
+
+                boost::shared_ptr<std::vector<char> > data(new std::vector<char>());
+                if (!Single_flight::read(it->path().string(), cache_.max_object(), *data))
+                    continue;
+
+                if (!cache_.warm(key, data))
+                    return false;
+
+                ++count;
+                bytes += data->size();
+            }
+
+            return true;
+        }
+
+        // Accepts on a listening socket inherited from another process.
+        void adopt_listener(Transfer_shard& shard, int fd)
+        {
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            if (::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) != 0)
+            {
+                LERROR << "adopt listener " << fd << " error(" << errno << ")";
+                return;
+            }
+
+            acceptor_ptr acceptor(new tcp::acceptor(shard.io_service()));
+            acceptor->assign(addr.ss_family == AF_INET6 ? tcp::v6() : tcp::v4(), fd);
+
+            add_listener(shard, acceptor);
+        }
+#endif
+
+        void add_listener(Transfer_shard& shard, const acceptor_ptr& acceptor)
+        {
+            // lets handle_accept drain the backlog without blocking
+            acceptor->non_blocking(true);
+
+            Listener listener = { &shard, acceptor };
+            listeners_.push_back(listener);
+        }
+
+        std::vector<int> listeners_to_hand_over()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return listener_fds_;
+        }
+
+        // Runs on the shard. The kernel resets connections still queued on a listener when the
+        // last reference to it closes, take_backlog accepts them first. Those arriving in between
+        // are lost unless another process holds the listener too, or the kernel migrates them
+        // (net.ipv4.tcp_migrate_req).
+        void close_listeners(Transfer_shard* shard, bool take_backlog)
+        {
+            size_t closed = 0;
+            for (size_t i = 0; i < listeners_.size(); ++i)
+            {
+                if (listeners_[i].shard != shard)
+                    continue;
+
+                tcp::acceptor& acceptor = *listeners_[i].acceptor;
+                while (take_backlog)
+                {
+                    Transfer_connection::pointer connection = shard->make_connection(this, recv_path_);
+
+                    boost::system::error_code ec;
+                    acceptor.accept(connection->socket(), ec);
+                    if (ec)
+                        break;
+
+                    admit(connection);
+                }
+
+                boost::system::error_code ignore;
+                acceptor.close(ignore);
+                ++closed;
+            }
+
+            if (handover_ && shard == &engine_->shard(0))
+                handover_->close();
+
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            listening_ -= std::min(listening_, closed);
+            if (listening_ == 0)
+                drained_.notify_all();
+        }
+
+        void start_accept(Transfer_shard* shard, tcp::acceptor* acceptor)
+        {
+            Transfer_connection::pointer new_connection = shard->make_connection(this, recv_path_);
+
+            acceptor->async_accept(new_connection->socket(),
+                boost::bind(&Transfer::handle_accept, this, shard, acceptor, new_connection,
                     boost::asio::placeholders::error));
         }
 
-        void handle_accept(Transfer_connection::pointer new_connection,
+        void handle_accept(Transfer_shard* shard, tcp::acceptor* acceptor, Transfer_connection::pointer new_connection,
             const boost::system::error_code& error)
         {
+            // closed by drain()
+            if (!acceptor->is_open())
+                return;
+
             if (!error)
             {
-                new_connection->start_recv();
+                admit(new_connection);
+
+                // under an accept storm take whatever else is queued in one go
+                size_t batch = accept_batch();
+                for (size_t i = 1; i < batch; ++i)
+                {
+                    Transfer_connection::pointer connection = shard->make_connection(this, recv_path_);
+
+                    boost::system::error_code ec;
+                    acceptor->accept(connection->socket(), ec);
+                    if (ec)
+                        break;
+
+                    admit(connection);
+                }
+            }
+
+            start_accept(shard, acceptor);
+        }
+
+        void admit(Transfer_connection::pointer connection)
+        {
+            int retry_after = 0;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+
+                if (limits_.max_connections == 0 || connections_ < limits_.max_connections)
+                {
+                    ++connections_;
+                }
+                else {
+                    retry_after = limits_.retry_after_ms;
+                }
+            }
+
+            if (retry_after > 0)
+            {
+                LWARNING << "too many connections, reject";
+                connection->reject_busy(retry_after);
+                return;
             }
 
-            start_accept();
+            connection->set_admitted();
+            connection->tune_socket();
+            connection->start_recv();
+        }
+
+        size_t accept_batch()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            return std::max<size_t>(limits_.accept_batch, 1);
         }
 
-        void run()
+        friend class Connection_pool;
+
+        void connection_opened()
         {
-            ios_.run();
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            ++live_connections_;
         }
 
-        Status get_task_status(const FileInfo& info)
+        void connection_closed()
         {
             boost::lock_guard<boost::mutex> guard(mutex_);
+            --live_connections_;
 
-            std::map<std::string, Task>::iterator it = pending_task_.find(info.key());
-            if (it != pending_task_.end())
+            if (live_connections_ == 0)
+                drained_.notify_all();
+        }
+
+        void release_connection()
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+            --connections_;
+
+            if (draining_ && connections_ == 0)
+                drained_.notify_all();
+        }
+
+        // Returns 0 if the receive is admitted, otherwise the retry hint in milliseconds. A receive
+        // larger than the byte limit is admitted alone, waiting for room would never end.
+        int admit_receive(size_t size)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            if ((limits_.max_receives != 0 && receives_ >= limits_.max_receives)
+                || (limits_.max_bytes_in_flight != 0 && bytes_in_flight_ != 0
+                    && bytes_in_flight_ + size > limits_.max_bytes_in_flight))
+            {
+                return limits_.retry_after_ms > 0 ? limits_.retry_after_ms : 1;
+            }
+
+            ++receives_;
+            bytes_in_flight_ += size;
+
+            return 0;
+        }
+
+        void release_receive(size_t size)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            --receives_;
+            bytes_in_flight_ -= size;
+        }
+
+        // an admitted receive turned out to need only to bytes, a chunked upload, or a stream
+        // grew to them
+        void resize_receive(size_t from, size_t to)
+        {
+            boost::lock_guard<boost::mutex> guard(mutex_);
+
+            bytes_in_flight_ = bytes_in_flight_ - from + to;
+        }
+
+        // Transfers started through the API go round robin over the shards.
+        Connection::pointer make_connection()
+        {
+            size_t index = 0;
+            if (engine_->size() > 1)
+            {
+                boost::lock_guard<boost::mutex> guard(mutex_);
+                index = next_shard_++ % engine_->size();
+            }
+
+            return engine_->shard(index).make_connection(this, recv_path_);
+        }
+
+        // generation, if given, is what add_waiter() checks to see that no task came or went since
+        Status get_task_status(const FileInfo& info, size_t* generation = NULL)
+        {
+            Registry& registry = registry_for(info.key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            if (generation)
+                *generation = registry.generation;
+
+            std::map<std::string, Task>::iterator it = registry.tasks.find(info.key());
+            if (it != registry.tasks.end())
             {
                 return it->second.status;
             }
@@ -163,35 +892,135 @@ namespace ft
             return UNKNOWN;
         }
 
+        bool has_task(const std::string& key)
+        {
+            Registry& registry = registry_for(key);
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            return registry.tasks.count(key) > 0;
+        }
+
+        Connection::pointer get_task_connection(const FileInfo& info)
+        {
+            Registry& registry = registry_for(info.key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            std::map<std::string, Task>::iterator it = registry.tasks.find(info.key());
+            if (it != registry.tasks.end())
+            {
+                return it->second.connection;
+            }
+
+            return Connection::pointer();
+        }
+
         void add_task(Connection::pointer ptr, Status status)
         {
-            boost::lock_guard<boost::mutex> guard(mutex_);
+            Registry& registry = registry_for(ptr->file_info().key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
 
             std::map<std::string, Task>::value_type value(ptr->file_info().key(), Task(status, ptr));
 
-            std::pair< std::map<std::string, Task>::iterator, bool> result = pending_task_.insert(value);
+            std::pair< std::map<std::string, Task>::iterator, bool> result = registry.tasks.insert(value);
             if (!result.second)
             {
                 LERROR << "duplicate task " << ptr->file_info().key();
             }
+
+            ++registry.generation;
         }
 
         void remove_task(Connection::pointer ptr)
         {
-            boost::lock_guard<boost::mutex> guard(mutex_);
-            pending_task_.erase(ptr->file_info().key());
+            Registry& registry = registry_for(ptr->file_info().key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            // queries for the same key share it, only the task owner may remove it
+            std::map<std::string, Task>::iterator it = registry.tasks.find(ptr->file_info().key());
+            if (it != registry.tasks.end() && it->second.connection == ptr)
+            {
+                registry.tasks.erase(it);
+                ++registry.generation;
+            }
+        }
+
+        // Parks a QUERY connection until the file it asks for is committed. Returns false without
+        // parking if a task came or went since get_task_status() returned generation.
+        bool add_waiter(Connection::pointer ptr, size_t generation)
+        {
+            Registry& registry = registry_for(ptr->file_info().key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            if (registry.generation != generation)
+                return false;
+
+            registry.waiters[ptr->file_info().key()].push_back(ptr);
+            return true;
+        }
+
+        // Returns false if the waiter was already released by notify_waiters().
+        bool remove_waiter(Connection::pointer ptr)
+        {
+            Registry& registry = registry_for(ptr->file_info().key());
+            boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+            Waiter_map::iterator it = registry.waiters.find(ptr->file_info().key());
+            if (it == registry.waiters.end())
+                return false;
+
+            std::vector<Connection::pointer>::iterator pos = std::find(it->second.begin(), it->second.end(), ptr);
+            if (pos == it->second.end())
+                return false;
+
+            it->second.erase(pos);
+            if (it->second.empty())
+                registry.waiters.erase(it);
+
+            return true;
+        }
+
+        void notify_waiters(const FileInfo& info)
+        {
+            // the copy replies share is of the file before, as is the cached one
+            flights_.forget(info.key());
+            cache_.erase(info.key());
+
+            std::vector<Connection::pointer> ready;
+            {
+                Registry& registry = registry_for(info.key());
+                boost::lock_guard<boost::mutex> guard(registry.mutex);
+
+                Waiter_map::iterator it = registry.waiters.find(info.key());
+                if (it == registry.waiters.end())
+                    return;
+
+                ready.swap(it->second);
+                registry.waiters.erase(it);
+            }
+
+            LINFO << info.key() << " committed, wake " << ready.size() << " waiting queries";
+
+            // each on its own shard
+            for (size_t i = 0; i < ready.size(); ++i)
+            {
+                ready[i]->shard()->io_service().post(boost::bind(&Transfer_connection::wake, ready[i]));
+            }
         }
 
     private:
         const bool is_server_;
-        boost::asio::io_service ios_;
-        boost::shared_ptr< boost::asio::io_service::work> work_;
-        boost::thread thread_;
         const std::string host_;
         const std::string port_;
         const std::string recv_path_;
 
-        acceptor_ptr acceptor_;
+        enum
+        {
+            server_pool_reserve = 64,
+            client_pool_reserve = 8,
+        };
+        EnginePtr engine_;
+        const bool owns_engine_;
+        size_t next_shard_;
 
         boost::mutex mutex_;
         struct Task {
@@ -207,8 +1036,84 @@ namespace ft
             {}
         };
 
-        std::map<std::string, Task> pending_task_;
+        typedef boost::unordered_map<std::string, std::vector<Connection::pointer> > Waiter_map;
+
+        // Tasks and waiters, split by key into one stripe per shard so that shards touching
+        // different keys do not contend on one lock.
+        struct Registry {
+            boost::mutex mutex;
+            std::map<std::string, Task> tasks;
+            Waiter_map waiters;
+            size_t generation;
+
+            Registry() : generation(0)
+            {}
+        };
+
+        Registry& registry_for(const std::string& key)
+        {
+            return *registry_[boost::hash<std::string>()(key) % registry_.size()];
+        }
+
+        // after engine_, so that the connections it holds go back to pools that still exist
+        std::vector<boost::shared_ptr<Registry> > registry_;
+
+        std::vector<Peer> replicas_;
+
+        Rate_limiter limiter_;
+        Page_cache_policy page_cache_;
+
+        SocketTuning tuning_;
+        size_t zerocopy_threshold_;
+        size_t dedup_threshold_;
+        bool chunking_;
+        bool upload_ack_;
+        Storage_layout layout_;
+        const Blob_store blobs_;
+        const Chunk_store chunk_store_;
+#ifdef __linux__
+        Segment_store segments_;
+        Storage_tiers tiers_;
+        Durability durability_;
+#endif
+        Single_flight flights_;
+        Object_cache cache_;
+        Io_queuePtr store_queue_;  // after the stores it works on, so that it stops first
+        AdmissionLimits limits_;
+        size_t connections_;
+        size_t receives_;
+        size_t bytes_in_flight_;
+
+        bool draining_;
+        size_t listening_;         // listeners a drain has yet to close
+        size_t live_connections_;  // taken out of the engine's pools for this transfer
+        boost::condition_variable drained_;
+
+        const ServerOptions options_;
+        bool started_;
+
+        struct Listener
+        {
+            Transfer_shard* shard;
+            acceptor_ptr acceptor;
+        };
+        std::vector<Listener> listeners_;
+        std::vector<int> listener_fds_;
+        // accepts on the io_service of the first shard
+        boost::shared_ptr<Listener_handover> handover_;
     };
+
+    inline void Connection_pool::connection_opened(Transfer* transfer)
+    {
+        if (transfer)
+            transfer->connection_opened();
+    }
+
+    inline void Connection_pool::connection_closed(Transfer* transfer)
+    {
+        if (transfer)
+            transfer->connection_closed();
+    }
 }
 
 #endif
@@ -0,0 +1,143 @@
+#ifndef _FILE_TRANSFER_SHARD_H_
+#define _FILE_TRANSFER_SHARD_H_
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "easylogging++.h"
+#include "file_buffer_arena.h"
+#include "file_connection_pool.h"
+
+namespace ft {
+
+    // One io_service with its own thread, connection pool and receive buffers, shared by every
+    // transfer of an engine. A connection stays on the shard that created it; other shards only
+    // post work to it.
+    class Transfer_shard
+        : private boost::noncopyable
+    {
+    public:
+        // cpu < 0 leaves the thread unpinned
+        Transfer_shard(size_t index, int cpu) : index_(index),
+            cpu_(cpu),
+            arena_(),
+            own_ios_(new boost::asio::io_service()),
+            ios_(*own_ios_),
+            work_(new boost::asio::io_service::work(ios_)),
+            pool_()
+        {
+            pool_.reset(new Connection_pool(this));
+        }
+
+        // Runs on an io_service of the application, which runs it; start() and stop() do nothing.
+        Transfer_shard(size_t index, boost::asio::io_service& ios) : index_(index),
+            cpu_(-1),
+            arena_(),
+            own_ios_(),
+            ios_(ios),
+            work_(),
+            pool_()
+        {
+            pool_.reset(new Connection_pool(this));
+        }
+
+        ~Transfer_shard()
+        {
+            join();
+
+            // connections still referenced are deleted when released, not pooled
+            pool_->close();
+            arena_.clear_waiters();
+        }
+
+        size_t index() const
+        {
+            return index_;
+        }
+
+        boost::asio::io_service& io_service()
+        {
+            return ios_;
+        }
+
+        Buffer_arena& arena()
+        {
+            return arena_;
+        }
+
+        Connection_pool& pool()
+        {
+            return *pool_;
+        }
+
+        Transfer_connection::pointer make_connection(Transfer* transfer, const std::string& recv_path)
+        {
+            return pool_->acquire(transfer, recv_path);
+        }
+
+        void start()
+        {
+            if (own_ios_)
+                thread_ = boost::thread(boost::bind(&Transfer_shard::run, this));
+        }
+
+        void stop()
+        {
+            work_.reset();
+        }
+
+        void join()
+        {
+            if (thread_.joinable())
+                thread_.join();
+        }
+
+    private:
+        void run()
+        {
+#ifdef __linux__
+            if (cpu_ >= 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu_, &cpus);
+
+                int error = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+                if (error != 0)
+                {
+                    LWARNING << "pin shard " << index_ << " to cpu " << cpu_ << " error(" << error << ")";
+                }
+                else {
+                    LINFO << "shard " << index_ << " pinned to cpu " << cpu_;
+                }
+            }
+#endif
+            ios_.run();
+        }
+
+    private:
+        const size_t index_;
+        const int cpu_;
+
+        // declared before ios_ so that it outlives connections released by its destructor
+        Buffer_arena arena_;
+        boost::scoped_ptr<boost::asio::io_service> own_ios_;
+        boost::asio::io_service& ios_;
+        boost::shared_ptr<boost::asio::io_service::work> work_;
+        boost::thread thread_;
+
+        boost::shared_ptr<Connection_pool> pool_;
+    };
+}
+
+#endif
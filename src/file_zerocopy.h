@@ -0,0 +1,139 @@
+#ifndef _FILE_TRANSFER_ZEROCOPY_H_
+#define _FILE_TRANSFER_ZEROCOPY_H_
+
+#include <cstring>
+
+#include <boost/cstdint.hpp>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "easylogging++.h"
+
+#ifdef __linux__
+// older headers, the kernel has them since 4.14
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
+namespace ft {
+
+    // Bookkeeping for MSG_ZEROCOPY sends on one socket. The kernel numbers every successful send
+    // and reports ranges of finished ones on the socket error queue; until a send is reported its
+    // pages may still be read, so the memory must stay untouched.
+    class Zerocopy
+    {
+    public:
+        enum
+        {
+            // below this the page pinning and the notification cost more than the copy
+            default_threshold = 64 * 1024,
+        };
+
+        Zerocopy() : sent_(0),
+            done_(0),
+            copied_(0)
+        {}
+
+        static bool enable(int sock)
+        {
+#ifdef __linux__
+            int on = 1;
+            return ::setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+#else
+            return false;
+#endif
+        }
+
+        void reset()
+        {
+            sent_ = 0;
+            done_ = 0;
+            copied_ = 0;
+        }
+
+        // one successful send with MSG_ZEROCOPY
+        void sent()
+        {
+            ++sent_;
+        }
+
+        bool idle() const
+        {
+            return done_ == sent_;
+        }
+
+        boost::uint32_t count() const
+        {
+            return sent_;
+        }
+
+        // sends the kernel copied after all, loopback and devices without scatter-gather do
+        boost::uint32_t copied() const
+        {
+            return copied_;
+        }
+
+        // Takes every notification queued on sock. Returns false on a socket error.
+        bool reap(int sock)
+        {
+#ifdef __linux__
+            while (!idle())
+            {
+                char control[128];
+
+                msghdr msg;
+                std::memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (::recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+                    return errno == EAGAIN || errno == EWOULDBLOCK;
+
+                for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                {
+                    const sock_extended_err* err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+                    if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    {
+                        // a real error, queued where the notifications go
+                        if (err->ee_errno != 0)
+                        {
+                            errno = err->ee_errno;
+                            return false;
+                        }
+                        continue;
+                    }
+
+                    // ee_info to ee_data, inclusive
+                    boost::uint32_t range = err->ee_data - err->ee_info + 1;
+                    done_ += range;
+
+                    if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                        copied_ += range;
+                }
+            }
+#endif
+            return true;
+        }
+
+    private:
+        boost::uint32_t sent_;
+        boost::uint32_t done_;
+        boost::uint32_t copied_;
+    };
+}
+
+#endif
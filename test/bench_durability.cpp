@@ -0,0 +1,82 @@
+#include "test_util.h"
+
+#include <fstream>
+#include <cstdlib>
+
+// Upload throughput of small files under each durability mode, every upload asking for DONE.
+// Not a test, nothing is checked against a bound: a fast disk returns from fsync in well under a
+// millisecond and narrows the gap to a real device flush.
+//
+// bench_durability [files] [clients] [shards]
+
+// files per syncfs, from the "group commit N files" lines of the server log
+static double files_per_sync(const std::string& log)
+{
+    std::ifstream in(log.c_str());
+    std::string line;
+    double files = 0;
+    int syncs = 0;
+    while (std::getline(in, line))
+    {
+        std::string::size_type pos = line.find("group commit ");
+        if (pos == std::string::npos)
+            continue;
+
+        files += std::atof(line.c_str() + pos + 13);
+        ++syncs;
+    }
+
+    return syncs > 0 ? files / syncs : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const int files = argc > 1 ? std::atoi(argv[1]) : 8000;
+    const int clients = argc > 2 ? std::atoi(argv[2]) : 16;
+    const size_t shards = argc > 3 ? std::atoi(argv[3]) : 4;
+
+    const std::string dir = ft_test::scratch_dir("bench_durability");
+    const char* names[] = { "none", "file", "group" };
+    std::vector<ft::TransferPtr> transfers;
+
+    std::cout << files << " 4KB files from " << clients << " clients to a " << shards << "-shard server" << std::endl;
+
+    for (int mode = ft::DurabilityMode::NONE; mode <= ft::DurabilityMode::GROUP; ++mode)
+    {
+        std::stringstream port, path;
+        port << 17060 + mode;
+        path << dir << "server" << mode << "/";
+
+        ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port.str(), path.str(), dir + "logs/", shards);
+        ft::set_durability(server, static_cast<ft::DurabilityMode::Mode>(mode), 5);
+        transfers.push_back(server);
+
+        std::vector<ft::TransferPtr> senders;
+        for (int i = 0; i < clients; ++i)
+        {
+            senders.push_back(ft::make_transfer_client("127.0.0.1", port.str(), dir + "client/", dir + "logs/"));
+            ft::set_upload_ack(senders.back(), true);
+            transfers.push_back(senders.back());
+        }
+
+        boost::posix_time::ptime start = ft_test::now();
+        std::vector<ft::CompletionPtr> completions;
+        for (int i = 0; i < files; ++i)
+        {
+            std::stringstream id;
+            id << "f" << i;
+            completions.push_back(ft::send(senders[i % clients], ft::make_memory_source(ft_test::blob(4096, i)), id.str(), "ts", "20200606", "930", "1530"));
+        }
+
+        int stored = 0;
+        for (int i = 0; i < files; ++i)
+            stored += ft::wait(completions[i]).status == ft::TransferResult::OK;
+
+        long ms = std::max<long>(ft_test::elapsed_ms(start), 1);
+        std::cout << "  " << names[mode] << "\t" << stored << " stored in " << ms << "ms, " << stored * 1000L / ms << " files/s" << std::endl;
+    }
+
+    std::cout << "  group\tabout " << files_per_sync(dir + "logs/file_transfer.log") << " files per syncfs" << std::endl;
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,93 @@
+#include "test_util.h"
+
+#include <cstring>
+
+#include <boost/bind.hpp>
+
+#include "file_buffer_arena.h"
+
+// Receive buffers come from a budget. Over it a receive waits for a slab instead of reading, and
+// goes on once one comes back; every upload still arrives whole.
+static void count(int* calls)
+{
+    ++*calls;
+}
+
+static void check_arena()
+{
+    // the smallest budget there is, one chunk
+    ft::Buffer_arena arena(0);
+
+    std::vector<ft::Buffer_arena::Slab*> slabs;
+    int retries = 0;
+    for (size_t i = 0; i < ft::Buffer_arena::chunk_size / ft::Buffer_arena::slab_size; ++i)
+    {
+        ft::Buffer_arena::Slab* slab = arena.acquire(boost::bind(&count, &retries));
+        FT_CHECK(slab != NULL);
+        if (!slab)
+            return;
+
+        FT_CHECK(slab->size == ft::Buffer_arena::slab_size);
+        std::memset(slab->data, static_cast<int>(i), slab->size);
+        slabs.push_back(slab);
+    }
+
+    // over budget: nothing now, a call once a slab is back
+    FT_CHECK(arena.acquire(boost::bind(&count, &retries)) == NULL);
+    FT_CHECK(retries == 0);
+
+    ft::Buffer_arena::Slab* returned = slabs.back();
+    slabs.pop_back();
+    arena.release(returned);
+    FT_CHECK(retries == 1);
+
+    // the same memory again
+    ft::Buffer_arena::Slab* again = arena.acquire(boost::bind(&count, &retries));
+    FT_CHECK(again == returned);
+    slabs.push_back(again);
+
+    // a larger budget maps more
+    arena.set_budget(2 * ft::Buffer_arena::chunk_size);
+    ft::Buffer_arena::Slab* more = arena.acquire(boost::bind(&count, &retries));
+    FT_CHECK(more != NULL);
+    slabs.push_back(more);
+
+    for (size_t i = 0; i < slabs.size(); ++i)
+        arena.release(slabs[i]);
+    FT_CHECK(retries == 1);
+}
+
+int main()
+{
+    check_arena();
+
+    const std::string dir = ft_test::scratch_dir("buffer_arena");
+    const std::string port = "17035";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::set_buffer_budget(server, ft::Buffer_arena::chunk_size);
+
+    // more receives at once than the budget has slabs
+    const int uploads = 32;
+    std::vector<ft::TransferPtr> clients;
+    std::vector<ft::CompletionPtr> completions;
+    for (int i = 0; i < uploads; ++i)
+    {
+        clients.push_back(ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/"));
+        ft::set_upload_ack(clients.back(), true);
+
+        std::stringstream id;
+        id << "f" << i;
+        completions.push_back(ft::send(clients.back(), ft::make_memory_source(ft_test::blob(1024 * 1024, i)), id.str(), "ts", "20200606", "930", "1530"));
+    }
+
+    for (int i = 0; i < uploads; ++i)
+    {
+        std::stringstream id;
+        id << "f" << i;
+        FT_CHECK(ft::wait(completions[i]).status == ft::TransferResult::OK);
+        FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", id.str(), "ts")) == *ft_test::blob(1024 * 1024, i));
+    }
+
+    return ft_test::finish(dir);
+}
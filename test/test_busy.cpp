@@ -0,0 +1,74 @@
+#include "test_util.h"
+
+// A server over its admission limits answers BUSY with the retry hint right away instead of
+// queueing the work, and takes it once there is room again.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("busy");
+    const std::string port = "17030";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr slow = ft::make_transfer_client("127.0.0.1", port, dir + "slow/", dir + "logs/");
+    ft::TransferPtr fast = ft::make_transfer_client("127.0.0.1", port, dir + "fast/", dir + "logs/");
+    // uploads are over once stored and their receive has left the limits
+    ft::set_upload_ack(slow, true);
+    ft::set_upload_ack(fast, true);
+
+    ft::AdmissionLimits limits;
+    limits.max_receives = 1;
+    limits.max_bytes_in_flight = 4 * 1024 * 1024;
+    limits.retry_after_ms = 250;
+    ft::set_admission_limits(server, limits);
+
+    // the one receive allowed, busy for about a second
+    boost::shared_ptr<std::vector<char> > large = ft_test::blob(2 * 1024 * 1024, 30);
+    ft::set_connection_rate(slow, 2 * 1024 * 1024);
+    ft::CompletionPtr upload = ft::send(slow, ft::make_memory_source(large), "large", "ts", "20200606", "930", "1530");
+    ::usleep(300 * 1000);
+    FT_CHECK(!ft::is_complete(upload));
+
+    boost::shared_ptr<std::vector<char> > small = ft_test::blob(4096, 31);
+    boost::posix_time::ptime start = ft_test::now();
+    ft::TransferResult shed = ft::wait(ft::send(fast, ft::make_memory_source(small), "small", "ts", "20200606", "930", "1530"));
+    FT_CHECK(shed.status == ft::TransferResult::BUSY);
+    FT_CHECK(shed.retry_after_ms == 250);
+    FT_CHECK(ft_test::elapsed_ms(start) < 300);
+    FT_CHECK(!ft::is_complete(upload));
+
+    // queries are no receives and still served
+    FT_CHECK(ft::wait(ft::query(fast, "large", "ts", "20200606", "930", "1530")).status != ft::TransferResult::BUSY);
+
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+
+    ft::TransferResult retried = ft::wait(ft::send(fast, ft::make_memory_source(small), "small", "ts", "20200606", "930", "1530"));
+    FT_CHECK(retried.status == ft::TransferResult::OK);
+
+    // larger than all the bytes allowed in flight together, but alone
+    boost::shared_ptr<std::vector<char> > huge = ft_test::blob(5 * 1024 * 1024, 32);
+    FT_CHECK(ft::wait(ft::send(fast, ft::make_memory_source(huge), "huge", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    // a stream of unknown size counts the bytes it has received
+    limits.max_receives = 0;
+    ft::set_admission_limits(server, limits);
+
+    boost::shared_ptr<std::vector<char> > streamed = ft_test::blob(3 * 1024 * 1024, 33);
+    int fds[2];
+    FT_CHECK(::pipe(fds) == 0);
+    ft::CompletionPtr stream = ft::send(slow, ft::make_pipe_source(fds[0]), "stream", "ts", "20200606", "930", "1530");
+    FT_CHECK(::write(fds[1], &(*streamed)[0], streamed->size()) == static_cast<ssize_t>(streamed->size()));
+    ::usleep(1500 * 1000);
+
+    boost::shared_ptr<std::vector<char> > medium = ft_test::blob(3 * 1024 * 1024, 34);
+    FT_CHECK(ft::wait(ft::send(fast, ft::make_memory_source(medium), "medium", "ts", "20200606", "930", "1530")).status == ft::TransferResult::BUSY);
+
+    ::close(fds[1]);
+    FT_CHECK(ft::wait(stream).status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait(ft::send(fast, ft::make_memory_source(medium), "medium", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "large", "ts")) == *large);
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "small", "ts")) == *small);
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "huge", "ts")) == *huge);
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "stream", "ts")) == *streamed);
+
+    return ft_test::finish(dir);
+}
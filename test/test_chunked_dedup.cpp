@@ -0,0 +1,47 @@
+#include "test_util.h"
+
+// With chunked dedup an upload that differs from a stored one by a small edit is answered NEED
+// for the few chunks around the edit, sends only those, and is put together on the server.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("chunked_dedup");
+    const std::string port = "17042";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+    ft::set_dedup_threshold(client, 64 * 1024);
+    ft::set_chunked_dedup(client, true);
+
+    boost::shared_ptr<std::vector<char> > original = ft_test::blob(2 * 1024 * 1024, 42);
+
+    ft::TransferResult first = ft::wait(ft::send(client, ft::make_memory_source(original), "original", "ts", "20200606", "930", "1530"));
+    FT_CHECK(first.status == ft::TransferResult::OK);
+    FT_CHECK(first.dedup_bytes == 0);
+
+    // a hundred bytes inserted in the middle shift everything after them
+    boost::shared_ptr<std::vector<char> > edited(new std::vector<char>(*original));
+    boost::shared_ptr<std::vector<char> > insert = ft_test::blob(100, 43);
+    edited->insert(edited->begin() + edited->size() / 2, insert->begin(), insert->end());
+
+    ft::TransferResult second = ft::wait(ft::send(client, ft::make_memory_source(edited), "edited", "ts", "20200606", "930", "1530"));
+    FT_CHECK(second.status == ft::TransferResult::OK);
+    FT_CHECK(!second.deduplicated);
+    FT_CHECK(second.bytes + second.dedup_bytes == static_cast<boost::int64_t>(edited->size()));
+    FT_CHECK(second.dedup_bytes > static_cast<boost::int64_t>(edited->size()) * 8 / 10);
+
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    FT_CHECK(ft::wait(ft::query(client, "edited", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *edited);
+    FT_CHECK(ft::wait(ft::query(client, "original", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *original);
+
+    // every chunk known: nothing is sent
+    ft::TransferResult copy = ft::wait(ft::send(client, ft::make_memory_source(edited), "copy", "ts", "20200606", "930", "1530"));
+    FT_CHECK(copy.status == ft::TransferResult::OK);
+    FT_CHECK(copy.bytes == 0);
+    FT_CHECK(ft::wait(ft::query(client, "copy", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *edited);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,91 @@
+#include "test_util.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// send() and query() hand back a completion that can be polled, waited on with or without a
+// timeout, turned into a future or given a handler, before or after the transfer is over.
+struct Recorder
+{
+    boost::mutex mutex;
+    std::vector<ft::TransferResult> results;
+    std::vector<boost::thread::id> threads;
+
+    void record(const ft::TransferResult& result)
+    {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        results.push_back(result);
+        threads.push_back(boost::this_thread::get_id());
+    }
+
+    size_t size()
+    {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        return results.size();
+    }
+};
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("completion");
+    const std::string port = "17033";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+    ft::set_connection_rate(client, 4 * 1024 * 1024);
+
+    // about half a second at the connection rate
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(2 * 1024 * 1024, 33);
+    Recorder recorder;
+
+    ft::CompletionPtr upload = ft::send(client, ft::make_memory_source(data), "file", "ts", "20200606", "930", "1530");
+    ft::on_complete(upload, boost::bind(&Recorder::record, &recorder, _1));
+    boost::shared_future<ft::TransferResult> future = ft::get_future(upload);
+    FT_CHECK(!ft::is_complete(upload));
+
+    // the same file once more while it is pending
+    ft::TransferResult twice = ft::wait(ft::send(client, ft::make_memory_source(data), "file", "ts", "20200606", "930", "1530"));
+    FT_CHECK(twice.status == ft::TransferResult::REJECTED);
+
+    ft::TransferResult result;
+    FT_CHECK(!ft::wait(upload, boost::posix_time::milliseconds(50), result));
+    FT_CHECK(ft::wait(upload, boost::posix_time::seconds(10), result));
+    FT_CHECK(result.status == ft::TransferResult::OK);
+    FT_CHECK(result.key == "file_ts_20200606_930_1530");
+    FT_CHECK(result.bytes == static_cast<boost::int64_t>(data->size()));
+    FT_CHECK(result.duration >= boost::posix_time::milliseconds(200));
+    FT_CHECK(ft::is_complete(upload));
+
+    FT_CHECK(future.get().status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+
+    // the handler ran once, on the transfer thread
+    for (int i = 0; i < 100 && recorder.size() == 0; ++i)
+        ::usleep(10 * 1000);
+    FT_CHECK(recorder.size() == 1);
+    FT_CHECK(recorder.threads[0] != boost::this_thread::get_id());
+
+    // one added afterwards runs right away, on the caller's thread
+    ft::on_complete(upload, boost::bind(&Recorder::record, &recorder, _1));
+    FT_CHECK(recorder.size() == 2);
+    FT_CHECK(recorder.threads[1] == boost::this_thread::get_id());
+    FT_CHECK(recorder.results[1].status == ft::TransferResult::OK);
+
+    // queries complete the same way, also when there is nothing
+    ft::set_connection_rate(client, 0);
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    ft::CompletionPtr query = ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_memory_sink(received));
+    FT_CHECK(ft::get_future(query).get().status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+
+    ft::CompletionPtr missing = ft::query(client, "missing", "ts", "20200606", "930", "1530");
+    ft::on_complete(missing, boost::bind(&Recorder::record, &recorder, _1));
+    FT_CHECK(ft::wait(missing).status == ft::TransferResult::NOT_FOUND);
+    for (int i = 0; i < 100 && recorder.size() < 3; ++i)
+        ::usleep(10 * 1000);
+    FT_CHECK(recorder.size() == 3);
+    FT_CHECK(recorder.results[2].status == ft::TransferResult::NOT_FOUND);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,87 @@
+#include "test_util.h"
+
+#include "file_handler_alloc.h"
+
+// Connections go back to a pool and handlers reuse the memory of the one before. Nothing of a
+// transfer may be left over for the next one on the same connection: a burst of uploads, hits,
+// misses and rejected uploads keeps every result apart.
+static void check_allocator()
+{
+    ft::Handler_allocator allocator;
+
+    void* first = allocator.allocate(128);
+    // taken: a second handler goes to the heap, and so does one too large for the slot
+    void* second = allocator.allocate(128);
+    FT_CHECK(second != first);
+    allocator.deallocate(second);
+    allocator.deallocate(first);
+
+    // free again, the same memory
+    FT_CHECK(allocator.allocate(64) == first);
+    allocator.deallocate(first);
+
+    void* large = allocator.allocate(4096);
+    FT_CHECK(large != first);
+    FT_CHECK(allocator.allocate(64) == first);
+    allocator.deallocate(large);
+    allocator.deallocate(first);
+}
+
+int main()
+{
+    check_allocator();
+
+    const std::string dir = ft_test::scratch_dir("connection_reuse");
+    const std::string port = "17034";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // one receive at a time, a second one concurrent with it is turned down
+    ft::AdmissionLimits limits;
+    limits.max_receives = 1;
+    limits.retry_after_ms = 10;
+    ft::set_admission_limits(server, limits);
+
+    for (int round = 0; round < 200; ++round)
+    {
+        std::stringstream id;
+        id << "f" << round;
+        boost::shared_ptr<std::vector<char> > data = ft_test::blob(1000 + round * 37, round);
+
+        FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(data), id.str(), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+        boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+        ft::TransferResult hit = ft::wait(ft::query(client, id.str(), "ts", "20200606", "930", "1530", ft::make_memory_sink(received)));
+        FT_CHECK(hit.status == ft::TransferResult::OK);
+        FT_CHECK(hit.bytes == static_cast<boost::int64_t>(data->size()));
+        FT_CHECK(*received == *data);
+
+        ft::TransferResult miss = ft::wait(ft::query(client, "missing", "ts", "20200606", "930", "1530"));
+        FT_CHECK(miss.status == ft::TransferResult::NOT_FOUND);
+        FT_CHECK(miss.bytes == 0);
+
+        // every tenth round two uploads at once, one of them busy
+        if (round % 10 == 0)
+        {
+            ft::set_connection_rate(client, 1024 * 1024);
+            ft::CompletionPtr slow = ft::send(client, ft::make_memory_source(ft_test::blob(256 * 1024, round)), "slow", "ts", "20200606", "930", "1530");
+            ::usleep(50 * 1000);
+            ft::TransferResult busy = ft::wait(ft::send(client, ft::make_memory_source(data), "busy", "ts", "20200606", "930", "1530"));
+            FT_CHECK(busy.status == ft::TransferResult::BUSY);
+            FT_CHECK(busy.retry_after_ms == 10);
+            FT_CHECK(ft::wait(slow).status == ft::TransferResult::OK);
+            ft::set_connection_rate(client, 0);
+        }
+    }
+
+    for (int round = 0; round < 200; ++round)
+    {
+        std::stringstream id;
+        id << "f" << round;
+        FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", id.str(), "ts")) == *ft_test::blob(1000 + round * 37, round));
+    }
+
+    return ft_test::finish(dir);
+}
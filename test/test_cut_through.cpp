@@ -0,0 +1,44 @@
+#include "test_util.h"
+
+// A query for a file still being received streams it as it arrives instead of answering
+// NOT_FOUND or a truncated copy, and ends with the whole file.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("cut_through");
+    const std::string port = "17027";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr reader = ft::make_transfer_client("127.0.0.1", port, dir + "reader/", dir + "logs/");
+    ft::TransferPtr writer = ft::make_transfer_client("127.0.0.1", port, dir + "writer/", dir + "logs/");
+
+    // about two seconds on the wire
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(4 * 1024 * 1024, 27);
+    ft::set_connection_rate(writer, 2 * 1024 * 1024);
+
+    ft::CompletionPtr upload = ft::send(writer, ft::make_memory_source(data), "growing", "ts", "20200606", "930", "1530");
+    ::usleep(500 * 1000);
+    FT_CHECK(!ft::is_complete(upload));
+
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    ft::CompletionPtr query = ft::query(reader, "growing", "ts", "20200606", "930", "1530", ft::make_memory_sink(received));
+
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+
+    ft::TransferResult result = ft::wait(query);
+    FT_CHECK(result.status == ft::TransferResult::OK);
+    FT_CHECK(result.bytes == static_cast<boost::int64_t>(data->size()));
+    FT_CHECK(*received == *data);
+
+    // into a file as well; other content, the same would be deduplicated
+    data = ft_test::blob(4 * 1024 * 1024, 28);
+    upload = ft::send(writer, ft::make_memory_source(data), "growing2", "ts", "20200606", "930", "1530");
+    ::usleep(500 * 1000);
+    FT_CHECK(!ft::is_complete(upload));
+
+    result = ft::wait(ft::query(reader, "growing2", "ts", "20200606", "930", "1530"));
+    FT_CHECK(result.status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "reader/", "growing2", "ts")) == *data);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,111 @@
+#include "test_util.h"
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+// A server from before dedup: takes the data right after the SEND header, answers nothing.
+static void legacy_server(boost::asio::ip::tcp::acceptor* acceptor, size_t uploads, std::vector<size_t>* received)
+{
+    for (size_t i = 0; i < uploads; ++i)
+    {
+        boost::asio::ip::tcp::socket socket(acceptor->get_io_service());
+        acceptor->accept(socket);
+
+        boost::system::error_code ec;
+        boost::asio::streambuf buffer;
+        size_t header = boost::asio::read_until(socket, buffer, ';', ec);
+
+        size_t bytes = 0;
+        char data[65536];
+        while (!ec)
+            bytes += socket.read_some(boost::asio::buffer(data), ec);
+
+        received->push_back(bytes + buffer.size() - header);
+    }
+}
+
+// An upload of content the server has stored already is answered HAVE and linked to it without
+// sending the data; the copies stay independent when one of them is overwritten.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("dedup");
+    const std::string port = "17041";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+    ft::set_dedup_threshold(client, 64 * 1024);
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(1024 * 1024, 41);
+
+    ft::TransferResult first = ft::wait(ft::send(client, ft::make_memory_source(data), "first", "ts", "20200606", "930", "1530"));
+    FT_CHECK(first.status == ft::TransferResult::OK);
+    FT_CHECK(!first.deduplicated);
+    FT_CHECK(first.bytes == static_cast<boost::int64_t>(data->size()));
+
+    ft::TransferResult second = ft::wait(ft::send(client, ft::make_memory_source(data), "second", "ts", "20200606", "930", "1530"));
+    FT_CHECK(second.status == ft::TransferResult::OK);
+    FT_CHECK(second.deduplicated);
+    FT_CHECK(second.bytes == 0);
+    FT_CHECK(second.dedup_bytes == static_cast<boost::int64_t>(data->size()));
+
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    FT_CHECK(ft::wait(ft::query(client, "second", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+
+    // new content under the first key leaves the second one as it was
+    boost::shared_ptr<std::vector<char> > other = ft_test::blob(1024 * 1024, 42);
+    ft::TransferResult overwrite = ft::wait(ft::send(client, ft::make_memory_source(other), "first", "ts", "20200606", "930", "1530"));
+    FT_CHECK(overwrite.status == ft::TransferResult::OK);
+    FT_CHECK(!overwrite.deduplicated);
+
+    FT_CHECK(ft::wait(ft::query(client, "first", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *other);
+    FT_CHECK(ft::wait(ft::query(client, "second", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+
+    // below the threshold the content is sent every time
+    boost::shared_ptr<std::vector<char> > small = ft_test::blob(4096, 43);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(small), "small", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    ft::TransferResult again = ft::wait(ft::send(client, ft::make_memory_source(small), "small2", "ts", "20200606", "930", "1530"));
+    FT_CHECK(again.status == ft::TransferResult::OK);
+    FT_CHECK(!again.deduplicated);
+    FT_CHECK(again.bytes == static_cast<boost::int64_t>(small->size()));
+
+    // a server with replicas receives the content again, to forward it
+    ft::TransferPtr replica = ft::make_transfer_server("127.0.0.1", "17142", dir + "replica/", dir + "logs/");
+    ft::TransferPtr primary = ft::make_transfer_server("127.0.0.1", "17143", dir + "primary/", dir + "logs/");
+    ft::add_replica(primary, "127.0.0.1", "17142");
+    ft::TransferPtr fanout = ft::make_transfer_client("127.0.0.1", "17143", dir + "fanout/", dir + "logs/");
+    ft::set_upload_ack(fanout, true);
+    ft::set_dedup_threshold(fanout, 64 * 1024);
+
+    FT_CHECK(ft::wait(ft::send(fanout, ft::make_memory_source(data), "r1", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    ft::TransferResult resent = ft::wait(ft::send(fanout, ft::make_memory_source(data), "r2", "ts", "20200606", "930", "1530"));
+    FT_CHECK(resent.status == ft::TransferResult::OK);
+    FT_CHECK(!resent.deduplicated);
+
+    ft::TransferPtr replica_reader = ft::make_transfer_client("127.0.0.1", "17142", dir + "replica_reader/", dir + "logs/");
+    FT_CHECK(ft::wait(ft::query(replica_reader, "r2", "ts", "20200606", "930", "1530", ft::make_memory_sink(received),
+        ft_test::now() + boost::posix_time::seconds(10))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+
+    // off by default, and a server that does not answer the hash gets the data after a while
+    boost::asio::io_service ios;
+    boost::asio::ip::tcp::acceptor acceptor(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 17141));
+    std::vector<size_t> received_sizes;
+    boost::thread legacy(boost::bind(&legacy_server, &acceptor, 2, &received_sizes));
+
+    ft::TransferPtr old_client = ft::make_transfer_client("127.0.0.1", "17141", dir + "old/", dir + "logs/");
+    boost::posix_time::ptime start = ft_test::now();
+    FT_CHECK(ft::wait(ft::send(old_client, ft::make_memory_source(data), "legacy", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::elapsed_ms(start) < 2000);
+
+    ft::set_dedup_threshold(old_client, 64 * 1024);
+    FT_CHECK(ft::wait(ft::send(old_client, ft::make_memory_source(data), "legacy2", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    legacy.join();
+    FT_CHECK(received_sizes.size() == 2);
+    FT_CHECK(received_sizes.size() == 2 && received_sizes[0] == data->size() && received_sizes[1] == data->size());
+
+    return ft_test::finish(dir);
+}
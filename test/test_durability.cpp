@@ -0,0 +1,69 @@
+#include "test_util.h"
+
+// An upload asking for DONE is over once the server has stored the file as its durability mode
+// says: written, synced on its own, or synced with the group of files received around it.
+static const int uploads = 16;
+
+static void upload_all(ft::TransferPtr& client, const std::string& server_path, const std::string& prefix)
+{
+    std::vector<ft::CompletionPtr> completions;
+    for (int i = 0; i < uploads; ++i)
+    {
+        std::stringstream id;
+        id << prefix << i;
+        completions.push_back(ft::send(client, ft::make_memory_source(ft_test::blob(64 * 1024, i)), id.str(), "ts", "20200606", "930", "1530"));
+    }
+
+    for (int i = 0; i < uploads; ++i)
+    {
+        std::stringstream id;
+        id << prefix << i;
+        FT_CHECK(ft::wait(completions[i]).status == ft::TransferResult::OK);
+        // stored by the time DONE arrived
+        FT_CHECK(ft_test::read_file(ft_test::stored_path(server_path, id.str(), "ts")) == *ft_test::blob(64 * 1024, i));
+    }
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("durability");
+    // kept to the end, releasing a server waits for its listener like stop()
+    std::vector<ft::TransferPtr> transfers;
+
+    // none, per file, group
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        std::stringstream port, path;
+        port << 17050 + mode;
+        path << dir << "server" << mode << "/";
+
+        ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port.str(), path.str(), dir + "logs/");
+        ft::set_durability(server, static_cast<ft::DurabilityMode::Mode>(mode), 5);
+        ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port.str(), dir + "client/", dir + "logs/");
+        ft::set_upload_ack(client, true);
+        transfers.push_back(server);
+        transfers.push_back(client);
+
+        upload_all(client, path.str(), "m");
+    }
+
+    // DONE waits for the group to be synced, an upload not asking for it does not
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", "17053", dir + "group/", dir + "logs/");
+    ft::set_durability(server, ft::DurabilityMode::GROUP, 500);
+    ft::TransferPtr acked = ft::make_transfer_client("127.0.0.1", "17053", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(acked, true);
+    ft::TransferPtr unacked = ft::make_transfer_client("127.0.0.1", "17053", dir + "client/", dir + "logs/");
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(4096, 50);
+    boost::posix_time::ptime start = ft_test::now();
+    FT_CHECK(ft::wait(ft::send(acked, ft::make_memory_source(data), "acked", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::elapsed_ms(start) >= 450);
+
+    start = ft_test::now();
+    FT_CHECK(ft::wait(ft::send(unacked, ft::make_memory_source(data), "unacked", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::elapsed_ms(start) < 400);
+
+    upload_all(acked, dir + "group/", "g");
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,101 @@
+#include "test_util.h"
+
+// Several servers on one port: two sharing it with reuse_port both take connections, a new
+// server takes the listeners over at the handover path while the old one lets its upload run to
+// the end, and a drained server takes nothing new.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static size_t count_files(const std::string& dir, const char* prefix, int n)
+{
+    size_t count = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!ft_test::find_file(dir, file_id(prefix, i) + "_ts_20200606_930_1530").empty())
+            ++count;
+    }
+    return count;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("handover");
+
+    // reuse_port: the kernel spreads new connections over both servers
+    ft::ServerOptions shared;
+    shared.reuse_port = true;
+    ft::TransferPtr first = ft::make_transfer_server("127.0.0.1", "17037", dir + "first/", dir + "logs/", shared);
+    ft::TransferPtr second = ft::make_transfer_server("127.0.0.1", "17037", dir + "second/", dir + "logs/", shared);
+
+    std::vector<ft::TransferPtr> clients;
+    for (int i = 0; i < 32; ++i)
+    {
+        clients.push_back(ft::make_transfer_client("127.0.0.1", "17037", dir + "client/", dir + "logs/"));
+        ft::set_upload_ack(clients.back(), true);
+        FT_CHECK(ft::wait(ft::send(clients.back(), ft::make_memory_source(ft_test::blob(4096, i)), file_id("r", i), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    }
+
+    size_t on_first = count_files(dir + "first/ts/", "r", 32);
+    size_t on_second = count_files(dir + "second/ts/", "r", 32);
+    FT_CHECK(on_first + on_second == 32);
+    FT_CHECK(on_first > 0 && on_second > 0);
+
+    // handover: the old server finishes the upload it has, the new one takes every new connection
+    ft::ServerOptions handing;
+    handing.handover_path = dir + "handover.sock";
+    ft::TransferPtr old_server = ft::make_transfer_server("127.0.0.1", "17038", dir + "old/", dir + "logs/", handing);
+
+    ft::TransferPtr slow = ft::make_transfer_client("127.0.0.1", "17038", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(slow, true);
+    ft::set_connection_rate(slow, 1024 * 1024);
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(1536 * 1024, 37);
+    ft::CompletionPtr upload = ft::send(slow, ft::make_memory_source(data), "slow", "ts", "20200606", "930", "1530");
+    ::usleep(300 * 1000);
+
+    ft::TransferPtr new_server = ft::make_transfer_server("127.0.0.1", "17038", dir + "new/", dir + "logs/", handing);
+
+    // the upload still runs on the old server
+    FT_CHECK(!ft::wait_drained(old_server, 200));
+
+    for (int i = 0; i < 8; ++i)
+    {
+        ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", "17038", dir + "client/", dir + "logs/");
+        ft::set_upload_ack(client, true);
+        clients.push_back(client);
+        FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(4096, 100 + i)), file_id("h", i), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    }
+    FT_CHECK(count_files(dir + "new/ts/", "h", 8) == 8);
+
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait_drained(old_server, 5000));
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "old/", "slow", "ts")) == *data);
+
+    // and is the one offering the listeners next
+    ft::TransferPtr newest = ft::make_transfer_server("127.0.0.1", "17038", dir + "newest/", dir + "logs/", handing);
+    FT_CHECK(ft::wait_drained(new_server, 5000));
+
+    ft::TransferPtr late = ft::make_transfer_client("127.0.0.1", "17038", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(late, true);
+    FT_CHECK(ft::wait(ft::send(late, ft::make_memory_source(ft_test::blob(4096, 200)), "n0", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(!ft_test::find_file(dir + "newest/ts/", "n0_ts_20200606_930_1530").empty());
+
+    // drain: nothing is accepted any more
+    ft::TransferPtr drained = ft::make_transfer_server("127.0.0.1", "17039", dir + "drained/", dir + "logs/");
+    ft::TransferPtr before = ft::make_transfer_client("127.0.0.1", "17039", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(before, true);
+    FT_CHECK(ft::wait(ft::send(before, ft::make_memory_source(ft_test::blob(4096, 300)), "d0", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    FT_CHECK(!ft::wait_drained(drained, 100));
+    ft::drain(drained);
+    FT_CHECK(ft::wait_drained(drained, 5000));
+
+    ft::TransferPtr after = ft::make_transfer_client("127.0.0.1", "17039", dir + "client/", dir + "logs/");
+    FT_CHECK(ft::wait(ft::send(after, ft::make_memory_source(ft_test::blob(4096, 301)), "d1", "ts", "20200606", "930", "1530")).status != ft::TransferResult::OK);
+    FT_CHECK(ft_test::find_file(dir + "drained/ts/", "d1_ts_20200606_930_1530").empty());
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,77 @@
+#include "test_util.h"
+
+#include <fcntl.h>
+
+#include <boost/bind.hpp>
+
+// Files past 2GB go up and down whole: sizes and offsets are 64 bit on the wire and in between.
+static const boost::int64_t large_size = (boost::int64_t(1) << 31) + 4096;
+static const char tail[] = "the last bytes";
+
+struct Counter
+{
+    boost::int64_t bytes;
+    std::string last;
+
+    bool handle(const char* data, size_t size, const boost::function<void ()>&)
+    {
+        bytes += size;
+        last = (last + std::string(data, size)).substr(std::max<size_t>(last.size() + size, sizeof(tail) - 1) - (sizeof(tail) - 1));
+        return true;
+    }
+};
+
+// sparse but for the tail, nothing to write to the disk
+static bool make_large_file(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0)
+        return false;
+
+    bool made = ::ftruncate(fd, large_size) == 0
+        && ::pwrite(fd, tail, sizeof(tail) - 1, large_size - (sizeof(tail) - 1)) == static_cast<ssize_t>(sizeof(tail) - 1);
+    ::close(fd);
+    return made;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("large_file");
+    const std::string port = "17031";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // downloaded from the server
+    boost::filesystem::create_directories(dir + "server/ts/");
+    FT_CHECK(make_large_file(ft_test::stored_path(dir + "server/", "stored", "ts")));
+
+    Counter counter = Counter();
+    ft::TransferResult query = ft::wait(ft::query(client, "stored", "ts", "20200606", "930", "1530",
+        ft::make_callback_sink(boost::bind(&Counter::handle, &counter, _1, _2, _3))));
+    FT_CHECK(query.status == ft::TransferResult::OK);
+    FT_CHECK(query.bytes == large_size);
+    FT_CHECK(counter.bytes == large_size);
+    FT_CHECK(counter.last == tail);
+
+    // uploaded to it
+    const std::string path = dir + "upload";
+    FT_CHECK(make_large_file(path));
+
+    ft::TransferResult sent = ft::wait(ft::send(client, ft::make_file_source(path), "sent", "ts", "20200606", "930", "1530"));
+    FT_CHECK(sent.status == ft::TransferResult::OK);
+    FT_CHECK(sent.bytes == large_size);
+
+    const std::string stored = ft_test::stored_path(dir + "server/", "sent", "ts");
+    boost::system::error_code ec;
+    FT_CHECK(static_cast<boost::int64_t>(boost::filesystem::file_size(stored, ec)) == large_size);
+
+    char last[sizeof(tail) - 1];
+    int fd = ::open(stored.c_str(), O_RDONLY);
+    FT_CHECK(::pread(fd, last, sizeof(last), large_size - sizeof(last)) == static_cast<ssize_t>(sizeof(last)));
+    FT_CHECK(std::string(last, sizeof(last)) == tail);
+    ::close(fd);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,68 @@
+#include "test_util.h"
+
+// A query with a deadline waits for a missing file and is answered once the file is committed,
+// or with NOT_FOUND once the deadline passes.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("long_poll");
+    const std::string port = "17026";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr reader = ft::make_transfer_client("127.0.0.1", port, dir + "reader/", dir + "logs/");
+    ft::TransferPtr writer = ft::make_transfer_client("127.0.0.1", port, dir + "writer/", dir + "logs/");
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(300000, 26);
+
+    // woken by the upload long before its deadline
+    boost::posix_time::ptime start = ft_test::now();
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    ft::CompletionPtr query = ft::query(reader, "late", "ts", "20200606", "930", "1530", ft::make_memory_sink(received),
+        start + boost::posix_time::seconds(10));
+
+    ::usleep(300 * 1000);
+    FT_CHECK(!ft::is_complete(query));
+
+    ft::TransferResult sent = ft::wait(ft::send(writer, ft::make_memory_source(data), "late", "ts", "20200606", "930", "1530"));
+    FT_CHECK(sent.status == ft::TransferResult::OK);
+
+    ft::TransferResult woken = ft::wait(query);
+    FT_CHECK(woken.status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+    FT_CHECK(ft_test::elapsed_ms(start) < 5000);
+
+    // nothing arrives: NOT_FOUND at the deadline, not before and not much after
+    start = ft_test::now();
+    ft::TransferResult expired = ft::wait(ft::query(reader, "never", "ts", "20200606", "930", "1530",
+        start + boost::posix_time::milliseconds(1000)));
+    FT_CHECK(expired.status == ft::TransferResult::NOT_FOUND);
+    FT_CHECK(ft_test::elapsed_ms(start) >= 900);
+    FT_CHECK(ft_test::elapsed_ms(start) < 5000);
+
+    // without a deadline a missing file is answered right away
+    start = ft_test::now();
+    ft::TransferResult missing = ft::wait(ft::query(reader, "never", "ts", "20200606", "930", "1530"));
+    FT_CHECK(missing.status == ft::TransferResult::NOT_FOUND);
+    FT_CHECK(ft_test::elapsed_ms(start) < 900);
+
+    // a waiting client that hangs up frees its connection long before the deadline
+    ft::AdmissionLimits limits;
+    limits.max_connections = 1;
+    ft::set_admission_limits(server, limits);
+    {
+        boost::asio::io_service ios;
+        boost::asio::ip::tcp::socket socket(ios);
+        boost::system::error_code ec;
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 17026), ec);
+        boost::asio::write(socket, boost::asio::buffer(std::string("CMD=QUERY,ID=gone,TYPE=ts,DATE=20200606,BEGIN=930,END=1530,WAIT=30000,;")), ec);
+        FT_CHECK(!ec);
+        ::usleep(300 * 1000);
+    }
+    ::usleep(300 * 1000);
+
+    start = ft_test::now();
+    ft::TransferResult after = ft::wait(ft::query(reader, "late", "ts", "20200606", "930", "1530"));
+    FT_CHECK(after.status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::elapsed_ms(start) < 5000);
+
+    return ft_test::finish(dir);
+}
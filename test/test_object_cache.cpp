@@ -0,0 +1,89 @@
+#include "test_util.h"
+
+#include <cstdio>
+
+// Hot stored files are replied from memory: once warmed or asked for often enough, a file goes
+// out even with its disk copy gone. Files too large for the budget, of other types or not
+// matching are not warmed, a file received again replaces its cached copy, and a budget of 0
+// turns the cache off.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static bool upload(ft::TransferPtr& client, const std::string& id, const std::string& type, const std::string& date, const boost::shared_ptr<std::vector<char> >& data)
+{
+    return ft::wait(ft::send(client, ft::make_memory_source(data), id, type, date, "930", "1530")).status == ft::TransferResult::OK;
+}
+
+static bool replied(ft::TransferPtr& client, const std::string& id, const std::string& type, const std::vector<char>& data)
+{
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    return ft::wait(ft::query(client, id, type, "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK
+        && *received == data;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("object_cache");
+    const std::string port = "17144";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // the largest file kept is 1/64 of the budget, 100KB here
+    ft::set_cache_budget(server, 6400 * 1024);
+
+    for (int i = 0; i < 6; ++i)
+        FT_CHECK(upload(client, file_id("w", i), "ts", "20200606", ft_test::blob(50 * 1024, i)));
+    FT_CHECK(upload(client, "big", "ts", "20200606", ft_test::blob(200 * 1024, 10)));
+    FT_CHECK(upload(client, "yesterday", "ts", "20200605", ft_test::blob(50 * 1024, 11)));
+    FT_CHECK(upload(client, "w0", "md", "20200606", ft_test::blob(50 * 1024, 12)));
+
+    FT_CHECK(ft::warm_cache(server, "ts", "20200606") == 6);
+
+    // from memory with the files gone from disk
+    for (int i = 0; i < 6; ++i)
+        FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", file_id("w", i), "ts").c_str()) == 0);
+    for (int i = 0; i < 6; ++i)
+        FT_CHECK(replied(client, file_id("w", i), "ts", *ft_test::blob(50 * 1024, i)));
+
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "big", "ts").c_str()) == 0);
+    FT_CHECK(!replied(client, "big", "ts", *ft_test::blob(200 * 1024, 10)));
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "w0", "md").c_str()) == 0);
+    FT_CHECK(!replied(client, "w0", "md", *ft_test::blob(50 * 1024, 12)));
+
+    // received again: the new copy, from disk and then from memory
+    boost::shared_ptr<std::vector<char> > replaced = ft_test::blob(40 * 1024, 20);
+    FT_CHECK(upload(client, "w1", "ts", "20200606", replaced));
+    FT_CHECK(replied(client, "w1", "ts", *replaced));
+    FT_CHECK(replied(client, "w1", "ts", *replaced));
+    FT_CHECK(replied(client, "w1", "ts", *replaced));
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "w1", "ts").c_str()) == 0);
+    FT_CHECK(replied(client, "w1", "ts", *replaced));
+
+    // taken in by being asked for
+    boost::shared_ptr<std::vector<char> > popular = ft_test::blob(60 * 1024, 21);
+    FT_CHECK(upload(client, "popular", "ts", "20200606", popular));
+    for (int i = 0; i < 3; ++i)
+        FT_CHECK(replied(client, "popular", "ts", *popular));
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "popular", "ts").c_str()) == 0);
+    FT_CHECK(replied(client, "popular", "ts", *popular));
+
+    // off: nothing kept, nothing warmed
+    ft::set_cache_budget(server, 0);
+    FT_CHECK(!replied(client, "popular", "ts", *popular));
+    FT_CHECK(!replied(client, "w2", "ts", *ft_test::blob(50 * 1024, 2)));
+
+    FT_CHECK(upload(client, "cold", "ts", "20200606", ft_test::blob(50 * 1024, 22)));
+    FT_CHECK(ft::warm_cache(server, "ts", "20200606") == 0);
+    for (int i = 0; i < 3; ++i)
+        FT_CHECK(replied(client, "cold", "ts", *ft_test::blob(50 * 1024, 22)));
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "cold", "ts").c_str()) == 0);
+    FT_CHECK(!replied(client, "cold", "ts", *ft_test::blob(50 * 1024, 22)));
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,110 @@
+#include "test_util.h"
+
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Every page cache policy gets files through intact both ways. Archive uploads leave little of
+// themselves in the page cache, and archive files are never kept in the object cache however
+// often they are asked for, while hot ones are.
+static double resident(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    ::fstat(fd, &st);
+    void* map = ::mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const long page = ::sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((st.st_size + page - 1) / page);
+    ::mincore(map, st.st_size, &pages[0]);
+    ::munmap(map, st.st_size);
+
+    size_t count = 0;
+    for (size_t i = 0; i < pages.size(); ++i)
+        count += pages[i] & 1;
+
+    return double(count) / pages.size();
+}
+
+// whether the file system under dir drops clean pages when asked, tmpfs does not
+static bool drops_pages(const std::string& dir)
+{
+    std::string path = dir + "probe";
+    FILE* file = ::fopen(path.c_str(), "wb");
+    if (!file)
+        return false;
+
+    std::vector<char> data(1024 * 1024, 'p');
+    ::fwrite(&data[0], 1, data.size(), file);
+    ::fflush(file);
+    ::fdatasync(::fileno(file));
+    ::posix_fadvise(::fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+    ::fclose(file);
+
+    bool dropped = resident(path) < 0.5;
+    std::remove(path.c_str());
+    return dropped;
+}
+
+static bool round_trip(ft::TransferPtr& client, const std::string& id, const std::string& type, const std::vector<char>& data)
+{
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    return ft::wait(ft::query(client, id, type, "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK
+        && *received == data;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("page_cache");
+    const std::string port = "17145";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::set_type_cache_policy(server, "md", ft::CachePolicy::NORMAL);
+    ft::set_type_cache_policy(server, "bulk", ft::CachePolicy::ARCHIVE);
+    ft::set_type_cache_policy(server, "snap", ft::CachePolicy::HOT);
+
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // ts is hot by default; several read-ahead and drop-behind windows each
+    const char* types[] = { "ts", "md", "bulk", "snap" };
+    for (int i = 0; i < 4; ++i)
+    {
+        boost::shared_ptr<std::vector<char> > data = ft_test::blob(24 * 1024 * 1024 + 4321, i);
+        FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(data), "large", types[i], "20200606", "930", "1530")).status == ft::TransferResult::OK);
+        FT_CHECK(round_trip(client, "large", types[i], *data));
+        FT_CHECK(round_trip(client, "large", types[i], *data));
+    }
+
+    // written back and dropped as it came in
+    boost::shared_ptr<std::vector<char> > archived = ft_test::blob(32 * 1024 * 1024, 10);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(archived), "archived", "bulk", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    if (drops_pages(dir))
+        FT_CHECK(resident(ft_test::stored_path(dir + "server/", "archived", "bulk")) < 0.5);
+    FT_CHECK(round_trip(client, "archived", "bulk", *archived));
+
+    // asked for often, but only the hot file is replied from memory once its disk copy is gone
+    boost::shared_ptr<std::vector<char> > small = ft_test::blob(64 * 1024, 11);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(small), "small", "bulk", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(small), "small", "snap", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    for (int i = 0; i < 3; ++i)
+    {
+        FT_CHECK(round_trip(client, "small", "bulk", *small));
+        FT_CHECK(round_trip(client, "small", "snap", *small));
+    }
+
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "small", "bulk").c_str()) == 0);
+    FT_CHECK(std::remove(ft_test::stored_path(dir + "server/", "small", "snap").c_str()) == 0);
+    FT_CHECK(!round_trip(client, "small", "bulk", *small));
+    FT_CHECK(round_trip(client, "small", "snap", *small));
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,90 @@
+#include "test_util.h"
+
+#include <fstream>
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+
+// A peer that hangs up in the middle of the data: reads the header and a little, then resets.
+static void hang_up(boost::asio::ip::tcp::acceptor* acceptor)
+{
+    for (;;)
+    {
+        boost::asio::ip::tcp::socket socket(acceptor->get_io_service());
+        acceptor->accept(socket);
+
+        boost::system::error_code ec;
+        char data[65536];
+        socket.read_some(boost::asio::buffer(data), ec);
+        socket.set_option(boost::asio::socket_base::linger(true, 0), ec);
+        socket.close(ec);
+    }
+}
+
+// Received files are forwarded to every replica. Peers that go away in the middle of sendfile or
+// splice fail that transfer with EPIPE, they do not take the process down with SIGPIPE.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("replication");
+
+    boost::asio::io_service ios;
+    boost::asio::ip::tcp::acceptor acceptor(ios, boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string("127.0.0.1"), 17128));
+    boost::thread peer(boost::bind(&hang_up, &acceptor));
+
+    ft::TransferPtr replica = ft::make_transfer_server("127.0.0.1", "17129", dir + "replica/", dir + "logs/");
+    ft::TransferPtr primary = ft::make_transfer_server("127.0.0.1", "17028", dir + "primary/", dir + "logs/");
+    ft::add_replica(primary, "127.0.0.1", "17129");
+    ft::add_replica(primary, "127.0.0.1", "17128");
+
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", "17028", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(8 * 1024 * 1024, 28);
+    const std::string path = dir + "upload";
+    std::ofstream(path.c_str(), std::ios::binary).write(&(*data)[0], data->size());
+
+    FT_CHECK(ft::wait(ft::send(client, ft::make_file_source(path), "file", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    // the good replica gets it although the other one keeps hanging up
+    const std::string copy = ft_test::stored_path(dir + "replica/", "file", "ts");
+    bool forwarded = false;
+    for (int i = 0; i < 100 && !forwarded; ++i)
+    {
+        forwarded = ft_test::read_file(copy) == *data;
+        if (!forwarded)
+            ::usleep(100 * 1000);
+    }
+    FT_CHECK(forwarded);
+
+    // a reader that hangs up mid-download
+    for (int i = 0; i < 3; ++i)
+    {
+        boost::asio::ip::tcp::socket socket(ios);
+        boost::system::error_code ec;
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 17028), ec);
+        boost::asio::write(socket, boost::asio::buffer(std::string("CMD=QUERY,ID=file,TYPE=ts,DATE=20200606,BEGIN=930,END=1530,;")), ec);
+        char some[1024];
+        socket.read_some(boost::asio::buffer(some), ec);
+        socket.set_option(boost::asio::socket_base::linger(true, 0), ec);
+        socket.close(ec);
+    }
+
+    // uploads with sendfile and splice to a server that hangs up fail, and that is all
+    ft::TransferPtr dropped = ft::make_transfer_client("127.0.0.1", "17128", dir + "dropped/", dir + "logs/");
+    FT_CHECK(ft::wait(ft::send(dropped, ft::make_file_source(path), "file", "ts", "20200606", "930", "1530")).status != ft::TransferResult::OK);
+
+    int fds[2];
+    FT_CHECK(::pipe(fds) == 0);
+    boost::thread writer(boost::bind(&::write, fds[1], &(*data)[0], data->size()));
+    FT_CHECK(ft::wait(ft::send(dropped, ft::make_pipe_source(fds[0]), "pipe", "ts", "20200606", "930", "1530")).status != ft::TransferResult::OK);
+    writer.join();
+    ::close(fds[1]);
+
+    // still serving
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    FT_CHECK(ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *data);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,109 @@
+#include "test_util.h"
+
+#include <sys/wait.h>
+
+// Two servers on one storage directory, as during a handover: the new one reads the segments
+// of the old one but packs nothing while the old one still appends to them, and takes them over
+// once it has exited, with everything it appended meanwhile.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static bool upload(ft::TransferPtr& client, const std::string& id, int seed)
+{
+    return ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(4096, seed)), id, "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK;
+}
+
+static bool stored(ft::TransferPtr& client, const std::string& id, int seed)
+{
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    return ft::wait(ft::query(client, id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK
+        && *received == *ft_test::blob(4096, seed);
+}
+
+// the old server, told by the parent when to go on over to_old and answering over to_new
+static void old_server(const std::string& dir, int to_old, int to_new)
+{
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", "17147", dir + "server/", dir + "logs/");
+    ft::set_packed_storage(server, 65536);
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", "17147", dir + "old/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    char step = 0;
+    int ok = 0;
+    for (int i = 0; i < 5; ++i)
+        ok += upload(client, file_id("a", i), i);
+    step = ok == 5;
+    ::write(to_new, &step, 1);
+
+    // appended after the new server has read the segments
+    ::read(to_old, &step, 1);
+    for (int i = 5; i < 10; ++i)
+        ok += upload(client, file_id("a", i), i);
+    step = ok == 10;
+    ::write(to_new, &step, 1);
+
+    ::read(to_old, &step, 1);
+    ::_exit(0);
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("segment_handover");
+
+    int to_old[2], to_new[2];
+    FT_CHECK(::pipe(to_old) == 0 && ::pipe(to_new) == 0);
+
+    pid_t pid = ::fork();
+    if (pid == 0)
+        old_server(dir, to_old[0], to_new[1]);
+
+    char step = 0;
+    FT_CHECK(::read(to_new[0], &step, 1) == 1 && step == 1);
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", "17148", dir + "server/", dir + "logs/");
+    ft::set_packed_storage(server, 65536);
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", "17148", dir + "new/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    for (int i = 0; i < 5; ++i)
+        FT_CHECK(stored(client, file_id("a", i), i));
+
+    // stored as files while the old server appends; a1 replaces its packed copy
+    FT_CHECK(upload(client, "b0", 100));
+    FT_CHECK(upload(client, "a1", 101));
+    FT_CHECK(!ft_test::find_file(dir + "server/ts/", "b0_ts_20200606_930_1530").empty());
+    FT_CHECK(stored(client, "a1", 101));
+
+    FT_CHECK(::write(to_old[1], &step, 1) == 1);
+    FT_CHECK(::read(to_new[0], &step, 1) == 1 && step == 1);
+    FT_CHECK(::write(to_old[1], &step, 1) == 1);
+
+    int status = -1;
+    ::waitpid(pid, &status, 0);
+    FT_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // taken over within a few seconds, with what the old server appended last
+    bool taken = false;
+    for (int i = 0; i < 50 && !taken; ++i)
+    {
+        taken = stored(client, file_id("a", 9), 9);
+        if (!taken)
+            ::usleep(100 * 1000);
+    }
+    FT_CHECK(taken);
+
+    for (int i = 0; i < 10; ++i)
+        FT_CHECK(stored(client, file_id("a", i), i == 1 ? 101 : i));
+    FT_CHECK(stored(client, "b0", 100));
+
+    // packed from now on
+    FT_CHECK(upload(client, "b1", 102));
+    FT_CHECK(ft_test::find_file(dir + "server/ts/", "b1_ts_20200606_930_1530").empty());
+    FT_CHECK(stored(client, "b1", 102));
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,53 @@
+#include "test_util.h"
+
+// Outgoing file data is held to the connection, host and global rates, and while the global
+// bucket is short a realtime type goes before bulk ones.
+static boost::int64_t timed_send(ft::TransferPtr& client, size_t size, const std::string& id, const std::string& type)
+{
+    boost::posix_time::ptime start = ft_test::now();
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(size, 29)), id, type, "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    return ft_test::elapsed_ms(start);
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("shaping");
+    const std::string port = "17029";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // 2MB at 4MB/s, less the burst of a tenth of a second
+    ft::set_connection_rate(client, 4 * 1024 * 1024);
+    boost::int64_t ms = timed_send(client, 2 * 1024 * 1024, "connection", "ts");
+    FT_CHECK(ms >= 350);
+    FT_CHECK(ms < 3000);
+    ft::set_connection_rate(client, 0);
+
+    ft::set_host_rate(client, "127.0.0.1", 4 * 1024 * 1024);
+    ms = timed_send(client, 2 * 1024 * 1024, "host", "ts");
+    FT_CHECK(ms >= 350);
+    FT_CHECK(ms < 3000);
+    ft::set_host_rate(client, "127.0.0.1", 0);
+
+    // unlimited again
+    FT_CHECK(timed_send(client, 2 * 1024 * 1024, "free", "ts") < 300);
+
+    // a bulk upload started first is overtaken by a realtime one
+    ft::set_global_rate(client, 4 * 1024 * 1024);
+    ft::set_type_priority(client, "bulk", ft::TransferPriority::BULK);
+
+    ft::CompletionPtr bulk = ft::send(client, ft::make_memory_source(ft_test::blob(4 * 1024 * 1024, 30)), "bulk", "bulk", "20200606", "930", "1530");
+    ::usleep(200 * 1000);
+    ft::CompletionPtr realtime = ft::send(client, ft::make_memory_source(ft_test::blob(1024 * 1024, 31)), "realtime", "ts", "20200606", "930", "1530");
+
+    FT_CHECK(ft::wait(realtime).status == ft::TransferResult::OK);
+    FT_CHECK(!ft::is_complete(bulk));
+    FT_CHECK(ft::wait(bulk).status == ft::TransferResult::OK);
+
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "bulk", "bulk")) == *ft_test::blob(4 * 1024 * 1024, 30));
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "server/", "realtime", "ts")) == *ft_test::blob(1024 * 1024, 31));
+
+    return ft_test::finish(dir);
+}
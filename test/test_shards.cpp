@@ -0,0 +1,86 @@
+#include "test_util.h"
+
+// A server of several shards, each with its own io thread and listener on the same port, serves
+// as one: files received on one shard are found, followed while still arriving, and waited for
+// from connections on the others.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("shards");
+    const std::string port = "17036";
+    const int clients = 8;
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/", 4);
+
+    std::vector<ft::TransferPtr> peers;
+    for (int i = 0; i < clients; ++i)
+    {
+        peers.push_back(ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/"));
+        ft::set_upload_ack(peers.back(), true);
+    }
+
+    // uploads and queries spread over the shards by the kernel
+    std::vector<ft::CompletionPtr> uploads;
+    for (int i = 0; i < 64; ++i)
+        uploads.push_back(ft::send(peers[i % clients], ft::make_memory_source(ft_test::blob(64 * 1024, i)), file_id("f", i), "ts", "20200606", "930", "1530"));
+    for (int i = 0; i < 64; ++i)
+        FT_CHECK(ft::wait(uploads[i]).status == ft::TransferResult::OK);
+
+    for (int i = 0; i < 64; ++i)
+    {
+        boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+        FT_CHECK(ft::wait(ft::query(peers[(i + 3) % clients], file_id("f", i), "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+        FT_CHECK(*received == *ft_test::blob(64 * 1024, i));
+    }
+
+    // waiters on every shard are woken by uploads on any of them
+    boost::posix_time::ptime start = ft_test::now();
+    std::vector<ft::CompletionPtr> waiting;
+    std::vector<boost::shared_ptr<std::vector<char> > > received;
+    for (int i = 0; i < 16; ++i)
+    {
+        received.push_back(boost::shared_ptr<std::vector<char> >(new std::vector<char>()));
+        waiting.push_back(ft::query(peers[i % clients], file_id("late", i % 4), "ts", "20200606", "930", "1530", ft::make_memory_sink(received.back()),
+            start + boost::posix_time::seconds(20)));
+    }
+    ::usleep(300 * 1000);
+
+    for (int i = 0; i < 4; ++i)
+        FT_CHECK(ft::wait(ft::send(peers[(i + 5) % clients], ft::make_memory_source(ft_test::blob(100000, 100 + i)), file_id("late", i), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    for (int i = 0; i < 16; ++i)
+    {
+        FT_CHECK(ft::wait(waiting[i]).status == ft::TransferResult::OK);
+        FT_CHECK(*received[i] == *ft_test::blob(100000, 100 + i % 4));
+    }
+    FT_CHECK(ft_test::elapsed_ms(start) < 10000);
+
+    // a slow upload followed by readers on the other shards while it arrives
+    boost::shared_ptr<std::vector<char> > slow = ft_test::blob(2 * 1024 * 1024, 36);
+    ft::set_connection_rate(peers[0], 4 * 1024 * 1024);
+    ft::CompletionPtr upload = ft::send(peers[0], ft::make_memory_source(slow), "slow", "ts", "20200606", "930", "1530");
+    ::usleep(100 * 1000);
+
+    std::vector<ft::CompletionPtr> readers;
+    received.clear();
+    for (int i = 1; i < clients; ++i)
+    {
+        received.push_back(boost::shared_ptr<std::vector<char> >(new std::vector<char>()));
+        readers.push_back(ft::query(peers[i], "slow", "ts", "20200606", "930", "1530", ft::make_memory_sink(received.back())));
+    }
+
+    FT_CHECK(ft::wait(upload).status == ft::TransferResult::OK);
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        FT_CHECK(ft::wait(readers[i]).status == ft::TransferResult::OK);
+        FT_CHECK(*received[i] == *slow);
+    }
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,103 @@
+#include "test_util.h"
+
+#include <boost/thread.hpp>
+
+// Any number of clients and servers on one engine run on its threads alone, a transfer stopped
+// on it leaves the others running, and an engine on the application's io_service needs no
+// threads of its own.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static size_t thread_count()
+{
+    size_t count = 0;
+    for (boost::filesystem::directory_iterator it("/proc/self/task"), end; it != end; ++it)
+        ++count;
+    return count;
+}
+
+static bool round_trip(ft::TransferPtr& client, const std::string& id, int seed)
+{
+    if (ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(32 * 1024, seed)), id, "ts", "20200606", "930", "1530")).status != ft::TransferResult::OK)
+        return false;
+
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    return ft::wait(ft::query(client, id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK
+        && *received == *ft_test::blob(32 * 1024, seed);
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("shared_engine");
+
+    ft::EnginePtr engine = ft::make_engine(2);
+    ft::TransferPtr first = ft::make_transfer_server(engine, "127.0.0.1", "17040", dir + "first/", dir + "logs/");
+    ft::TransferPtr second = ft::make_transfer_server(engine, "127.0.0.1", "17043", dir + "second/", dir + "logs/");
+
+    std::vector<ft::TransferPtr> clients;
+    clients.push_back(ft::make_transfer_client(engine, "127.0.0.1", "17040", dir + "client/", dir + "logs/"));
+    ft::set_upload_ack(clients.back(), true);
+    FT_CHECK(round_trip(clients.back(), "warm", 0));
+
+    // forty more peers, no more threads
+    size_t threads = thread_count();
+    for (int i = 0; i < 40; ++i)
+    {
+        clients.push_back(ft::make_transfer_client(engine, "127.0.0.1", i % 2 ? "17043" : "17040", dir + "client/", dir + "logs/"));
+        ft::set_upload_ack(clients.back(), true);
+    }
+
+    std::vector<ft::CompletionPtr> uploads;
+    for (int i = 0; i < 40; ++i)
+        uploads.push_back(ft::send(clients[i + 1], ft::make_memory_source(ft_test::blob(32 * 1024, i)), file_id("f", i), "ts", "20200606", "930", "1530"));
+    for (int i = 0; i < 40; ++i)
+        FT_CHECK(ft::wait(uploads[i]).status == ft::TransferResult::OK);
+
+    FT_CHECK(thread_count() == threads);
+    FT_CHECK(!ft_test::find_file(dir + "first/ts/", "f0_ts_20200606_930_1530").empty());
+    FT_CHECK(!ft_test::find_file(dir + "second/ts/", "f1_ts_20200606_930_1530").empty());
+
+    // stopping some leaves the engine to the others
+    for (int i = 1; i <= 20; ++i)
+        ft::stop(clients[i]);
+    ft::stop(second);
+
+    for (int i = 21; i <= 40; i += 2)
+        FT_CHECK(round_trip(clients[i], file_id("g", i), 100 + i));
+    FT_CHECK(ft::wait(ft::send(clients[22], ft::make_memory_source(ft_test::blob(4096, 1)), "gone", "ts", "20200606", "930", "1530")).status != ft::TransferResult::OK);
+
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        if (i == 0 || i > 20)
+            ft::stop(clients[i]);
+    }
+    ft::stop(first);
+    ft::stop(engine);
+
+    // on the application's io_service
+    boost::asio::io_service ios;
+    boost::asio::io_service::work work(ios);
+    boost::thread runner(boost::bind(&boost::asio::io_service::run, &ios));
+
+    ft::EnginePtr external = ft::make_engine(ios);
+    ft::TransferPtr server = ft::make_transfer_server(external, "127.0.0.1", "17044", dir + "external/", dir + "logs/");
+    threads = thread_count();
+    ft::TransferPtr client = ft::make_transfer_client(external, "127.0.0.1", "17044", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    for (int i = 0; i < 8; ++i)
+        FT_CHECK(round_trip(client, file_id("e", i), 200 + i));
+    FT_CHECK(thread_count() == threads);
+
+    ft::stop(client);
+    ft::stop(server);
+    ft::stop(external);
+    ios.stop();
+    runner.join();
+
+    return ft_test::finish(dir);
+}
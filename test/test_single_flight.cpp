@@ -0,0 +1,87 @@
+#include "test_util.h"
+
+// A burst of queries for one stored file, as at the open: the file is read once for all of
+// them, and every one gets it whole, whether it joins the read, finds the cached copy or the
+// file is too large for the cache and streams from disk. A file received again is what the next
+// burst gets. A client runs one transfer of a key at a time, so every query has a client.
+static void check_burst(std::vector<ft::TransferPtr>& clients, const std::string& id, const std::vector<char>& data)
+{
+    std::vector<ft::CompletionPtr> queries;
+    std::vector<boost::shared_ptr<std::vector<char> > > received;
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        received.push_back(boost::shared_ptr<std::vector<char> >(new std::vector<char>()));
+        queries.push_back(ft::query(clients[i], id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received.back())));
+    }
+
+    for (size_t i = 0; i < clients.size(); ++i)
+    {
+        FT_CHECK(ft::wait(queries[i]).status == ft::TransferResult::OK);
+        FT_CHECK(*received[i] == data);
+    }
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("single_flight");
+    const std::string port = "17049";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+
+    ft::EnginePtr engine = ft::make_engine(4);
+    std::vector<ft::TransferPtr> clients;
+    for (int i = 0; i < 48; ++i)
+    {
+        clients.push_back(ft::make_transfer_client(engine, "127.0.0.1", port, dir + "client/", dir + "logs/"));
+        ft::set_upload_ack(clients.back(), true);
+    }
+
+    // within the largest object of the default cache, and beyond it
+    boost::shared_ptr<std::vector<char> > hot = ft_test::blob(768 * 1024, 1);
+    boost::shared_ptr<std::vector<char> > large = ft_test::blob(3 * 1024 * 1024, 2);
+    FT_CHECK(ft::wait(ft::send(clients[0], ft::make_memory_source(hot), "hot", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(ft::wait(ft::send(clients[0], ft::make_memory_source(large), "large", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    check_burst(clients, "hot", *hot);
+    check_burst(clients, "large", *large);
+
+    // served from the cache by now
+    check_burst(clients, "hot", *hot);
+
+    // received again, no query gets the old copy
+    boost::shared_ptr<std::vector<char> > replaced = ft_test::blob(512 * 1024, 3);
+    FT_CHECK(ft::wait(ft::send(clients[1], ft::make_memory_source(replaced), "hot", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    check_burst(clients, "hot", *replaced);
+    check_burst(clients, "hot", *replaced);
+
+    // bursts for several keys at once
+    std::vector<boost::shared_ptr<std::vector<char> > > files;
+    for (int i = 0; i < 6; ++i)
+    {
+        std::stringstream id;
+        id << "k" << i;
+        files.push_back(ft_test::blob(200 * 1024 + i, 10 + i));
+        FT_CHECK(ft::wait(ft::send(clients[i], ft::make_memory_source(files.back()), id.str(), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    }
+
+    for (int round = 0; round < 2; ++round)
+    {
+        std::vector<ft::CompletionPtr> queries;
+        std::vector<boost::shared_ptr<std::vector<char> > > received;
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            std::stringstream id;
+            id << "k" << i % 6;
+            received.push_back(boost::shared_ptr<std::vector<char> >(new std::vector<char>()));
+            queries.push_back(ft::query(clients[i], id.str(), "ts", "20200606", "930", "1530", ft::make_memory_sink(received.back())));
+        }
+
+        for (size_t i = 0; i < clients.size(); ++i)
+        {
+            FT_CHECK(ft::wait(queries[i]).status == ft::TransferResult::OK);
+            FT_CHECK(*received[i] == *files[i % 6]);
+        }
+    }
+
+    return ft_test::finish(dir);
+}
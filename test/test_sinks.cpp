@@ -0,0 +1,112 @@
+#include "test_util.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// Downloads into a file, into memory and through a callback that pauses the download until the
+// consumer resumes it from another thread. A received checksum covers the bytes delivered.
+struct Slow_consumer
+{
+    boost::mutex mutex;
+    std::vector<char> received;
+    std::vector<boost::function<void ()> > pending;
+    bool done;
+    int pauses;
+
+    Slow_consumer() : done(false), pauses(0) {}
+
+    bool handle(const char* data, size_t size, const boost::function<void ()>& resume)
+    {
+        boost::lock_guard<boost::mutex> guard(mutex);
+        if (data == NULL)
+        {
+            done = true;
+            return true;
+        }
+
+        received.insert(received.end(), data, data + size);
+
+        // every other chunk waits for the consumer thread
+        if (++pauses % 2 == 0)
+        {
+            pending.push_back(resume);
+            return false;
+        }
+
+        return true;
+    }
+
+    void run(const ft::CompletionPtr& completion)
+    {
+        while (!ft::is_complete(completion))
+        {
+            std::vector<boost::function<void ()> > resumes;
+            {
+                boost::lock_guard<boost::mutex> guard(mutex);
+                resumes.swap(pending);
+            }
+
+            for (size_t i = 0; i < resumes.size(); ++i)
+                resumes[i]();
+            ::usleep(2 * 1000);
+        }
+    }
+};
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("sinks");
+    const std::string port = "17032";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(2 * 1024 * 1024 + 5, 32);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(data), "file", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+
+    // to recv_path by default, or to any path
+    ft::TransferResult plain = ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530"));
+    FT_CHECK(plain.status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(dir + "client/", "file", "ts")) == *data);
+
+    ft::TransferResult to_file = ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_file_sink(dir + "elsewhere")));
+    FT_CHECK(to_file.status == ft::TransferResult::OK);
+    FT_CHECK(ft_test::read_file(dir + "elsewhere") == *data);
+    FT_CHECK(to_file.checksum == plain.checksum);
+    FT_CHECK(to_file.checksum != 0);
+
+    // into memory, resized or of a fixed capacity
+    boost::shared_ptr<std::vector<char> > grown(new std::vector<char>());
+    ft::TransferResult to_vector = ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_memory_sink(grown)));
+    FT_CHECK(to_vector.status == ft::TransferResult::OK);
+    FT_CHECK(*grown == *data);
+    FT_CHECK(to_vector.bytes == static_cast<boost::int64_t>(data->size()));
+
+    std::vector<char> fixed(data->size());
+    FT_CHECK(ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_memory_sink(&fixed[0], fixed.size()))).status == ft::TransferResult::OK);
+    FT_CHECK(fixed == *data);
+
+    std::vector<char> small(data->size() / 2);
+    FT_CHECK(ft::wait(ft::query(client, "file", "ts", "20200606", "930", "1530", ft::make_memory_sink(&small[0], small.size()))).status == ft::TransferResult::FAILED);
+
+    // a consumer that pauses the download and resumes it from its own thread
+    Slow_consumer consumer;
+    ft::CompletionPtr query = ft::query(client, "file", "ts", "20200606", "930", "1530",
+        ft::make_callback_sink(boost::bind(&Slow_consumer::handle, &consumer, _1, _2, _3)));
+    consumer.run(query);
+
+    ft::TransferResult streamed = ft::wait(query);
+    FT_CHECK(streamed.status == ft::TransferResult::OK);
+    FT_CHECK(consumer.done);
+    FT_CHECK(consumer.pauses > 2);
+    FT_CHECK(consumer.received == *data);
+    FT_CHECK(streamed.checksum == plain.checksum);
+
+    // nothing stored under the key: no sink is written to
+    boost::shared_ptr<std::vector<char> > none(new std::vector<char>());
+    FT_CHECK(ft::wait(ft::query(client, "missing", "ts", "20200606", "930", "1530", ft::make_memory_sink(none))).status == ft::TransferResult::NOT_FOUND);
+    FT_CHECK(none->empty());
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,89 @@
+#include "test_util.h"
+
+#include <fstream>
+
+// Each socket profile gets through intact and the result reports what the kernel made of it:
+// LAN turns Nagle off, LOOPBACK sizes the buffers, AUTO measures the rate and sizes them to it,
+// and explicit settings are read back as they are.
+static int wmem_max()
+{
+    int value = 0;
+    std::ifstream("/proc/sys/net/core/wmem_max") >> value;
+    return value;
+}
+
+static ft::TransferResult round_trip(ft::TransferPtr& client, const std::string& id, size_t size, int seed)
+{
+    ft::TransferResult sent = ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(size, seed)), id, "ts", "20200606", "930", "1530"));
+    FT_CHECK(sent.status == ft::TransferResult::OK);
+
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    FT_CHECK(ft::wait(ft::query(client, id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *ft_test::blob(size, seed));
+
+    return sent;
+}
+
+static ft::TransferPtr make_client(const std::string& dir, ft::SocketTuning::Profile profile)
+{
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", "17045", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+    ft::set_socket_profile(client, profile);
+    return client;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("socket_tuning");
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", "17045", dir + "server/", dir + "logs/");
+    ft::set_socket_profile(server, ft::SocketTuning::LAN);
+    FT_CHECK(ft::get_socket_tuning(server).profile == ft::SocketTuning::LAN);
+    FT_CHECK(ft::get_socket_tuning(server).nodelay);
+
+    ft::TransferPtr plain = ft::make_transfer_client("127.0.0.1", "17045", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(plain, true);
+    FT_CHECK(ft::get_socket_tuning(plain).profile == ft::SocketTuning::DEFAULT);
+    ft::TransferResult result = round_trip(plain, "default", 256 * 1024, 0);
+    FT_CHECK(result.tuning.profile == ft::SocketTuning::DEFAULT);
+    FT_CHECK(!result.tuning.nodelay);
+    FT_CHECK(result.tuning.send_buffer > 0);
+
+    ft::TransferPtr lan = make_client(dir, ft::SocketTuning::LAN);
+    result = round_trip(lan, "lan", 256 * 1024, 1);
+    FT_CHECK(result.tuning.profile == ft::SocketTuning::LAN);
+    FT_CHECK(result.tuning.nodelay);
+
+    // the kernel reports twice what was set, capped by net.core.wmem_max
+    ft::TransferPtr loopback = make_client(dir, ft::SocketTuning::LOOPBACK);
+    result = round_trip(loopback, "loopback", 256 * 1024, 2);
+    FT_CHECK(result.tuning.profile == ft::SocketTuning::LOOPBACK);
+    FT_CHECK(result.tuning.send_buffer >= 2 * std::min(4 * 1024 * 1024, wmem_max()));
+
+    ft::TransferPtr wan = make_client(dir, ft::SocketTuning::WAN);
+    result = round_trip(wan, "wan", 256 * 1024, 3);
+    FT_CHECK(result.tuning.profile == ft::SocketTuning::WAN);
+    FT_CHECK(!result.tuning.congestion.empty());
+
+    // measures once it has sent enough, then sizes the send buffer to the rate
+    ft::TransferPtr automatic = make_client(dir, ft::SocketTuning::AUTO);
+    result = round_trip(automatic, "auto", 16 * 1024 * 1024, 4);
+    FT_CHECK(result.tuning.profile == ft::SocketTuning::AUTO);
+    FT_CHECK(result.tuning.rate > 0);
+    FT_CHECK(result.tuning.send_buffer > 0);
+    result = round_trip(automatic, "auto_small", 64 * 1024, 5);
+    FT_CHECK(result.tuning.rate == 0);
+
+    ft::SocketTuning custom;
+    custom.nodelay = true;
+    custom.congestion = "reno";
+    ft::TransferPtr explicit_client = ft::make_transfer_client("127.0.0.1", "17045", dir + "client/", dir + "logs/");
+    ft::set_upload_ack(explicit_client, true);
+    ft::set_socket_tuning(explicit_client, custom);
+    FT_CHECK(ft::get_socket_tuning(explicit_client).congestion == "reno");
+    result = round_trip(explicit_client, "custom", 256 * 1024, 6);
+    FT_CHECK(result.tuning.nodelay);
+    FT_CHECK(result.tuning.congestion == "reno");
+
+    return ft_test::finish(dir);
+}
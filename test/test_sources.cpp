@@ -0,0 +1,96 @@
+#include "test_util.h"
+
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+// Uploads from memory, from fds, from pipes written while the upload runs and from a generator
+// all arrive whole; streams of unknown length end when their source runs dry.
+struct Counting_generator
+{
+    const std::vector<char>* data;
+    size_t offset;
+
+    size_t next(char* buf, size_t size)
+    {
+        // uneven pieces
+        size_t n = std::min(std::min(size, static_cast<size_t>(1000 + offset % 3000)), data->size() - offset);
+        std::memcpy(buf, &(*data)[0] + offset, n);
+        offset += n;
+        return n;
+    }
+};
+
+static void trickle(int fd, const std::vector<char>* data)
+{
+    for (size_t offset = 0; offset < data->size(); offset += 64 * 1024)
+    {
+        size_t n = std::min<size_t>(64 * 1024, data->size() - offset);
+        if (::write(fd, &(*data)[0] + offset, n) != static_cast<ssize_t>(n))
+            break;
+        ::usleep(5 * 1000);
+    }
+    ::close(fd);
+}
+
+static void check_sent(ft::TransferPtr& client, const ft::SourcePtr& source, const std::string& id, const std::string& server_path, const std::vector<char>& data)
+{
+    FT_CHECK(source);
+    ft::TransferResult result = ft::wait(ft::send(client, source, id, "ts", "20200606", "930", "1530"));
+    FT_CHECK(result.status == ft::TransferResult::OK);
+    FT_CHECK(result.bytes == static_cast<boost::int64_t>(data.size()));
+    FT_CHECK(ft_test::read_file(ft_test::stored_path(server_path, id, "ts")) == data);
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("sources");
+    const std::string port = "17131";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    boost::shared_ptr<std::vector<char> > data = ft_test::blob(3 * 1024 * 1024 + 17, 31);
+    const std::string path = dir + "data";
+    std::ofstream(path.c_str(), std::ios::binary).write(&(*data)[0], data->size());
+
+    check_sent(client, ft::make_memory_source(data), "shared", dir + "server/", *data);
+    check_sent(client, ft::make_memory_source(&(*data)[0], data->size()), "raw", dir + "server/", *data);
+    check_sent(client, ft::make_file_source(path), "file", dir + "server/", *data);
+
+    // the whole file whatever the position of fd
+    int fd = ::open(path.c_str(), O_RDONLY);
+    FT_CHECK(::lseek(fd, 1000, SEEK_SET) == 1000);
+    check_sent(client, ft::make_fd_source(fd, true), "fd", dir + "server/", *data);
+
+    int fds[2];
+    FT_CHECK(::pipe(fds) == 0);
+    boost::thread writer(boost::bind(&trickle, fds[1], data.get()));
+    check_sent(client, ft::make_pipe_source(fds[0]), "pipe", dir + "server/", *data);
+    writer.join();
+
+    // a pipe given as an fd is streamed the same way
+    FT_CHECK(::pipe(fds) == 0);
+    boost::thread fd_writer(boost::bind(&trickle, fds[1], data.get()));
+    check_sent(client, ft::make_fd_source(fds[0], true), "fd_pipe", dir + "server/", *data);
+    fd_writer.join();
+
+    Counting_generator generator = { data.get(), 0 };
+    check_sent(client, ft::make_generator_source(boost::bind(&Counting_generator::next, &generator, _1, _2)), "generator", dir + "server/", *data);
+
+    // empty content is a file all the same
+    check_sent(client, ft::make_memory_source(boost::shared_ptr<const std::vector<char> >(new std::vector<char>())), "empty", dir + "server/", std::vector<char>());
+
+    // fds that are neither files nor pipes are refused, and so is a send without a source
+    int null = ::open("/dev/null", O_RDONLY);
+    FT_CHECK(!ft::make_fd_source(null));
+    ::close(null);
+    FT_CHECK(!ft::make_file_source(dir + "missing"));
+    FT_CHECK(ft::wait(ft::send(client, ft::SourcePtr(), "none", "ts", "20200606", "930", "1530")).status == ft::TransferResult::REJECTED);
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,64 @@
+#include "test_util.h"
+
+#include <set>
+
+// Files are stored in the directories the layout pattern names and found there by queries;
+// requests whose fields would leave the storage root are turned away without harm.
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("storage_layout");
+    const std::string port = "17046";
+
+    ft::ServerOptions options;
+    options.deferred_start = true;
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/", options);
+    FT_CHECK(!ft::set_storage_layout(server, "{type}/{nope}/"));
+    FT_CHECK(ft::set_storage_layout(server, "{type}/{date}/{hash}/"));
+    ft::start(server);
+
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    for (int i = 0; i < 20; ++i)
+    {
+        std::stringstream id;
+        id << "file" << i;
+        FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(1000, i)), id.str(), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    }
+
+    // spread over the hash directories under type and date
+    std::set<std::string> hashes;
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    for (int i = 0; i < 20; ++i)
+    {
+        std::stringstream id;
+        id << "file" << i;
+        std::string path = ft_test::find_file(dir + "server/", id.str() + "_ts_20200606_930_1530");
+        FT_CHECK(path.find(dir + "server/ts/20200606/") == 0);
+        hashes.insert(boost::filesystem::path(path).parent_path().filename().string());
+
+        FT_CHECK(ft::wait(ft::query(client, id.str(), "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+        FT_CHECK(*received == *ft_test::blob(1000, i));
+    }
+    FT_CHECK(hashes.size() > 1);
+
+    // an empty field once expanded to "/" and recursed without end; these must just be refused
+    const char* invalid[] = {
+        "CMD=SEND,ID=x,TYPE=,DATE=20200606,BEGIN=930,END=1530,SIZE=4,;data",
+        "CMD=QUERY,ID=x,TYPE=,DATE=20200606,BEGIN=930,END=1530,;",
+        "CMD=QUERY,ID=x,TYPE=ts,DATE=,BEGIN=930,END=1530,;",
+        "CMD=SEND,ID=../../escape,TYPE=ts,DATE=20200606,BEGIN=930,END=1530,SIZE=4,;data",
+        "CMD=QUERY,ID=x,TYPE=..,DATE=20200606,BEGIN=930,END=1530,;",
+        "CMD=SEND,ID=x,TYPE=/tmp,DATE=20200606,BEGIN=930,END=1530,SIZE=4,;data",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i)
+        FT_CHECK(ft_test::raw_request(port, invalid[i]).find("CMD=SEND") == std::string::npos);
+
+    FT_CHECK(ft_test::find_file(dir, "escape_ts_20200606_930_1530").empty());
+
+    // still serving
+    FT_CHECK(ft::wait(ft::query(client, "file0", "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK);
+    FT_CHECK(*received == *ft_test::blob(1000, 0));
+
+    return ft_test::finish(dir);
+}
@@ -0,0 +1,118 @@
+#include "test_util.h"
+
+#include <cstdio>
+
+#include <boost/filesystem.hpp>
+
+// Received files spread over recv_path and the added roots, by hash of the key or in proportion
+// to the free space, each file on exactly one root; a file received again stays where it is,
+// and queries, of this server or of one started later on the same roots, find every file.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static bool upload(ft::TransferPtr& client, const std::string& id, int seed)
+{
+    return ft::wait(ft::send(client, ft::make_memory_source(ft_test::blob(8192, seed)), id, "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK;
+}
+
+static bool stored(ft::TransferPtr& client, const std::string& id, int seed)
+{
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    return ft::wait(ft::query(client, id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received))).status == ft::TransferResult::OK
+        && *received == *ft_test::blob(8192, seed);
+}
+
+// how many files of prefix each root has, checking that none is on two
+static std::vector<int> spread(const std::vector<std::string>& roots, const char* prefix, int count)
+{
+    std::vector<int> files(roots.size(), 0);
+    for (int i = 0; i < count; ++i)
+    {
+        int copies = 0;
+        for (size_t r = 0; r < roots.size(); ++r)
+        {
+            if (!ft_test::find_file(roots[r], file_id(prefix, i) + "_ts_20200606_930_1530").empty())
+            {
+                ++files[r];
+                ++copies;
+            }
+        }
+        FT_CHECK(copies == 1);
+    }
+
+    return files;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("storage_roots");
+    const std::string port = "17136";
+
+    std::vector<std::string> roots;
+    roots.push_back(dir + "server/");
+    roots.push_back(dir + "disk1/");
+    roots.push_back(dir + "disk2/");
+    boost::filesystem::create_directories(roots[1]);
+    boost::filesystem::create_directories(roots[2]);
+
+    ft::ServerOptions options;
+    options.deferred_start = true;
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, roots[0], dir + "logs/", options);
+    ::fclose(::fopen((dir + "plain").c_str(), "w"));
+    FT_CHECK(!ft::add_storage_root(server, dir + "plain"));
+    FT_CHECK(ft::add_storage_root(server, roots[1]));
+    FT_CHECK(ft::add_storage_root(server, roots[2]));
+    FT_CHECK(ft::set_storage_layout(server, "{type}/{date}/{hash}/"));
+    ft::start(server);
+
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // by hash
+    for (int i = 0; i < 60; ++i)
+        FT_CHECK(upload(client, file_id("h", i), i));
+
+    std::vector<int> files = spread(roots, "h", 60);
+    for (size_t r = 0; r < roots.size(); ++r)
+        FT_CHECK(files[r] > 0);
+    for (int i = 0; i < 60; ++i)
+        FT_CHECK(stored(client, file_id("h", i), i));
+
+    // received again, in place
+    for (int i = 0; i < 10; ++i)
+        FT_CHECK(upload(client, file_id("h", i), 100 + i));
+    spread(roots, "h", 60);
+    for (int i = 0; i < 10; ++i)
+        FT_CHECK(stored(client, file_id("h", i), 100 + i));
+
+    // by free space, the roots share one file system here so they take alike
+    ft::set_storage_placement(server, ft::StoragePlacement::BY_FREE_SPACE);
+    for (int i = 0; i < 60; ++i)
+        FT_CHECK(upload(client, file_id("f", i), 200 + i));
+
+    files = spread(roots, "f", 60);
+    for (size_t r = 0; r < roots.size(); ++r)
+        FT_CHECK(files[r] > 0);
+    for (int i = 0; i < 60; ++i)
+        FT_CHECK(stored(client, file_id("f", i), 200 + i));
+
+    // a server started later on the same roots finds them all
+    ft::TransferPtr later = ft::make_transfer_server("127.0.0.1", "17137", roots[0], dir + "logs/", options);
+    FT_CHECK(ft::add_storage_root(later, roots[1]));
+    FT_CHECK(ft::add_storage_root(later, roots[2]));
+    FT_CHECK(ft::set_storage_layout(later, "{type}/{date}/{hash}/"));
+    ft::start(later);
+
+    ft::TransferPtr reader = ft::make_transfer_client("127.0.0.1", "17137", dir + "client/", dir + "logs/");
+    for (int i = 0; i < 60; ++i)
+    {
+        FT_CHECK(stored(reader, file_id("h", i), i < 10 ? 100 + i : i));
+        FT_CHECK(stored(reader, file_id("f", i), 200 + i));
+    }
+
+    return ft_test::finish(dir);
+}
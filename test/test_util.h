@@ -0,0 +1,147 @@
+#ifndef _FILE_TRANSFER_TEST_UTIL_H_
+#define _FILE_TRANSFER_TEST_UTIL_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include <unistd.h>
+
+#include <file_transfer.h>
+
+// Behaviour tests run a server and its clients over loopback in one process, each test on a
+// port of its own so that ctest may run them in parallel.
+namespace ft_test {
+
+    inline int& failures()
+    {
+        static int count = 0;
+        return count;
+    }
+
+#define FT_CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++ft_test::failures(); \
+        } \
+    } while (0)
+
+    // An empty directory of the test's own under the system temp directory.
+    inline std::string scratch_dir(const std::string& name)
+    {
+        std::stringstream dir;
+        dir << (boost::filesystem::temp_directory_path() / ("ft_test_" + name)).string() << "_" << ::getpid() << "/";
+
+        boost::filesystem::remove_all(dir.str());
+        boost::filesystem::create_directories(dir.str());
+        return dir.str();
+    }
+
+    // size bytes that differ with seed, and within a buffer, so no two chunks are alike
+    inline boost::shared_ptr<std::vector<char> > blob(size_t size, unsigned seed)
+    {
+        boost::shared_ptr<std::vector<char> > data(new std::vector<char>(size));
+        unsigned x = seed * 2654435761u + 1;
+        for (size_t i = 0; i < size; ++i)
+        {
+            x = x * 1103515245u + 12345u;
+            (*data)[i] = static_cast<char>(x >> 16);
+        }
+
+        return data;
+    }
+
+    inline boost::posix_time::ptime now()
+    {
+        return boost::posix_time::microsec_clock::universal_time();
+    }
+
+    inline boost::int64_t elapsed_ms(const boost::posix_time::ptime& since)
+    {
+        return (now() - since).total_milliseconds();
+    }
+
+    // The file a client downloaded or a server stored under recv_path with the default layout.
+    inline std::string stored_path(const std::string& recv_path, const std::string& id, const std::string& type)
+    {
+        return recv_path + type + "/" + id + "_" + type + "_20200606_930_1530";
+    }
+
+    inline std::vector<char> read_file(const std::string& path)
+    {
+        std::vector<char> data;
+        FILE* file = ::fopen(path.c_str(), "rb");
+        if (!file)
+            return data;
+
+        char buf[65536];
+        size_t n;
+        while ((n = ::fread(buf, 1, sizeof(buf), file)) > 0)
+            data.insert(data.end(), buf, buf + n);
+
+        ::fclose(file);
+        return data;
+    }
+
+    // Sends a raw action, e.g. "CMD=QUERY,ID=...,;", and returns what the server answers until it
+    // closes the connection; empty if it could not connect.
+    inline std::string raw_request(const std::string& port, const std::string& action)
+    {
+        boost::asio::io_service ios;
+        boost::asio::ip::tcp::socket socket(ios);
+        boost::system::error_code ec;
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"),
+            static_cast<unsigned short>(std::atoi(port.c_str()))), ec);
+        if (ec)
+            return std::string();
+
+        boost::asio::write(socket, boost::asio::buffer(action), ec);
+
+        std::string reply;
+        char data[4096];
+        while (!ec)
+        {
+            size_t n = socket.read_some(boost::asio::buffer(data), ec);
+            reply.append(data, n);
+        }
+
+        return reply;
+    }
+
+    // The path of the file named name anywhere under dir, empty if there is none.
+    inline std::string find_file(const std::string& dir, const std::string& name)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::recursive_directory_iterator it(dir, ec), end;
+        for (; !ec && it != end; it.increment(ec))
+        {
+            if (it->path().filename() == name)
+                return it->path().string();
+        }
+
+        return std::string();
+    }
+
+    // Removes the scratch directory and reports. The transfers are left to the process exit, a
+    // server's stop() or destructor would wait for its listener.
+    inline int finish(const std::string& dir)
+    {
+        int failed = failures();
+        if (failed == 0)
+            boost::filesystem::remove_all(dir);
+
+        std::cerr << (failed ? "FAILED" : "passed") << std::endl;
+        std::cerr.flush();
+        ::_exit(failed ? 1 : 0);
+    }
+}
+
+#endif
@@ -0,0 +1,77 @@
+#include "test_util.h"
+
+#include <cstring>
+
+// Memory sources at and above the zero-copy threshold arrive intact whether the kernel pins the
+// pages or copies them after all, and their send completes only once the kernel is done with
+// the memory, so the caller may reuse it right away.
+static std::string file_id(const char* prefix, int i)
+{
+    std::stringstream id;
+    id << prefix << i;
+    return id.str();
+}
+
+static bool stored(ft::TransferPtr& client, const std::string& id, const std::vector<char>& data)
+{
+    boost::shared_ptr<std::vector<char> > received(new std::vector<char>());
+    boost::posix_time::ptime until = ft_test::now() + boost::posix_time::seconds(10);
+    return ft::wait(ft::query(client, id, "ts", "20200606", "930", "1530", ft::make_memory_sink(received), until)).status == ft::TransferResult::OK
+        && *received == data;
+}
+
+int main()
+{
+    const std::string dir = ft_test::scratch_dir("zerocopy");
+    const std::string port = "17046";
+
+    ft::TransferPtr server = ft::make_transfer_server("127.0.0.1", port, dir + "server/", dir + "logs/");
+    ft::TransferPtr client = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    ft::set_upload_ack(client, true);
+
+    // around the default threshold, and well above it
+    const size_t sizes[] = { 64 * 1024 - 1, 64 * 1024, 64 * 1024 + 1, 3 * 1024 * 1024 + 17, 24 * 1024 * 1024 };
+    for (int i = 0; i < 5; ++i)
+    {
+        boost::shared_ptr<std::vector<char> > data = ft_test::blob(sizes[i], i);
+        FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(data), file_id("s", i), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+        FT_CHECK(stored(client, file_id("s", i), *data));
+    }
+
+    // every memory send zero-copy, and none
+    ft::set_zerocopy_threshold(client, 1);
+    boost::shared_ptr<std::vector<char> > small = ft_test::blob(1000, 10);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(small), "always", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(stored(client, "always", *small));
+
+    ft::set_zerocopy_threshold(client, 0);
+    boost::shared_ptr<std::vector<char> > large = ft_test::blob(4 * 1024 * 1024, 11);
+    FT_CHECK(ft::wait(ft::send(client, ft::make_memory_source(large), "never", "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+    FT_CHECK(stored(client, "never", *large));
+    ft::set_zerocopy_threshold(client, 64 * 1024);
+
+    // without the ack a send completes once the data has left: the memory is overwritten at once
+    ft::TransferPtr quick = ft::make_transfer_client("127.0.0.1", port, dir + "client/", dir + "logs/");
+    for (int i = 0; i < 4; ++i)
+    {
+        boost::shared_ptr<std::vector<char> > original = ft_test::blob(8 * 1024 * 1024, 20 + i);
+        std::vector<char> reused(*original);
+
+        FT_CHECK(ft::wait(ft::send(quick, ft::make_memory_source(&reused[0], reused.size()), file_id("r", i), "ts", "20200606", "930", "1530")).status == ft::TransferResult::OK);
+        std::memset(&reused[0], 0x5a, reused.size());
+
+        FT_CHECK(stored(client, file_id("r", i), *original));
+    }
+
+    // the source holds a shared buffer until the send completes
+    std::vector<ft::CompletionPtr> sends;
+    for (int i = 0; i < 8; ++i)
+        sends.push_back(ft::send(quick, ft::make_memory_source(ft_test::blob(2 * 1024 * 1024, 30 + i)), file_id("h", i), "ts", "20200606", "930", "1530"));
+    for (int i = 0; i < 8; ++i)
+    {
+        FT_CHECK(ft::wait(sends[i]).status == ft::TransferResult::OK);
+        FT_CHECK(stored(client, file_id("h", i), *ft_test::blob(2 * 1024 * 1024, 30 + i)));
+    }
+
+    return ft_test::finish(dir);
+}